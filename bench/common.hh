@@ -0,0 +1,123 @@
+#ifndef LCC_BENCH_COMMON_HH
+#define LCC_BENCH_COMMON_HH
+
+/// Scaffolding shared by the compiler benchmarks: a context to compile
+/// in, generating and lowering a module of large functions, timing, and
+/// parsing arguments.
+#include <lcc/codegen/mir.hh>
+#include <lcc/context.hh>
+#include <lcc/format.hh>
+#include <lcc/ir/module.hh>
+#include <lcc/target.hh>
+#include <lcc/utils.hh>
+
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace lcc::bench {
+constexpr usz FunctionCount = 4;
+
+/// A context for x86_64 Linux that prints and stops at nothing.
+inline auto MakeContext() -> Context {
+    return Context{
+        Target::x86_64_linux,
+        Format::gnu_as_att_assembly,
+        Context::Options{
+            Context::DoNotUseColour,
+            Context::DoNotPrintAST,
+            Context::DoNotStopatSyntax,
+            Context::DoNotStopatSema,
+            Context::DoNotPrintMIR,
+            Context::DoNotStopatMIR,
+            Context::DoNotUseLinearScan,
+            Context::DoNotOmitFramePointer,
+        },
+    };
+}
+
+/// IR for a module of `FunctionCount` functions, each a loop-free chain of
+/// `blocks` blocks that work on a local, `%2`, initialised to the first
+/// parameter.
+///
+/// `block(out, b, value)` appends the instructions of block `b`, numbering
+/// its values from `value`, and returns the next free value number. Every
+/// block should end by branching to block `b + 1`, or to the exit block,
+/// `blocks + 1`, which returns the local.
+template <typename BlockBody>
+auto Generate(usz blocks, BlockBody block) -> std::string {
+    std::string out{};
+    for (usz index = 0; index < FunctionCount; ++index) {
+        out += fmt::format("bench_{} : i64(i64 %0, i64 %1):\n", index);
+        out += "  bb0:\n"
+               "    %2 = alloca i64\n"
+               "    store i64 %0 into %2\n"
+               "    branch to %bb1\n";
+
+        usz value = 3;
+        for (usz b = 1; b <= blocks; ++b) {
+            out += fmt::format("  bb{}:\n", b);
+            value = block(out, b, value);
+        }
+
+        out += fmt::format("  bb{}:\n", blocks + 1);
+        out += fmt::format("    %{} = load i64 from %2\n", value);
+        out += fmt::format("    return i64 %{}\n\n", value);
+    }
+    return out;
+}
+
+/// Parse and lower `source`, returning the module along with its MIR.
+inline auto Lower(Context& ctx, std::string_view source) -> std::pair<std::unique_ptr<Module>, std::vector<MFunction>> {
+    auto mod = Module::Parse(&ctx, source);
+    if (not mod) Diag::Fatal("Failed to parse generated module");
+    mod->lower();
+    auto mir = mod->mir();
+    return {std::move(mod), std::move(mir)};
+}
+
+/// Call `run` on what `prepare` returns `repetitions` times, and return
+/// the best time in ms. Only `run` is timed.
+template <typename Prepare, typename Run>
+auto Time(usz repetitions, Prepare prepare, Run run) -> double {
+    auto best = chr::nanoseconds::max();
+    for (usz i = 0; i < repetitions; ++i) {
+        auto input = prepare();
+        auto start = chr::steady_clock::now();
+        run(input);
+        auto elapsed = chr::steady_clock::now() - start;
+        best = std::min(best, chr::duration_cast<chr::nanoseconds>(elapsed));
+    }
+    return chr::duration<double, std::milli>(best).count();
+}
+
+inline auto Blocks(const std::vector<MFunction>& mir) -> usz {
+    usz blocks = 0;
+    for (auto& f : mir) blocks += f.blocks().size();
+    return blocks;
+}
+
+inline auto Instructions(const std::vector<MFunction>& mir) -> usz {
+    usz instructions = 0;
+    for (auto& f : mir)
+        for (auto& b : f.blocks()) instructions += b.instructions().size();
+    return instructions;
+}
+
+/// Parse a positive count from the command line, or use `fallback` if
+/// it was not given.
+inline auto ParseCount(const char* arg, usz fallback) -> usz {
+    if (not arg) return fallback;
+    std::string_view s{arg};
+    usz value{};
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc{} or ptr != s.data() + s.size() or value == 0)
+        Diag::Fatal("Expected a positive integer, got '{}'", s);
+    return value;
+}
+} // namespace lcc::bench
+
+#endif // LCC_BENCH_COMMON_HH
@@ -0,0 +1,98 @@
+/// Instruction selection benchmark.
+///
+/// Generates a module containing a few large functions, lowers it to
+/// MIR, and runs x86_64 instruction selection on it using both the
+/// pattern matching automaton and the reference matcher that tries
+/// every pattern in turn. The output of both is checked to be the same.
+///
+/// Usage: lcc-bench-isel [blocks per function] [repetitions]
+#include "common.hh"
+
+#include <lcc/codegen/isel.hh>
+#include <lcc/codegen/mir.hh>
+#include <lcc/codegen/x86_64/isel_patterns.hh>
+#include <lcc/codegen/x86_64/x86_64.hh>
+#include <lcc/context.hh>
+#include <lcc/format.hh>
+#include <lcc/ir/module.hh>
+#include <lcc/utils.hh>
+
+#include <string>
+#include <vector>
+
+namespace {
+using namespace lcc;
+using namespace lcc::bench;
+using Patterns = isel::x86_64::AllPatterns;
+
+/// Some arithmetic on the local, a compare, and a branch.
+auto GenerateBlock(std::string& out, usz b, usz blocks, usz v) -> usz {
+    out += fmt::format("    %{} = load i64 from %2\n", v);
+    out += fmt::format("    %{} = add i64 %{}, %1\n", v + 1, v);
+    out += fmt::format("    %{} = mul i64 %{}, 3\n", v + 2, v + 1);
+    out += fmt::format("    %{} = xor i64 %{}, %0\n", v + 3, v + 2);
+    out += fmt::format("    %{} = shl i64 %{}, 2\n", v + 4, v + 3);
+    out += fmt::format("    %{} = sub i64 %{}, %{}\n", v + 5, v + 4, v);
+    out += fmt::format("    %{} = and i64 %{}, 65535\n", v + 6, v + 5);
+    out += fmt::format("    store i64 %{} into %2\n", v + 6);
+    out += fmt::format("    %{} = ult i64 %{}, 1000\n", v + 7, v + 6);
+    out += fmt::format("    branch on %{} to %bb{} else %bb{}\n", v + 7, b + 1, blocks + 1);
+    return v + 8;
+}
+
+template <isel::Matcher matcher>
+auto Select(Module* mod, std::vector<MFunction>& mir) -> std::vector<MFunction> {
+    std::vector<MFunction> out{};
+    for (auto& f : mir) out.push_back(Patterns::rewrite<matcher>(mod, f));
+    return out;
+}
+
+auto Print(const std::vector<MFunction>& mir) -> std::string {
+    std::string out{};
+    for (auto& f : mir) out += PrintMFunctionImpl(f, x86_64::opcode_to_string);
+    return out;
+}
+} // namespace
+
+auto main(int argc, const char** argv) -> int {
+    auto blocks = ParseCount(argc > 1 ? argv[1] : nullptr, 2000);
+    auto repetitions = ParseCount(argc > 2 ? argv[2] : nullptr, 5);
+
+    auto ctx = MakeContext();
+    auto source = Generate(blocks, [&](std::string& out, usz b, usz value) {
+        return GenerateBlock(out, b, blocks, value);
+    });
+
+    /// Selection allocates new virtual registers from the function it
+    /// reads, so give each matcher its own copy to get comparable output.
+    auto [mod, mir] = Lower(ctx, source);
+    auto linear_mir = mir;
+    auto automaton_mir = mir;
+    auto linear = Print(Select<isel::Matcher::Linear>(mod.get(), linear_mir));
+    auto automaton = Print(Select<isel::Matcher::Automaton>(mod.get(), automaton_mir));
+    if (linear != automaton) Diag::Fatal("Instruction selection output differs between matchers");
+
+    const auto copy = [&] { return mir; };
+    auto linear_ms = Time(repetitions, copy, [&](auto& input) {
+        Select<isel::Matcher::Linear>(mod.get(), input);
+    });
+    auto automaton_ms = Time(repetitions, copy, [&](auto& input) {
+        Select<isel::Matcher::Automaton>(mod.get(), input);
+    });
+
+    fmt::print(
+        "{} functions, {} blocks, {} MIR instructions, {} patterns (best of {})\n"
+        "  {:<10}  {:>10.3f} ms\n"
+        "  {:<10}  {:>10.3f} ms  ({:.2f}x)\n",
+        mir.size(),
+        Blocks(mir),
+        Instructions(mir),
+        Patterns::pattern_count,
+        repetitions,
+        "linear",
+        linear_ms,
+        "automaton",
+        automaton_ms,
+        linear_ms / automaton_ms
+    );
+}
@@ -0,0 +1,106 @@
+/// Register allocation benchmark.
+///
+/// Generates a module containing a few large functions, lowers it to
+/// MIR, selects x86_64 instructions, and allocates registers using both
+/// the graph colouring and the linear scan allocator. Reports the time
+/// each takes, and, as a measure of the quality of the code, how many
+/// instructions and stack slots for spilled values each function ends
+/// up with.
+///
+/// Usage: lcc-bench-regalloc [blocks per function] [repetitions]
+#include "common.hh"
+
+#include <lcc/codegen/isel.hh>
+#include <lcc/codegen/mir.hh>
+#include <lcc/codegen/register_allocation.hh>
+#include <lcc/codegen/x86_64/x86_64.hh>
+#include <lcc/context.hh>
+#include <lcc/format.hh>
+#include <lcc/utils.hh>
+
+#include <string>
+#include <vector>
+
+namespace {
+using namespace lcc;
+using namespace lcc::bench;
+
+/// Values computed, and live at the same time, in each block; more than
+/// there are registers, so that some of them have to be spilled.
+constexpr usz ValuesPerBlock = 16;
+
+/// A number of values computed from the local, combined, and a branch.
+auto GenerateBlock(std::string& out, usz b, usz blocks, usz value) -> usz {
+    out += fmt::format("    %{} = load i64 from %2\n", value);
+    auto first = value++;
+    for (usz i = 0; i < ValuesPerBlock; ++i, ++value)
+        out += fmt::format("    %{} = add i64 %{}, {}\n", value, value - 1, i + 3);
+    auto sum = value - 1;
+    for (usz i = 1; i <= ValuesPerBlock; ++i, ++value) {
+        out += fmt::format("    %{} = sub i64 %{}, %{}\n", value, sum, sum - 2 * i + 1);
+        sum = value;
+    }
+    out += fmt::format("    %{} = add i64 %{}, 1\n", value, sum);
+    out += fmt::format("    store i64 %{} into %2\n", value);
+    out += fmt::format("    %{} = ult i64 %{}, %{}\n", value + 1, value, first);
+    out += fmt::format("    branch on %{} to %bb{} else %bb{}\n", value + 1, b + 1, blocks + 1);
+    return value + 2;
+}
+
+auto Allocate(
+    const MachineDescription& desc,
+    std::vector<MFunction> mir,
+    RegisterAllocator allocator
+) -> std::vector<MFunction> {
+    for (auto& f : mir) allocate_registers(desc, f, allocator);
+    return mir;
+}
+
+auto SpillSlots(const std::vector<MFunction>& mir) -> usz {
+    usz slots = 0;
+    for (auto& f : mir) slots += f.spill_slots();
+    return slots;
+}
+} // namespace
+
+auto main(int argc, const char** argv) -> int {
+    auto blocks = ParseCount(argc > 1 ? argv[1] : nullptr, 20);
+    auto repetitions = ParseCount(argc > 2 ? argv[2] : nullptr, 5);
+
+    auto ctx = MakeContext();
+    auto [mod, mir] = Lower(ctx, Generate(blocks, [&](std::string& out, usz b, usz value) {
+        return GenerateBlock(out, b, blocks, value);
+    }));
+    for (auto& f : mir) select_instructions(mod.get(), f);
+
+    auto desc = x86_64::GetMachineDescription(ctx.target());
+    auto graph = Allocate(desc, mir, RegisterAllocator::GraphColouring);
+    auto linear = Allocate(desc, mir, RegisterAllocator::LinearScan);
+
+    const auto copy = [&] { return mir; };
+    auto graph_ms = Time(repetitions, copy, [&](auto& input) {
+        Allocate(desc, std::move(input), RegisterAllocator::GraphColouring);
+    });
+    auto linear_ms = Time(repetitions, copy, [&](auto& input) {
+        Allocate(desc, std::move(input), RegisterAllocator::LinearScan);
+    });
+
+    fmt::print(
+        "{} functions, {} blocks, {} MIR instructions (best of {})\n"
+        "  {:<10}  {:>10.3f} ms  {:>8} instructions  {:>6} spill slots\n"
+        "  {:<10}  {:>10.3f} ms  {:>8} instructions  {:>6} spill slots  ({:.2f}x)\n",
+        mir.size(),
+        Blocks(mir),
+        Instructions(mir),
+        repetitions,
+        "graph",
+        graph_ms,
+        Instructions(graph),
+        SpillSlots(graph),
+        "linear",
+        linear_ms,
+        Instructions(linear),
+        SpillSlots(linear),
+        graph_ms / linear_ms
+    );
+}
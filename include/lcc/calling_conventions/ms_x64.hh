@@ -0,0 +1,91 @@
+#ifndef LCC_CALLING_CONVENTION_MS_X64_HH
+#define LCC_CALLING_CONVENTION_MS_X64_HH
+
+#include <lcc/codegen/x86_64/x86_64.hh>
+#include <lcc/ir/ir.hh>
+
+#include <array>
+#include <vector>
+
+namespace lcc::cconv::msx64 {
+
+/// Unlike SysV, each argument register belongs to the parameter at the
+/// same position, whether or not the parameters before it used theirs.
+constexpr const std::array<usz, 4> arg_regs = {
+    +x86_64::RegisterId::RCX,
+    +x86_64::RegisterId::RDX,
+    +x86_64::RegisterId::R8,
+    +x86_64::RegisterId::R9 //
+};
+
+/// The caller reserves this much stack space just above the return
+/// address, whatever the number of arguments, for the callee to spill
+/// the argument registers into. Stack arguments come after it.
+constexpr usz shadow_space_bytes = arg_regs.size() * x86_64::GeneralPurposeBytewidth;
+
+/// Whether a value of type \p t is passed and returned by value, in a
+/// single register. Any other value is passed as a pointer to a copy the
+/// caller makes, and returned in memory the caller passes a pointer to
+/// as a hidden first argument.
+inline auto passes_in_register(const Type* t) -> bool {
+    switch (t->bytes()) {
+        case 1:
+        case 2:
+        case 4:
+        case 8:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Whether a value of type \p t is returned in RAX.
+inline auto returns_in_registers(const Type* t) -> bool {
+    return t->bytes() == 0 or passes_in_register(t);
+}
+
+struct ParameterDescription {
+    struct Parameter {
+        /// Whether the parameter is passed in the argument register at its
+        /// position, rather than on the stack.
+        bool in_register{};
+        /// Offset of a stack parameter from the stack pointer at the call,
+        /// i.e. from just above the return address. Each takes up one
+        /// eightbyte, after the shadow space.
+        usz stack_byte_offset{};
+    };
+    std::vector<Parameter> info;
+
+    /// Bytes the caller reserves for the shadow space and stack parameters.
+    usz stack_bytes{shadow_space_bytes};
+};
+
+/// Assign parameters to argument registers by position, and the rest to
+/// the stack. By the time this is used, every parameter that does not fit
+/// in a register has been replaced with a pointer to a copy of it.
+inline auto parameter_description(usz parameter_count) -> ParameterDescription {
+    ParameterDescription out{};
+    out.info.reserve(parameter_count);
+    for (usz i = 0; i < parameter_count; ++i) {
+        ParameterDescription::Parameter param{};
+        if (i < arg_regs.size()) param.in_register = true;
+        else {
+            param.stack_byte_offset = out.stack_bytes;
+            out.stack_bytes += x86_64::GeneralPurposeBytewidth;
+        }
+        out.info.emplace_back(param);
+    }
+    return out;
+}
+
+inline auto parameter_description(Function* function) -> ParameterDescription {
+    return parameter_description(function->params().size());
+}
+
+inline auto parameter_description(CallInst* call) -> ParameterDescription {
+    return parameter_description(call->args().size());
+}
+
+} // namespace lcc::cconv::msx64
+
+#endif /* LCC_CALLING_CONVENTION_MS_X64_HH */
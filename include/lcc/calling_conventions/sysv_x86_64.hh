@@ -3,6 +3,11 @@
 
 #include <lcc/codegen/x86_64/x86_64.hh>
 #include <lcc/ir/ir.hh>
+#include <lcc/utils.hh>
+
+#include <algorithm>
+#include <array>
+#include <vector>
 
 namespace lcc::cconv::sysv {
 
@@ -17,15 +22,66 @@ constexpr const std::array<usz, 6> arg_regs = {
     +x86_64::RegisterId::R9 //
 };
 
+/// Registers that hold the first and second eightbyte of a value returned
+/// in registers.
+constexpr const std::array<usz, 2> ret_regs = {
+    +x86_64::RegisterId::RAX,
+    +x86_64::RegisterId::RDX //
+};
+
 enum class ParameterClass {
     INVALID,
 
+    /// Every eightbyte of the value goes in a general purpose register.
+    /// LCC IR has no floating point types, so this is the only register
+    /// class (INTEGER in the psABI).
     REGISTER,
+
+    /// The value is copied onto the stack by the caller.
     MEMORY,
 
     COUNT
 };
 
+/// Number of eightbytes a value of type \p t takes up.
+inline auto eightbytes(const Type* t) -> usz {
+    return (t->bytes() + x86_64::GeneralPurposeBytewidth - 1) / x86_64::GeneralPurposeBytewidth;
+}
+
+namespace detail {
+/// Whether every member of \p t is at an offset that is a multiple of
+/// its alignment. IR structs are laid out without padding.
+inline auto members_aligned(const Type* t, usz offset = 0) -> bool {
+    if (offset % std::max<usz>(t->align() / 8, 1)) return false;
+    if (auto* s = cast<StructType>(t)) {
+        for (auto* member : s->members()) {
+            if (not members_aligned(member, offset)) return false;
+            offset += member->bytes();
+        }
+    } else if (auto* a = cast<ArrayType>(t)) {
+        for (usz i = 0; i < a->length(); ++i, offset += a->element_type()->bytes())
+            if (not members_aligned(a->element_type(), offset)) return false;
+    }
+    return true;
+}
+} // namespace detail
+
+/// Classify a value of type \p t as the psABI does, regardless of how
+/// many argument registers are left: a value larger than two eightbytes,
+/// or one with unaligned members, goes in memory; anything else goes in
+/// as many registers as it has eightbytes.
+inline auto classify(const Type* t) -> ParameterClass {
+    if (eightbytes(t) > 2 or not detail::members_aligned(t))
+        return ParameterClass::MEMORY;
+    return ParameterClass::REGISTER;
+}
+
+/// Whether a value of type \p t is returned in `ret_regs` rather than
+/// in memory the caller passes a pointer to as a hidden first argument.
+inline auto returns_in_registers(const Type* t) -> bool {
+    return t->bytes() == 0 or classify(t) == ParameterClass::REGISTER;
+}
+
 struct ParameterDescription {
     struct Parameter {
         ParameterClass kind{ParameterClass::INVALID};
@@ -35,50 +91,66 @@ struct ParameterDescription {
         /// The amount of argument registers taken up by this parameter.
         usz arg_regs{};
         usz stack_slot_index{};
+        /// Offset of a memory parameter from the first one, which is just
+        /// above the return address. Each takes up a whole number of
+        /// eightbytes.
         usz stack_byte_offset{};
     };
     std::vector<Parameter> info;
-};
 
-auto parameter_description(Function* function) -> ParameterDescription {
-    // If we super-cared or measured this function as being really slow or
-    // called over and over (which won't happen), we could implement a cache
-    // on Function* here, or a name-based one.
+    /// Bytes taken up by all memory parameters.
+    usz stack_bytes{};
+};
 
+/// Assign parameters of the given types, in order, to argument registers
+/// or to the stack. A value that doesn't fit in the registers that are
+/// left goes in memory as a whole, but later ones may still use them.
+inline auto parameter_description(const std::vector<Type*>& types) -> ParameterDescription {
     ParameterDescription out{};
-    ParameterDescription::Parameter working_param{};
-
-    out.info.reserve(function->params().size());
+    out.info.reserve(types.size());
 
+    usz registers_used{};
     usz next_stack_slot_index{};
-    for (const auto* param : function->params()) {
-        working_param.arg_regs_used += working_param.arg_regs;
-        working_param.stack_slot_index = next_stack_slot_index;
-
-        working_param.kind = ParameterClass::REGISTER;
-        working_param.arg_regs = 0;
+    for (const auto* type : types) {
+        ParameterDescription::Parameter param{};
+        param.arg_regs_used = registers_used;
 
+        auto eightbyte_count = std::max<usz>(eightbytes(type), 1);
         if (
-            param->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-            and working_param.arg_regs_used < arg_regs.size()
-        ) ++working_param.arg_regs;
-
-        else if (
-            param->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-            and working_param.arg_regs_used < arg_regs.size() - 1
-        ) working_param.arg_regs += 2;
-
-        else {
-            working_param.kind = ParameterClass::MEMORY;
-            ++next_stack_slot_index;
-            working_param.stack_byte_offset += param->type()->bytes();
+            classify(type) == ParameterClass::REGISTER
+            and registers_used + eightbyte_count <= arg_regs.size()
+        ) {
+            param.kind = ParameterClass::REGISTER;
+            param.arg_regs = eightbyte_count;
+            registers_used += eightbyte_count;
+        } else {
+            auto align = std::max<usz>(type->align() / 8, x86_64::GeneralPurposeBytewidth);
+            param.kind = ParameterClass::MEMORY;
+            param.stack_slot_index = next_stack_slot_index++;
+            param.stack_byte_offset = utils::AlignTo(out.stack_bytes, align);
+            out.stack_bytes = param.stack_byte_offset + eightbyte_count * x86_64::GeneralPurposeBytewidth;
         }
 
-        out.info.emplace_back(working_param);
+        out.info.emplace_back(param);
     }
 
     return out;
-};
+}
+
+inline auto parameter_description(Function* function) -> ParameterDescription {
+    // If we super-cared or measured this function as being really slow or
+    // called over and over (which won't happen), we could implement a cache
+    // on Function* here, or a name-based one.
+    std::vector<Type*> types{};
+    for (const auto* param : function->params()) types.push_back(param->type());
+    return parameter_description(types);
+}
+
+inline auto parameter_description(CallInst* call) -> ParameterDescription {
+    std::vector<Type*> types{};
+    for (const auto* arg : call->args()) types.push_back(arg->type());
+    return parameter_description(types);
+}
 
 } // namespace lcc::cconv::sysv
 
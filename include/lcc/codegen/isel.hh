@@ -5,8 +5,17 @@
 #include <lcc/ir/module.hh>
 #include <lcc/utils.hh>
 #include <lcc/utils/result.hh>
-#include <unordered_map>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
 #include <variant>
+#include <vector>
 
 namespace lcc {
 namespace isel {
@@ -256,6 +265,26 @@ struct r {
     static constexpr usz value = register_value;
 };
 
+/// Map from the index of a v<> operand of a pattern to the virtual
+/// register allocated for it. A pattern only ever uses a handful of
+/// these, so they are stored inline.
+class NewVirtuals {
+    static constexpr usz Capacity = 8;
+    std::array<std::pair<usz, usz>, Capacity> _entries{};
+    usz _count{};
+
+public:
+    /// Get the register for v<index>, allocating one if there is none yet.
+    auto get(MFunction& function, usz index) -> usz {
+        for (usz i = 0; i < _count; ++i)
+            if (_entries[i].first == index) return _entries[i].second;
+
+        LCC_ASSERT(_count < Capacity, "Too many new virtual registers in a single pattern");
+        _entries[_count] = {index, function.next_vreg()};
+        return _entries[_count++].second;
+    }
+};
+
 template <typename clobbers_, usz opcode_, typename... operands>
 struct Inst {
     using clobbers = clobbers_;
@@ -272,8 +301,8 @@ struct Inst {
     static constexpr auto get_operand(
         Module* mod,
         MFunction& function,       // for locals lookup
-        std::vector<MInst*> input, // for Input*Reference,
-        std::unordered_map<usz, usz>& new_virtuals
+        std::span<MInst* const> input, // for Input*Reference,
+        NewVirtuals& new_virtuals
     ) -> MOperand {
         const auto input_operand_by_index = [&](usz index) -> Result<MOperand> {
             // Current operand index.
@@ -354,10 +383,6 @@ struct Inst {
             }
 
             case OperandKind::NewVirtual: {
-                if (not new_virtuals.contains(operand::index)) {
-                    new_virtuals[operand::index] = mod->next_vreg();
-                }
-
                 MOperand op{};
                 // Current operand index.
                 usz i = 0;
@@ -393,7 +418,7 @@ struct Inst {
                     size = std::get<MOperandImmediate>(op).size;
                 else LCC_ASSERT(false, "Sorry, moperand type not handled in NewVirtual handling...");
 
-                return MOperandRegister(new_virtuals[operand::index], uint(size));
+                return MOperandRegister(new_virtuals.get(function, operand::index), uint(size));
             }
 
             case OperandKind::Local:
@@ -467,179 +492,508 @@ struct Pattern {
     using output = out;
 };
 
+/// How `PatternList::rewrite()` finds the pattern that matches the
+/// instructions at the front of the window.
+enum struct Matcher {
+    /// Look the instructions up in tables that are built from the
+    /// patterns at compile time. This is what code generation uses.
+    Automaton,
+
+    /// Try every pattern in order. This is the reference that the
+    /// automaton must agree with; it is only used for benchmarking.
+    Linear,
+};
+
+namespace detail {
+/// A match key encodes everything the matcher looks at in an
+/// instruction: its opcode, its operand count, and the kind of each
+/// operand. An input instruction of a pattern matches an instruction
+/// iff their keys are equal.
+///
+///     [63:32]   Opcode
+///     [31:27]   Operand count
+///     [26:0]    Operand kinds, 3 bits each, first operand lowest
+constexpr usz MatchKindBits = 3;
+constexpr usz MatchMaxOperands = 27 / MatchKindBits;
+
+/// Key of an instruction that has too many operands for any pattern
+/// to match it.
+constexpr u64 NoMatchKey = ~u64(0);
+
+constexpr auto MakeMatchKey(usz opcode, usz operand_count, u64 kinds) -> u64 {
+    return (u64(opcode) << 32) | (u64(operand_count) << 27) | kinds;
+}
+
+/// Kinds that cannot appear in an MInst (e.g. o<>) never match anything.
+constexpr auto MatchKind(OperandKind kind) -> u64 {
+    switch (kind) {
+        case OperandKind::Immediate: return 1;
+        case OperandKind::Register: return 2;
+        case OperandKind::Local: return 3;
+        case OperandKind::Global: return 4;
+        case OperandKind::Function: return 5;
+        case OperandKind::Block: return 6;
+        default: return 7;
+    }
+}
+
+inline auto MatchKey(const MInst& inst) -> u64 {
+    static_assert(
+        std::variant_size_v<MOperand> == 6,
+        "Exhaustive handling of MOperand alternatives in instruction selection"
+    );
+
+    /// Indexed by `MOperand::index()`.
+    static constexpr std::array<u64, 6> kinds_by_alternative{
+        MatchKind(OperandKind::Register),
+        MatchKind(OperandKind::Immediate),
+        MatchKind(OperandKind::Local),
+        MatchKind(OperandKind::Global),
+        MatchKind(OperandKind::Function),
+        MatchKind(OperandKind::Block),
+    };
+
+    const auto& operands = inst.all_operands();
+    if (operands.size() > MatchMaxOperands) return NoMatchKey;
+
+    u64 kinds = 0;
+    for (usz i = 0; i < operands.size(); ++i)
+        kinds |= kinds_by_alternative[operands[i].index()] << (MatchKindBits * i);
+    return MakeMatchKey(inst.opcode(), operands.size(), kinds);
+}
+} // namespace detail
+
+/// The instructions that patterns are matched against: a ring buffer of
+/// pointers to instructions that are either still in the input block,
+/// or that were produced by a pattern and live in an `InstArena`.
+///
+/// The buffer only grows if the window ever holds more instructions than
+/// it has so far, so it does not allocate in the steady state.
+class Window {
+public:
+    static constexpr usz NotInArena = usz(-1);
+
+    struct Entry {
+        MInst* inst;
+
+        /// Slot in the arena, or `NotInArena`.
+        usz slot;
+    };
+
+private:
+    /// The size of this is always a power of two.
+    std::vector<Entry> _entries;
+    usz _head{};
+    usz _size{};
+
+public:
+    explicit Window(usz capacity) : _entries(std::bit_ceil(std::max<usz>(capacity, 2))) {}
+
+    [[nodiscard]]
+    auto empty() const -> bool { return _size == 0; }
+
+    [[nodiscard]]
+    auto size() const -> usz { return _size; }
+
+    [[nodiscard]]
+    auto entry(usz index) const -> const Entry& {
+        return _entries[(_head + index) & (_entries.size() - 1)];
+    }
+
+    [[nodiscard]]
+    auto front() const -> MInst* { return entry(0).inst; }
+
+    [[nodiscard]]
+    auto operator[](usz index) const -> MInst* { return entry(index).inst; }
+
+    void pop_front(usz count = 1) {
+        LCC_ASSERT(count <= _size, "Cannot pop more instructions than there are in the window");
+        _head = (_head + count) & (_entries.size() - 1);
+        _size -= count;
+    }
+
+    void push_back(Entry e) {
+        if (_size == _entries.size()) Grow();
+        _entries[(_head + _size++) & (_entries.size() - 1)] = e;
+    }
+
+    void push_front(Entry e) {
+        if (_size == _entries.size()) Grow();
+        _head = (_head - 1) & (_entries.size() - 1);
+        _entries[_head] = e;
+        ++_size;
+    }
+
+private:
+    void Grow() {
+        std::vector<Entry> bigger(_entries.size() * 2);
+        for (usz i = 0; i < _size; ++i) bigger[i] = entry(i);
+        _entries = std::move(bigger);
+        _head = 0;
+    }
+};
+
+/// Storage for the instructions that patterns produce while they are
+/// in the window. Freed slots are reused, and chunks never move, so a
+/// pointer into the arena stays valid until its slot is freed.
+class InstArena {
+    static constexpr usz ChunkSize = 64;
+    using Chunk = std::array<std::optional<MInst>, ChunkSize>;
+
+    std::vector<std::unique_ptr<Chunk>> _chunks{};
+    std::vector<usz> _free{};
+
+    [[nodiscard]]
+    auto at(usz slot) -> std::optional<MInst>& {
+        return (*_chunks[slot / ChunkSize])[slot % ChunkSize];
+    }
+
+public:
+    /// Create an instruction in a free slot.
+    [[nodiscard]]
+    auto create(usz opcode, lcc::Register reg) -> Window::Entry {
+        if (_free.empty()) {
+            _chunks.push_back(std::make_unique<Chunk>());
+            for (usz i = ChunkSize; i--;) _free.push_back((_chunks.size() - 1) * ChunkSize + i);
+        }
+
+        auto slot = _free.back();
+        _free.pop_back();
+        auto& storage = at(slot);
+        storage.emplace(opcode, reg);
+        return {&*storage, slot};
+    }
+
+    /// Free a slot.
+    void free(usz slot) {
+        at(slot).reset();
+        _free.push_back(slot);
+    }
+
+    /// Move the instruction out of a slot and free it.
+    [[nodiscard]]
+    auto take(usz slot) -> MInst {
+        auto inst = std::move(*at(slot));
+        free(slot);
+        return inst;
+    }
+};
+
 template <typename... Patterns>
 struct PatternList {
+    static constexpr usz pattern_count = sizeof...(Patterns);
+
+    /// Number of instructions in the longest input pattern.
+    static constexpr usz longest_input = std::max({Patterns::input::size()...});
+
+    /// Number of instructions in the longest output pattern.
+    static constexpr usz longest_output = std::max({Patterns::output::size()...});
+
+    static MFunction rewrite(lcc::Module* mod, MFunction& function) {
+        return rewrite<Matcher::Automaton>(mod, function);
+    }
+
+    template <Matcher matcher>
     static MFunction rewrite(lcc::Module* mod, MFunction& function) {
         MFunction out{function.calling_convention()};
         out.names() = function.names();
         out.locals() = function.locals();
         out.location(function.location());
 
-        // Get the longest input pattern length
-        usz longest_pattern_length = 0;
-        Foreach<Patterns...>([&]<typename _> {
-            ++longest_pattern_length;
-        });
-        LCC_ASSERT(longest_pattern_length, "Cannot do instruction selection with no input patterns to match");
-
-        // NOTE: If you modify block.instructions() in any way, you are going to
-        // have a bad time.
-        std::vector<MInst*> instructions{};
-        // Any instructions we allocate are stored here, so that we can free them
-        // after everything has been inserted as a value. Ideally we wouldn't have
-        // to do this, but I can't make a vector of references, sadly.
-        std::vector<MInst*> pool{};
+        // Instructions produced by patterns are stored in the arena until they
+        // are emitted, so nothing in here allocates once the window and the
+        // arena have grown to the size this function needs.
+        Window instructions{longest_input + longest_output};
+        InstArena arena{};
 
         for (auto& old_block : function.blocks()) {
-            out.add_block(MBlock(old_block));
+            MBlock block{old_block.name()};
+            block.location(old_block.location());
+            block.execution_count(old_block.execution_count());
+            block.successors() = old_block.successors();
+            block.predecessors() = old_block.predecessors();
+            block.instructions().reserve(old_block.instructions().size());
+            out.add_block(std::move(block));
             auto& new_block = out.blocks().back();
-            new_block.instructions().clear();
 
             usz instructions_handled = 0;
             do {
                 for (; instructions_handled < old_block.instructions().size(); ++instructions_handled) {
-                    // Add (up to) `longest_pattern_length` instructions to the instructions vector.
-                    if (instructions.size() >= longest_pattern_length) break;
-                    instructions.push_back(old_block.instructions().data() + instructions_handled);
+                    // Add (up to) `longest_input` instructions to the window; no
+                    // pattern can look any further than that.
+                    if (instructions.size() >= longest_input) break;
+                    instructions.push_back({old_block.instructions().data() + instructions_handled, Window::NotInArena});
                 }
 
-                bool to_be_handled = true;
-                While<Patterns...>(to_be_handled, [&]<typename pattern>() {
-                    // If the input pattern is longer than the current amount of instructions,
-                    // skip this pattern.
-                    if (pattern::input::size() > instructions.size()) return;
-
-                    // Ensure all opcodes and operand types match from the input pattern.
-                    usz input_i = 0;
-                    bool pattern_matches = true;
-                    pattern::input::foreach ([&]<typename inst> {
-                        // If the pattern has failed to match, skip the rest of the instructions
-                        // in the pattern.
-                        if (not pattern_matches) return;
-
-                        auto& instruction = instructions[input_i];
-
-                        // If the `i`th input instruction's opcode doesn't match the `i`th
-                        // instruction window's opcode, the pattern does not match.
-                        if (instruction->opcode() != inst::opcode) {
-                            pattern_matches = false;
-                            return;
-                        }
-
-                        // Ensure operand amount and kinds match the input pattern.
-                        bool operands_match = false;
-                        if (inst::operand_count == instruction->all_operands().size()) {
-                            operands_match = true;
-
-                            usz op_i = 0;
-                            inst::foreach_operand([&]<typename op> {
-                                // If the operands have failed to match, skip the rest of the operands.
-                                if (not operands_match) return;
-
-                                auto& operand = instruction->all_operands().at(op_i);
-                                static_assert(
-                                    std::variant_size_v<MOperand> == 6,
-                                    "Exhaustive handling of MOperand alternatives in instruction selection"
-                                );
-                                if (std::holds_alternative<MOperandImmediate>(operand)) {
-                                    operands_match = op::kind == OperandKind::Immediate;
-                                } else if (std::holds_alternative<MOperandRegister>(operand)) {
-                                    operands_match = op::kind == OperandKind::Register;
-                                } else if (std::holds_alternative<MOperandLocal>(operand)) {
-                                    operands_match = op::kind == OperandKind::Local;
-                                } else if (std::holds_alternative<MOperandGlobal>(operand)) {
-                                    operands_match = op::kind == OperandKind::Global;
-                                } else if (std::holds_alternative<MOperandFunction>(operand)) {
-                                    operands_match = op::kind == OperandKind::Function;
-                                } else if (std::holds_alternative<MOperandBlock>(operand)) {
-                                    operands_match = op::kind == OperandKind::Block;
-                                } else LCC_ASSERT(false, "Unhandled MIR Operand Kind in ISel...");
-                                ++op_i;
-                            });
-                        }
+                usz pattern_index{};
+                if constexpr (matcher == Matcher::Automaton) pattern_index = Match(instructions);
+                else pattern_index = MatchLinear(instructions);
+
+                // If a pattern matched, replace its input with its output.
+                if (pattern_index != pattern_count)
+                    apply[pattern_index](mod, function, instructions, arena);
+
+                // If none of the patterns matched, we can pop an instruction off the
+                // front and emit it into the output, before going back to the "add
+                // instructions" bit.
+                else if (not instructions.empty()) {
+                    auto front = instructions.entry(0);
+                    instructions.pop_front();
+                    if (front.slot == Window::NotInArena) new_block.insert(*front.inst);
+                    else new_block.insert(arena.take(front.slot));
+                }
 
-                        pattern_matches = operands_match;
+                // If there are still instructions in the window to be handled, go back
+                // and handle them (after topping off the window with any more
+                // instructions that there may be). If the window is empty, but there are
+                // still more instructions to handle in this block, also go back and
+                // handle them.
+            } while (not instructions.empty() or instructions_handled < old_block.instructions().size());
+        }
 
-                        ++input_i;
-                    });
+        out.first_free_vreg(function.first_free_vreg());
+        return out;
+    }
 
-                    // If pattern does not match, continue trying more patterns.
-                    if (not pattern_matches) return;
+private:
+    static_assert(pattern_count, "Cannot do instruction selection with no input patterns to match");
+    static_assert(
+        ((Patterns::input::size() != 0) and ...),
+        "Every pattern must match at least one instruction"
+    );
+
+    template <typename inst>
+    static constexpr auto InputKey() -> u64 {
+        static_assert(
+            inst::operand_count <= detail::MatchMaxOperands,
+            "Too many operands in input instruction of pattern"
+        );
+
+        u64 kinds = 0;
+        usz i = 0;
+        inst::foreach_operand([&]<typename op> {
+            kinds |= detail::MatchKind(op::kind) << (detail::MatchKindBits * i++);
+        });
+        return detail::MakeMatchKey(inst::opcode, inst::operand_count, kinds);
+    }
 
-                    // Remove pattern input instruction(s) from instruction window,
-                    // keeping references to it/them.
-                    std::vector<MInst*> input{};
-                    input.insert(input.begin(), instructions.begin(), instructions.begin() + pattern::input::size());
-                    instructions.erase(instructions.begin(), instructions.begin() + pattern::input::size());
+    /// Match keys of the input instructions of a pattern.
+    struct InputKeys {
+        std::array<u64, longest_input> keys{};
+        usz size{};
+    };
 
-                    // Add pattern output instruction(s) to instruction window, fixing
-                    // up reference-type operands (operand references get updated to the
-                    // operand they reference).
+    template <typename pattern>
+    static constexpr auto PatternInputKeys() -> InputKeys {
+        InputKeys k{};
+        pattern::input::foreach ([&]<typename inst> {
+            k.keys[k.size++] = InputKey<inst>();
+        });
+        return k;
+    }
 
-                    // Map of the index from v<index> to the id of the new virtual register it
-                    // should be replaced with.
-                    std::unordered_map<usz, usz> new_virtuals{};
+    static constexpr std::array<InputKeys, pattern_count> input_keys{PatternInputKeys<Patterns>()...};
+
+    /// (first input key, pattern index) pairs, sorted. Patterns with
+    /// the same first key stay in list order, so the first pattern in
+    /// the list that matches still wins.
+    static constexpr auto by_first_key = [] {
+        std::array<std::pair<u64, usz>, pattern_count> entries{};
+        for (usz i = 0; i < pattern_count; ++i) entries[i] = {input_keys[i].keys[0], i};
+        rgs::sort(entries);
+        return entries;
+    }();
+
+    /// For each opcode, the range of `by_first_key` that holds the
+    /// patterns whose first input instruction has that opcode.
+    static constexpr auto by_opcode = [] {
+        constexpr usz size = (by_first_key.back().first >> 32) + 1;
+        std::array<std::pair<u16, u16>, size> ranges{};
+        for (usz i = 0; i < pattern_count; ++i) {
+            auto& range = ranges[by_first_key[i].first >> 32];
+            if (range.first == range.second) range.first = u16(i);
+            range.second = u16(i + 1);
+        }
+        return ranges;
+    }();
+
+    static_assert(pattern_count <= std::numeric_limits<u16>::max(), "Too many patterns");
+
+    /// Find the first pattern that matches the front of the window using
+    /// the tables above; that is one lookup for the first instruction,
+    /// followed by comparing the keys of the candidates, which are few.
+    ///
+    /// Returns `pattern_count` if no pattern matches.
+    static auto Match(const Window& window) -> usz {
+        if (window.empty() or window.front()->opcode() >= by_opcode.size()) return pattern_count;
+
+        // Keys of the instructions in the window, computed on demand.
+        std::array<u64, longest_input> keys{};
+        usz keys_computed = 0;
+        const auto Key = [&](usz i) {
+            for (; keys_computed <= i; ++keys_computed)
+                keys[keys_computed] = detail::MatchKey(*window[keys_computed]);
+            return keys[i];
+        };
 
-                    isz output_i = 0;
-                    pattern::output::foreach ([&]<typename inst> {
-                        // Use instruction's vreg from input of pattern.
-                        auto* output = new MInst(inst::opcode, {input.back()->reg(), uint(input.back()->regsize())});
-                        // Use instruction's location from input of pattern.
-                        output->location(input.back()->location());
+        auto [begin, end] = by_opcode[window.front()->opcode()];
+        for (usz c = begin; c < end; ++c) {
+            auto [first_key, index] = by_first_key[c];
+            if (first_key < Key(0)) continue;
+            if (first_key > Key(0)) break;
 
-                        // Keep track of newly allocated machine instructions.
-                        pool.push_back(output);
-                        instructions.insert(instructions.begin() + output_i, output);
+            const auto& pattern_keys = input_keys[index];
+            if (pattern_keys.size > window.size()) continue;
 
-                        inst::clobbers::foreach ([&]<typename clobber> {
-                            if constexpr (clobber::kind == ClobberKind::Operand)
-                                output->add_operand_clobber(clobber::index);
-                            else if constexpr (clobber::kind == ClobberKind::RegisterValue)
-                                LCC_ASSERT(false, "TODO: Register clobbers member in MIR");
-                        });
+            bool matches = true;
+            for (usz i = 1; matches and i < pattern_keys.size; ++i)
+                matches = Key(i) == pattern_keys.keys[i];
+            if (matches) return index;
+        }
 
-                        inst::foreach_operand([&]<typename op> {
-                            output->add_operand(inst::template get_operand<op>(mod, function, input, new_virtuals));
-                        });
+        return pattern_count;
+    }
 
-                        // Stupidly match use count (not sure if even necessary).
-                        usz use_count = input.back()->use_count();
-                        while (use_count--) output->add_use();
+    /// Try all patterns in order, checking opcodes and operand kinds one
+    /// by one. Returns `pattern_count` if no pattern matches.
+    static auto MatchLinear(const Window& instructions) -> usz {
+        usz pattern_index = 0;
+        bool to_be_handled = true;
+        While<Patterns...>(to_be_handled, [&]<typename pattern>() {
+            if (Matches<pattern>(instructions)) to_be_handled = false; // break
+            else ++pattern_index;
+        });
+        return pattern_index;
+    }
 
-                        ++output_i;
-                    });
+    template <typename pattern>
+    static auto Matches(const Window& instructions) -> bool {
+        // If the input pattern is longer than the current amount of instructions,
+        // skip this pattern.
+        if (pattern::input::size() > instructions.size()) return false;
+
+        // Ensure all opcodes and operand types match from the input pattern.
+        usz input_i = 0;
+        bool pattern_matches = true;
+        pattern::input::foreach ([&]<typename inst> {
+            // If the pattern has failed to match, skip the rest of the instructions
+            // in the pattern.
+            if (not pattern_matches) return;
+
+            auto* instruction = instructions[input_i];
+
+            // If the `i`th input instruction's opcode doesn't match the `i`th
+            // instruction window's opcode, the pattern does not match.
+            if (instruction->opcode() != inst::opcode) {
+                pattern_matches = false;
+                return;
+            }
 
-                    to_be_handled = false; // break
+            // Ensure operand amount and kinds match the input pattern.
+            bool operands_match = false;
+            if (inst::operand_count == instruction->all_operands().size()) {
+                operands_match = true;
+
+                usz op_i = 0;
+                inst::foreach_operand([&]<typename op> {
+                    // If the operands have failed to match, skip the rest of the operands.
+                    if (not operands_match) return;
+
+                    auto& operand = instruction->all_operands().at(op_i);
+                    static_assert(
+                        std::variant_size_v<MOperand> == 6,
+                        "Exhaustive handling of MOperand alternatives in instruction selection"
+                    );
+                    if (std::holds_alternative<MOperandImmediate>(operand)) {
+                        operands_match = op::kind == OperandKind::Immediate;
+                    } else if (std::holds_alternative<MOperandRegister>(operand)) {
+                        operands_match = op::kind == OperandKind::Register;
+                    } else if (std::holds_alternative<MOperandLocal>(operand)) {
+                        operands_match = op::kind == OperandKind::Local;
+                    } else if (std::holds_alternative<MOperandGlobal>(operand)) {
+                        operands_match = op::kind == OperandKind::Global;
+                    } else if (std::holds_alternative<MOperandFunction>(operand)) {
+                        operands_match = op::kind == OperandKind::Function;
+                    } else if (std::holds_alternative<MOperandBlock>(operand)) {
+                        operands_match = op::kind == OperandKind::Block;
+                    } else LCC_ASSERT(false, "Unhandled MIR Operand Kind in ISel...");
+                    ++op_i;
                 });
+            }
 
-                // If we get through *all* of the patterns, and none of them matched, we
-                // can pop an instruction off the front and emit it into the output,
-                // before going back to the "add instructions" bit.
-                if (to_be_handled) {
-                    if (instructions.size()) {
-                        // Add front of `instructions` to emission output.
-                        auto inst = instructions.front();
-                        new_block.insert(*inst);
-                        // Pop instruction from front of instruction window.
-                        instructions.erase(instructions.begin());
-                        // If instruction was a temporary allocation, free it.
-                        if (auto found = rgs::find(pool, inst) != pool.end()) {
-                            std::erase(pool, inst);
-                            delete inst;
-                        }
-                    }
-                }
+            pattern_matches = operands_match;
 
-                // If there are still instructions in the window to be handled, go back
-                // and handle them (after topping off the window with any more
-                // instructions that there may be). If the window is empty, but there are
-                // still more instructions to handle in this block, also go back and
-                // handle them.
-            } while (not instructions.empty() or instructions_handled < old_block.instructions().size());
+            ++input_i;
+        });
+
+        return pattern_matches;
+    }
+
+    /// Replace the input of a pattern at the front of the window with
+    /// its output.
+    template <typename pattern>
+    static void Apply(
+        lcc::Module* mod,
+        MFunction& function,
+        Window& instructions,
+        InstArena& arena
+    ) {
+        // Remove pattern input instruction(s) from instruction window,
+        // keeping references to it/them.
+        constexpr usz input_size = pattern::input::size();
+        std::array<MInst*, input_size> input{};
+        std::array<usz, input_size> input_slots{};
+        for (usz i = 0; i < input_size; ++i) {
+            input[i] = instructions[i];
+            input_slots[i] = instructions.entry(i).slot;
         }
+        instructions.pop_front(input_size);
+
+        // Create pattern output instruction(s), fixing up reference-type
+        // operands (operand references get updated to the operand they
+        // reference).
+
+        // Map of the index from v<index> to the id of the new virtual register it
+        // should be replaced with.
+        NewVirtuals new_virtuals{};
+
+        std::array<Window::Entry, pattern::output::size()> outputs{};
+        usz output_i = 0;
+        pattern::output::foreach ([&]<typename inst> {
+            // Use instruction's vreg from input of pattern.
+            auto entry = arena.create(inst::opcode, {input.back()->reg(), uint(input.back()->regsize())});
+            auto* output = entry.inst;
+            // Use instruction's location from input of pattern.
+            output->location(input.back()->location());
+
+            inst::clobbers::foreach ([&]<typename clobber> {
+                if constexpr (clobber::kind == ClobberKind::Operand)
+                    output->add_operand_clobber(clobber::index);
+                else if constexpr (clobber::kind == ClobberKind::RegisterValue)
+                    LCC_ASSERT(false, "TODO: Register clobbers member in MIR");
+            });
+
+            inst::foreach_operand([&]<typename op> {
+                output->add_operand(inst::template get_operand<op>(mod, function, input, new_virtuals));
+            });
+
+            // Stupidly match use count (not sure if even necessary).
+            usz use_count = input.back()->use_count();
+            while (use_count--) output->add_use();
+
+            outputs[output_i++] = entry;
+        });
 
-        return out;
+        // Add pattern output instruction(s) to the front of the window.
+        for (usz i = outputs.size(); i--;) instructions.push_front(outputs[i]);
+
+        // Inputs that were themselves produced by a pattern are dead now.
+        for (auto slot : input_slots)
+            if (slot != Window::NotInArena) arena.free(slot);
     }
+
+    using Applier = void (*)(lcc::Module*, MFunction&, Window&, InstArena&);
+    static constexpr std::array<Applier, pattern_count> apply{&Apply<Patterns>...};
 };
 
 } // namespace isel
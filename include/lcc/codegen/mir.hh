@@ -6,7 +6,9 @@
 #include <lcc/location.hh>
 #include <lcc/utils.hh>
 
+#include <optional>
 #include <set>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -31,6 +33,10 @@ struct LocalOp {
     // an index into the function's locals and, instead, the offset is used
     // directly from the base pointer. Allows access of parent stackframe.
     static constexpr u32 absolute_index = u32(-2);
+    // Local operand's index field, when at least this value, refers to a
+    // stack slot the register allocator spilled a value to (index minus
+    // this value is the number of the slot) rather than to a local.
+    static constexpr u32 first_spill_index = u32(1) << 31;
     u32 index{bad_index}; // if you have more locals than this, /you/ fucked up.
     i32 offset{0};
 };
@@ -107,6 +113,12 @@ public:
         UGt,
         UGe,
 
+        /// Binary instructions with no IR equivalent
+        // High half of the double-width product of the operands; used to
+        // lower division by a constant.
+        SMulHi,
+        UMulHi,
+
         ArchStart = 0x420,
     };
 
@@ -226,15 +238,22 @@ public:
 class MBlock {
     std::string _name;
 
-    // Probably not best to reference blocks by name. But, hey, it's what we
-    // got.
-    std::vector<std::string> _successors;
-    std::vector<std::string> _predecessors;
+    /// Index of this block in its parent function.
+    usz _id{};
+
+    /// Control flow edges, as indices into the blocks of the parent
+    /// function; the name is only used for printing.
+    std::vector<usz> _successors;
+    std::vector<usz> _predecessors;
 
     std::vector<MInst> _instructions;
 
     Location _location;
 
+    /// How often the IR block this was lowered from was executed in a
+    /// profiling run, if a profile was applied.
+    std::optional<u64> _execution_count;
+
 public:
     MBlock(std::string name) : _name(name){};
 
@@ -258,36 +277,45 @@ public:
         return _name;
     }
 
+    /// Get the index of this block in its parent function.
+    [[nodiscard]]
+    auto id() const -> usz { return _id; }
+    void id(usz id) { _id = id; }
+
     [[nodiscard]]
     auto location() const -> Location { return _location; }
     void location(Location location) { _location = location; }
 
     [[nodiscard]]
-    auto successors() -> std::vector<std::string>& {
+    auto execution_count() const -> std::optional<u64> { return _execution_count; }
+    void execution_count(std::optional<u64> count) { _execution_count = count; }
+
+    [[nodiscard]]
+    auto successors() -> std::vector<usz>& {
         return _successors;
     }
 
     [[nodiscard]]
-    auto successors() const -> std::vector<std::string> {
+    auto successors() const -> const std::vector<usz>& {
         return _successors;
     }
 
     [[nodiscard]]
-    auto predecessors() -> std::vector<std::string>& {
+    auto predecessors() -> std::vector<usz>& {
         return _predecessors;
     }
 
     [[nodiscard]]
-    auto predecessors() const -> std::vector<std::string> {
+    auto predecessors() const -> const std::vector<usz>& {
         return _predecessors;
     }
 
-    void add_successor(std::string block_name) {
-        _successors.push_back(block_name);
+    void add_successor(usz block_id) {
+        _successors.push_back(block_id);
     }
 
-    void add_predecessor(std::string block_name) {
-        _predecessors.push_back(block_name);
+    void add_predecessor(usz block_id) {
+        _predecessors.push_back(block_id);
     }
 
     bool closed() {
@@ -295,15 +323,15 @@ public:
         return MInst::is_terminator(_instructions.back().kind());
     }
 
-    void add_instruction(const MInst& inst, bool forced = false) {
+    void add_instruction(MInst inst, bool forced = false) {
         LCC_ASSERT(forced or not closed(), "Cannot insert into MBlock that has already been closed.");
         if (forced and closed()) {
-            _instructions.insert(_instructions.end() - 1, inst);
+            _instructions.insert(_instructions.end() - 1, std::move(inst));
             return;
         }
-        _instructions.push_back(inst);
+        _instructions.push_back(std::move(inst));
     }
-    void insert(const MInst& inst) { add_instruction(inst); }
+    void insert(MInst inst) { add_instruction(std::move(inst)); }
 
     void remove_inst_by_reg(usz regvalue) {
         std::erase_if(_instructions, [&](const MInst& minst) -> bool {
@@ -321,6 +349,19 @@ class MFunction {
 
     std::set<u8> _registers_used{};
 
+    // Number of eight-byte stack slots that hold values spilled by the
+    // register allocator.
+    usz _spill_slots{};
+
+    // Offset from the base pointer of each stack slot, and the size of the
+    // frame that holds them; see `frame_layout()`.
+    std::vector<isz> _slot_offsets{};
+    usz _frame_size{};
+    bool _frame_laid_out{};
+
+    // Next virtual register to hand out after lowering; see `next_vreg()`.
+    usz _next_vreg{};
+
     Location _location;
 
     CallConv cc;
@@ -355,8 +396,42 @@ public:
     auto location() const -> Location { return _location; }
     void location(Location location) { _location = location; }
 
+    /// Create a new virtual register. Unlike `Module::next_vreg()`, this
+    /// only touches the function itself, so that functions can be
+    /// compiled in parallel once lowered; registers are only unique within
+    /// a function. Set `first_free_vreg()` past every virtual register the
+    /// function uses first.
+    [[nodiscard]]
+    auto next_vreg() -> usz {
+        LCC_ASSERT(_next_vreg, "Creating a virtual register in a function before setting its first free one");
+        return _next_vreg++;
+    }
+
+    [[nodiscard]]
+    auto first_free_vreg() const -> usz { return _next_vreg; }
+    void first_free_vreg(usz vreg) { _next_vreg = vreg; }
+
+    /// Get a block by its index (see `MBlock::id()`).
+    [[nodiscard]]
+    auto block(usz id) -> MBlock& {
+        LCC_ASSERT(id < _blocks.size(), "Block index {} out of range", id);
+        return _blocks[id];
+    }
+
+    [[nodiscard]]
+    auto block(usz id) const -> const MBlock& {
+        LCC_ASSERT(id < _blocks.size(), "Block index {} out of range", id);
+        return _blocks[id];
+    }
+
     void add_block(const MBlock& block) {
         _blocks.push_back(block);
+        _blocks.back().id(_blocks.size() - 1);
+    }
+
+    void add_block(MBlock&& block) {
+        _blocks.push_back(std::move(block));
+        _blocks.back().id(_blocks.size() - 1);
     }
 
     auto locals() -> std::vector<AllocaInst*>& {
@@ -367,32 +442,60 @@ public:
         return _locals;
     }
 
-    // Given an index into the locals of this function (aka what local
-    // operands are), return the offset required to get to *the beginning of*
-    // this local.
-    // <local_offset(index)>(%rbp), basically
-    isz INTERNAL_local_offset(usz needle) const {
+    void add_local(AllocaInst* local) {
+        _locals.push_back(local);
+    }
+
+    /// Reserve a new eight-byte stack slot for a spilled value, and return
+    /// an operand that refers to it.
+    auto add_spill_slot() -> MOperandLocal {
+        return {MOperandLocal::first_spill_index + u32(_spill_slots++), 0};
+    }
+
+    [[nodiscard]]
+    auto spill_slots() const -> usz { return _spill_slots; }
+
+    /// Number of stack slots: one per local, followed by one per spill
+    /// slot.
+    [[nodiscard]]
+    auto stack_slots() const -> usz { return _locals.size() + _spill_slots; }
+
+    /// Index of the stack slot a local operand refers to (see
+    /// `stack_slots()`).
+    [[nodiscard]]
+    auto stack_slot(MOperandLocal local) const -> usz {
         LCC_ASSERT(
-            needle != MOperandLocal::bad_index,
-            "Getting offset of local with invalid index"
+            local.index != MOperandLocal::bad_index and local.index != MOperandLocal::absolute_index,
+            "Local operand does not refer to a stack slot"
         );
+        if (local.index >= MOperandLocal::first_spill_index)
+            return _locals.size() + (local.index - MOperandLocal::first_spill_index);
+        return local.index;
+    }
 
-        // Absolute local operand (see definition of MOperand's base type).
-        if (needle == MOperandLocal::absolute_index) return 0;
-
-        isz offset = 0;
-        for (usz index = 0; index <= needle; ++index)
-            offset -= isz(_locals.at(index)->allocated_type()->bytes());
-        return offset;
+    /// Place each stack slot at the given offset from the base pointer
+    /// (see `allocate_stack_slots()`), in a frame of `size` bytes.
+    void frame_layout(std::vector<isz> offsets, usz size) {
+        LCC_ASSERT(offsets.size() == stack_slots(), "Frame layout must place every stack slot");
+        _slot_offsets = std::move(offsets);
+        _frame_size = size;
+        _frame_laid_out = true;
     }
 
     // <local_offset(index)+offset>(%rbp), basically
     isz local_offset(MOperandLocal local) const {
-        return INTERNAL_local_offset(local.index) + local.offset;
+        // Absolute local operand (see definition of MOperand's base type).
+        if (local.index == MOperandLocal::absolute_index) return local.offset;
+        LCC_ASSERT(_frame_laid_out, "Getting offset of local before laying out the stack frame");
+        return _slot_offsets.at(stack_slot(local)) + local.offset;
     }
 
-    void add_local(AllocaInst* local) {
-        _locals.push_back(local);
+    /// Size of the stack frame (before alignment) that holds all stack
+    /// slots.
+    [[nodiscard]]
+    auto frame_size() const -> usz {
+        LCC_ASSERT(_frame_laid_out, "Getting size of stack frame before laying it out");
+        return _frame_size;
     }
 
     auto registers_used() -> std::set<u8>& {
@@ -402,14 +505,6 @@ public:
     auto registers_used() const -> const std::set<u8>& {
         return _registers_used;
     }
-
-    auto block_by_name(std::string_view name) -> MBlock* {
-        auto found = std::find_if(_blocks.begin(), _blocks.end(), [&](const MBlock& b) {
-            return b.name() == name;
-        });
-        if (found == _blocks.end()) return nullptr;
-        return &*found;
-    }
 };
 
 inline std::string ToString(MInst::Kind k) {
@@ -456,6 +551,8 @@ inline std::string ToString(MInst::Kind k) {
         case MInst::Kind::ULe: return "M.ULe";
         case MInst::Kind::UGt: return "M.UGt";
         case MInst::Kind::UGe: return "M.UGe";
+        case MInst::Kind::SMulHi: return "M.SMulHi";
+        case MInst::Kind::UMulHi: return "M.UMulHi";
         case MInst::Kind::ArchStart: return "M.ArchStart";
     }
     LCC_UNREACHABLE();
@@ -470,9 +567,9 @@ auto PrintMInstImpl(const MInst& inst, auto&& inst_opcode) -> std::string;
 [[nodiscard]]
 auto PrintMInst(const MInst& inst) -> std::string;
 [[nodiscard]]
-auto PrintMBlockImpl(const MBlock& block, auto&& inst_opcode) -> std::string;
+auto PrintMBlockImpl(const MFunction& function, const MBlock& block, auto&& inst_opcode) -> std::string;
 [[nodiscard]]
-auto PrintMBlock(const MBlock& block) -> std::string;
+auto PrintMBlock(const MFunction& function, const MBlock& block) -> std::string;
 [[nodiscard]]
 auto PrintMFunctionImpl(const MFunction& function, auto&& inst_opcode) -> std::string;
 [[nodiscard]]
@@ -10,10 +10,60 @@ namespace lcc {
 struct MachineDescription {
     usz return_register;
     usz return_register_to_replace;
+
+    /// Opcode of a call instruction. Values that are live across a call
+    /// are only ever allocated to preserved registers.
+    usz call_opcode;
+
+    /// Opcode of a copy from one register into another. Copies between
+    /// registers that do not interfere are coalesced.
+    usz copy_opcode;
+
+    /// Opcodes of a load from a local into a register and of a store from
+    /// a register into a local, used to reload and store spilled values.
+    usz load_opcode;
+    usz store_opcode;
+
+    /// Opcode of an instruction that computes the address of its memory
+    /// operand instead of accessing it. A local whose address is taken
+    /// may be accessed through it anywhere, so its stack slot is never
+    /// shared with another.
+    usz address_opcode;
+
+    /// Whether an instruction reads from or writes to its operand at the
+    /// given index; used to place the reloads and stores of spilled values.
+    bool (*reads_operand)(const MInst&, usz);
+    bool (*writes_operand)(const MInst&, usz);
+
+    /// Registers available for allocation, in order of preference.
     std::vector<usz> registers;
+
+    /// The subset of `registers` that a callee must preserve. A function
+    /// that is allocated one of these saves it in its prologue and
+    /// restores it in its epilogue.
+    std::vector<usz> preserved_registers;
 };
 
-void allocate_registers(const MachineDescription& desc, MFunction& function);
+enum struct RegisterAllocator {
+    /// Colour an interference graph of all registers, coalescing copies.
+    /// Slower, but produces better code.
+    GraphColouring,
+
+    /// Scan the live intervals of virtual registers over the linear order
+    /// of instructions, assigning the first free register to each. Fast,
+    /// and uses little memory even for very large functions.
+    LinearScan,
+};
+
+void allocate_registers(
+    const MachineDescription& desc,
+    MFunction& function,
+    RegisterAllocator allocator = RegisterAllocator::GraphColouring
+);
+
+/// Preserved registers that were allocated in \p function, in the order
+/// the prologue saves them; the epilogue restores them in reverse.
+auto saved_registers(const MachineDescription& desc, const MFunction& function) -> std::vector<usz>;
 
 }
 
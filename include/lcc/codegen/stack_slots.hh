@@ -0,0 +1,17 @@
+#ifndef LCC_CODEGEN_STACK_SLOTS_HH
+#define LCC_CODEGEN_STACK_SLOTS_HH
+
+#include <lcc/codegen/register_allocation.hh>
+#include <lcc/forward.hh>
+
+namespace lcc {
+
+/// Lay out the stack frame of a function whose registers have been
+/// allocated: place every local and spill slot at an offset from the
+/// base pointer, sharing space between slots that are never live at the
+/// same time, and set the size of the frame.
+void allocate_stack_slots(const MachineDescription& desc, MFunction& function);
+
+} // namespace lcc
+
+#endif /* LCC_CODEGEN_STACK_SLOTS_HH */
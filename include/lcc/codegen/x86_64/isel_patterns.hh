@@ -109,8 +109,8 @@ using s_ext_reg = Pattern<
 using not_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Compl), Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Not), o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Not), i<0>>>>;
 
 using sar_imm_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Sar), Immediate<>, Immediate<>>>,
@@ -161,62 +161,68 @@ using shl_imm_reg = Pattern<
 using sar_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Sar), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::ShiftRightArithmetic), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftRightArithmetic), o<1>, i<0>>>>;
 
 using shr_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Shr), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::ShiftRightLogical), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftRightLogical), o<1>, i<0>>>>;
 
 using shl_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Shl), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::ShiftLeft), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftLeft), o<1>, i<0>>>>;
 
 using sar_reg_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Sar), Register<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Move), o<1>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
-        Inst<Clobbers<>, usz(Opcode::ShiftRightArithmetic), Register<usz(RegId::RCX), Immediate<8>>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<>, usz(Opcode::Move), ResizedRegister<1, 32>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftRightArithmetic), Register<usz(RegId::RCX), Immediate<8>>, i<0>>>>;
 
 using shr_reg_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Shr), Register<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Move), o<1>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
-        Inst<Clobbers<>, usz(Opcode::ShiftRightLogical), Register<usz(RegId::RCX), Immediate<8>>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<>, usz(Opcode::Move), ResizedRegister<1, 32>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftRightLogical), Register<usz(RegId::RCX), Immediate<8>>, i<0>>>>;
 
 using shl_reg_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Shl), Register<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Move), o<1>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
-        Inst<Clobbers<>, usz(Opcode::ShiftLeft), Register<usz(RegId::RCX), Immediate<8>>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<>, usz(Opcode::Move), ResizedRegister<1, 32>, Register<usz(RegId::RCX), Immediate<32>>>, // 32 bits to clear dependencies
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::ShiftLeft), Register<usz(RegId::RCX), Immediate<8>>, i<0>>>>;
 
+// x86_64 arithmetic overwrites one of its operands, and either source may
+// still be live afterwards, so the first source is copied into the result
+// register and the operation is applied to that:
+//   mov %o0, %i0
+//   op  %o1, %i0
+// If the first source dies here, the allocator coalesces the copy away.
 template <usz inst_kind, usz out_opcode>
 using binary_commutative_reg_reg = Pattern<
     InstList<Inst<Clobbers<>, inst_kind, Register<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, out_opcode, o<0>, o<1>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, out_opcode, o<1>, i<0>>>>;
 
 using and_reg_reg = binary_commutative_reg_reg<usz(MKind::And), usz(Opcode::And)>;
 using and_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::And), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::And), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::And), o<1>, i<0>>>>;
 
 using or_reg_reg = binary_commutative_reg_reg<usz(MKind::Or), usz(Opcode::Or)>;
 using or_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Or), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Or), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Or), o<1>, i<0>>>>;
 
 using add_local_imm_1 = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Add), Local<>, Immediate<>>>,
@@ -228,44 +234,68 @@ using add_local_imm_2 = Pattern<
         Inst<Clobbers<>, usz(Opcode::LoadEffectiveAddress), o<0>, i<0>>,
         Inst<Clobbers<c<1>>, usz(Opcode::Add), o<1>, i<0>>>>;
 
+using add_global_imm = Pattern<
+    InstList<Inst<Clobbers<>, usz(MKind::Add), Global<>, Immediate<>>>,
+    InstList<
+        Inst<Clobbers<>, usz(Opcode::LoadEffectiveAddress), o<0>, i<0>>,
+        Inst<Clobbers<c<1>>, usz(Opcode::Add), o<1>, i<0>>>>;
+
 using add_reg_reg = binary_commutative_reg_reg<usz(MKind::Add), usz(Opcode::Add)>;
 using add_imm_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Add), Immediate<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Add), o<0>, o<1>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Add), o<0>, i<0>>>>;
 
 using add_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Add), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Add), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Add), o<1>, i<0>>>>;
 
+using mul_reg_reg = binary_commutative_reg_reg<usz(MKind::Mul), usz(Opcode::Multiply)>;
 using mul_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Mul), Register<>, Immediate<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Multiply), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Multiply), o<1>, i<0>>>>;
 
 using mul_imm_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Mul), Immediate<>, Register<>>>,
     InstList<
-        Inst<Clobbers<>, usz(Opcode::Multiply), o<0>, o<1>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Multiply), o<0>, i<0>>>>;
+
+// High half of the product of a register and an immediate:
+//   mov %o0, %rax
+//   mov $o1, %rdx
+//   mul %rdx        ; rdx:rax = rax * rdx
+//   mov %rdx, %i0
+template <MKind kind, Opcode multiply_opcode>
+using mul_hi_reg_imm = Pattern<
+    InstList<Inst<Clobbers<>, usz(kind), Register<>, Immediate<>>>,
+    InstList<
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, Register<usz(RegId::RAX), Sizeof<0>>>,
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<1>, Register<usz(RegId::RDX), Sizeof<0>>>,
+        Inst<Clobbers<c<0>, c<1>>, usz(multiply_opcode), Register<usz(RegId::RDX), Sizeof<0>>, Register<usz(RegId::RAX), Sizeof<0>>>,
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), Register<usz(RegId::RDX), Sizeof<0>>, i<0>>>>;
+
+using s_mul_hi_reg_imm = mul_hi_reg_imm<MKind::SMulHi, Opcode::MultiplyWideSigned>;
+using u_mul_hi_reg_imm = mul_hi_reg_imm<MKind::UMulHi, Opcode::MultiplyWideUnsigned>;
 
 using sub_reg_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Sub), Register<>, Register<>>>,
     InstList<
         // NOTE: GNU ordering of operands
-        Inst<Clobbers<>, usz(Opcode::Sub), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Sub), o<1>, i<0>>>>;
 
 using sub_reg_imm = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::Sub), Register<>, Immediate<>>>,
     InstList<
         // NOTE: GNU ordering of operands
-        Inst<Clobbers<>, usz(Opcode::Sub), o<1>, o<0>>,
-        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>>>;
+        Inst<Clobbers<c<1>>, usz(Opcode::Move), o<0>, i<0>>,
+        Inst<Clobbers<>, usz(Opcode::Sub), o<1>, i<0>>>>;
 
 using cond_branch_reg = Pattern<
     InstList<Inst<Clobbers<>, usz(MKind::CondBranch), Register<>, Block<>, Block<>>>,
@@ -412,12 +442,16 @@ using AllPatterns = PatternList<
 
     add_local_imm_1,
     add_local_imm_2,
+    add_global_imm,
     add_reg_reg,
     add_imm_reg,
     add_reg_imm,
 
+    mul_reg_reg,
     mul_imm_reg,
     mul_reg_imm,
+    s_mul_hi_reg_imm,
+    u_mul_hi_reg_imm,
 
     sub_reg_reg,
     sub_reg_imm,
@@ -0,0 +1,20 @@
+#ifndef LCC_CODEGEN_X86_64_PEEPHOLE_HH
+#define LCC_CODEGEN_X86_64_PEEPHOLE_HH
+
+#include <lcc/codegen/mir.hh>
+
+namespace lcc::x86_64 {
+
+/// Clean up the code of a function after register allocation, before it
+/// is emitted (as assembly or as an object file).
+///
+/// This removes moves of a register into itself, jumps to the block that
+/// follows, and reloads of a value that was just stored; merges adjacent
+/// additions of immediates to the same register; and uses the shorter
+/// `xor` and `test` idioms for zeroing a register and comparing it to
+/// zero. The number of each kind of rewrite is reported as a statistic.
+void optimise_peephole(MFunction& function);
+
+} // namespace lcc::x86_64
+
+#endif /* LCC_CODEGEN_X86_64_PEEPHOLE_HH */
@@ -2,10 +2,14 @@
 #define LCC_CODEGEN_X86_64_HH
 
 #include <lcc/codegen/mir.hh>
+#include <lcc/codegen/register_allocation.hh>
+#include <lcc/target.hh>
 #include <lcc/utils.hh>
 
+#include <optional>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace lcc::x86_64 {
 
@@ -19,20 +23,30 @@ enum struct Opcode : u32 {
     Pop,              // pop
     Jump,             // jmp
     Call,             // call
+
+    // Operands, if any, are the registers clobbered by the kernel; they
+    // only exist for the register allocator and are not emitted.
+    Syscall, // syscall
+
     Move,             // mov
     MoveSignExtended, // movsx
     MoveZeroExtended, // movzx
 
-    // Optional third offset operand (default zero).
-    MoveDereferenceRHS, // mov <any>, [offset](%register).
-    MoveDereferenceLHS, // mov [offset](%register), <any>
+    // When the address is a register, it may be followed by the optional
+    // trailing operands of an `Address`: an offset (default zero), then an
+    // index register and scale.
+    MoveDereferenceRHS, // mov <any>, [offset](%register[, %index, scale]).
+    MoveDereferenceLHS, // mov [offset](%register[, %index, scale]), <any>
 
+    // Same address operands as MoveDereferenceLHS when the first operand
+    // is a register.
     LoadEffectiveAddress, // lea
 
     // Bitwise
     Not, // One's Complement Negation
     And,
     Or,
+    Xor,
     ShiftRightArithmetic,
     ShiftRightLogical,
     ShiftLeft,
@@ -40,11 +54,36 @@ enum struct Opcode : u32 {
     Add,      // add
     Multiply, // mul
 
+    // One-operand multiply: RDX:RAX = RAX * operand. The second operand
+    // is always RAX, and only exists for the register allocator.
+    MultiplyWideUnsigned, // mul
+    MultiplyWideSigned,   // imul
+
     Sub, // sub
 
-    Compare,        // cmp
-    Test,           // test
-    JumpIfZeroFlag, // jz
+    Compare, // cmp
+    Test,    // test
+
+    // Conditional jumps, named after the flags they test or, for those
+    // that follow a `cmp`, after the comparison they branch on.
+    JumpIfZeroFlag,                // jz
+    JumpIfNotZeroFlag,             // jnz
+    JumpIfSignFlag,                // js
+    JumpIfNotSignFlag,             // jns
+    JumpIfOverflowFlag,            // jo
+    JumpIfNotOverflowFlag,         // jno
+    JumpIfParityFlag,              // jp
+    JumpIfNotParityFlag,           // jnp
+    JumpIfEqual,                   // je
+    JumpIfNotEqual,                // jne
+    JumpIfEqualOrLessUnsigned,     // jbe
+    JumpIfEqualOrLessSigned,       // jle
+    JumpIfEqualOrGreaterUnsigned,  // jae
+    JumpIfEqualOrGreaterSigned,    // jge
+    JumpIfLessUnsigned,            // jb
+    JumpIfLessSigned,              // jl
+    JumpIfGreaterUnsigned,         // ja
+    JumpIfGreaterSigned,           // jg
 
     SetByteIfEqual,                  // sete (set if equal)
     SetByteIfNotEqual,               // setne (set if not equal)
@@ -84,6 +123,105 @@ enum struct RegisterId : u32 {
 
 auto opcode_to_string(usz opcode) -> std::string;
 
+/// Whether an instruction reads the operand at the given index. Operands
+/// that are only written to (e.g. the destination of a `mov`) are not read.
+auto ReadsOperand(const MInst& inst, usz index) -> bool;
+
+/// Whether an instruction writes to the operand at the given index.
+auto WritesOperand(const MInst& inst, usz index) -> bool;
+
+/// The value of an immediate operand of an instruction on a register of
+/// \p bits bits: truncated to that size and sign-extended back.
+auto SignedImmediate(u64 value, usz bits) -> i64;
+
+/// Describe the registers of \p target, and the instructions that access
+/// them, to the register allocator.
+auto GetMachineDescription(const Target* target) -> MachineDescription;
+
+/// A memory operand that is addressed through a register:
+///
+///     displacement(%base, %index, scale)
+///
+/// In the MIR, this is the base register operand of a MoveDereferenceLHS,
+/// MoveDereferenceRHS, or LoadEffectiveAddress, followed by up to three
+/// trailing operands: an immediate displacement, an index register, and
+/// an immediate scale of 1, 2, 4, or 8.
+struct Address {
+    /// Index of the operand that holds the base register.
+    static constexpr usz BaseOperand(Opcode op) {
+        return op == Opcode::MoveDereferenceRHS ? 1 : 0;
+    }
+
+    /// Index of the first trailing operand.
+    static constexpr usz DisplacementOperand = 2;
+
+    MOperandRegister base;
+    i64 displacement{};
+    std::optional<MOperandRegister> index{};
+    u8 scale{1};
+
+    /// Whether the given instruction accesses memory through a register.
+    static auto Is(const MInst& inst) -> bool;
+
+    /// Get the address of an instruction for which `Is()` is true.
+    static auto Of(const MInst& inst) -> Address;
+
+    /// Append the trailing operands of this address to an instruction
+    /// whose base operand is already present.
+    void append_to(MInst& inst) const;
+};
+
+enum struct FrameKind {
+    /// Save %rbp and point it at the frame; locals and parameters are
+    /// addressed relative to %rbp.
+    BasePointer,
+
+    /// Allocate the frame with a single adjustment of %rsp and address
+    /// locals and parameters relative to %rsp; %rbp is left untouched.
+    /// Only used with `-fomit-frame-pointer`.
+    StackPointer,
+
+    /// A leaf function keeps its locals in the red zone below %rsp, which
+    /// the SysV ABI guarantees is not clobbered by signal handlers, so
+    /// %rsp is never adjusted.
+    RedZone,
+
+    /// A leaf function without locals needs no frame at all.
+    None,
+};
+
+/// The stack frame of a function: how it is set up by the prologue and
+/// torn down by the epilogue, and how its locals are addressed.
+///
+/// Preserved registers are saved below the locals when there is a base
+/// pointer, and above them otherwise, so that %rsp only needs to be
+/// adjusted once either way.
+struct Frame {
+    /// The largest amount of locals that fit in the red zone.
+    static constexpr usz RedZoneSize = 128;
+
+    FrameKind kind{FrameKind::BasePointer};
+
+    /// Bytes subtracted from %rsp by the prologue (and added back by the
+    /// epilogue), including padding that keeps %rsp aligned to 16 bytes.
+    usz size{};
+
+    /// Preserved registers, in the order the prologue pushes them.
+    std::vector<usz> saved{};
+
+    /// Pick the frame kind for a function once its registers have been
+    /// allocated and its stack slots laid out.
+    static auto Of(const Context* ctx, const MachineDescription& desc, const MFunction& function) -> Frame;
+
+    /// Whether locals and parameters are addressed relative to %rbp.
+    [[nodiscard]]
+    auto has_base_pointer() const -> bool { return kind == FrameKind::BasePointer; }
+
+    /// Memory operand that a local operand refers to.
+    [[nodiscard]]
+    auto address(const MFunction& function, MOperandLocal local) const -> Address;
+};
+
 namespace regs {
 template <char r>
 constexpr auto LegacyGPR(usz size) -> std::string_view {
@@ -125,6 +263,7 @@ constexpr auto ToString(Opcode op) -> std::string_view {
         case Opcode::Return: return "ret";
         case Opcode::Jump: return "jmp";
         case Opcode::Call: return "call";
+        case Opcode::Syscall: return "syscall";
         case Opcode::MoveDereferenceLHS:
         case Opcode::MoveDereferenceRHS:
         case Opcode::Move: return "mov";
@@ -134,16 +273,36 @@ constexpr auto ToString(Opcode op) -> std::string_view {
         case Opcode::Not: return "not";
         case Opcode::And: return "and";
         case Opcode::Or: return "or";
+        case Opcode::Xor: return "xor";
         case Opcode::ShiftLeft: return "shl";
         case Opcode::ShiftRightLogical: return "shr";
         case Opcode::ShiftRightArithmetic: return "sar";
         case Opcode::Add: return "add";
         case Opcode::Multiply: return "imul";
+        case Opcode::MultiplyWideUnsigned: return "mul";
+        case Opcode::MultiplyWideSigned: return "imul";
         case Opcode::Sub: return "sub";
         case Opcode::Push: return "push";
         case Opcode::Pop: return "pop";
         case Opcode::Test: return "test";
         case Opcode::JumpIfZeroFlag: return "jz";
+        case Opcode::JumpIfNotZeroFlag: return "jnz";
+        case Opcode::JumpIfSignFlag: return "js";
+        case Opcode::JumpIfNotSignFlag: return "jns";
+        case Opcode::JumpIfOverflowFlag: return "jo";
+        case Opcode::JumpIfNotOverflowFlag: return "jno";
+        case Opcode::JumpIfParityFlag: return "jp";
+        case Opcode::JumpIfNotParityFlag: return "jnp";
+        case Opcode::JumpIfEqual: return "je";
+        case Opcode::JumpIfNotEqual: return "jne";
+        case Opcode::JumpIfEqualOrLessUnsigned: return "jbe";
+        case Opcode::JumpIfEqualOrLessSigned: return "jle";
+        case Opcode::JumpIfEqualOrGreaterUnsigned: return "jae";
+        case Opcode::JumpIfEqualOrGreaterSigned: return "jge";
+        case Opcode::JumpIfLessUnsigned: return "jb";
+        case Opcode::JumpIfLessSigned: return "jl";
+        case Opcode::JumpIfGreaterUnsigned: return "ja";
+        case Opcode::JumpIfGreaterSigned: return "jg";
         case Opcode::Compare: return "cmp";
         case Opcode::SetByteIfEqual: return "sete";
         case Opcode::SetByteIfNotEqual: return "setne";
@@ -41,6 +41,14 @@ public:
         DoNotStopatMIR,
         StopatMIR = true,
     };
+    enum OptionLinearScan : bool {
+        DoNotUseLinearScan,
+        UseLinearScan = true,
+    };
+    enum OptionOmitFramePointer : bool {
+        DoNotOmitFramePointer,
+        OmitFramePointer = true,
+    };
 
     struct Options {
         OptionColour _colour_diagnostics;
@@ -51,6 +59,9 @@ public:
 
         OptionPrintMIR _should_print_mir;
         OptionStopatMIR _stopat_mir;
+
+        OptionLinearScan _use_linear_scan;
+        OptionOmitFramePointer _omit_frame_pointer;
     };
 
 private:
@@ -170,6 +181,20 @@ public:
         return _options._stopat_mir;
     }
 
+    /// Whether to allocate registers with a linear scan instead of by
+    /// colouring an interference graph.
+    [[nodiscard]]
+    auto option_use_linear_scan() const {
+        return _options._use_linear_scan;
+    }
+
+    /// Whether functions that need a stack frame may address it relative
+    /// to the stack pointer, leaving the base pointer free.
+    [[nodiscard]]
+    auto option_omit_frame_pointer() const {
+        return _options._omit_frame_pointer;
+    }
+
     auto include_directories() const -> const decltype(_include_directories)& {
         return _include_directories;
     }
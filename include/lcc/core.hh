@@ -80,6 +80,7 @@ enum struct IntrinsicKind {
 
     /// Perform a system call.
     /// Operands: any_int %syscall, any_int... %args
+    /// Yields: i64 result of the system call
     SystemCall,
 };
 
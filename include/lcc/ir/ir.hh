@@ -14,6 +14,7 @@
 #include <algorithm>
 #include <concepts>
 #include <functional>
+#include <optional>
 #include <span>
 #include <string>
 #include <string_view>
@@ -240,7 +241,7 @@ public:
     [[nodiscard]]
     auto init() -> Value* { return _init; }
     [[nodiscard]]
-    auto names() const -> std::vector<IRName> { return _names; }
+    auto names() const -> const std::vector<IRName>& { return _names; }
 
     /// RTTI.
     [[nodiscard]]
@@ -413,6 +414,9 @@ class Block : public UseTrackingValue {
     /// The name of this block.
     std::string block_name;
 
+    /// How often this block was executed, if a profile was applied.
+    std::optional<u64> exec_count{};
+
     /// TODO: Blocks and functions should also keep track of their users
     /// to simplify dead code elimination and computing predecessors.
 
@@ -443,6 +447,14 @@ public:
     /// Erase this block and all instructions in it.
     void erase();
 
+    /// Get how often this block was executed in a profiling run, or
+    /// nothing if no profile was applied (see `-fprofile-use`).
+    [[nodiscard]]
+    auto execution_count() const -> std::optional<u64> { return exec_count; }
+
+    /// Set how often this block was executed in a profiling run.
+    void execution_count(u64 count) { exec_count = count; }
+
     /// Get the parent function.
     [[nodiscard]]
     auto function() const -> Function* { return parent; }
@@ -629,7 +641,7 @@ public:
 
     // Get the names of this function.
     [[nodiscard]]
-    auto names() const -> std::vector<IRName> { return func_names; }
+    auto names() const -> const std::vector<IRName>& { return func_names; }
 
     [[nodiscard]]
     auto has_name(std::string_view name) const {
@@ -832,6 +844,18 @@ public:
         for (auto* o : operand_list) AddUse(o, this);
     }
 
+    /// Create an intrinsic that yields a value of the given type (e.g.
+    /// the `i64` result of a system call).
+    explicit IntrinsicInst(
+        IntrinsicKind intrinsic_,
+        std::vector<Value*> operands,
+        Type* ty,
+        Location location = {}
+    ) : Inst(Kind::Intrinsic, ty, location),
+        intrinsic(intrinsic_), operand_list(std::move(operands)) {
+        for (auto* o : operand_list) AddUse(o, this);
+    }
+
     /// Get the intrinsic ID.
     [[nodiscard]]
     auto intrinsic_kind() const -> IntrinsicKind { return intrinsic; }
@@ -90,6 +90,9 @@ public:
     void lower();
     void emit(std::filesystem::path output_file_path);
 
+    /// Create a new virtual register while lowering to MIR. Not safe to
+    /// call from multiple threads; once lowered, functions create their
+    /// own with `MFunction::next_vreg()`.
     [[nodiscard]]
     auto next_vreg() -> usz {
         return _virtual_register++;
@@ -5,8 +5,22 @@
 
 namespace lcc::opt {
 /// Run the optimisation pipeline on the given module.
+///
+/// -O1 only runs cheap passes (SSA construction, instruction combining,
+/// DCE and global DCE); -O2 runs every other pass too, with a small
+/// iteration cap; -O3 adds common subexpression elimination, and runs
+/// until a fixed point is reached.
 void Optimise(Module* module, int opt_level);
 
+/// Reorder the blocks of each function so that likely successors fall
+/// through and cold code (e.g. paths ending in `unreachable`) ends up
+/// at the end of the function.
+///
+/// This is separate from `Optimise()` so it can run after a profile
+/// has been applied, in which case block execution counts are used
+/// instead of static heuristics.
+void LayoutBlocks(Module* module);
+
 /// Run select optimisation passes on the module.
 void RunPasses(Module* module, std::string_view passes);
 }
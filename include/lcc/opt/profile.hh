@@ -0,0 +1,34 @@
+#ifndef LCC_OPT_PROFILE_HH
+#define LCC_OPT_PROFILE_HH
+
+#include <lcc/ir/module.hh>
+
+#include <string_view>
+
+/// Profile-guided optimisation (`-fprofile-generate`, `-fprofile-use`).
+///
+/// An instrumented module counts how often each block is executed and,
+/// when `main` returns or the program calls `exit()`, `abort()` and the
+/// like, writes the counts to a profile file. Feeding that file back into
+/// a later compilation of the same program attaches the counts to the
+/// blocks (see `Block::execution_count()`), so that block layout and
+/// register allocation can tell hot code from cold code.
+///
+/// Both have to be run at the same point of the pipeline (before
+/// optimisation), since the profile is only accepted if the structure of
+/// the module is unchanged.
+namespace lcc::opt {
+/// Insert block counters into every defined function of the module and
+/// arrange for them to be written to `profile_path` when the program
+/// exits.
+void InstrumentProfile(Module* module, std::string_view profile_path);
+
+/// Read a profile written by an instrumented build of the same module
+/// and attach the execution counts to its blocks.
+///
+/// A profile that is missing or does not match the module is ignored
+/// with a warning.
+void ApplyProfile(Module* module, std::string_view profile_path);
+} // namespace lcc::opt
+
+#endif // LCC_OPT_PROFILE_HH
@@ -120,6 +120,129 @@ public:
 
     [[nodiscard]] auto str() const -> std::string { return fmt::format("{}", w); }
 };
+
+/// Constants needed to divide by a fixed divisor using a multiplication
+/// instead of a division (see Hacker's Delight, chapter 10).
+///
+/// For an N-bit dividend `n`, the quotient is the high N bits of the
+/// 2N-bit product of `n` and `multiplier`, shifted right by `shift`, plus
+/// a correction that depends on the signedness of the division.
+struct DivisionMagic {
+    aint multiplier;
+    u64 shift;
+
+    /// Unsigned only: the real multiplier has N + 1 bits, and `multiplier`
+    /// only holds its lower N bits, so the dividend has to be added back
+    /// to the product (see `UnsignedDivisionMagic()`).
+    bool add{};
+};
+
+/// Compute the magic number for signed division by `divisor`.
+///
+/// `divisor` must not be 0, 1, -1, or a (negated) power of two; those
+/// are better handled with moves and shifts anyway.
+///
+/// Signed division of `n` by `divisor` is then
+///
+///     q = mulhs(n, multiplier)
+///     q = q + n   if divisor > 0 and multiplier < 0
+///     q = q - n   if divisor < 0 and multiplier > 0
+///     q = q >>s shift
+///     q = q + (q >>u (N - 1))
+[[nodiscard]] constexpr auto SignedDivisionMagic(aint divisor) -> DivisionMagic {
+    using Word = aint::Word;
+    const u64 bits = divisor.bits();
+    const Word mask = divisor.sign_bit() | (divisor.sign_bit() - 1);
+    const Word d = divisor.value();
+    const Word ad = (divisor.is_negative() ? -d : d) & mask;
+    LCC_ASSERT(ad > 1 and not std::has_single_bit(ad), "Signed division magic for unsupported divisor");
+
+    const Word two_n1 = divisor.sign_bit();
+    const Word t = two_n1 + (d >> (bits - 1));
+    const Word anc = t - 1 - t % ad;
+
+    u64 p = bits - 1;
+    Word q1 = two_n1 / anc;
+    Word r1 = two_n1 - q1 * anc;
+    Word q2 = two_n1 / ad;
+    Word r2 = two_n1 - q2 * ad;
+    Word delta{};
+    do {
+        ++p;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc) {
+            q1 = (q1 + 1) & mask;
+            r1 = (r1 - anc) & mask;
+        }
+
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= ad) {
+            q2 = (q2 + 1) & mask;
+            r2 = (r2 - ad) & mask;
+        }
+
+        delta = ad - r2;
+    } while (q1 < delta or (q1 == delta and r1 == 0));
+
+    aint multiplier{bits, q2 + 1};
+    if (divisor.is_negative()) multiplier = -multiplier;
+    return {multiplier, p - bits};
+}
+
+/// Compute the magic number for unsigned division by `divisor`.
+///
+/// `divisor` must not be 0 or a power of two; those are better handled
+/// with moves and shifts anyway.
+///
+/// Unsigned division of `n` by `divisor` is then
+///
+///     q = mulhu(n, multiplier)
+///     q = q >>u shift                               if not add
+///     q = (((n - q) >>u 1) + q) >>u (shift - 1)     if add
+[[nodiscard]] constexpr auto UnsignedDivisionMagic(aint divisor) -> DivisionMagic {
+    using Word = aint::Word;
+    const u64 bits = divisor.bits();
+    const Word mask = divisor.sign_bit() | (divisor.sign_bit() - 1);
+    const Word d = divisor.value();
+    LCC_ASSERT(d > 1 and not std::has_single_bit(d), "Unsigned division magic for unsupported divisor");
+
+    const Word two_n1 = divisor.sign_bit();
+    const Word nc = (mask - ((-d) & mask) % d) & mask;
+
+    bool add = false;
+    u64 p = bits - 1;
+    Word q1 = two_n1 / nc;
+    Word r1 = two_n1 - q1 * nc;
+    Word q2 = (two_n1 - 1) / d;
+    Word r2 = (two_n1 - 1) - q2 * d;
+    Word delta{};
+    do {
+        ++p;
+        if (r1 >= nc - r1) {
+            q1 = (2 * q1 + 1) & mask;
+            r1 = (2 * r1 - nc) & mask;
+        } else {
+            q1 = (2 * q1) & mask;
+            r1 = (2 * r1) & mask;
+        }
+
+        if (r2 + 1 >= d - r2) {
+            if (q2 >= two_n1 - 1) add = true;
+            q2 = (2 * q2 + 1) & mask;
+            r2 = (2 * r2 + 1 - d) & mask;
+        } else {
+            if (q2 >= two_n1) add = true;
+            q2 = (2 * q2) & mask;
+            r2 = (2 * r2 + 1) & mask;
+        }
+
+        delta = d - 1 - r2;
+    } while (p < 2 * bits and (q1 < delta or (q1 == delta and r1 == 0)));
+
+    return {aint{bits, q2 + 1}, p - bits, add};
+}
 } // namespace lcc
 
 template <>
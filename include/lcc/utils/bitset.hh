@@ -0,0 +1,87 @@
+#ifndef LCC_UTILS_BITSET_HH
+#define LCC_UTILS_BITSET_HH
+
+#include <lcc/utils.hh>
+
+#include <bit>
+#include <vector>
+
+namespace lcc {
+
+/// A set of integers in [0, size), stored as one bit per integer.
+///
+/// Unlike `std::bitset`, the size is chosen at runtime; unlike
+/// `std::vector<bool>`, whole sets can be combined a word at a time.
+class Bitset {
+    using Word = u64;
+    static constexpr usz WordBits = 64;
+
+    std::vector<Word> _words{};
+    usz _size{};
+
+public:
+    Bitset() = default;
+    explicit Bitset(usz size) : _words((size + WordBits - 1) / WordBits), _size(size) {}
+
+    [[nodiscard]]
+    auto size() const -> usz { return _size; }
+
+    [[nodiscard]]
+    auto test(usz index) const -> bool {
+        LCC_ASSERT(index < _size, "Bitset: index {} out of bounds", index);
+        return _words[index / WordBits] & (Word(1) << (index % WordBits));
+    }
+
+    void set(usz index) {
+        LCC_ASSERT(index < _size, "Bitset: index {} out of bounds", index);
+        _words[index / WordBits] |= Word(1) << (index % WordBits);
+    }
+
+    void reset(usz index) {
+        LCC_ASSERT(index < _size, "Bitset: index {} out of bounds", index);
+        _words[index / WordBits] &= ~(Word(1) << (index % WordBits));
+    }
+
+    /// Number of integers in the set.
+    [[nodiscard]]
+    auto count() const -> usz {
+        usz n = 0;
+        for (auto word : _words) n += usz(std::popcount(word));
+        return n;
+    }
+
+    /// Add all integers in \p other to this set. Return whether this
+    /// set changed.
+    auto merge(const Bitset& other) -> bool {
+        LCC_ASSERT(other._size == _size, "Bitset: cannot merge sets of different sizes");
+        bool changed = false;
+        for (usz i = 0; i < _words.size(); ++i) {
+            auto merged = _words[i] | other._words[i];
+            changed |= merged != _words[i];
+            _words[i] = merged;
+        }
+        return changed;
+    }
+
+    /// Remove all integers in \p other from this set.
+    void remove(const Bitset& other) {
+        LCC_ASSERT(other._size == _size, "Bitset: cannot remove sets of different sizes");
+        for (usz i = 0; i < _words.size(); ++i) _words[i] &= ~other._words[i];
+    }
+
+    /// Call \p callback with each integer in the set, in ascending order.
+    template <typename Callback>
+    void for_each(Callback&& callback) const {
+        for (usz i = 0; i < _words.size(); ++i) {
+            for (auto word = _words[i]; word; word &= word - 1)
+                callback(i * WordBits + usz(std::countr_zero(word)));
+        }
+    }
+
+    [[nodiscard]]
+    auto operator==(const Bitset& other) const -> bool = default;
+};
+
+} // namespace lcc
+
+#endif /* LCC_UTILS_BITSET_HH */
@@ -0,0 +1,45 @@
+#ifndef LCC_UTILS_PARALLEL_HH
+#define LCC_UTILS_PARALLEL_HH
+
+#include <lcc/utils.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace lcc {
+
+/// Call `callback(i)` for every `i` in [0, count), spread over as many
+/// threads as there are hardware threads, and return once all calls are
+/// done. The calls may happen in any order, so they must not depend on
+/// each other; results that have to be in order should be written to a
+/// slot indexed by `i`.
+///
+/// Work is handed out one index at a time, so that a few expensive
+/// calls (e.g. one huge function among many small ones) don't keep the
+/// other threads waiting.
+template <typename Callback>
+void ParallelFor(usz count, Callback&& callback) {
+    usz threads = std::min(count, usz(std::max(1u, std::thread::hardware_concurrency())));
+    if (threads <= 1) {
+        for (usz i = 0; i < count; ++i) callback(i);
+        return;
+    }
+
+    std::atomic<usz> next{0};
+    auto work = [&] {
+        for (usz i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+            callback(i);
+    };
+
+    // The calling thread does its share of the work too.
+    std::vector<std::jthread> workers{};
+    workers.reserve(threads - 1);
+    for (usz i = 1; i < threads; ++i) workers.emplace_back(work);
+    work();
+}
+
+} // namespace lcc
+
+#endif /* LCC_UTILS_PARALLEL_HH */
@@ -14,6 +14,10 @@ bool StdoutIsTerminal();
 
 /// Check whether stderr is a terminal.
 bool StderrIsTerminal();
+
+/// Get the peak resident memory usage of this process so far, in
+/// bytes, or 0 if that is not supported on this platform.
+unsigned long long PeakMemoryUsage();
 } // namespace lcc::platform
 
 #endif // LCC_PLATFORM_HH
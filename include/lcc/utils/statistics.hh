@@ -0,0 +1,78 @@
+#ifndef LCC_UTILS_STATISTICS_HH
+#define LCC_UTILS_STATISTICS_HH
+
+#include <lcc/utils.hh>
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+/// Compile-time statistics (`-ftime-report`, `-stats`).
+///
+/// Timers record the wall time spent in, and the peak memory usage at
+/// the end of, a named phase of the compiler (e.g. "sema", "isel", or a
+/// single optimisation pass); repeated runs of the same phase accumulate.
+/// Counters record how much work a phase actually did, e.g. how many
+/// instructions were folded or how many blocks were removed.
+///
+/// Nothing is recorded unless collection was enabled by the driver, so
+/// it is fine to leave timers and counters in hot paths.
+namespace lcc::stats {
+enum struct ReportFormat {
+    Table,
+    JSON,
+};
+
+/// Start collecting phase timings.
+void EnableTiming();
+
+/// Start collecting counters.
+void EnableCounters();
+
+[[nodiscard]]
+auto TimingEnabled() -> bool;
+
+[[nodiscard]]
+auto CountersEnabled() -> bool;
+
+/// RAII helper that times the enclosing scope as the given phase.
+///
+/// Example:
+/// \code{.cpp}
+///     {
+///         stats::Timer _{"isel"};
+///         for (auto& mfunc : machine_ir)
+///             select_instructions(this, mfunc);
+///     }
+/// \endcode
+///
+/// Timers may be nested; a phase is reported underneath the phase that
+/// was running when it was first started.
+class Timer {
+    usz _phase{};
+    chr::steady_clock::time_point _start{};
+    bool _active;
+
+public:
+    explicit Timer(std::string_view phase);
+    ~Timer();
+
+    Timer(const Timer&) = delete;
+    Timer(Timer&&) = delete;
+    auto operator=(const Timer&) -> Timer& = delete;
+    auto operator=(Timer&&) -> Timer& = delete;
+};
+
+/// Add `amount` to the counter `name` in `group` (usually the name of a pass).
+void Count(std::string_view group, std::string_view name, usz amount = 1);
+
+/// Raise the counter `name` in `group` to `value` if it is lower, e.g.
+/// to record the most memory a data structure ever used.
+void Max(std::string_view group, std::string_view name, usz value);
+
+/// Format everything that was recorded so far.
+[[nodiscard]]
+auto Report(ReportFormat format) -> std::string;
+} // namespace lcc::stats
+
+#endif // LCC_UTILS_STATISTICS_HH
@@ -254,15 +254,31 @@ struct GenericObject {
     std::vector<Symbol> symbols;
     std::vector<Relocation> relocations;
 
-    Section& section(std::string_view name) {
+    // Index of the section with the given name in `sections`. Look a
+    // section up by name once and keep the index around, rather than
+    // searching for it over and over.
+    usz section_index(std::string_view name) const {
         auto found = rgs::find_if(sections, [&](const Section& s) {
             return std::string_view(s.name) == name;
         });
         LCC_ASSERT(found != sections.end(), "Could not find section with name {}", name);
-        return *found;
+        return usz(found - sections.begin());
+    }
+
+    Section& section(usz index) {
+        LCC_ASSERT(index < sections.size(), "Section index {} out of range", index);
+        return sections[index];
+    }
+    const Section& section(usz index) const {
+        LCC_ASSERT(index < sections.size(), "Section index {} out of range", index);
+        return sections[index];
+    }
+
+    Section& section(std::string_view name) {
+        return section(section_index(name));
     }
     const Section& section(std::string_view name) const {
-        return section(name);
+        return section(section_index(name));
     }
 
     // Creates symbols representing all names of the given global.
@@ -322,7 +338,7 @@ struct GenericObject {
                     // Align uninitialized data to variable type's alignment requirements.
                     uninitialized_data.length() = u32(align_to(
                         uninitialized_data.length(),
-                        isz(var->type()->align_bytes())
+                        isz(var->allocated_type()->align_bytes())
                     ));
 
                     // The symbol will now begin at an aligned address.
@@ -331,7 +347,7 @@ struct GenericObject {
                     symbols.push_back(s);
 
                     // Write uninitialized bytes for this variable.
-                    uninitialized_data.length() += u32(var->type()->bytes());
+                    uninitialized_data.length() += u32(var->allocated_type()->bytes());
                 }
             }
         }
@@ -3,6 +3,7 @@
 #include <lcc/context.hh>
 #include <lcc/file.hh>
 #include <lcc/ir/module.hh>
+#include <lcc/utils/statistics.hh>
 
 #include <glint/ir_gen.hh>
 #include <glint/parser.hh>
@@ -12,18 +13,25 @@ namespace lcc::glint {
 
 auto produce_module(Context* context, File& source) -> lcc::Module* {
     // Parse the file.
-    auto mod = Parser::Parse(context, source);
+    std::unique_ptr<Module> mod{};
+    {
+        stats::Timer _{"parse"};
+        mod = Parser::Parse(context, source);
+    }
     if (context->option_print_ast() and mod) mod->print(context->option_use_colour());
     // The error condition is handled by the caller already.
     if (context->has_error()) return {};
     if (context->option_stopat_syntax()) return {};
 
     // Perform semantic analysis.
-    lcc::glint::Sema::Analyse(
-        context,
-        *mod,
-        context->option_use_colour()
-    );
+    {
+        stats::Timer _{"sema"};
+        lcc::glint::Sema::Analyse(
+            context,
+            *mod,
+            context->option_use_colour()
+        );
+    }
     if (context->option_print_ast()) {
         fmt::print("\nAfter Sema:\n");
         mod->print(context->option_use_colour());
@@ -34,7 +42,11 @@ auto produce_module(Context* context, File& source) -> lcc::Module* {
     // Stop after sema if requested.
     if (context->option_stopat_sema()) return {};
 
-    auto* ir = IRGen::Generate(context, *mod);
+    lcc::Module* ir{};
+    {
+        stats::Timer _{"irgen"};
+        ir = IRGen::Generate(context, *mod);
+    }
     if (context->has_error()) return {};
 
     return ir;
@@ -7,7 +7,14 @@
 #include <lcc/ir/module.hh>
 #include <lcc/target.hh>
 #include <lcc/utils.hh>
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <unordered_map>
 #include <variant>
+#include <vector>
 
 namespace lcc {
 
@@ -63,7 +70,7 @@ static void calculate_defining_uses_for_block(
     // anything fancy; just follow the simple control flow for as long as
     // possible.
     while (block->successors().size() == 1) {
-        block = function.block_by_name(block->successors().front());
+        block = &function.block(block->successors().front());
         mark_defining_uses(regs_seen, block);
     }
     // If a block has multiple successors, we will "remember" the
@@ -75,7 +82,7 @@ static void calculate_defining_uses_for_block(
     for (auto successor : block->successors()) {
         // Copy registers seen.
         std::vector<usz> regs_seen_copy = {regs_seen};
-        calculate_defining_uses_for_block(function, regs_seen_copy, function.block_by_name(successor), visited, doubly_visited);
+        calculate_defining_uses_for_block(function, regs_seen_copy, &function.block(successor), visited, doubly_visited);
     }
 }
 
@@ -84,11 +91,475 @@ static void calculate_defining_uses(MFunction& function) {
     calculate_defining_uses_for_block(function, {}, &function.blocks().front(), {}, {});
 }
 
+namespace {
+auto IsVirtual(const MOperand& op) -> bool {
+    return std::holds_alternative<MOperandRegister>(op)
+       and std::get<MOperandRegister>(op).value >= +MInst::Kind::ArchStart;
+}
+
+/// Get the number of operands that refer to each virtual register.
+auto CountUses(const MFunction& function) -> std::unordered_map<usz, usz> {
+    std::unordered_map<usz, usz> uses{};
+    for (const auto& block : function.blocks())
+        for (const auto& inst : block.instructions())
+            for (const auto& op : inst.all_operands())
+                if (IsVirtual(op)) ++uses[std::get<MOperandRegister>(op).value];
+    return uses;
+}
+
+/// Folds address arithmetic into the x86_64 memory operands of the loads
+/// and stores that use it, before the patterns see any of it.
+///
+/// GEP and GMP lower to `mul`s by the element size and `add`s to the base
+/// pointer. When such a computation has a single user in the same block,
+/// it becomes part of that user's `displacement(%base, %index, scale)`
+/// address instead, and when it doesn't, it becomes a `lea`.
+class AddressFolder {
+    MFunction& _function;
+
+    /// Number of operands that refer to each virtual register.
+    std::unordered_map<usz, usz> _uses{};
+
+    /// State of the block that is currently being folded.
+    std::vector<MInst>* _instructions{};
+    std::unordered_map<usz, usz> _defined_at{};
+    std::vector<bool> _dead{};
+    std::vector<std::optional<MInst>> _insert_before{};
+
+    /// Instructions that are folded into the address being built.
+    std::vector<usz> _folded{};
+
+public:
+    explicit AddressFolder(MFunction& function) : _function(function) {}
+
+    void run() {
+        _uses = CountUses(_function);
+        for (auto& block : _function.blocks()) fold(block);
+    }
+
+private:
+    /// Whether an operand is a 64-bit register.
+    static auto IsPointer(const MOperand& op) -> bool {
+        return std::holds_alternative<MOperandRegister>(op)
+           and std::get<MOperandRegister>(op).size == x86_64::GeneralPurposeBitwidth;
+    }
+
+    static auto FitsDisplacement(i64 value) -> bool {
+        return value >= std::numeric_limits<i32>::min() and value <= std::numeric_limits<i32>::max();
+    }
+
+    static void CopyUses(const MInst& from, MInst& to) {
+        usz use_count = from.use_count();
+        while (use_count--) to.add_use();
+    }
+
+    /// Get the index of the instruction in the current block that defines
+    /// `reg`, if `user` is the only instruction that uses it.
+    auto single_use_def(MOperandRegister reg, usz user) -> std::optional<usz> {
+        if (reg.value < +MInst::Kind::ArchStart or _uses[reg.value] != 1) return std::nullopt;
+        auto it = _defined_at.find(reg.value);
+        if (it == _defined_at.end() or it->second >= user or _dead[it->second]) return std::nullopt;
+        return it->second;
+    }
+
+    /// If `op` is only used by `user`, and is a multiplication by 1, 2, 4,
+    /// or 8 (or a left shift by up to 3), fold it into an index register
+    /// and scale.
+    auto scaled_index(const MOperand& op, usz user) -> std::optional<std::pair<MOperandRegister, u8>> {
+        if (not IsVirtual(op)) return std::nullopt;
+        auto def_index = single_use_def(std::get<MOperandRegister>(op), user);
+        if (not def_index) return std::nullopt;
+        const auto& def = _instructions->at(*def_index);
+        if (def.all_operands().size() != 2) return std::nullopt;
+
+        MOperand index{};
+        u64 scale = 0;
+        if (def.kind() == MInst::Kind::Mul) {
+            index = def.get_operand(0);
+            auto factor = def.get_operand(1);
+            if (std::holds_alternative<MOperandImmediate>(index)) std::swap(index, factor);
+            if (not std::holds_alternative<MOperandImmediate>(factor)) return std::nullopt;
+            scale = std::get<MOperandImmediate>(factor).value;
+        } else if (def.kind() == MInst::Kind::Shl) {
+            index = def.get_operand(0);
+            auto amount = def.get_operand(1);
+            if (not std::holds_alternative<MOperandImmediate>(amount)) return std::nullopt;
+            if (std::get<MOperandImmediate>(amount).value > 3) return std::nullopt;
+            scale = u64(1) << std::get<MOperandImmediate>(amount).value;
+        } else return std::nullopt;
+
+        if (not IsPointer(index)) return std::nullopt;
+        if (scale != 1 and scale != 2 and scale != 4 and scale != 8) return std::nullopt;
+
+        _folded.push_back(*def_index);
+        return std::pair{std::get<MOperandRegister>(index), u8(scale)};
+    }
+
+    /// Fold an `add` that computes the base of `address` into it. If
+    /// `unscaled` is false, only fold in an index register if it can be
+    /// scaled.
+    auto absorb(x86_64::Address& address, const MInst& add, usz user, bool unscaled = true) -> bool {
+        if (add.kind() != MInst::Kind::Add or add.all_operands().size() != 2) return false;
+        auto lhs = add.get_operand(0);
+        auto rhs = add.get_operand(1);
+
+        // base + displacement
+        if (std::holds_alternative<MOperandImmediate>(lhs)) std::swap(lhs, rhs);
+        if (std::holds_alternative<MOperandImmediate>(rhs)) {
+            auto displacement = address.displacement + i64(std::get<MOperandImmediate>(rhs).value);
+            if (not IsPointer(lhs) or not FitsDisplacement(displacement)) return false;
+            address.base = std::get<MOperandRegister>(lhs);
+            address.displacement = displacement;
+            return true;
+        }
+
+        // base + index * scale
+        if (address.index or not IsPointer(lhs) or not IsPointer(rhs)) return false;
+        auto scaled = scaled_index(rhs, user);
+        if (not scaled) {
+            scaled = scaled_index(lhs, user);
+            if (scaled) std::swap(lhs, rhs);
+        }
+
+        if (not scaled and not unscaled) return false;
+        address.base = std::get<MOperandRegister>(lhs);
+        address.index = scaled ? scaled->first : std::get<MOperandRegister>(rhs);
+        address.scale = scaled ? scaled->second : 1;
+        return true;
+    }
+
+    /// Fold as many single-use `add`s into `address` as possible.
+    void absorb_all(x86_64::Address& address, usz user) {
+        while (auto def = single_use_def(address.base, user)) {
+            if (not absorb(address, _instructions->at(*def), user)) break;
+            _folded.push_back(*def);
+        }
+    }
+
+    /// Whether `address` can be used at `user` instead of at the first of
+    /// the folded instructions: none of its registers may be redefined in
+    /// between, and we don't keep values live across calls just for this.
+    ///
+    /// The register allocator does not track how long hardware registers
+    /// (e.g. arguments) are live, so if the address uses one, there must
+    /// not be anything else in between at all.
+    auto can_move_to(const x86_64::Address& address, usz user) -> bool {
+        if (_folded.empty()) return true;
+        bool hardware = not IsVirtual(address.base) or (address.index and not IsVirtual(*address.index));
+        for (usz i = rgs::min(_folded) + 1; i < user; ++i) {
+            const auto& inst = _instructions->at(i);
+            if (hardware and rgs::find(_folded, i) == _folded.end()) return false;
+            if (inst.kind() == MInst::Kind::Call or inst.kind() == MInst::Kind::Intrinsic) return false;
+            if (inst.reg() == address.base.value) return false;
+            if (address.index and inst.reg() == address.index->value) return false;
+        }
+        return true;
+    }
+
+    void commit() {
+        for (auto i : _folded) _dead[i] = true;
+    }
+
+    void fold(MBlock& block) {
+        _instructions = &block.instructions();
+        _defined_at.clear();
+        _dead.assign(_instructions->size(), false);
+        _insert_before.assign(_instructions->size(), std::nullopt);
+        for (usz i = 0; i < _instructions->size(); ++i)
+            if (_instructions->at(i).reg() >= +MInst::Kind::ArchStart)
+                _defined_at[_instructions->at(i).reg()] = i;
+
+        // Fold addresses into loads and stores.
+        for (usz i = 0; i < _instructions->size(); ++i) {
+            auto& inst = _instructions->at(i);
+            bool is_load = inst.kind() == MInst::Kind::Load and inst.all_operands().size() == 1;
+            bool is_store = inst.kind() == MInst::Kind::Store and inst.all_operands().size() == 2;
+            if (not is_load and not is_store) continue;
+
+            auto pointer = inst.all_operands().back();
+            if (not IsPointer(pointer)) continue;
+
+            x86_64::Address address{std::get<MOperandRegister>(pointer)};
+            _folded.clear();
+            absorb_all(address, i);
+            if (_folded.empty() or not can_move_to(address, i)) continue;
+
+            if (is_load) {
+                // r | Load (displacement + base + index * scale)
+                // becomes
+                //     mov displacement(%base, %index, scale), %r
+                auto load = MInst(usz(x86_64::Opcode::MoveDereferenceLHS), {inst.reg(), uint(inst.regsize())});
+                load.location(inst.location());
+                load.add_operand(address.base);
+                load.add_operand(MOperandRegister{inst.reg(), uint(inst.regsize())});
+                address.append_to(load);
+                load.add_operand_clobber(1);
+                CopyUses(inst, load);
+                commit();
+                inst = std::move(load);
+                continue;
+            }
+
+            // Store value (displacement + base + index * scale)
+            // becomes
+            //     mov %value, displacement(%base, %index, scale)
+            // An immediate value is moved into a register first.
+            auto value = inst.get_operand(0);
+            if (std::holds_alternative<MOperandImmediate>(value)) {
+                auto imm = std::get<MOperandImmediate>(value);
+                if (not imm.size) continue;
+                auto tmp = MOperandRegister{_function.next_vreg(), imm.size};
+                auto mov = MInst(usz(x86_64::Opcode::Move), {0, 0});
+                mov.location(inst.location());
+                mov.add_operand(imm);
+                mov.add_operand(tmp);
+                _insert_before[i] = std::move(mov);
+                value = tmp;
+            } else if (not std::holds_alternative<MOperandRegister>(value)) continue;
+
+            auto store = MInst(usz(x86_64::Opcode::MoveDereferenceRHS), {inst.reg(), uint(inst.regsize())});
+            store.location(inst.location());
+            store.add_operand(value);
+            store.add_operand(address.base);
+            address.append_to(store);
+            commit();
+            inst = std::move(store);
+        }
+
+        // What is left of the address arithmetic becomes `lea`s. A plain
+        // addition of two registers is left as-is.
+        for (usz i = 0; i < _instructions->size(); ++i) {
+            auto& inst = _instructions->at(i);
+            if (
+                _dead[i]
+                or inst.kind() != MInst::Kind::Add
+                or inst.reg() < +MInst::Kind::ArchStart
+                or inst.regsize() != x86_64::GeneralPurposeBitwidth
+            ) continue;
+
+            auto dst = MOperandRegister{inst.reg(), uint(inst.regsize())};
+            x86_64::Address address{dst};
+            _folded.clear();
+            if (not absorb(address, inst, i, false)) continue;
+            absorb_all(address, i);
+            if (not can_move_to(address, i)) continue;
+
+            // r | Add base (Mul index scale)
+            // becomes
+            //     lea (%base, %index, scale), %r
+            auto lea = MInst(usz(x86_64::Opcode::LoadEffectiveAddress), {inst.reg(), uint(inst.regsize())});
+            lea.location(inst.location());
+            lea.add_operand(address.base);
+            lea.add_operand(dst);
+            address.append_to(lea);
+            lea.add_operand_clobber(1);
+            CopyUses(inst, lea);
+            commit();
+            inst = std::move(lea);
+        }
+
+        if (rgs::none_of(_dead, std::identity{}) and rgs::none_of(_insert_before, [](const auto& i) { return i.has_value(); }))
+            return;
+
+        std::vector<MInst> out{};
+        out.reserve(_instructions->size());
+        for (usz i = 0; i < _instructions->size(); ++i) {
+            if (_insert_before[i]) out.push_back(std::move(*_insert_before[i]));
+            if (not _dead[i]) out.push_back(std::move(_instructions->at(i)));
+        }
+        *_instructions = std::move(out);
+    }
+};
+
+/// Fuses a comparison into the conditional branch that is its only user.
+///
+/// On its own, a comparison becomes a `cmp` and a `setcc` into a register,
+/// which a conditional branch then has to `test` before it can `jz`. When
+/// the branch is the only thing that needs the result, it can branch on
+/// the flags set by the `cmp` directly instead.
+class BranchFuser {
+    MFunction& _function;
+
+    /// Number of operands that refer to each virtual register.
+    std::unordered_map<usz, usz> _uses{};
+
+public:
+    explicit BranchFuser(MFunction& function) : _function(function) {}
+
+    void run() {
+        _uses = CountUses(_function);
+        for (auto [index, block] : vws::enumerate(_function.blocks()))
+            fuse(block, usz(index));
+    }
+
+private:
+    /// Get the comparison that is true when `kind` is true with its
+    /// operands swapped.
+    static auto Mirror(MInst::Kind kind) -> MInst::Kind {
+        switch (kind) {
+            case MInst::Kind::SLt: return MInst::Kind::SGt;
+            case MInst::Kind::SLe: return MInst::Kind::SGe;
+            case MInst::Kind::SGt: return MInst::Kind::SLt;
+            case MInst::Kind::SGe: return MInst::Kind::SLe;
+            case MInst::Kind::ULt: return MInst::Kind::UGt;
+            case MInst::Kind::ULe: return MInst::Kind::UGe;
+            case MInst::Kind::UGt: return MInst::Kind::ULt;
+            case MInst::Kind::UGe: return MInst::Kind::ULe;
+            default: return kind;
+        }
+    }
+
+    /// Get the comparison that is true when `kind` is false.
+    static auto Invert(MInst::Kind kind) -> MInst::Kind {
+        switch (kind) {
+            case MInst::Kind::Eq: return MInst::Kind::Ne;
+            case MInst::Kind::Ne: return MInst::Kind::Eq;
+            case MInst::Kind::SLt: return MInst::Kind::SGe;
+            case MInst::Kind::SLe: return MInst::Kind::SGt;
+            case MInst::Kind::SGt: return MInst::Kind::SLe;
+            case MInst::Kind::SGe: return MInst::Kind::SLt;
+            case MInst::Kind::ULt: return MInst::Kind::UGe;
+            case MInst::Kind::ULe: return MInst::Kind::UGt;
+            case MInst::Kind::UGt: return MInst::Kind::ULe;
+            case MInst::Kind::UGe: return MInst::Kind::ULt;
+            default: LCC_UNREACHABLE();
+        }
+    }
+
+    /// Get the jump that is taken after `cmp rhs, lhs` if `lhs <kind> rhs`.
+    static auto ConditionalJump(MInst::Kind kind) -> std::optional<x86_64::Opcode> {
+        switch (kind) {
+            case MInst::Kind::Eq: return x86_64::Opcode::JumpIfEqual;
+            case MInst::Kind::Ne: return x86_64::Opcode::JumpIfNotEqual;
+            case MInst::Kind::SLt: return x86_64::Opcode::JumpIfLessSigned;
+            case MInst::Kind::SLe: return x86_64::Opcode::JumpIfEqualOrLessSigned;
+            case MInst::Kind::SGt: return x86_64::Opcode::JumpIfGreaterSigned;
+            case MInst::Kind::SGe: return x86_64::Opcode::JumpIfEqualOrGreaterSigned;
+            case MInst::Kind::ULt: return x86_64::Opcode::JumpIfLessUnsigned;
+            case MInst::Kind::ULe: return x86_64::Opcode::JumpIfEqualOrLessUnsigned;
+            case MInst::Kind::UGt: return x86_64::Opcode::JumpIfGreaterUnsigned;
+            case MInst::Kind::UGe: return x86_64::Opcode::JumpIfEqualOrGreaterUnsigned;
+            default: return std::nullopt;
+        }
+    }
+
+    /// Whether `cmp` can encode `imm` when comparing it to `reg`; a 64-bit
+    /// comparison only takes a sign-extended 32-bit immediate.
+    static auto FitsCompare(MOperandImmediate imm, MOperandRegister reg) -> bool {
+        if (reg.size != x86_64::GeneralPurposeBitwidth) return true;
+        auto value = i64(imm.value);
+        return value >= std::numeric_limits<i32>::min() and value <= std::numeric_limits<i32>::max();
+    }
+
+    void fuse(MBlock& block, usz block_index) {
+        auto& instructions = block.instructions();
+        if (instructions.size() < 2) return;
+
+        auto& branch = instructions.back();
+        if (branch.kind() != MInst::Kind::CondBranch or branch.all_operands().size() != 3) return;
+        auto cond = branch.get_operand(0);
+        if (not IsVirtual(cond)) return;
+        auto cond_reg = std::get<MOperandRegister>(cond);
+        if (_uses[cond_reg.value] != 1) return;
+
+        std::optional<usz> def{};
+        for (usz i = instructions.size() - 1; i-- and not def;)
+            if (instructions[i].reg() == cond_reg.value) def = i;
+        if (not def) return;
+        auto def_index = *def;
+
+        auto& cmp = instructions[def_index];
+        auto kind = cmp.kind();
+        if (not ConditionalJump(kind) or cmp.all_operands().size() != 2) return;
+
+        // x86_64 compares a register to a register or an immediate; an
+        // immediate on the left is swapped to the right.
+        auto lhs = cmp.get_operand(0);
+        auto rhs = cmp.get_operand(1);
+        if (std::holds_alternative<MOperandImmediate>(lhs)) {
+            std::swap(lhs, rhs);
+            kind = Mirror(kind);
+        }
+        if (not std::holds_alternative<MOperandRegister>(lhs)) return;
+        auto lhs_reg = std::get<MOperandRegister>(lhs);
+        if (std::holds_alternative<MOperandImmediate>(rhs)) {
+            if (not FitsCompare(std::get<MOperandImmediate>(rhs), lhs_reg)) return;
+        } else if (not std::holds_alternative<MOperandRegister>(rhs)) return;
+
+        // The comparison is moved down to the branch, so its operands must
+        // still hold the same values there. The register allocator does not
+        // track how long hardware registers are live, so if an operand is
+        // one, there must not be anything in between at all.
+        bool hardware = not IsVirtual(lhs) or (std::holds_alternative<MOperandRegister>(rhs) and not IsVirtual(rhs));
+        if (hardware and def_index != instructions.size() - 2) return;
+        for (usz i = def_index + 1; i < instructions.size() - 1; ++i) {
+            const auto& inst = instructions[i];
+            if (inst.kind() == MInst::Kind::Call or inst.kind() == MInst::Kind::Intrinsic) return;
+            if (inst.reg() == lhs_reg.value) return;
+            if (std::holds_alternative<MOperandRegister>(rhs) and inst.reg() == std::get<MOperandRegister>(rhs).value)
+                return;
+        }
+
+        // r | <kind> lhs rhs
+        // CondBranch r then else
+        // becomes
+        //     cmp rhs, lhs
+        //     j<kind> then
+        //     jmp else
+        // If the `then` block comes next, the condition is inverted instead,
+        // so the unconditional jump is to the next block and can be elided.
+        auto then_op = branch.get_operand(1);
+        auto else_op = branch.get_operand(2);
+        if (
+            std::holds_alternative<MOperandBlock>(then_op)
+            and std::get<MOperandBlock>(then_op)->machine_block()->id() == block_index + 1
+        ) {
+            std::swap(then_op, else_op);
+            kind = Invert(kind);
+        }
+
+        auto compare = MInst(usz(x86_64::Opcode::Compare), {0, 0});
+        compare.location(cmp.location());
+        compare.add_operand(rhs);
+        compare.add_operand(lhs);
+
+        auto jcc = MInst(usz(*ConditionalJump(kind)), {0, 0});
+        jcc.location(branch.location());
+        jcc.add_operand(then_op);
+
+        auto jmp = MInst(usz(x86_64::Opcode::Jump), {0, 0});
+        jmp.location(branch.location());
+        jmp.add_operand(else_op);
+
+        instructions.erase(instructions.begin() + isz(def_index));
+        instructions.back() = std::move(compare);
+        instructions.push_back(std::move(jcc));
+        instructions.push_back(std::move(jmp));
+    }
+};
+} // namespace
+
 void select_instructions(Module* mod, MFunction& function) {
     // Don't selection instructions for empty functions.
     if (function.blocks().empty()) return;
 
+    // New virtual registers are numbered after the ones the function
+    // already uses, rather than by the module, so that the functions of a
+    // module can be selected in parallel.
+    usz first_free_vreg = +MInst::Kind::ArchStart;
+    for (auto& block : function.blocks()) {
+        for (auto& inst : block.instructions()) {
+            first_free_vreg = std::max(first_free_vreg, inst.reg() + 1);
+            for (auto& op : inst.all_operands())
+                if (std::holds_alternative<MOperandRegister>(op))
+                    first_free_vreg = std::max(first_free_vreg, std::get<MOperandRegister>(op).value + 1);
+        }
+    }
+    function.first_free_vreg(first_free_vreg);
+
     if (mod->context()->target()->is_arch_x86_64()) {
+        AddressFolder{function}.run();
+        BranchFuser{function}.run();
         function = lcc::isel::x86_64::AllPatterns::rewrite(mod, function);
 
         // In-code instruction selection. Ideally, we wouldn't have to do this at
@@ -27,6 +27,8 @@ auto PrintMOperand(const MOperand& op) -> std::string {
         std::string index_string;
         if (l.index == MOperandLocal::absolute_index)
             index_string = "abs";
+        else if (l.index >= MOperandLocal::first_spill_index)
+            index_string = fmt::format("spill.{}", l.index - MOperandLocal::first_spill_index);
         else index_string = fmt::format("{}", l.index);
         return fmt::format("local({}){:+}", index_string, l.offset);
     }
@@ -83,18 +85,19 @@ auto PrintMInst(const MInst& inst) -> std::string {
 }
 
 [[nodiscard]]
-auto PrintMBlockImpl(const MBlock& block, auto&& inst_opcode) -> std::string {
+auto PrintMBlockImpl(const MFunction& function, const MBlock& block, auto&& inst_opcode) -> std::string {
+    const auto Name = [&](usz id) -> const std::string& { return function.block(id).name(); };
     auto out = fmt::format("  {}:\n", block.name());
     if (block.predecessors().size()) {
         out += fmt::format(
             "    predecessors: {}\n",
-            fmt::join(block.predecessors(), ", ")
+            fmt::join(vws::transform(block.predecessors(), Name), ", ")
         );
     }
     if (block.successors().size()) {
         out += fmt::format(
             "    successors: {}\n",
-            fmt::join(block.successors(), ", ")
+            fmt::join(vws::transform(block.successors(), Name), ", ")
         );
     }
     for (auto& instruction : block.instructions()) {
@@ -106,8 +109,8 @@ auto PrintMBlockImpl(const MBlock& block, auto&& inst_opcode) -> std::string {
 };
 
 [[nodiscard]]
-auto PrintMBlock(const MBlock& block) -> std::string {
-    return PrintMBlockImpl(block, MInstOpcodeToString);
+auto PrintMBlock(const MFunction& function, const MBlock& block) -> std::string {
+    return PrintMBlockImpl(function, block, MInstOpcodeToString);
 }
 
 [[nodiscard]]
@@ -135,7 +138,7 @@ auto PrintMFunctionImpl(const MFunction& function, auto&& inst_opcode) -> std::s
         );
     }
     for (auto& block : function.blocks()) {
-        out += PrintMBlockImpl(block, inst_opcode);
+        out += PrintMBlockImpl(function, block, inst_opcode);
         out += '\n';
     }
     return out;
@@ -2,43 +2,100 @@
 #include <lcc/codegen/register_allocation.hh>
 #include <lcc/codegen/x86_64/x86_64.hh>
 #include <lcc/utils.hh>
+#include <lcc/utils/bitset.hh>
+#include <lcc/utils/statistics.hh>
 
 #include <algorithm>
 #include <memory>
+#include <numeric>
 #include <ranges>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <variant>
 #include <vector>
 
 namespace lcc {
 
-struct AdjacencyMatrix {
-    std::unique_ptr<bool[]> data;
-    usz size;
+/// Which registers interfere with each other, by index.
+///
+/// Small graphs are stored as a triangular bit matrix, which is fast to
+/// query and update. Its size grows quadratically with the number of
+/// registers, though, while the number of interferences of most large
+/// functions grows about linearly, so large graphs instead store a hash
+/// set of the neighbours of each register.
+class InterferenceGraph {
+    /// Largest number of registers for which we use a bit matrix; that is
+    /// 4 MiB at most.
+    static constexpr usz DenseLimit = 8192;
+
+    usz _size;
+    Bitset _dense{};
+    std::vector<std::unordered_set<usz>> _sparse{};
 
-    explicit AdjacencyMatrix(usz sz) : data(std::make_unique<bool[]>(sz * sz)), size(sz) {}
+    [[nodiscard]]
+    auto dense() const -> bool { return _size <= DenseLimit; }
 
     [[nodiscard]]
     auto coord(usz x, usz y) const -> usz {
-        LCC_ASSERT(x < size, "AdjacencyMatrix: X out of bounds");
-        LCC_ASSERT(y < size, "AdjacencyMatrix: Y out of bounds");
-        LCC_ASSERT(x != y, "AdjacencyMatrix: X and Y are equal; must not set adjacency with self");
-        return y * size + x;
+        LCC_ASSERT(x < _size, "InterferenceGraph: X out of bounds");
+        LCC_ASSERT(y < _size, "InterferenceGraph: Y out of bounds");
+        LCC_ASSERT(x != y, "InterferenceGraph: X and Y are equal; must not set adjacency with self");
+        if (x < y) std::swap(x, y);
+        return x * (x - 1) / 2 + y;
+    }
+
+public:
+    explicit InterferenceGraph(usz size) : _size(size) {
+        if (dense()) _dense = Bitset{size * (size - 1) / 2};
+        else _sparse.resize(size);
     }
 
+    [[nodiscard]]
+    auto size() const -> usz { return _size; }
+
+    [[nodiscard]]
+    auto sparse() const -> bool { return not dense(); }
+
     [[nodiscard]]
     auto at(usz x, usz y) const -> bool {
-        return data[coord(x, y)];
+        if (dense()) return _dense.test(coord(x, y));
+        return _sparse.at(x).contains(y);
     }
 
+    // Interference is symmetric, so set both directions.
     void set(usz x, usz y) {
         if (x == y) return;
-        data[coord(x, y)] = true;
+        if (dense()) {
+            _dense.set(coord(x, y));
+            return;
+        }
+        _sparse.at(x).insert(y);
+        _sparse.at(y).insert(x);
     }
 
-    void clear(usz x, usz y) {
-        if (x == y) return;
-        data[coord(x, y)] = false;
+    /// Call `callback(y)` for every register `y` that interferes with \p x.
+    template <typename Callback>
+    void for_each_neighbour(usz x, Callback&& callback) const {
+        if (sparse()) {
+            for (auto y : _sparse.at(x)) callback(y);
+            return;
+        }
+        for (usz y = 0; y < _size; ++y)
+            if (y != x and _dense.test(coord(x, y))) callback(y);
+    }
+
+    /// Approximate number of bytes used to store the graph.
+    [[nodiscard]]
+    auto memory() const -> usz {
+        if (dense()) return (_dense.size() + 7) / 8;
+        usz bytes = _sparse.capacity() * sizeof(std::unordered_set<usz>);
+        for (auto& neighbours : _sparse) {
+            bytes += neighbours.bucket_count() * sizeof(void*);
+            bytes += neighbours.size() * (sizeof(usz) + sizeof(void*));
+        }
+        return bytes;
     }
 };
 
@@ -66,6 +123,10 @@ struct AdjacencyList {
     // set).
     bool allocated;
 
+    // Live index of the list this one was coalesced into, or its own index
+    // if it was not coalesced.
+    usz alias;
+
     // Spill handling.
     char spill_flag;
     usz spill_offset;
@@ -76,17 +137,18 @@ struct AdjacencyList {
         return fmt::format("r{}", value, index);
     }
 
+    /// \p list_index maps the value of each register to the index of its list.
     [[nodiscard]]
-    auto string(const std::vector<AdjacencyList>& lists) const -> std::string {
+    auto string(
+        const std::vector<AdjacencyList>& lists,
+        const std::unordered_map<usz, usz>& list_index
+    ) const -> std::string {
         auto out = string_base() + ": ";
         bool first{true};
         for (usz adj_i : adjacencies) {
             if (not first) out += ", ";
             else first = false;
-            auto found = std::find_if(lists.begin(), lists.end(), [&](const AdjacencyList& l) {
-                return adj_i == l.value;
-            });
-            out += lists.at(usz(found - lists.begin())).string_base();
+            out += lists.at(list_index.at(adj_i)).string_base();
         }
         return out;
     }
@@ -94,121 +156,175 @@ struct AdjacencyList {
 
 namespace {
 
-void collect_interferences_from_block(
-    AdjacencyMatrix& matrix,
-    std::vector<Register>& registers,
-    MFunction& function,
-    std::vector<usz> live_values,
-    std::vector<MBlock*> visited,
-    std::vector<MBlock*> doubly_visited,
-    MBlock* block
-) {
-    /// Don't visit the same block thrice.
-    if (std::find(visited.begin(), visited.end(), block) != visited.end()) {
-        if (std::find(doubly_visited.begin(), doubly_visited.end(), block) != doubly_visited.end())
-            return;
-        doubly_visited.push_back(block);
-    } else visited.push_back(block);
+/// Call `callback(reg, reads, writes, clobbered)` for every register
+/// operand of an instruction. An operand that is neither read nor written
+/// is treated as read.
+template <typename Callback>
+void for_each_access(const MachineDescription& desc, MInst& inst, Callback&& callback) {
+    for (auto [i, op] : vws::enumerate(inst.all_operands())) {
+        if (not std::holds_alternative<MOperandRegister>(op)) continue;
+        auto reg = std::get<MOperandRegister>(op);
+        if (not reg.value) continue;
+        bool writes = desc.writes_operand(inst, usz(i));
+        bool reads = not reg.defining_use and (desc.reads_operand(inst, usz(i)) or not writes);
+        bool clobbered = rgs::find(inst.operand_clobbers(), usz(i)) != inst.operand_clobbers().end();
+        callback(reg.value, reads, writes, clobbered);
+    }
+}
 
-    const auto live_idx_from_register_value = [&](usz value) -> usz {
-        auto found = std::find_if(registers.begin(), registers.end(), [&](const Register& r) {
-            return value == r.value;
-        });
-        LCC_ASSERT(found != registers.end(), "Did not find referenced register in register list");
-        return usz(found - registers.begin());
-    };
-    const auto live_idx_from_register = [&](Register reg) -> usz {
-        return live_idx_from_register_value(reg.value);
-    };
+/// Call `use(reg)` for every register an instruction reads, and then
+/// `kill(reg)` for every register it overwrites without reading it (e.g.
+/// the destination of a copy), which is therefore not live before it.
+template <typename Use, typename Kill>
+void for_each_use_and_kill(const MachineDescription& desc, MInst& inst, Use&& use, Kill&& kill) {
+    for_each_access(desc, inst, [&](usz reg, bool reads, bool, bool) {
+        if (reads) use(reg);
+    });
+    for_each_access(desc, inst, [&](usz reg, bool reads, bool, bool) {
+        if (not reads) kill(reg);
+    });
+    if (inst.is_defining() and inst.reg()) kill(inst.reg());
+    // The callee may overwrite any register it is not required to preserve.
+    if (inst.opcode() == desc.call_opcode) {
+        for (auto reg : desc.registers)
+            if (rgs::find(desc.preserved_registers, reg) == desc.preserved_registers.end())
+                kill(reg);
+    }
+}
 
-    // Basically, walk over the instructions of the block backwards, keeping
-    // track of all virtual registers that have been encountered but not
-    // their defining use, as these are our "live values".
-    for (auto& inst : block->instructions() | vws::reverse) {
-        // fmt::print("{}\n", PrintMInstImpl(inst, x86_64::opcode_to_string));
-        // fmt::print("live after: {}\n", fmt::join(live_values, ", "));
+/// Registers live into and out of each block of a function. Registers are
+/// identified by their index in the map passed to `compute_liveness()`.
+struct Liveness {
+    std::vector<Bitset> live_in;
+    std::vector<Bitset> live_out;
+};
 
-        // If the defining use of a virtual register is an operand of this
-        // instruction, remove it from vector of live vals.
-        if (inst.is_defining()) std::erase(live_values, inst.reg());
-        for (auto& op : inst.all_operands()) {
-            if (std::holds_alternative<MOperandRegister>(op)) {
-                auto reg = std::get<MOperandRegister>(op);
-                if (reg.defining_use) std::erase(live_values, reg.value);
-            }
+/// Standard iterative backward dataflow: a register is live into a block
+/// if the block reads it before overwriting it, or if it is live out of
+/// the block and the block doesn't overwrite it; it is live out of a
+/// block if it is live into any of its successors.
+auto compute_liveness(
+    const MachineDescription& desc,
+    MFunction& function,
+    const std::unordered_map<usz, usz>& index
+) -> Liveness {
+    auto& blocks = function.blocks();
+    std::vector<Bitset> uses(blocks.size(), Bitset{index.size()});
+    std::vector<Bitset> kills(blocks.size(), Bitset{index.size()});
+    for (auto [b, block] : vws::enumerate(blocks)) {
+        auto& use = uses[usz(b)];
+        auto& kill = kills[usz(b)];
+        for (auto& inst : block.instructions()) {
+            for_each_use_and_kill(
+                desc,
+                inst,
+                [&](usz reg) {
+                    auto i = index.at(reg);
+                    if (not kill.test(i)) use.set(i);
+                },
+                [&](usz reg) { kill.set(index.at(reg)); }
+            );
         }
+    }
+
+    Liveness liveness{uses, std::vector<Bitset>(blocks.size(), Bitset{index.size()})};
+    Bitset live_through{index.size()};
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (usz b = blocks.size(); b--;) {
+            for (auto successor : blocks[b].successors())
+                liveness.live_out[b].merge(liveness.live_in[successor]);
+            live_through = liveness.live_out[b];
+            live_through.remove(kills[b]);
+            changed |= liveness.live_in[b].merge(live_through);
+        }
+    }
+
+    return liveness;
+}
+
+/// Walk the instructions of a block backwards, starting with the
+/// registers live out of it, and make every register that is accessed by
+/// an instruction interfere with every register live across it.
+void collect_interferences_from_block(
+    const MachineDescription& desc,
+    InterferenceGraph& graph,
+    const std::unordered_map<usz, usz>& index,
+    MBlock& block,
+    Bitset live
+) {
+    for (auto& inst : block.instructions() | vws::reverse) {
+        // fmt::print("{}\n", PrintMInstImpl(inst, x86_64::opcode_to_string));
 
-        // fmt::print("live during: {}\n", fmt::join(live_values, ", "));
+        // Registers this instruction overwrites are not live during it, so
+        // they don't interfere with what is live after it, unless it reads
+        // them too.
+        std::vector<usz> uses{};
+        for_each_use_and_kill(
+            desc,
+            inst,
+            [&](usz reg) { uses.push_back(index.at(reg)); },
+            [&](usz reg) { live.reset(index.at(reg)); }
+        );
+
+        const auto interfere_with_live = [&](usz idx) {
+            live.for_each([&](usz live_idx) { graph.set(live_idx, idx); });
+        };
 
         // Register Clobbers
         // Basically, a "clobbered register" has the affect that all live values
         // will interfere with the clobber.
-        for (auto index : inst.operand_clobbers()) {
-            auto op = inst.get_operand(index);
-            if (std::holds_alternative<MOperandRegister>(op)) {
-                auto reg = std::get<MOperandRegister>(op);
-                auto live_idx = live_idx_from_register(reg);
-                for (auto live : live_values) {
-                    matrix.set(live_idx_from_register_value(live), live_idx);
-                    // fmt::print("Clobber r{} interferes with live value r{}\n", reg.value, live);
-                }
-            }
+        for (auto i : inst.operand_clobbers()) {
+            auto op = inst.get_operand(i);
+            if (std::holds_alternative<MOperandRegister>(op))
+                interfere_with_live(index.at(std::get<MOperandRegister>(op).value));
         }
 
-        // Collect all register operands from this instruction that are
-        // used as operands somewhere in the function (i.e. within the list of
-        // registers). Cache the index within the adjacency matrix so we don't
-        // have to keep recomputing it.
-        typedef struct RegisterPlusLiveValIndex {
-            Register reg;
-            usz idx;
-        } MIROperandPlusLiveValIndex;
-        std::vector<MIROperandPlusLiveValIndex> vreg_operands{};
-        if (inst.reg() >= +MInst::Kind::ArchStart) {
-            auto reg = Register{inst.reg(), uint(inst.regsize())};
-            vreg_operands.push_back({reg, live_idx_from_register(reg)});
-        }
-        for (auto& op : inst.all_operands()) {
-            if (std::holds_alternative<MOperandRegister>(op)) {
-                auto reg = std::get<MOperandRegister>(op);
-                if (reg.value >= +MInst::Kind::ArchStart)
-                    vreg_operands.push_back({reg, live_idx_from_register(reg)});
-            }
+        // Hardware Register Definitions
+        // Writing to a hardware register (e.g. copying an argument into its
+        // argument register) destroys whatever was in it, so all values live
+        // after this instruction interfere with it, just like a clobber.
+        if (inst.reg() and inst.reg() < +MInst::Kind::ArchStart)
+            interfere_with_live(index.at(inst.reg()));
+
+        // Calls
+        // The callee may overwrite any register it is not required to
+        // preserve, so all values live across a call interfere with those.
+        // This leaves them to be allocated to preserved registers, which the
+        // callee saves and restores if it uses them.
+        if (inst.opcode() == desc.call_opcode) {
+            for (auto reg : desc.registers)
+                if (rgs::find(desc.preserved_registers, reg) == desc.preserved_registers.end())
+                    interfere_with_live(index.at(reg));
         }
 
+        // Collect all register operands of this instruction, along with
+        // whether they are clobbered.
+        // The register an instruction is said to define is only accessed by
+        // the instruction itself if it is also an operand, e.g.
+        //     DEF v2 | shr $63, %v1
+        //         v2 | mov %v1, %v2
+        // except for a call, which writes its result to it. Treating it as
+        // an operand otherwise makes it interfere with the operands, which
+        // would keep the copy from being coalesced.
+        // Hardware registers are included, so that no value is allocated to
+        // one while it holds something that is read later, e.g. an argument.
+        std::vector<std::pair<usz, bool>> operands{};
+        if (inst.reg() >= +MInst::Kind::ArchStart and inst.opcode() == desc.call_opcode)
+            operands.emplace_back(index.at(inst.reg()), false);
+        for_each_access(desc, inst, [&](usz reg, bool, bool, bool clobbered) {
+            operands.emplace_back(index.at(reg), clobbered);
+        });
+
         // Make all reg operands interfere with each other; if two different,
         // non-clobbered registers are used as inputs to an instruction, they must
         // exist at the same time (at instruction execution), and therefore must
         // interfere. For cases like `move %v0 into %v1` where v1 is marked as
         // clobbered, v0 and v1 do not interfere.
-        // x86_64 GNU ASM
-        //     mov 40(%v0), %v1
-        // MIR Representation
-        //     MoveDereferenceLHS(v0, v1, 40) clobbers 1st operand
-        // RESULT
-        //     Both v0 and v1 interfere with both v3 and v7.
-
-        // Collect clobbered registers
-        std::vector<usz> clobbered_regs{};
-        for (auto index : inst.operand_clobbers()) {
-            auto& op = inst.all_operands().at(index);
-            if (std::holds_alternative<MOperandRegister>(op)) {
-                auto reg = std::get<MOperandRegister>(op);
-                clobbered_regs.push_back(reg.value);
-            }
-        }
-
-        for (auto A : vreg_operands) {
-            for (auto B : vreg_operands) {
-                // If either A or B is clobbered, do NOT set interference between the two.
-                if (
-                    rgs::find(clobbered_regs, A.reg.value) == clobbered_regs.end()
-                    and rgs::find(clobbered_regs, B.reg.value) == clobbered_regs.end()
-                ) {
-                    matrix.set(A.idx, B.idx);
-                    // fmt::print("Non-clobbered register operands r{} and r{} interfere\n", A.reg.value, B.reg.value);
-                }
-            }
+        for (auto [a, a_clobbered] : operands) {
+            if (a_clobbered) continue;
+            for (auto [b, b_clobbered] : operands)
+                if (not b_clobbered) graph.set(a, b);
         }
 
         // Make all reg operands interfere with all currently live values
@@ -219,129 +335,182 @@ void collect_interferences_from_block(
         //     MoveDereferenceLHS(v0, v1, 40) clobbers 1st operand
         // RESULT
         //     Both v0 and v1 interfere with both v3 and v7.
-        for (auto r : vreg_operands) {
-            for (auto live : live_values)
-                matrix.set(r.idx, live_idx_from_register_value(live));
-        }
-
-        // If a virtual register is not live and is seen as an operand, it is
-        // added to the vector of live values.
-        for (auto r : vreg_operands) {
-            if (
-                not r.reg.defining_use
-                and std::find(live_values.begin(), live_values.end(), r.reg.value) == live_values.end()
-            ) {
-                live_values.push_back(r.reg.value);
-            }
-        }
-        // Handle the case of a non-defining register operand in use of the
-        // instruction that defines that register.
-        if (inst.is_defining()) std::erase(live_values, inst.reg());
-
-        // fmt::print("live before: {}\n", fmt::join(live_values, ", "));
-
-    } // for inst
-
-    // Walk CFG backwards (follow predecessors)
+        for (auto [idx, clobbered] : operands) interfere_with_live(idx);
 
-    // No predecessors == entry block: done walking.
-    if (block->predecessors().empty()) return;
-
-    // Follow all predecessors, resetting live values to what they are now
-    // before each one.
-    for (const auto& parent_name : block->predecessors()) {
-        auto* parent = function.block_by_name(parent_name);
-        auto live_values_copy{live_values};
-        collect_interferences_from_block(matrix, registers, function, live_values_copy, visited, doubly_visited, parent);
+        // Registers the instruction reads are live before it.
+        for (auto idx : uses) live.set(idx);
     }
 }
 
-void collect_interferences(AdjacencyMatrix& matrix, std::vector<Register>& registers, MFunction& function) {
-    std::vector<MBlock*> exits{};
-    for (auto& block : function.blocks()) {
-        if (block.successors().empty())
-            exits.push_back(&block);
-    }
-
-    LCC_ASSERT(not exits.empty(), "Cannot walk CFG as function {} has no exit blocks", function.names().at(0).name);
+/// Build the interference graph of a function.
+void collect_interferences(
+    const MachineDescription& desc,
+    InterferenceGraph& graph,
+    const std::unordered_map<usz, usz>& index,
+    MFunction& function
+) {
+    auto liveness = compute_liveness(desc, function, index);
+    for (auto [b, block] : vws::enumerate(function.blocks()))
+        collect_interferences_from_block(desc, graph, index, block, liveness.live_out[usz(b)]);
+}
 
-    // fmt::print(
-    //     "Collected following exit blocks for function {}: {}\n",
-    //     function.names().at(0).name,
-    //     fmt::join(vws::transform(exits, [](MBlock* b) { return b->name(); }), ", ")
-    // );
-
-    // From each exit block (collected above), follow control flow to the
-    // root of the function (entry block), or to a block already visited.
-    for (auto* exit : exits)
-        collect_interferences_from_block(matrix, registers, function, {}, {}, {}, exit);
+/// Follow the chain of lists that a list was coalesced into.
+auto representative(std::vector<AdjacencyList>& lists, usz index) -> AdjacencyList& {
+    while (lists.at(index).alias != index) index = lists.at(index).alias;
+    return lists.at(index);
 }
 
-} // namespace
+/// Conservatively coalesce the virtual registers of copies that do not
+/// interfere, so that they are allocated the same register and the copy
+/// becomes a move of a register into itself.
+///
+/// Two registers are merged only if the merged node has fewer than k
+/// neighbours of significant degree (Briggs), so that a colorable graph
+/// stays colorable. If one of them has been merged into other registers
+/// already, the merged node is also accepted if every neighbour of the
+/// one being merged either already interferes with the other or is of
+/// insignificant degree (George).
+///
+/// Copies from and to hardware registers are not coalesced. Merging a
+/// virtual register into a hardware register fixes its color for all of
+/// its live range, and neither test can tell whether its neighbours stay
+/// colorable then: hardware registers always count as significant, and
+/// their degree does not say how many virtual registers need them.
+void coalesce(
+    const MachineDescription& desc,
+    MFunction& function,
+    InterferenceGraph& graph,
+    std::vector<AdjacencyList>& lists,
+    const std::unordered_set<usz>& spill_temporaries
+) {
+    std::unordered_map<usz, usz> index_of{};
+    for (auto& list : lists) index_of[list.value] = list.index;
 
-void allocate_registers(const MachineDescription& desc, MFunction& function) {
-    // Don't allocate registers for empty functions.
-    if (function.blocks().empty()) return;
+    const usz k = desc.registers.size();
+    const auto list_of = [&](usz value) -> AdjacencyList& {
+        return lists.at(index_of.at(value));
+    };
+    const auto significant = [&](AdjacencyList& list) {
+        return list.value < +MInst::Kind::ArchStart or list.degree() >= k;
+    };
 
-    // Steps:
-    //   1. Collect all existing registers, both hardware and virtual.
-    //   2. Walk control flow in reverse, build adjacency matrix as you go.
-    //   3. Build adjacency lists from adjacency matrix.
-    //   4. Figure out order that registers should be allocated in: call this
-    //      list the "coloring stack".
-    //   5. Assign colors to registers, ensuring no overlap (adjacencies), in
-    //      order of the coloring stack.
-    //     5a. TODO If we can't color with the existing stack, spill a register
-    //         and retry.
-    //   6. Map colors to registers, updating all register operands to the
-    //      allocated register.
+    const auto merge = [&](AdjacencyList& into, AdjacencyList& from) {
+        for (usz value : from.adjacencies) {
+            auto& neighbour = list_of(value);
+            std::erase(neighbour.adjacencies, from.value);
+            if (not graph.at(into.index, neighbour.index)) {
+                graph.set(into.index, neighbour.index);
+                into.adjacencies.push_back(neighbour.value);
+                neighbour.adjacencies.push_back(into.value);
+            }
+        }
+        from.adjacencies.clear();
+        from.alias = into.index;
+        from.allocated = true;
+        into.spill_cost += from.spill_cost;
+        stats::Count("ra", "copies coalesced");
+    };
 
-    // STEP -1
-    // Replace explicit return registers with the actual return register...
     for (auto& block : function.blocks()) {
         for (auto& inst : block.instructions()) {
-            if (inst.reg() == desc.return_register_to_replace)
-                inst.reg(desc.return_register);
-            for (auto& op : inst.all_operands()) {
-                if (std::holds_alternative<MOperandRegister>(op)) {
-                    MOperandRegister reg = std::get<MOperandRegister>(op);
-                    if (reg.value == desc.return_register_to_replace) {
-                        reg.value = desc.return_register;
-                        op = reg;
-                    }
-                }
-            }
+            if (inst.opcode() != desc.copy_opcode or inst.all_operands().size() != 2) continue;
+            auto src_op = inst.get_operand(0);
+            auto dst_op = inst.get_operand(1);
+            if (
+                not std::holds_alternative<MOperandRegister>(src_op)
+                or not std::holds_alternative<MOperandRegister>(dst_op)
+            ) continue;
+
+            auto src = std::get<MOperandRegister>(src_op);
+            auto dst = std::get<MOperandRegister>(dst_op);
+            if (src.size != dst.size) continue;
+            if (spill_temporaries.contains(src.value) or spill_temporaries.contains(dst.value))
+                continue;
+
+            auto& a = representative(lists, index_of.at(src.value));
+            auto& b = representative(lists, index_of.at(dst.value));
+            if (a.index == b.index or graph.at(a.index, b.index)) continue;
+
+            if (a.value < +MInst::Kind::ArchStart or b.value < +MInst::Kind::ArchStart)
+                continue;
+
+            std::unordered_set<usz> neighbours{a.adjacencies.begin(), a.adjacencies.end()};
+            neighbours.insert(b.adjacencies.begin(), b.adjacencies.end());
+            bool briggs = usz(rgs::count_if(neighbours, [&](usz value) {
+                              return significant(list_of(value));
+                          })) < k;
+            bool george = rgs::all_of(b.adjacencies, [&](usz value) {
+                auto& neighbour = list_of(value);
+                return not significant(neighbour) or graph.at(neighbour.index, a.index);
+            });
+            if (briggs or george) merge(a, b);
         }
     }
+}
 
-    // TODO: We need the context here (or the module so we can get to the
-    // context) so that we can query if target is actually x86_64.
-    // fmt::print(
-    //    "Return register replaced.\n{}\n",
-    //    PrintMFunctionImpl(function, x86_64::opcode_to_string)
-    //);
+/// Remove copies that allocation turned into moves of a register into
+/// itself. 32-bit moves zero the upper half of the register, so those
+/// have to stay.
+void remove_self_copies(const MachineDescription& desc, MFunction& function) {
+    for (auto& block : function.blocks()) {
+        std::erase_if(block.instructions(), [&](MInst& inst) {
+            if (inst.opcode() != desc.copy_opcode or inst.all_operands().size() != 2) return false;
+            auto src = inst.get_operand(0);
+            auto dst = inst.get_operand(1);
+            if (
+                not std::holds_alternative<MOperandRegister>(src)
+                or not std::holds_alternative<MOperandRegister>(dst)
+            ) return false;
+            auto src_reg = std::get<MOperandRegister>(src);
+            auto dst_reg = std::get<MOperandRegister>(dst);
+            return src_reg.value == dst_reg.value
+               and src_reg.size == dst_reg.size
+               and src_reg.size != 32;
+        });
+    }
+}
+
+/// Virtual registers that need to be spilled, grouped so that no two
+/// registers in a group interfere; each group shares one stack slot.
+using SpillGroups = std::vector<std::vector<usz>>;
 
+/// Color the interference graph of a function and, if that succeeds,
+/// replace its virtual registers with hardware registers. Otherwise,
+/// return the virtual registers that need to be spilled.
+auto color_registers(
+    const MachineDescription& desc,
+    MFunction& function,
+    const std::unordered_set<usz>& spill_temporaries
+) -> SpillGroups {
     // STEP ONE
     // Populate list of registers, first using hardware registers, then using virtual registers.
     std::vector<Register> registers{};
+    // Index of each register in `registers`, by value.
+    std::unordered_map<usz, usz> register_index{};
     // Helper function that handles not adding duplicates.
     auto add_reg = [&](usz id, usz size) {
-        auto found = std::find_if(registers.begin(), registers.end(), [&](Register& r) {
-            return r.value == id;
-        });
-        if (found == registers.end())
-            registers.push_back(Register{id, uint(size)});
+        if (register_index.contains(id)) return;
+        register_index[id] = registers.size();
+        registers.push_back(Register{id, uint(size)});
     };
     for (auto [index, reg] : vws::enumerate(desc.registers))
         add_reg(reg, 0);
 
+    // Also count the occurrences of each virtual register: the number of
+    // loads and stores needed if it is spilled. With a profile, each one
+    // is weighted by how often its block was executed, so that registers
+    // used in hot code are the last to be spilled.
+    std::unordered_map<usz, usz> occurrences{};
     for (auto& block : function.blocks()) {
+        const usz weight = block.execution_count().value_or(0) + 1;
         for (auto& inst : block.instructions()) {
             add_reg(inst.reg(), inst.regsize());
+            occurrences[inst.reg()] += weight;
             for (auto& op : inst.all_operands()) {
                 if (std::holds_alternative<MOperandRegister>(op)) {
                     MOperandRegister reg = std::get<MOperandRegister>(op);
                     add_reg(reg.value, reg.size);
+                    occurrences[reg.value] += weight;
                 }
             }
         }
@@ -358,113 +527,130 @@ void allocate_registers(const MachineDescription& desc, MFunction& function) {
     );
 
     // STEP TWO
-    // Walk control flow in reverse, build adjacency matrix as you go.
-    // We walk in reverse because of how control flow tends to work; a single
-    // vreg may have multiple defining uses in different predecessor blocks.
-    AdjacencyMatrix matrix{registers.size()};
-
-    // Collect the interferences into the matrix by walking CFG in reverse.
-    collect_interferences(matrix, registers, function);
+    // Compute the registers live at the end of each block, then walk each
+    // block backwards from there, building the interference graph as we go.
+    InterferenceGraph graph{registers.size()};
+    collect_interferences(desc, graph, register_index, function);
 
     // STEP THREE
-    // Build adjacency lists from adjacency matrix
+    // Build adjacency lists from the interference graph
     std::vector<AdjacencyList> lists{};
 
     for (auto [i, reg] : vws::enumerate(registers)) {
         AdjacencyList list{};
         list.index = usz(i);
+        list.alias = usz(i);
         list.value = reg.value;
         if (list.value < +MInst::Kind::ArchStart) {
             list.color = list.value;
             list.allocated = true;
         }
+        // Spilling a register that was introduced by spilling would not
+        // shorten any live range, so never choose one of those.
+        list.spill_cost = spill_temporaries.contains(list.value)
+                            ? usz(-1)
+                            : occurrences[list.value];
         lists.push_back(list);
     }
 
-    for (auto [a_idx, a] : vws::enumerate(registers)) {
-        for (auto [b_idx, b] : vws::enumerate(registers)) {
-            if (a_idx == b_idx) break;
-            if (matrix.at(usz(a_idx), usz(b_idx))) {
-                auto& a_list = lists.at(usz(a_idx));
-                auto& b_list = lists.at(usz(b_idx));
-                a_list.adjacencies.push_back(b.value);
-                b_list.adjacencies.push_back(a.value);
-            }
-        }
+    for (auto& list : lists) {
+        graph.for_each_neighbour(list.index, [&](usz neighbour) {
+            list.adjacencies.push_back(registers.at(neighbour).value);
+        });
     }
 
+    // STEP THREE AND A HALF
+    // Merge registers that are copied into one another, where that does not
+    // make the graph harder to color.
+    coalesce(desc, function, graph, lists, spill_temporaries);
+
+    if (graph.sparse()) stats::Count("ra", "sparse interference graphs");
+    stats::Max("ra", "peak interference graph bytes", graph.memory());
+
     // fmt::print("AdjacencyLists:\n");
     // for (auto list : lists)
-    //     fmt::print("{}\n", list.string(lists));
+    //     fmt::print("{}\n", list.string(lists, register_index));
 
     // STEP FOUR
     // Build something called the "coloring stack": this is the list of live
     // indices (index into lists vector) that determine what order we should
     // assign registers in.
+    //
+    // Simplify: a register with fewer than k neighbours can always be
+    // colored, whatever its neighbours are colored with, so remove it from
+    // the graph, lowering the degree of its neighbours, and color it after
+    // them. When every register left has at least k neighbours, remove the
+    // one that is cheapest to spill per neighbour instead, in the hope that
+    // its neighbours end up sharing colors (optimistic coloring).
     std::vector<usz> coloring_stack{};
 
+    // We don't color hardware registers with other hardware registers,
+    // so they are never removed, and registers coalesced into another one
+    // are removed along with it.
     const auto should_skip_list = [&](AdjacencyList& list) {
         return list.value < +MInst::Kind::ArchStart or list.allocated;
     };
 
     usz k = desc.registers.size();
-    // We don't color hardware registers with other hardware registers,
-    // so we don't count them.
-    usz count = registers.size() - k;
+    std::vector<usz> degree(lists.size());
+    std::vector<usz> low_degree{};
+    usz count = 0;
+    for (auto& list : lists) {
+        if (should_skip_list(list)) continue;
+        degree[list.index] = list.degree();
+        if (degree[list.index] < k) low_degree.push_back(list.index);
+        ++count;
+    }
+
+    const auto remove = [&](AdjacencyList& list) {
+        list.allocated = true;
+        coloring_stack.push_back(list.index);
+        --count;
+        for (usz value : list.adjacencies) {
+            auto& neighbour = lists.at(register_index.at(value));
+            if (should_skip_list(neighbour)) continue;
+            if (degree[neighbour.index]-- == k) low_degree.push_back(neighbour.index);
+        }
+    };
+
     while (count) {
         /// degree < k rule:
         ///   A graph G is k-colorable if, for every node N in G, the degree
         ///   of N < k.
-        bool done{true};
-        do {
-            done = true;
-            for (auto [i, list] : vws::enumerate(lists)) {
-                if (should_skip_list(list)) continue;
-                if (list.degree() < k) {
-                    list.allocated = 1;
-                    done = false;
-                    count--;
-                    coloring_stack.push_back(usz(i));
-                }
-            }
-        } while (!done && count);
-
-        if (count) {
-            /// Determine node with minimal spill cost.
-            usz min_cost = (usz) -1; /// (!)
-            usz node_to_spill = 0;
-
-            for (auto& list : lists) {
-                if (should_skip_list(list)) continue;
-                list.spill_cost = list.degree() ? (list.spill_cost / list.degree()) : 0;
-                if (list.degree() and list.spill_cost <= min_cost) {
-                    min_cost = list.spill_cost;
-                    node_to_spill = list.index;
-                    if (not min_cost) break;
-                }
+        while (not low_degree.empty()) {
+            auto& list = lists.at(low_degree.back());
+            low_degree.pop_back();
+            if (not should_skip_list(list)) remove(list);
+        }
+        if (not count) break;
+
+        /// Determine node with minimal spill cost per neighbour; those
+        /// introduced by spilling are only chosen if nothing else is left.
+        AdjacencyList* node_to_spill{};
+        double min_cost{};
+        for (auto& list : lists) {
+            if (should_skip_list(list)) continue;
+            auto cost = double(list.spill_cost) / double(degree[list.index]);
+            if (not node_to_spill or cost < min_cost) {
+                node_to_spill = &list;
+                min_cost = cost;
             }
-            /// Push onto color allocation stack.
-            coloring_stack.push_back(node_to_spill);
-            lists.at(node_to_spill).allocated = true;
-            count--;
         }
+        remove(*node_to_spill);
     }
 
     // fmt::print("Coloring Stack: {}\n", fmt::join(coloring_stack, ", "));
 
     // STEP FIVE
-    // Use coloring stack to assign hardware registers (colors) to virtual
-    // registers, ensuring no overlap (interferences/adjacencies).
-    for (usz i : coloring_stack) {
+    // Pop registers off the coloring stack, assigning each a hardware
+    // register (color) that none of its neighbours have been assigned.
+    // Registers that can not be colored are spilled.
+    std::vector<usz> spilled{};
+    for (usz i : coloring_stack | vws::reverse) {
         auto& list = lists.at(i);
-        // Skip hardware registers (no need to color them).
-        if (list.value < +MInst::Kind::ArchStart) continue;
         usz register_interferences = list.regmask;
         for (usz i_adj : list.adjacencies) {
-            auto adj_list = std::find_if(lists.begin(), lists.end(), [&](AdjacencyList& l) {
-                return l.value == i_adj;
-            });
-            LCC_ASSERT(adj_list != lists.end(), "Could not find adjacency list corresponding to vreg {}", i_adj);
+            auto adj_list = &lists.at(register_index.at(i_adj));
             // If any adjacency of the current list is already colored, the current
             // list must not be colored with that color.
             if (adj_list->color) {
@@ -482,21 +668,69 @@ void allocate_registers(const MachineDescription& desc, MFunction& function) {
         }
 
         if (not reg_value) {
-            Diag::Error("Can not color graph with {} colors until stack spilling is implemented!", desc.registers.size());
-            Diag::Note("Allocating registers for function `{}`", function.names().at(0).name);
-            return;
+            // A register introduced by spilling only lives for one
+            // instruction, so it can always be colored once the values live
+            // across that instruction are spilled; spill one of those.
+            if (spill_temporaries.contains(list.value)) {
+                AdjacencyList* victim{};
+                for (usz value : list.adjacencies) {
+                    auto& repr = representative(lists, register_index.at(value));
+                    if (repr.value < +MInst::Kind::ArchStart or spill_temporaries.contains(repr.value))
+                        continue;
+                    // One is being spilled already; try again after that.
+                    if (repr.spill_flag) {
+                        victim = nullptr;
+                        break;
+                    }
+                    if (not victim and repr.color) victim = &repr;
+                }
+                if (victim) {
+                    victim->spill_flag = true;
+                    spilled.push_back(victim->index);
+                } else if (spilled.empty()) {
+                    Diag::ICE(
+                        "Can not color graph with {} colors, even after spilling, in function `{}`",
+                        desc.registers.size(),
+                        function.names().at(0).name
+                    );
+                }
+                continue;
+            }
+            list.spill_flag = true;
+            spilled.push_back(list.index);
+            continue;
         }
 
         list.color = reg_value;
-        list.allocated = true;
-
-        // Track registers used in function so that calls can properly do
-        // caller-saved registers.
-        function.registers_used().insert(u8(list.color));
 
         // fmt::print("Vreg {} mapped to HWreg {}\n", list.value, list.color);
     }
 
+    if (not spilled.empty()) {
+        // Spilled registers that do not interfere share a stack slot, as do
+        // the registers coalesced into a spilled one.
+        SpillGroups groups{};
+        std::vector<std::vector<usz>> group_members{};
+        std::unordered_map<usz, usz> group_of{};
+        for (usz index : spilled) {
+            auto group = rgs::find_if(group_members, [&](const std::vector<usz>& members) {
+                return rgs::none_of(members, [&](usz member) { return graph.at(member, index); });
+            });
+            group_of[index] = usz(group - group_members.begin());
+            if (group == group_members.end()) {
+                group_members.emplace_back();
+                groups.emplace_back();
+                group = group_members.end() - 1;
+            }
+            group->push_back(index);
+        }
+        for (auto& list : lists) {
+            auto& repr = representative(lists, list.index);
+            if (repr.spill_flag) groups.at(group_of.at(repr.index)).push_back(list.value);
+        }
+        return groups;
+    }
+
     // STEP SIX
     // Actually update all references to old virtual registers with newly
     // colored hardware registers.
@@ -505,7 +739,12 @@ void allocate_registers(const MachineDescription& desc, MFunction& function) {
         if (list.value < +MInst::Kind::ArchStart) continue;
         LCC_ASSERT(list.allocated, "AdjacencyList must have a color allocated");
         usz vreg = list.value;
-        usz color = list.color;
+        usz color = representative(lists, list.index).color;
+
+        // Track registers used in function so that the prologue and epilogue
+        // can save and restore the preserved ones.
+        function.registers_used().insert(u8(color));
+
         for (auto& block : function.blocks()) {
             for (auto& instruction : block.instructions()) {
                 if (instruction.reg() == vreg) instruction.reg(color);
@@ -521,6 +760,495 @@ void allocate_registers(const MachineDescription& desc, MFunction& function) {
             }
         }
     }
+
+    remove_self_copies(desc, function);
+
+    return {};
+}
+
+/// Keep virtual registers in stack slots instead of registers: load each
+/// into a new virtual register before each instruction that reads it, and
+/// store that register back after each instruction that writes it. The
+/// new registers only live for a single instruction. The registers of a
+/// group share a stack slot; all of them are rewritten in one pass.
+void spill(
+    const MachineDescription& desc,
+    MFunction& function,
+    const SpillGroups& groups,
+    std::unordered_set<usz>& spill_temporaries
+) {
+    std::unordered_map<usz, MOperandLocal> slots{};
+    for (auto& group : groups) {
+        auto slot = function.add_spill_slot();
+        for (auto vreg : group) slots.emplace(vreg, slot);
+        stats::Count("ra", "registers spilled", group.size());
+    }
+
+    // How an instruction accesses a spilled register, and the register
+    // that replaces it in the instruction.
+    struct Access {
+        usz vreg;
+        usz temporary;
+        bool reads;
+        bool writes;
+    };
+    std::vector<Access> accesses{};
+
+    for (auto& block : function.blocks()) {
+        std::vector<MInst> instructions{};
+        instructions.reserve(block.instructions().size());
+        for (auto& inst : block.instructions()) {
+            accesses.clear();
+            const auto access = [&](usz vreg) -> Access& {
+                auto found = rgs::find(accesses, vreg, &Access::vreg);
+                if (found != accesses.end()) return *found;
+                auto temporary = function.next_vreg();
+                spill_temporaries.insert(temporary);
+                accesses.push_back(Access{vreg, temporary, false, false});
+                return accesses.back();
+            };
+
+            // The register an instruction is said to define is only
+            // written by a call; otherwise, it is not accessed at all.
+            if (inst.opcode() == desc.call_opcode and slots.contains(inst.reg()))
+                access(inst.reg()).writes |= inst.is_defining();
+            for (auto [i, op] : vws::enumerate(inst.all_operands())) {
+                if (not std::holds_alternative<MOperandRegister>(op)) continue;
+                if (not slots.contains(std::get<MOperandRegister>(op).value)) continue;
+                auto& a = access(std::get<MOperandRegister>(op).value);
+                a.reads |= desc.reads_operand(inst, usz(i));
+                a.writes |= desc.writes_operand(inst, usz(i));
+            }
+
+            if (accesses.empty()) {
+                instructions.push_back(std::move(inst));
+                continue;
+            }
+
+            for (auto& a : accesses) {
+                if (inst.reg() == a.vreg) inst.reg(a.temporary);
+                for (auto& op : inst.all_operands()) {
+                    if (not std::holds_alternative<MOperandRegister>(op)) continue;
+                    auto reg = std::get<MOperandRegister>(op);
+                    if (reg.value != a.vreg) continue;
+                    reg.value = a.temporary;
+                    op = reg;
+                }
+            }
+
+            // Spill slots are eight bytes, so always load and store the whole
+            // register, whatever size the instruction uses.
+            for (auto& a : accesses) {
+                if (not a.reads) continue;
+                MInst load{desc.load_opcode, {a.temporary, 64}};
+                load.is_defining(true);
+                load.add_operand(slots.at(a.vreg));
+                load.add_operand(MOperandRegister{a.temporary, 64});
+                load.location(inst.location());
+                instructions.push_back(std::move(load));
+            }
+
+            auto location = inst.location();
+            instructions.push_back(std::move(inst));
+
+            for (auto& a : accesses) {
+                if (not a.writes) continue;
+                MInst store{desc.store_opcode, {0, 0}};
+                store.add_operand(MOperandRegister{a.temporary, 64});
+                store.add_operand(slots.at(a.vreg));
+                store.location(location);
+                instructions.push_back(std::move(store));
+            }
+        }
+        block.instructions() = std::move(instructions);
+    }
+}
+
+/// The positions in the linear order of a function's instructions over
+/// which a virtual register is live. Instruction `n` (counting across all
+/// blocks, in order) reads its operands at position `2n` and writes them
+/// at `2n + 1`.
+struct LiveInterval {
+    usz vreg;
+    usz start;
+    usz end;
+
+    // Register this interval has been allocated, or zero.
+    usz color;
+
+    // Whether this is the register of a spilled value, which only lives for
+    // a single instruction.
+    bool temporary;
+};
+
+/// Allocate registers with a linear scan over the live intervals of the
+/// virtual registers of a function and, if every interval got one,
+/// replace the virtual registers with them. Otherwise, return the virtual
+/// registers that need to be spilled.
+///
+/// An interval spans from the first to the last position at which its
+/// register is live, ignoring any holes, so two intervals interfere
+/// exactly when they overlap and no interference graph is needed.
+auto scan_registers(
+    const MachineDescription& desc,
+    MFunction& function,
+    const std::unordered_set<usz>& spill_temporaries
+) -> SpillGroups {
+    const auto is_virtual = [](usz value) {
+        return value >= +MInst::Kind::ArchStart;
+    };
+
+    // Call `callback(reg)` for every register an instruction overwrites
+    // without it being an operand: the result of a call, which the call
+    // itself writes, and the registers a callee need not preserve.
+    const auto for_each_implicit_write = [&](MInst& inst, auto&& callback) {
+        if (inst.opcode() != desc.call_opcode) return;
+        if (inst.is_defining() and is_virtual(inst.reg())) callback(inst.reg());
+        for (auto reg : desc.registers)
+            if (rgs::find(desc.preserved_registers, reg) == desc.preserved_registers.end())
+                callback(reg);
+    };
+
+    // STEP ONE
+    // Compute which registers are live into and out of each block.
+    // Hardware registers are included, as no value may be allocated to one
+    // while it holds something that is read later, e.g. an argument.
+    auto& blocks = function.blocks();
+    std::vector<usz> registers{desc.registers};
+    std::unordered_map<usz, usz> register_index{};
+    for (auto [i, reg] : vws::enumerate(registers)) register_index[reg] = usz(i);
+    const auto add_reg = [&](usz reg) {
+        if (register_index.try_emplace(reg, registers.size()).second)
+            registers.push_back(reg);
+    };
+    for (auto& block : blocks) {
+        for (auto& inst : block.instructions()) {
+            if (inst.reg()) add_reg(inst.reg());
+            for_each_access(desc, inst, [&](usz reg, bool, bool, bool) { add_reg(reg); });
+        }
+    }
+
+    auto liveness = compute_liveness(desc, function, register_index);
+    const auto registers_in = [&](const Bitset& set) {
+        std::vector<usz> regs{};
+        set.for_each([&](usz i) { regs.push_back(registers[i]); });
+        return regs;
+    };
+
+    // STEP TWO
+    // Number the instructions and build the live intervals of the virtual
+    // registers. For hardware registers, record the ranges of positions at
+    // which each is live or written instead, as those can not be merged
+    // into one interval without making them useless. Also record the
+    // register each virtual register is copied from or to, which is the
+    // one we'd like to allocate it to, so that the copy can be removed.
+    std::vector<LiveInterval> intervals{};
+    std::unordered_map<usz, usz> interval_of{};
+    std::unordered_map<usz, std::vector<std::pair<usz, usz>>> busy{};
+    std::unordered_map<usz, usz> hints{};
+    const auto extend = [&](usz vreg, usz position) {
+        auto [it, inserted] = interval_of.try_emplace(vreg, intervals.size());
+        if (inserted) {
+            intervals.push_back({vreg, position, position, 0, spill_temporaries.contains(vreg)});
+            return;
+        }
+        auto& interval = intervals[it->second];
+        interval.start = std::min(interval.start, position);
+        interval.end = std::max(interval.end, position);
+    };
+
+    usz position = 0;
+    for (auto [b, block] : vws::enumerate(blocks)) {
+        usz first = position;
+        for (auto reg : registers_in(liveness.live_in[usz(b)]))
+            if (is_virtual(reg)) extend(reg, first);
+
+        for (auto& inst : block.instructions()) {
+            for_each_access(desc, inst, [&](usz reg, bool reads, bool writes, bool clobbered) {
+                if (not is_virtual(reg)) {
+                    if (writes) busy[reg].emplace_back(position + 1, position + 1);
+                    return;
+                }
+                // An operand that is only written does not interfere with
+                // the ones that are read if it is clobbered, i.e. `mov`.
+                if (reads or not clobbered) extend(reg, position);
+                if (writes) extend(reg, position + 1);
+            });
+            if (inst.reg() and not is_virtual(inst.reg()))
+                busy[inst.reg()].emplace_back(position + 1, position + 1);
+            // The result of a call is only written after the call returns,
+            // so it doesn't interfere with what the callee overwrites.
+            for_each_implicit_write(inst, [&](usz reg) {
+                if (is_virtual(reg)) extend(reg, position + 2);
+                else busy[reg].emplace_back(position + 1, position + 1);
+            });
+
+            if (inst.opcode() == desc.copy_opcode and inst.all_operands().size() == 2) {
+                auto src = inst.get_operand(0);
+                auto dst = inst.get_operand(1);
+                if (
+                    std::holds_alternative<MOperandRegister>(src)
+                    and std::holds_alternative<MOperandRegister>(dst)
+                ) {
+                    auto src_reg = std::get<MOperandRegister>(src);
+                    auto dst_reg = std::get<MOperandRegister>(dst);
+                    if (is_virtual(dst_reg.value)) hints.try_emplace(dst_reg.value, src_reg.value);
+                    else if (is_virtual(src_reg.value)) hints.try_emplace(src_reg.value, dst_reg.value);
+                }
+            }
+
+            position += 2;
+        }
+
+        usz last = position == first ? first : position - 1;
+        auto live_out = registers_in(liveness.live_out[usz(b)]);
+        for (auto reg : live_out)
+            if (is_virtual(reg)) extend(reg, last);
+
+        // Walk the block backwards to find where hardware registers are live.
+        std::unordered_map<usz, usz> live_until{};
+        for (auto reg : live_out)
+            if (not is_virtual(reg)) live_until[reg] = last;
+        usz inst_position = position;
+        for (auto& inst : block.instructions() | vws::reverse) {
+            inst_position -= 2;
+            const auto kill = [&](usz reg) {
+                auto found = live_until.find(reg);
+                if (found == live_until.end()) return;
+                busy[reg].emplace_back(inst_position + 1, found->second);
+                live_until.erase(found);
+            };
+            for_each_access(desc, inst, [&](usz reg, bool reads, bool, bool) {
+                if (not is_virtual(reg) and not reads) kill(reg);
+            });
+            for_each_implicit_write(inst, [&](usz reg) {
+                if (not is_virtual(reg)) kill(reg);
+            });
+            for_each_access(desc, inst, [&](usz reg, bool reads, bool, bool) {
+                if (not is_virtual(reg) and reads) live_until.try_emplace(reg, inst_position);
+            });
+        }
+        for (auto [reg, end] : live_until) busy[reg].emplace_back(first, end);
+    }
+
+    // Sort and merge the ranges of each hardware register, so that we can
+    // binary search them.
+    for (auto& [reg, ranges] : busy) {
+        rgs::sort(ranges);
+        std::vector<std::pair<usz, usz>> merged{};
+        for (auto range : ranges) {
+            if (not merged.empty() and range.first <= merged.back().second + 1)
+                merged.back().second = std::max(merged.back().second, range.second);
+            else merged.push_back(range);
+        }
+        ranges = std::move(merged);
+    }
+
+    // STEP THREE
+    // Walk the intervals in order of their start, keeping a list of those
+    // that are still live (active), and give each the first register that
+    // is neither held by an active interval nor busy while it is live. If
+    // there is no such register, spill whichever of it and the active
+    // intervals whose register it could take ends last.
+    const auto busy_during = [&](usz reg, const LiveInterval& interval) {
+        auto found = busy.find(reg);
+        if (found == busy.end()) return false;
+        auto it = rgs::lower_bound(found->second, interval.start, {}, [](auto range) {
+            return range.second;
+        });
+        return it != found->second.end() and it->first <= interval.end;
+    };
+
+    std::vector<usz> order(intervals.size());
+    std::iota(order.begin(), order.end(), usz(0));
+    rgs::sort(order, [&](usz a, usz b) {
+        if (intervals[a].start != intervals[b].start)
+            return intervals[a].start < intervals[b].start;
+        return intervals[a].end < intervals[b].end;
+    });
+
+    std::vector<usz> active{};
+    std::vector<usz> spilled{};
+    for (usz index : order) {
+        auto& interval = intervals[index];
+        std::erase_if(active, [&](usz a) { return intervals[a].end < interval.start; });
+
+        const auto available = [&](usz reg) {
+            if (busy_during(reg, interval)) return false;
+            return rgs::none_of(active, [&](usz a) { return intervals[a].color == reg; });
+        };
+
+        usz color = 0;
+        if (auto hint = hints.find(interval.vreg); hint != hints.end()) {
+            usz reg = hint->second;
+            if (is_virtual(reg)) reg = intervals[interval_of.at(reg)].color;
+            if (rgs::find(desc.registers, reg) != desc.registers.end() and available(reg))
+                color = reg;
+        }
+        if (not color) {
+            for (auto reg : desc.registers) {
+                if (available(reg)) {
+                    color = reg;
+                    break;
+                }
+            }
+        }
+
+        if (color) {
+            interval.color = color;
+            active.push_back(index);
+            continue;
+        }
+
+        // Spilling a register that was introduced by spilling would not
+        // shorten any live range, so never choose one of those.
+        usz victim = interval.temporary ? usz(-1) : index;
+        for (usz a : active) {
+            auto& other = intervals[a];
+            if (other.temporary or busy_during(other.color, interval)) continue;
+            if (victim == usz(-1) or other.end > intervals[victim].end) victim = a;
+        }
+
+        if (victim == usz(-1)) {
+            Diag::ICE(
+                "Can not allocate {} registers, even after spilling, in function `{}`",
+                desc.registers.size(),
+                function.names().at(0).name
+            );
+        }
+
+        spilled.push_back(victim);
+        if (victim == index) continue;
+        interval.color = intervals[victim].color;
+        intervals[victim].color = 0;
+        std::erase(active, victim);
+        active.push_back(index);
+    }
+
+    if (not spilled.empty()) {
+        // Spilled intervals that do not overlap share a stack slot.
+        rgs::sort(spilled, [&](usz a, usz b) { return intervals[a].start < intervals[b].start; });
+        SpillGroups groups{};
+        std::vector<usz> group_end{};
+        for (usz index : spilled) {
+            auto& interval = intervals[index];
+            auto group = rgs::find_if(group_end, [&](usz end) { return end < interval.start; });
+            if (group == group_end.end()) {
+                groups.emplace_back();
+                group_end.push_back(interval.end);
+                group = group_end.end() - 1;
+            }
+            *group = interval.end;
+            groups.at(usz(group - group_end.begin())).push_back(interval.vreg);
+        }
+        return groups;
+    }
+
+    // STEP FOUR
+    // Replace all virtual registers with their allocated registers.
+    for (auto& interval : intervals) {
+        // Track registers used in function so that the prologue and
+        // epilogue can save and restore the preserved ones.
+        function.registers_used().insert(u8(interval.color));
+    }
+
+    const auto color_of = [&](usz vreg) -> usz {
+        auto found = interval_of.find(vreg);
+        // A register that an instruction is only said to define is never
+        // accessed, so it may as well be any register.
+        if (found == interval_of.end()) return desc.registers.front();
+        return intervals[found->second].color;
+    };
+    for (auto& block : blocks) {
+        for (auto& inst : block.instructions()) {
+            if (is_virtual(inst.reg())) inst.reg(color_of(inst.reg()));
+            for (auto& op : inst.all_operands()) {
+                if (not std::holds_alternative<MOperandRegister>(op)) continue;
+                auto reg = std::get<MOperandRegister>(op);
+                if (not is_virtual(reg.value)) continue;
+                reg.value = color_of(reg.value);
+                op = reg;
+            }
+        }
+    }
+
+    remove_self_copies(desc, function);
+
+    return {};
+}
+
+} // namespace
+
+void allocate_registers(
+    const MachineDescription& desc,
+    MFunction& function,
+    RegisterAllocator allocator
+) {
+    // Don't allocate registers for empty functions.
+    if (function.blocks().empty()) return;
+
+    // Steps:
+    //   1. Collect all existing registers, both hardware and virtual.
+    //   2. Compute liveness, then walk each block in reverse, building the
+    //      interference graph as you go.
+    //   3. Build adjacency lists from the interference graph.
+    //   4. Figure out order that registers should be allocated in: call this
+    //      list the "coloring stack".
+    //   5. Assign colors to registers, ensuring no overlap (adjacencies), in
+    //      order of the coloring stack.
+    //     5a. If we can't color with the existing stack, spill the registers
+    //         that could not be colored and retry.
+    //   6. Map colors to registers, updating all register operands to the
+    //      allocated register.
+    //
+    // The linear scan allocator replaces steps one through six with a
+    // single pass over the live intervals of the virtual registers (see
+    // `scan_registers()`), spilling and retrying in the same way.
+
+    // STEP -1
+    // Replace explicit return registers with the actual return register...
+    for (auto& block : function.blocks()) {
+        for (auto& inst : block.instructions()) {
+            if (inst.reg() == desc.return_register_to_replace)
+                inst.reg(desc.return_register);
+            for (auto& op : inst.all_operands()) {
+                if (std::holds_alternative<MOperandRegister>(op)) {
+                    MOperandRegister reg = std::get<MOperandRegister>(op);
+                    if (reg.value == desc.return_register_to_replace) {
+                        reg.value = desc.return_register;
+                        op = reg;
+                    }
+                }
+            }
+        }
+    }
+
+    // TODO: We need the context here (or the module so we can get to the
+    // context) so that we can query if target is actually x86_64.
+    // fmt::print(
+    //    "Return register replaced.\n{}\n",
+    //    PrintMFunctionImpl(function, x86_64::opcode_to_string)
+    //);
+
+    // STEPS ONE THROUGH SIX
+    // Registers introduced by spilling are only live for one instruction,
+    // so this terminates once all other registers that need spilling are.
+    std::unordered_set<usz> spill_temporaries{};
+    for (;;) {
+        auto spilled = allocator == RegisterAllocator::LinearScan
+                         ? scan_registers(desc, function, spill_temporaries)
+                         : color_registers(desc, function, spill_temporaries);
+        if (spilled.empty()) break;
+        spill(desc, function, spilled, spill_temporaries);
+    }
+}
+
+auto saved_registers(const MachineDescription& desc, const MFunction& function) -> std::vector<usz> {
+    std::vector<usz> saved{};
+    for (auto reg : desc.preserved_registers)
+        if (function.registers_used().contains(u8(reg)))
+            saved.push_back(reg);
+    return saved;
 }
 
 } // namespace lcc
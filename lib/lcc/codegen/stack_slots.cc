@@ -0,0 +1,227 @@
+#include <lcc/codegen/mir.hh>
+#include <lcc/codegen/register_allocation.hh>
+#include <lcc/codegen/stack_slots.hh>
+#include <lcc/ir/ir.hh>
+#include <lcc/utils.hh>
+#include <lcc/utils/bitset.hh>
+#include <lcc/utils/statistics.hh>
+
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace lcc {
+namespace {
+
+/// Call `callback(slot, address_taken)` for every stack slot an
+/// instruction refers to.
+template <typename Callback>
+void for_each_slot(
+    const MachineDescription& desc,
+    const MFunction& function,
+    MInst& inst,
+    Callback&& callback
+) {
+    for (auto& op : inst.all_operands()) {
+        if (not std::holds_alternative<MOperandLocal>(op)) continue;
+        auto local = std::get<MOperandLocal>(op);
+        if (local.index == MOperandLocal::absolute_index) continue;
+        callback(function.stack_slot(local), inst.opcode() == desc.address_opcode);
+    }
+}
+
+/// Which stack slots are live at the same time, as a list of neighbours
+/// per slot (which may contain duplicates).
+///
+/// Nothing is known about what is in a slot before it is first accessed,
+/// and nothing reads it after it is last accessed, so a slot is live
+/// wherever it has been accessed on some path from the entry *and* will
+/// be accessed on some path to an exit. Within a block, that is a single
+/// range of instructions, so slots interfere exactly when their ranges in
+/// some block overlap.
+///
+/// This only holds for slots that are accessed directly; ones whose
+/// address is taken are returned in `address_taken` instead.
+struct Interferences {
+    std::vector<std::vector<usz>> neighbours;
+    Bitset address_taken;
+};
+
+auto collect_interferences(const MachineDescription& desc, MFunction& function) -> Interferences {
+    auto& blocks = function.blocks();
+    auto slots = function.stack_slots();
+    Interferences interferences{std::vector<std::vector<usz>>(slots), Bitset{slots}};
+
+    std::vector<Bitset> accessed(blocks.size(), Bitset{slots});
+    std::vector<std::vector<usz>> predecessors(blocks.size());
+    for (auto [b, block] : vws::enumerate(blocks)) {
+        for (auto successor : block.successors()) predecessors[successor].push_back(usz(b));
+        for (auto& inst : block.instructions()) {
+            for_each_slot(desc, function, inst, [&](usz slot, bool address_taken) {
+                accessed[usz(b)].set(slot);
+                if (address_taken) interferences.address_taken.set(slot);
+            });
+        }
+    }
+
+    // Propagate accesses forwards into `reached_in` (accessed on some path
+    // to the start of the block) and backwards into `needed_out` (accessed
+    // on some path from the end of the block).
+    std::vector<Bitset> reached_in(blocks.size(), Bitset{slots});
+    std::vector<Bitset> needed_out(blocks.size(), Bitset{slots});
+    Bitset scratch{slots};
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (usz b = 0; b < blocks.size(); ++b) {
+            for (auto predecessor : predecessors[b]) {
+                scratch = reached_in[predecessor];
+                scratch.merge(accessed[predecessor]);
+                changed |= reached_in[b].merge(scratch);
+            }
+        }
+        for (usz b = blocks.size(); b--;) {
+            for (auto successor : blocks[b].successors()) {
+                scratch = needed_out[successor];
+                scratch.merge(accessed[successor]);
+                changed |= needed_out[b].merge(scratch);
+            }
+        }
+    }
+
+    // Find the range of instructions each slot is live over in each block,
+    // and sweep over them in order of their start.
+    constexpr usz none = usz(-1);
+    std::vector<usz> first(slots, none);
+    std::vector<usz> last(slots, none);
+    std::vector<std::pair<usz, usz>> ranges{};
+    std::vector<usz> live{};
+    std::vector<usz> active{};
+    for (auto [b, block] : vws::enumerate(blocks)) {
+        for (auto [i, inst] : vws::enumerate(block.instructions())) {
+            for_each_slot(desc, function, inst, [&](usz slot, bool) {
+                if (first[slot] == none) first[slot] = usz(i);
+                last[slot] = usz(i);
+            });
+        }
+
+        live.clear();
+        const auto add_live = [&](usz slot) {
+            if (first[slot] == none and not reached_in[usz(b)].test(slot)) return;
+            if (last[slot] == none and not needed_out[usz(b)].test(slot)) return;
+            live.push_back(slot);
+        };
+        reached_in[usz(b)].for_each(add_live);
+        accessed[usz(b)].for_each([&](usz slot) {
+            if (not reached_in[usz(b)].test(slot)) add_live(slot);
+        });
+
+        const auto start = [&](usz slot) {
+            return reached_in[usz(b)].test(slot) ? 0 : first[slot];
+        };
+        const auto end = [&](usz slot) {
+            return needed_out[usz(b)].test(slot) ? none : last[slot];
+        };
+        rgs::sort(live, {}, start);
+
+        active.clear();
+        for (auto slot : live) {
+            std::erase_if(active, [&](usz other) { return end(other) < start(slot); });
+            for (auto other : active) {
+                interferences.neighbours[slot].push_back(other);
+                interferences.neighbours[other].push_back(slot);
+            }
+            active.push_back(slot);
+        }
+
+        accessed[usz(b)].for_each([&](usz slot) { first[slot] = last[slot] = none; });
+    }
+
+    return interferences;
+}
+
+} // namespace
+
+void allocate_stack_slots(const MachineDescription& desc, MFunction& function) {
+    auto slots = function.stack_slots();
+
+    // Size and alignment of each slot; spill slots hold a whole register.
+    std::vector<usz> size(slots, 8);
+    std::vector<usz> align(slots, 8);
+    for (auto [i, local] : vws::enumerate(function.locals())) {
+        size[usz(i)] = local->allocated_type()->bytes();
+        align[usz(i)] = std::max<usz>(local->allocated_type()->align_bytes(), 1);
+    }
+
+    auto interferences = collect_interferences(desc, function);
+
+    // Assign the slots, most strictly aligned and largest first, to areas
+    // of the frame. A slot shares an area with slots it doesn't interfere
+    // with if there is one, preferring the smallest area it fits in, so
+    // that areas grow as little as possible. Every area is at least as
+    // aligned as the slots in it.
+    struct Area {
+        usz size;
+        usz align;
+        bool shared;
+    };
+    std::vector<Area> areas{};
+    std::vector<usz> area_of(slots);
+    std::vector<usz> order(slots);
+    std::iota(order.begin(), order.end(), usz(0));
+    rgs::stable_sort(order, [&](usz a, usz b) {
+        return std::pair{align[a], size[a]} > std::pair{align[b], size[b]};
+    });
+
+    std::vector<bool> assigned(slots, false);
+    std::vector<usz> taken_by{};
+    for (auto slot : order) {
+        bool address_taken = interferences.address_taken.test(slot);
+        usz found = areas.size();
+        if (not address_taken) {
+            // Areas that hold a neighbour are stamped with this slot.
+            taken_by.resize(areas.size(), usz(-1));
+            for (auto neighbour : interferences.neighbours[slot])
+                if (assigned[neighbour]) taken_by[area_of[neighbour]] = slot;
+
+            // Prefer the smallest area the slot fits in, or else the
+            // largest one.
+            const auto better = [&](const Area& a, const Area& b) {
+                bool a_fits = a.size >= size[slot];
+                bool b_fits = b.size >= size[slot];
+                if (a_fits != b_fits) return a_fits;
+                return a_fits ? a.size < b.size : a.size > b.size;
+            };
+            for (usz a = 0; a < areas.size(); ++a) {
+                if (not areas[a].shared or taken_by[a] == slot) continue;
+                if (found == areas.size() or better(areas[a], areas[found])) found = a;
+            }
+        }
+
+        if (found == areas.size()) {
+            areas.push_back({size[slot], align[slot], not address_taken});
+        } else {
+            areas[found].size = std::max(areas[found].size, size[slot]);
+            areas[found].align = std::max(areas[found].align, align[slot]);
+            stats::Count("frame", "stack slots shared");
+        }
+        area_of[slot] = found;
+        assigned[slot] = true;
+    }
+
+    // Place the areas below the base pointer; they were created in order
+    // of decreasing alignment, so there is little padding between them.
+    std::vector<isz> area_offsets(areas.size());
+    usz frame_size = 0;
+    for (auto [a, area] : vws::enumerate(areas)) {
+        frame_size = utils::AlignTo(frame_size + area.size, area.align);
+        area_offsets[usz(a)] = -isz(frame_size);
+    }
+
+    std::vector<isz> offsets(slots);
+    for (usz slot = 0; slot < slots; ++slot) offsets[slot] = area_offsets[area_of[slot]];
+    function.frame_layout(std::move(offsets), frame_size);
+}
+
+} // namespace lcc
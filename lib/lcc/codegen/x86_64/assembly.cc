@@ -8,10 +8,14 @@
 #include <lcc/ir/ir.hh>
 #include <lcc/utils.hh>
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
 #include <functional>
 #include <ranges>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <variant>
 #include <vector>
@@ -20,25 +24,96 @@ namespace lcc::x86_64 {
 
 namespace {
 
-// NOTE: Does not handle empty string (because we want every input of this
-// function to produce the same output)
-auto safe_name(std::string in) -> std::string {
-    LCC_ASSERT(not in.empty(), "safe_name does not handle empty string input");
-    // . in the middle of an identifier is not allowed
-    std::replace(in.begin(), in.end(), '.', '_');
-    return fmt::format("{}", in);
-}
+/// Streams GNU assembly into a file through a fixed-size buffer, so the
+/// memory it takes doesn't grow with the size of the output. Everything
+/// is formatted straight into the buffer; nothing is built up in a
+/// temporary string first.
+class AssemblyWriter {
+    /// Flush once the buffer is half full, so that a line never has to
+    /// grow it.
+    static constexpr usz BufferSize = 64 * 1024;
+
+    fmt::basic_memory_buffer<char, BufferSize> _buffer{};
+    const fs::path& _path;
+    std::FILE* _file;
+
+public:
+    /// Open \p path for writing; "-" writes to stdout.
+    explicit AssemblyWriter(const fs::path& path)
+        : _path(path),
+          _file(path == "-" ? stdout : std::fopen(path.string().c_str(), "wb")) {
+        if (not _file) Diag::Fatal("Failed to write to file '{}': {}", _path.string(), std::strerror(errno));
+    }
 
-auto block_name(const std::string& in) -> std::string {
-    LCC_ASSERT(not in.empty(), "Cannot emit empty block name!");
-    // ".L" at the beginning tells the assembler it's a local label and not a
-    // function, which helps objdump and things like that don't get confused.
-    return fmt::format(".L{}", safe_name(in));
-}
+    AssemblyWriter(const AssemblyWriter&) = delete;
+    AssemblyWriter(AssemblyWriter&&) = delete;
+    auto operator=(const AssemblyWriter&) -> AssemblyWriter& = delete;
+    auto operator=(AssemblyWriter&&) -> AssemblyWriter& = delete;
 
-} // namespace
+    ~AssemblyWriter() {
+        if (_file and _file != stdout) std::fclose(_file);
+    }
+
+    template <typename... Args>
+    void write(fmt::format_string<Args...> fmt, Args&&... args) {
+        fmt::format_to(fmt::appender(_buffer), fmt, std::forward<Args>(args)...);
+        flush_if_full();
+    }
+
+    void write(std::string_view s) {
+        _buffer.append(s);
+        flush_if_full();
+    }
+
+    void write(char c) {
+        _buffer.push_back(c);
+        flush_if_full();
+    }
+
+    /// Write a symbol name in a form the assembler accepts.
+    // NOTE: Does not handle empty string (because we want every input of this
+    // function to produce the same output)
+    void write_name(std::string_view name) {
+        LCC_ASSERT(not name.empty(), "safe_name does not handle empty string input");
+        // . in the middle of an identifier is not allowed
+        for (auto c : name) _buffer.push_back(c == '.' ? '_' : c);
+        flush_if_full();
+    }
+
+    void write_block_name(std::string_view name) {
+        LCC_ASSERT(not name.empty(), "Cannot emit empty block name!");
+        // ".L" at the beginning tells the assembler it's a local label and not a
+        // function, which helps objdump and things like that don't get confused.
+        write(".L");
+        write_name(name);
+    }
+
+    void write_operand(MFunction& function, const Frame& frame, MOperand op);
+    void write_address(MFunction& function, const Frame& frame, const Address& address);
+
+    /// Write out what is left in the buffer and close the file.
+    void close() {
+        flush();
+        if (_file != stdout and std::fclose(_file) != 0) {
+            _file = nullptr;
+            Diag::Fatal("Failed to write to file '{}': {}", _path.string(), std::strerror(errno));
+        }
+        _file = nullptr;
+    }
+
+private:
+    void flush() {
+        if (_buffer.size() and std::fwrite(_buffer.data(), 1, _buffer.size(), _file) != _buffer.size())
+            Diag::Fatal("Failed to write to file '{}': {}", _path.string(), std::strerror(errno));
+        _buffer.clear();
+    }
 
-auto ToString(MFunction& function, MOperand op) -> std::string {
+    void flush_if_full() {
+        if (_buffer.size() >= BufferSize / 2) flush();
+    }
+};
+
+void AssemblyWriter::write_operand(MFunction& function, const Frame& frame, MOperand op) {
     static_assert(
         std::variant_size_v<MOperand> == 6,
         "Exhaustive handling of MOperand alternatives in x86_64 GNU Assembly backend"
@@ -46,57 +121,49 @@ auto ToString(MFunction& function, MOperand op) -> std::string {
     if (std::holds_alternative<MOperandRegister>(op)) {
         // TODO: Assert that register id is one of the x86_64 register ids...
         MOperandRegister reg = std::get<MOperandRegister>(op);
-        return fmt::format(
-            "%{}",
-            ToString(RegisterId(reg.value), reg.size)
-        );
-    }
-    if (std::holds_alternative<MOperandImmediate>(op)) {
-        return fmt::format(
-            "${}",
-            std::get<MOperandImmediate>(op).value
-        );
-    }
-    if (std::holds_alternative<MOperandLocal>(op)) {
-        return fmt::format(
-            "{}(%rbp)",
-            function.local_offset(std::get<MOperandLocal>(op))
-        );
-    }
-    if (std::holds_alternative<MOperandGlobal>(op)) {
-        return fmt::format(
-            "{}(%rip)",
-            safe_name(std::get<MOperandGlobal>(op)->names().at(0).name)
-        );
-    }
-    if (std::holds_alternative<MOperandFunction>(op)) {
-        return fmt::format(
-            "{}",
-            std::get<MOperandFunction>(op)->names().at(0).name
-        );
-    }
-    if (std::holds_alternative<MOperandBlock>(op)) {
-        return fmt::format(
-            "{}",
-            block_name(std::get<MOperandBlock>(op)->name())
-        );
+        write('%');
+        write(ToString(RegisterId(reg.value), reg.size));
+    } else if (std::holds_alternative<MOperandImmediate>(op)) {
+        write("${}", std::get<MOperandImmediate>(op).value);
+    } else if (std::holds_alternative<MOperandLocal>(op)) {
+        write_address(function, frame, frame.address(function, std::get<MOperandLocal>(op)));
+    } else if (std::holds_alternative<MOperandGlobal>(op)) {
+        write_name(std::get<MOperandGlobal>(op)->names().at(0).name);
+        write("(%rip)");
+    } else if (std::holds_alternative<MOperandFunction>(op)) {
+        write(std::string_view{std::get<MOperandFunction>(op)->names().at(0).name});
+    } else if (std::holds_alternative<MOperandBlock>(op)) {
+        write_block_name(std::get<MOperandBlock>(op)->name());
+    } else LCC_ASSERT(false, "Unhandled MOperand kind (index {})", op.index());
+}
+
+void AssemblyWriter::write_address(MFunction& function, const Frame& frame, const Address& address) {
+    if (address.displacement) write("{}", address.displacement);
+    write('(');
+    write_operand(function, frame, address.base);
+    if (address.index) {
+        write(", ");
+        write_operand(function, frame, *address.index);
+        write(", {}", address.scale);
     }
-    LCC_ASSERT(false, "Unhandled MOperand kind (index {})", op.index());
+    write(')');
 }
 
+} // namespace
+
 void emit_gnu_att_assembly(
     const fs::path& output_path,
     Module* module,
     const MachineDescription& desc,
     std::vector<MFunction>& mir
 ) {
-    std::string out{};
+    AssemblyWriter out{output_path};
 
     // If we ever add optional location information to the MIR (and some
     // eventually trickles through), this would allow somebody to step through
     // the source in a debugger like gdb.
     for (const auto& f : module->context()->files()) {
-        out += fmt::format(
+        out.write(
             "    .file {} \"{}\"\n",
             f->file_id(),
             fs::absolute(f->path()).string()
@@ -107,39 +174,39 @@ void emit_gnu_att_assembly(
         // From GNU as manual: `.extern` is accepted in the source program--for
         // compatibility with other assemblers--but it is ignored. `as` treats all
         // undefined symbols as external. That's why imported is ignored.
-        for (auto n : var->names()) {
+        for (const auto& n : var->names()) {
             if (IsExportedLinkage(n.linkage))
-                out += fmt::format("    .globl {}\n", n.name);
+                out.write("    .globl {}\n", n.name);
         }
 
         if (var->init()) {
-            for (auto n : var->names())
-                out += fmt::format("{}:\n", safe_name(n.name));
+            out.write("    .data\n");
+            for (const auto& n : var->names()) {
+                out.write_name(n.name);
+                out.write(":\n");
+            }
             switch (var->init()->kind()) {
                 case Value::Kind::ArrayConstant: {
                     auto* array_constant = as<ArrayConstant>(var->init());
-                    out += fmt::format(
-                        "    .byte {}\n",
-                        fmt::join(
-                            vws::transform(*array_constant, [&](char c) {
-                                return fmt::format("0x{:x}", int(c));
-                            }),
-                            ","
-                        )
-                    );
+                    out.write("    .byte ");
+                    for (auto [i, c] : vws::enumerate(*array_constant)) {
+                        if (i) out.write(',');
+                        out.write("0x{:x}", int(c));
+                    }
+                    out.write('\n');
                 } break;
 
                 case Value::Kind::IntegerConstant: {
                     auto* integer_constant = as<IntegerConstant>(var->init());
                     LCC_ASSERT(integer_constant->type()->bytes() <= 8, "Oversized integer constant");
                     // Represent bytes literally
-                    out += "    .byte ";
+                    out.write("    .byte ");
                     u64 value = integer_constant->value().value();
                     for (usz i = 0; i < integer_constant->type()->bytes(); ++i) {
                         int byte = (value >> (i * 8)) & 0xff;
-                        out += fmt::format("0x{:x}", byte);
+                        out.write("0x{:x}", byte);
                         if (i + 1 < integer_constant->type()->bytes())
-                            out += ", ";
+                            out.write(", ");
                     }
                 } break;
 
@@ -150,18 +217,32 @@ void emit_gnu_att_assembly(
                         Value::ToString(var->init()->kind())
                     );
             }
-            out += '\n';
+            out.write('\n');
+        } else if (not rgs::any_of(var->names(), [](const auto& n) { return IsImportedLinkage(n.linkage); })) {
+            // Uninitialised globals are zero-filled at load time.
+            out.write(
+                "    .bss\n"
+                "    .balign {}\n",
+                var->allocated_type()->align_bytes()
+            );
+            for (const auto& n : var->names()) {
+                out.write_name(n.name);
+                out.write(":\n");
+            }
+            out.write("    .zero {}\n", var->allocated_type()->bytes());
         }
     }
 
+    out.write("    .text\n");
+
     for (auto& function : mir) {
         bool imported{false};
-        for (auto n : function.names()) {
+        for (const auto& n : function.names()) {
             // From GNU as manual: `.extern` is accepted in the source program--for
             // compatibility with other assemblers--but it is ignored. `as` treats all
             // undefined symbols as external.
             if (IsExportedLinkage(n.linkage)) {
-                out += fmt::format(
+                out.write(
                     "    .globl {}\n"
                     "    .type {},@function\n",
                     n.name,
@@ -174,8 +255,8 @@ void emit_gnu_att_assembly(
         }
         if (imported) continue;
 
-        for (auto n : function.names())
-            out += fmt::format("{}:\n", n.name);
+        for (const auto& n : function.names())
+            out.write("{}:\n", n.name);
 
         // TODO: Total hack just to try and get the source to show up at all in a
         // debugger. We would need real location information to properly do this.
@@ -183,7 +264,7 @@ void emit_gnu_att_assembly(
         //   .loc <file-id> <line-number> [ <column-number> ]
         if (function.location().is_valid()) {
             auto l = function.location().seek_line_column(module->context());
-            out += fmt::format(
+            out.write(
                 "    .loc {} {} {}\n",
                 function.location().file_id,
                 l.line,
@@ -192,65 +273,72 @@ void emit_gnu_att_assembly(
         }
 
         // CFA (CIE starts it as %rsp+8)
-        out += "    .cfi_startproc\n";
+        out.write("    .cfi_startproc\n");
 
         // Function Header
-        // TODO: Different stack frame kinds.
-        out += "    push %rbp\n";
-        // Update CFA offset, as we now have changed the stack pointer (by 8).
-        // `.cfi_def_cfa_offset` updates CFA offset to new expression, but not register.
-        // `.cfi_offset` notifies saved register rbp location from CFA.
-        out +=
-            "    .cfi_def_cfa_offset 16\n"
-            "    .cfi_offset %rbp, -16\n";
-
-        out += "    mov %rsp, %rbp\n";
-        // Update CFA register, as we now have stored the value of RSP in RBP.
-        out += "    .cfi_def_cfa_register %rbp\n";
-
-        usz stack_frame_size = rgs::fold_left(
-            vws::transform(function.locals(), [](AllocaInst* l) {
-                return l->allocated_type()->bytes();
-            }),
-            0,
-            std::plus{}
-        );
-        if (stack_frame_size) {
-            constexpr usz alignment = 16;
-            stack_frame_size = utils::AlignTo(stack_frame_size, alignment);
-            out += fmt::format("    sub ${}, %rsp\n", stack_frame_size);
+        auto frame = Frame::Of(module->context(), desc, function);
+        if (frame.has_base_pointer()) {
+            out.write("    push %rbp\n");
+            // Update CFA offset, as we now have changed the stack pointer (by 8).
+            // `.cfi_def_cfa_offset` updates CFA offset to new expression, but not register.
+            // `.cfi_offset` notifies saved register rbp location from CFA.
+            out.write(
+                "    .cfi_def_cfa_offset 16\n"
+                "    .cfi_offset %rbp, -16\n"
+            );
+
+            out.write("    mov %rsp, %rbp\n");
+            // Update CFA register, as we now have stored the value of RSP in RBP.
+            out.write("    .cfi_def_cfa_register %rbp\n");
+
+            if (frame.size)
+                out.write("    sub ${}, %rsp\n", frame.size);
+
+            // Preserved registers are saved below the locals.
+            for (auto [i, reg] : vws::enumerate(frame.saved)) {
+                auto name = ToString(x86_64::RegisterId(reg));
+                out.write("    push %{}\n", name);
+                // The CFA is 16 above %rbp (return address and saved %rbp).
+                out.write(
+                    "    .cfi_offset %{}, -{}\n",
+                    name,
+                    16 + frame.size + 8 * (usz(i) + 1)
+                );
+            }
+        } else {
+            // The CFA stays relative to %rsp, so every adjustment of %rsp
+            // moves it.
+            usz cfa_offset = 8;
+            for (auto reg : frame.saved) {
+                auto name = ToString(x86_64::RegisterId(reg));
+                cfa_offset += 8;
+                out.write(
+                    "    push %{}\n"
+                    "    .cfi_def_cfa_offset {}\n"
+                    "    .cfi_offset %{}, -{}\n",
+                    name,
+                    cfa_offset,
+                    name,
+                    cfa_offset
+                );
+            }
+            if (frame.size) {
+                cfa_offset += frame.size;
+                out.write(
+                    "    sub ${}, %rsp\n"
+                    "    .cfi_def_cfa_offset {}\n",
+                    frame.size,
+                    cfa_offset
+                );
+            }
         }
 
         Location last_location{};
-        for (auto [block_index, block] : vws::enumerate(function.blocks())) {
-            out += fmt::format("{}:\n", block_name(block.name()));
+        for (auto& block : function.blocks()) {
+            out.write_block_name(block.name());
+            out.write(":\n");
 
             for (auto& instruction : block.instructions()) {
-                // ================================
-                // QUICK PATH OPTIMISATION (don't move a register into itself)
-                // ================================
-                if (
-                    instruction.opcode() == +x86_64::Opcode::Move
-                    and is_reg_reg(instruction)
-                ) {
-                    auto [lhs, rhs] = extract_reg_reg(instruction);
-                    if (lhs.value == rhs.value)
-                        continue;
-                }
-                // ================================
-                // QUICK PATH OPTIMISATION (simple jump threading)
-                // ================================
-                if (
-                    &block != &function.blocks().back()
-                    and instruction.opcode() == +x86_64::Opcode::Jump
-                    and is_block(instruction)
-                ) {
-                    auto* target_block = extract_block(instruction);
-                    auto next_block = function.blocks().at(usz(block_index + 1));
-                    if (target_block->name() == next_block.name())
-                        continue;
-                }
-
                 // ================================
                 // CONFIDENCE CHECK (moves between registers must match sizes)
                 // ================================
@@ -301,19 +389,39 @@ void emit_gnu_att_assembly(
                 // ================================
                 if (instruction.opcode() == +x86_64::Opcode::Return) {
                     // Function Footer
-                    // TODO: Different stack frame kinds.
-                    out +=
-                        "    mov %rbp, %rsp\n"
-                        "    pop %rbp\n";
-
-                    // Update CFA expression since 16(%rbp) is no longer accurate.
-                    out += "    .cfi_def_cfa %rsp, 8\n";
-
-                } else if (instruction.opcode() == +x86_64::Opcode::Call) {
-                    // Save return register, if necessary.
-                    // TODO: CFA `.cfi_offset`
-                    if (instruction.reg() != desc.return_register)
-                        out += fmt::format("    push %{}\n", ToString(x86_64::RegisterId(desc.return_register)));
+                    // Code may follow a return, so the unwind information
+                    // of the body is restored after it.
+                    out.write("    .cfi_remember_state\n");
+                    if (frame.has_base_pointer()) {
+                        for (auto reg : frame.saved | vws::reverse)
+                            out.write("    pop %{}\n", ToString(x86_64::RegisterId(reg)));
+                        out.write(
+                            "    mov %rbp, %rsp\n"
+                            "    pop %rbp\n"
+                        );
+
+                        // Update CFA expression since 16(%rbp) is no longer accurate.
+                        out.write("    .cfi_def_cfa %rsp, 8\n");
+                    } else {
+                        usz cfa_offset = 8 + 8 * frame.saved.size();
+                        if (frame.size) {
+                            out.write(
+                                "    add ${}, %rsp\n"
+                                "    .cfi_def_cfa_offset {}\n",
+                                frame.size,
+                                cfa_offset
+                            );
+                        }
+                        for (auto reg : frame.saved | vws::reverse) {
+                            cfa_offset -= 8;
+                            out.write(
+                                "    pop %{}\n"
+                                "    .cfi_def_cfa_offset {}\n",
+                                ToString(x86_64::RegisterId(reg)),
+                                cfa_offset
+                            );
+                        }
+                    }
                 }
 
                 // ================================
@@ -323,7 +431,7 @@ void emit_gnu_att_assembly(
                     auto loc = instruction.location();
                     if (loc.is_valid() and not loc.equal_position(last_location)) {
                         auto l = loc.seek_line_column(module->context());
-                        out += fmt::format(
+                        out.write(
                             "    .loc {} {} {}\n",
                             loc.file_id,
                             l.line,
@@ -336,55 +444,45 @@ void emit_gnu_att_assembly(
                 // ================================
                 // INSTRUCTION MNEMONIC
                 // ================================
-                out += "    ";
-                out += ToString(Opcode(instruction.opcode()));
+                out.write("    ");
+                out.write(ToString(Opcode(instruction.opcode())));
 
                 // ================================
-                // CUSTOM OPERAND HANDLING (dereference register operand on rhs of move)
+                // CUSTOM OPERAND HANDLING (syscall operands are only clobbers)
                 // ================================
-                if (
-                    instruction.opcode() == +x86_64::Opcode::MoveDereferenceRHS
-                    and std::holds_alternative<MOperandRegister>(instruction.get_operand(1))
-                ) {
-                    auto lhs = instruction.get_operand(0);
-                    auto rhs = instruction.get_operand(1);
-
-                    usz offset = 0;
-                    if (instruction.all_operands().size() == 3) {
-                        auto given_offset = instruction.get_operand(2);
-                        LCC_ASSERT(
-                            std::holds_alternative<MOperandImmediate>(given_offset),
-                            "Offset operand of dereferencing move must be an immediate"
-                        );
-                        offset = std::get<MOperandImmediate>(given_offset).value;
-                    }
-
-                    if (offset)
-                        out += fmt::format(" {}, {}({})\n", ToString(function, lhs), offset, ToString(function, rhs));
-                    else out += fmt::format(" {}, ({})\n", ToString(function, lhs), ToString(function, rhs));
+                if (instruction.opcode() == +x86_64::Opcode::Syscall) {
+                    out.write('\n');
                     continue;
                 }
+
                 // ================================
-                // CUSTOM OPERAND HANDLING (dereference register operand on lhs of move)
+                // CUSTOM OPERAND HANDLING (one-operand multiply; RAX is implicit)
                 // ================================
                 if (
-                    instruction.opcode() == +x86_64::Opcode::MoveDereferenceLHS
-                    and std::holds_alternative<MOperandRegister>(instruction.get_operand(0))
+                    instruction.opcode() == +x86_64::Opcode::MultiplyWideUnsigned
+                    or instruction.opcode() == +x86_64::Opcode::MultiplyWideSigned
                 ) {
-                    auto lhs = instruction.get_operand(0);
-                    auto rhs = instruction.get_operand(1);
-                    usz offset = 0;
-                    if (instruction.all_operands().size() == 3) {
-                        auto given_offset = instruction.get_operand(2);
-                        LCC_ASSERT(
-                            std::holds_alternative<MOperandImmediate>(given_offset),
-                            "Offset operand of dereferencing move must be an immediate"
-                        );
-                        offset = std::get<MOperandImmediate>(given_offset).value;
+                    out.write(' ');
+                    out.write_operand(function, frame, instruction.get_operand(0));
+                    out.write('\n');
+                    continue;
+                }
+
+                // ================================
+                // CUSTOM OPERAND HANDLING (memory addressed through a register)
+                // ================================
+                if (Address::Is(instruction)) {
+                    out.write(' ');
+                    if (instruction.opcode() == +x86_64::Opcode::MoveDereferenceRHS) {
+                        out.write_operand(function, frame, instruction.get_operand(0));
+                        out.write(", ");
+                        out.write_address(function, frame, Address::Of(instruction));
+                    } else {
+                        out.write_address(function, frame, Address::Of(instruction));
+                        out.write(", ");
+                        out.write_operand(function, frame, instruction.get_operand(1));
                     }
-                    if (offset)
-                        out += fmt::format(" {}({}), {}\n", offset, ToString(function, lhs), ToString(function, rhs));
-                    else out += fmt::format(" ({}), {}\n", ToString(function, lhs), ToString(function, rhs));
+                    out.write('\n');
                     continue;
                 }
                 // ================================
@@ -404,10 +502,10 @@ void emit_gnu_att_assembly(
 
                             auto bitwidth = std::get<MOperandImmediate>(lhs).size;
                             switch (bitwidth) {
-                                case 64: out += 'q'; break;
-                                case 32: out += 'l'; break;
-                                case 16: out += 'w'; break;
-                                case 8: out += 'b'; break;
+                                case 64: out.write('q'); break;
+                                case 32: out.write('l'); break;
+                                case 16: out.write('w'); break;
+                                case 8: out.write('b'); break;
                                 default: LCC_ASSERT(false, "Invalid move");
                             }
                         }
@@ -419,63 +517,62 @@ void emit_gnu_att_assembly(
                 // ================================
                 usz i = 0;
                 for (auto& operand : instruction.all_operands()) {
-                    if (i == 0) out += ' ';
-                    else out += ", ";
+                    if (i == 0) out.write(' ');
+                    else out.write(", ");
                     // Update 1-bit operations (boolean) to the minimum addressable on x86_64: a byte.
                     if (std::holds_alternative<MOperandRegister>(operand) and std::get<MOperandRegister>(operand).size == 1) {
                         auto tmp = std::get<MOperandRegister>(operand);
                         tmp.size = 8;
                         operand = tmp;
                     }
-                    out += ToString(function, operand);
+                    out.write_operand(function, frame, operand);
                     ++i;
                 }
-                out += '\n';
+                out.write('\n');
 
                 // ================================
                 // INSTRUCTION EPILOGUE (some insts have instructions following)
                 // ================================
+                if (instruction.opcode() == +x86_64::Opcode::Return)
+                    out.write("    .cfi_restore_state\n");
+
                 if (instruction.opcode() == +x86_64::Opcode::Call) {
                     // Move return value from return register to result register, if necessary.
-                    // Also restore return register, if necessary.
+                    // Nothing that is live across the call is allocated to the return
+                    // register, so there is no need to save it.
                     if (instruction.use_count() and instruction.reg() and instruction.reg() != desc.return_register) {
-                        out += fmt::format(
+                        out.write(
                             "    mov %{}, %{}\n",
                             ToString(x86_64::RegisterId(desc.return_register), instruction.regsize()),
                             ToString(x86_64::RegisterId(instruction.reg()), instruction.regsize())
                         );
-                        out += fmt::format("    pop %{}\n", ToString(x86_64::RegisterId(desc.return_register)));
                     }
                 }
             }
         }
 
-        out += fmt::format("    .cfi_endproc\n");
+        out.write("    .cfi_endproc\n");
 
-        for (auto n : function.names()) {
+        for (const auto& n : function.names()) {
             if (IsExportedLinkage(n.linkage))
-                out += fmt::format("    .size {}, .-{}\n", n.name, n.name);
+                out.write("    .size {}, .-{}\n", n.name, n.name);
         }
     }
 
     for (auto& section : module->extra_sections()) {
-        out += fmt::format(".section {}\n", section.name);
+        out.write(".section {}\n", section.name);
         LCC_ASSERT(not section.is_fill, "Sorry, haven't handled fill extra sections");
         if (section.contents().empty()) continue;
-        const auto write_byte = [&](u8 byte) {
-            return fmt::format("0x{:x}", byte);
-        };
-        out += fmt::format(
-            ".byte {}\n",
-            fmt::join(vws::transform(section.contents(), write_byte), ",")
-        );
+        out.write(".byte ");
+        for (auto [i, byte] : vws::enumerate(section.contents())) {
+            if (i) out.write(',');
+            out.write("0x{:x}", byte);
+        }
+        out.write('\n');
     }
 
-    out += ".section .note.GNU-stack\n";
-
-    if (output_path == "-")
-        fmt::print("{}", out);
-    else File::WriteOrTerminate(out.data(), out.size(), output_path);
+    out.write(".section .note.GNU-stack\n");
+    out.close();
 }
 
 } // namespace lcc::x86_64
@@ -1,16 +1,23 @@
 #include <lcc/codegen/mir.hh>
 #include <lcc/codegen/mir_utils.hh>
+#include <lcc/codegen/register_allocation.hh>
 #include <lcc/codegen/x86_64/object.hh>
 #include <lcc/codegen/x86_64/x86_64.hh>
 #include <lcc/context.hh>
 #include <lcc/core.hh>
 #include <lcc/utils.hh>
+#include <lcc/utils/parallel.hh>
 #include <object/generic.hh>
 
 #include <algorithm>
 #include <bit>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
 #include <ranges>
+#include <string_view>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -36,62 +43,24 @@ namespace lcc::x86_64 {
 //     field encodes the register operand of the instruction.
 
 namespace {
-constexpr auto as_bytes(u16 value) -> std::vector<u8> {
-    // 0xffff
-    //   __    upper
-    //     __  lower
-    const u8 upper = u8((value >> 8) & 0xff);
-    const u8 lower = u8((value >> 0) & 0xff);
-    return {lower, upper};
-}
-constexpr auto as_bytes(i16 value) -> std::vector<u8> {
-    return as_bytes(static_cast<u16>(value));
-}
-
-constexpr auto as_bytes(u32 value) -> std::vector<u8> {
-    // 0xffff.ffff
-    // a ____
-    // b      ____
-    const u8 upper_a = u8((value >> 24) & 0xff);
-    const u8 lower_a = u8((value >> 16) & 0xff);
-    const u8 upper_b = u8((value >> 8) & 0xff);
-    const u8 lower_b = u8((value >> 0) & 0xff);
-    return {lower_b, upper_b, lower_a, upper_a};
-}
-constexpr auto as_bytes(i32 value) -> std::vector<u8> {
-    return as_bytes(static_cast<u32>(value));
+/// Append the lowest \p bytes bytes of \p value to \p text, least
+/// significant byte first; immediates and displacements are encoded this
+/// way.
+void mcode_bytes(Section& text, u64 value, usz bytes) {
+    auto& contents = text.contents();
+    for (usz i = 0; i < bytes; ++i)
+        contents.push_back(u8(value >> (8 * i)));
 }
 
-constexpr auto as_bytes(u64 value) -> std::vector<u8> {
-    const u8 upper_a = u8((value >> 56) & 0xff);
-    const u8 lower_a = u8((value >> 48) & 0xff);
-    const u8 upper_b = u8((value >> 40) & 0xff);
-    const u8 lower_b = u8((value >> 32) & 0xff);
-    const u8 upper_c = u8((value >> 24) & 0xff);
-    const u8 lower_c = u8((value >> 16) & 0xff);
-    const u8 upper_d = u8((value >> 8) & 0xff);
-    const u8 lower_d = u8((value >> 0) & 0xff);
-    return {lower_d, upper_d, lower_c, upper_c, lower_b, upper_b, lower_a, upper_a};
-}
-constexpr auto as_bytes(i64 value) -> std::vector<u8> {
-    return as_bytes(static_cast<u64>(value));
-}
-
-constexpr auto as_bytes(MOperandImmediate imm) -> std::vector<u8> {
-    if (imm.size <= 8)
-        return {u8(imm.value)};
-    if (imm.size <= 16)
-        return as_bytes(u16(imm.value));
-    if (imm.size <= 32)
-        return as_bytes(u32(imm.value));
-    if (imm.size <= 64)
-        return as_bytes(u64(imm.value));
-    LCC_UNREACHABLE();
+/// Append an immediate operand that is \p bits wide.
+void mcode_immediate(Section& text, u64 value, usz bits) {
+    mcode_bytes(text, value, std::max<usz>(bits, 8) / 8);
 }
 
-constexpr auto as_bytes_cap32(MOperandImmediate imm) -> std::vector<u8> {
-    if (imm.size > 32) imm.size = 32;
-    return as_bytes(imm);
+template <typename Integer>
+auto fits_in(i64 value) -> bool {
+    return value >= std::numeric_limits<Integer>::min()
+       and value <= std::numeric_limits<Integer>::max();
 }
 } // namespace
 
@@ -255,6 +224,13 @@ static constexpr bool reg_topbit(Register reg) {
     return regbits_top(regbits(RegisterId(reg.value)));
 }
 
+/// Whether a byte register needs a REX prefix, even one with no bits
+/// set: without one, 8-bit encodings 4 through 7 are AH, CH, DH, and BH
+/// rather than SPL, BPL, SIL, and DIL. Booleans (size 1) are bytes too.
+static constexpr bool byte_register_needs_rex(Register reg) {
+    return (reg.size == 1 or reg.size == 8) and (regbits(reg) & 0b111) >= 4;
+}
+
 static constexpr u8 modrm_byte(u8 mod, u8 reg, u8 rm) {
     // Ensure no bits above the amount expected are set.
     LCC_ASSERT((mod & (~0b11)) == 0);
@@ -306,6 +282,57 @@ constexpr bool is_one_of(usz value) {
 
 static constexpr u8 prefix16 = 0x66;
 
+/// Encode the modrm byte, followed by the SIB byte and displacement if
+/// needed, for a memory operand addressed through a register. `reg` is
+/// the reg field of the modrm byte: a register or a /digit.
+///
+/// This handles the special cases of Table 2-5 in Chapter 2, Volume 2
+/// of the Intel SDM: RSP and R12 as base require a SIB byte, and RBP
+/// and R13 as base require a displacement, as mod = 0b00 means there
+/// is no base register with them.
+static void mcode_address(Section& text, u8 reg, const Address& address) {
+    u8 base = regbits(address.base);
+    LCC_ASSERT(
+        address.displacement >= std::numeric_limits<i32>::min()
+            and address.displacement <= std::numeric_limits<i32>::max(),
+        "x86_64: Address displacement {} does not fit in 32 bits",
+        address.displacement
+    );
+
+    u8 mod = 0b10;
+    if (address.displacement == 0 and (base & 0b111) != 0b101) mod = 0b00;
+    else if (address.displacement >= -128 and address.displacement <= 127) mod = 0b01;
+
+    if (address.index or (base & 0b111) == 0b100) {
+        // An index of 0b100 (without REX.X) means there is no index.
+        u8 index = 0b100;
+        u8 scale = 0;
+        if (address.index) {
+            index = regbits(*address.index);
+            LCC_ASSERT(index != 0b100, "x86_64: RSP cannot be used as an index register");
+            scale = u8(std::countr_zero(address.scale));
+        }
+        text += {modrm_byte(mod, reg, 0b100), sib_byte(scale, index, base)};
+    } else text += modrm_byte(mod, reg, base);
+
+    if (mod == 0b01) text += u8(i8(address.displacement));
+    else if (mod == 0b10) mcode_bytes(text, u64(address.displacement), 4);
+}
+
+/// Like `opcode_slash_r`, but with a memory operand addressed through a
+/// register in the r/m field. `op` is the final opcode byte, chosen by
+/// the caller according to the size of `reg`.
+static void opcode_slash_r_address(Section& text, u8 op, Register reg, const Address& address) {
+    bool x = address.index and reg_topbit(*address.index);
+    bool b = reg_topbit(address.base);
+
+    if (reg.size == 16) text += prefix16;
+    if (reg.size == 64 or reg_topbit(reg) or x or b or byte_register_needs_rex(reg))
+        text += rex_byte(reg.size == 64, reg_topbit(reg), x, b);
+    text += op;
+    mcode_address(text, regbits(reg), address);
+}
+
 // /r means register and r/m operand referenced by modrm.
 // Pattern must be:
 //           0x88 /r
@@ -361,16 +388,63 @@ static void opcode_slash_r(
 
         u8 modrm = modrm_byte(0b11, regbits(src), regbits(dst));
 
+        bool byte_needs_rex = byte_register_needs_rex(src) or byte_register_needs_rex(dst);
+
         if (src.size == 16) text += prefix16;
-        if (src.size == 64 or reg_topbit(src) or reg_topbit(dst))
+        if (src.size == 64 or reg_topbit(src) or reg_topbit(dst) or byte_needs_rex)
             text += rex_byte(src.size == 64, reg_topbit(src), false, reg_topbit(dst));
         text += {op, modrm};
     }
 }
 
+/// Encode one of the arithmetic and logic instructions that share the
+/// "0x80/0x81/0x83 /digit" immediate forms, applied to a register, in
+/// the shortest form for the value of the immediate.
+///
+/// GNU syntax (src, dst operands)
+///    REX 0x80 /digit ib | OP imm8, r/m8   | MI
+///   0x66 0x83 /digit ib | OP imm8, r/m16  | MI
+///        0x83 /digit ib | OP imm8, r/m32  | MI
+///  REX.W 0x83 /digit ib | OP imm8, r/m64  | MI
+///   0x66 0x81 /digit iw | OP imm16, r/m16 | MI
+///        0x81 /digit id | OP imm32, r/m32 | MI
+///  REX.W 0x81 /digit id | OP imm32, r/m64 | MI
+/// An imm8 is sign-extended to the size of the register, as is an imm32
+/// to a 64-bit register. When the value doesn't fit in an imm8 and the
+/// register is the accumulator, the form without a modrm byte,
+/// `(digit << 3) | 0b101` (or `0b100` for AL), is one byte shorter.
+static void mcode_alu_imm_reg(Section& text, u8 opcode_extension, MOperandImmediate imm, Register reg, MInst& inst) {
+    usz size = reg.size == 1 ? 8 : reg.size;
+    LCC_ASSERT((is_one_of<8, 16, 32, 64>(size)), "x86_64: invalid register size");
+
+    auto value = SignedImmediate(imm.value, size);
+    if (size == 64 and not fits_in<i32>(value)) Diag::ICE(
+        "x86_64 cannot encode an immediate that does not fit in 32 bits with a 64-bit register\n    {}\n",
+        PrintMInstImpl(inst, opcode_to_string)
+    );
+
+    bool short_imm = size != 8 and fits_in<i8>(value);
+    bool accumulator = RegisterId(reg.value) == RegisterId::RAX and not short_imm;
+    if (size == 16) text += prefix16;
+    if (size == 64 or reg_topbit(reg) or byte_register_needs_rex(reg))
+        text += rex_byte(size == 64, false, false, reg_topbit(reg));
+
+    if (accumulator) text += u8((opcode_extension << 3) | (size == 8 ? 0b100 : 0b101));
+    else {
+        u8 op = 0x81;
+        if (size == 8) op = 0x80;
+        else if (short_imm) op = 0x83;
+        text += {op, modrm_byte(0b11, opcode_extension, regbits(reg))};
+    }
+
+    if (short_imm) mcode_bytes(text, u64(value), 1);
+    else mcode_immediate(text, u64(value), std::min<usz>(size, 32));
+}
+
 static void assemble_inst(
     GenericObject& gobj,
     MFunction& func,
+    const Frame& frame,
     MInst& inst,
     Section& text
 ) {
@@ -394,7 +468,7 @@ static void assemble_inst(
                 "x86_64 SETcc requires 1-byte operand"
             );
             u8 modrm = modrm_byte(0b11, 0, regbits(reg));
-            if (reg_topbit(reg))
+            if (reg_topbit(reg) or byte_register_needs_rex(reg))
                 text += rex_byte(false, false, false, reg_topbit(reg));
             text += {0x0f, opcode, modrm};
         } else Diag::ICE(
@@ -403,23 +477,69 @@ static void assemble_inst(
         );
     };
 
+    // i.e. called with 0x84, would encode:
+    // 0x0f 0x84 cd | JZ rel32 | D
+    // "D" means offset is encoded after opcode.
+    auto jcc = [&](u8 opcode) {
+        Relocation reloc{};
+        if (is_block(inst)) {
+            reloc.symbol.name = extract_block(inst)->name();
+        } else if (is_function(inst)) {
+            reloc.symbol.kind = Symbol::Kind::FUNCTION;
+            reloc.symbol.name = extract_function(inst)->names().at(0).name;
+        } else Diag::ICE(
+            "Sorry, unhandled form\n    {}\n",
+            PrintMInstImpl(inst, opcode_to_string)
+        );
+
+        text += {0x0f, opcode};
+        // RELOCATION
+        reloc.symbol.byte_offset = text.contents().size();
+        reloc.symbol.section_name = text.name;
+        reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
+        gobj.relocations.push_back(reloc);
+
+        mcode_bytes(text, 0, 4);
+    };
+
     switch (Opcode(inst.opcode())) {
         case Opcode::Return: {
-            // TODO: Stack frame kinds
-            // GNU syntax (src, dst operands)
-            // mov %rbp, %rsp
-            // pop %rbp
-            auto mov_rbp_into_rsp = MInst(usz(Opcode::Move), {0, 0});
-            mov_rbp_into_rsp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
-            mov_rbp_into_rsp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
-            auto pop_rbp = MInst(usz(Opcode::Pop), {0, 0});
-            pop_rbp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
-            assemble_inst(gobj, func, mov_rbp_into_rsp, text);
-            assemble_inst(gobj, func, pop_rbp, text);
+            // Tear down the frame set up by `assemble()`.
+            const auto pop = [&](usz reg) {
+                auto pop_reg = MInst(usz(Opcode::Pop), {0, 0});
+                pop_reg.add_operand(MOperandRegister(reg, 64));
+                assemble_inst(gobj, func, frame, pop_reg, text);
+            };
+            if (frame.has_base_pointer()) {
+                // GNU syntax (src, dst operands)
+                // mov %rbp, %rsp
+                // pop %rbp
+                for (auto reg : frame.saved | vws::reverse) pop(reg);
+                auto mov_rbp_into_rsp = MInst(usz(Opcode::Move), {0, 0});
+                mov_rbp_into_rsp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
+                mov_rbp_into_rsp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
+                assemble_inst(gobj, func, frame, mov_rbp_into_rsp, text);
+                pop(usz(RegisterId::RBP));
+            } else {
+                // GNU syntax (src, dst operands)
+                // add $size, %rsp
+                if (frame.size) {
+                    auto add_rsp = MInst(usz(Opcode::Add), {0, 0});
+                    add_rsp.add_operand(MOperandImmediate(frame.size, 64));
+                    add_rsp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
+                    assemble_inst(gobj, func, frame, add_rsp, text);
+                }
+                for (auto reg : frame.saved | vws::reverse) pop(reg);
+            }
 
             text += 0xc3;
         } break;
 
+        case Opcode::Syscall: {
+            // 0x0f 0x05 | SYSCALL | ZO
+            text += {0x0f, 0x05};
+        } break;
+
         case Opcode::Push: {
             // 0x50+rw  |  PUSH r16  |  O
             // 0x50+rd  |  PUSH r64  |  O
@@ -442,17 +562,19 @@ static void assemble_inst(
                 text += 0x50 + rd_encoding(reg);
             }
             // 0x6a ib  |  PUSH imm8   |  I
-            // 0x68 iw  |  PUSH imm16  |  I
             // 0x68 id  |  PUSH imm32  |  I
+            // Both are sign extended to 64 bits; use the shorter one whenever the
+            // value allows, regardless of the size the immediate was given.
             else if (is_imm(inst)) {
                 auto imm = extract_imm(inst);
+                auto value = SignedImmediate(imm.value, imm.size ? imm.size : 64);
 
-                if (imm.size <= 8)
-                    text += {0x6a, u8(imm.value)};
-                else if (imm.size <= 32) {
+                if (fits_in<i8>(value))
+                    text += {0x6a, u8(value)};
+                else if (fits_in<i32>(value)) {
                     text += 0x68;
-                    text += as_bytes(imm);
-                } else Diag::ICE("x86_64 only supports pushing immediates sized 32, 16, or 8 bits: got {}", imm.size);
+                    mcode_bytes(text, u64(value), 4);
+                } else Diag::ICE("x86_64 can only push immediates that fit in 32 bits: got {}", imm.value);
             } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -490,17 +612,18 @@ static void assemble_inst(
             // "/r" means that register/memory operands are encoded in modrm byte.
             // "MR" means that the source operand goes in reg field of modrm and the
             // destination operand goes in the r/m field.
+            // Moves from a register into itself that can be dropped have
+            // already been removed by the peephole pass; the 32-bit ones
+            // that are left clear the upper half of the register.
             if (is_reg_reg(inst)) {
-                // OPT: Don't emit moves from a register into itself
-                auto [src, dst] = extract_reg_reg(inst);
-                if (src.value != dst.value)
-                    opcode_slash_r(gobj, func, inst, 0x88, text);
+                opcode_slash_r(gobj, func, inst, 0x88, text);
             }
             // GNU syntax (src, dst operands)
-            //        0xb0+rb ib | MOV imm8, r8   | OI
-            //   0x66 0xb8+rw iw | MOV imm16, r16 | OI
-            //        0xb8+rd id | MOV imm32, r32 | OI
-            //  REX.W 0xb8+rd io | MOV imm64, r64 | OI
+            //         0xb0+rb ib | MOV imm8, r8    | OI
+            //    0x66 0xb8+rw iw | MOV imm16, r16  | OI
+            //         0xb8+rd id | MOV imm32, r32  | OI
+            //   REX.W 0xc7 /0 id | MOV imm32, r/m64 | MI // sign extended
+            //   REX.W 0xb8+rd io | MOV imm64, r64  | OI
             // "OI" means source operand is an immediate and destination operand is
             // part of the opcode byte itself (bottom 3 bits).
             else if (is_imm_reg(inst)) {
@@ -513,24 +636,34 @@ static void assemble_inst(
                     "x86_64: invalid register size"
                 );
 
-                // Code size reduction: If immediate is sized larger than 32 bits but it's
-                // value can actually fit into 32 bits, reduce size of immediate and
-                // destination register to 32 bits. Prevents encoding 8 bytes of zeros for
-                // zeroing a register out, for example.
-                if (imm.size > 32 and imm.value <= 0xffffffff) {
-                    imm.size = 32;
-                    dst.size = 32;
+                // The size of the destination register decides the size of the
+                // immediate; the immediate's own size may be anything (or zero).
+                auto size = dst.size == 1 ? 8 : dst.size;
+                auto value = u64(SignedImmediate(imm.value, size));
+
+                // Code size reduction: writing a 32-bit register zeroes the top half of
+                // the 64-bit one, so a value that zero-extends from 32 bits needs only a
+                // 32-bit immediate, and one that sign-extends from 32 bits can use the
+                // sign-extending form. Only anything else needs all eight bytes.
+                if (size == 64) {
+                    if (value <= std::numeric_limits<u32>::max()) size = 32;
+                    else if (fits_in<i32>(i64(value))) {
+                        text += rex_byte(true, false, false, reg_topbit(dst));
+                        text += {0xc7, modrm_byte(0b11, 0, regbits(dst))};
+                        mcode_bytes(text, value, 4);
+                        break;
+                    }
                 }
 
                 u8 op = 0xb8 + rd_encoding(dst);
-                if (dst.size == 1 or dst.size == 8)
+                if (size == 8)
                     op -= 8; // op = 0xb0 + rb_encoding(dst);
 
-                if (dst.size == 16) text += prefix16;
-                if (dst.size == 64 or reg_topbit(dst))
-                    text += rex_byte(dst.size == 64, false, false, reg_topbit(dst));
+                if (size == 16) text += prefix16;
+                if (size == 64 or reg_topbit(dst) or byte_register_needs_rex(dst))
+                    text += rex_byte(size == 64, false, false, reg_topbit(dst));
                 text += op;
-                text += as_bytes(imm);
+                mcode_immediate(text, value, size);
 
             } else Diag::ICE(
                 "Sorry, unhandled form of move\n    {}\n",
@@ -548,7 +681,6 @@ static void assemble_inst(
             // destination operand goes in the r/m field.
             if (is_reg_local(inst)) {
                 auto [reg, local] = extract_reg_local(inst);
-                isz offset = func.local_offset(local);
 
                 LCC_ASSERT((is_one_of<1, 8, 16, 32, 64>(reg.size)));
 
@@ -556,31 +688,17 @@ static void assemble_inst(
                 if (reg.size == 1 or reg.size == 8)
                     op = 0x88;
 
-                u8 modrm = modrm_byte(0b10, regbits(reg), regbits(RegisterId::RBP));
+                opcode_slash_r_address(text, op, reg, frame.address(func, local));
+            } else if (Address::Is(inst) and std::holds_alternative<MOperandRegister>(inst.get_operand(0))) {
+                auto src = std::get<MOperandRegister>(inst.get_operand(0));
 
-                if (reg.size == 16) text += prefix16;
-                if (reg.size == 64 or reg_topbit(reg))
-                    text += rex_byte(reg.size == 64, reg_topbit(reg), false, false);
-                text += {op, modrm};
-                text += as_bytes(i32(offset));
-                // TODO: r12 nonsense
-            } else if (is_reg_reg(inst)) {
-                auto [src, dst] = extract_reg_reg(inst);
-
-                LCC_ASSERT((is_one_of<1, 8, 16, 32, 64>(dst.size)));
+                LCC_ASSERT((is_one_of<1, 8, 16, 32, 64>(src.size)));
 
                 u8 op = 0x89;
-                if (dst.size == 1 or dst.size == 8)
+                if (src.size == 1 or src.size == 8)
                     op = 0x88;
 
-                // TODO: Is 0b11 right here? Wouldn't that mean register to register move?
-                u8 modrm = modrm_byte(0b11, regbits(dst), regbits(src));
-
-                if (dst.size == 16) text += prefix16;
-                if (dst.size == 64 || reg_topbit(src) || reg_topbit(dst))
-                    text += rex_byte(dst.size == 64, reg_topbit(dst), false, reg_topbit(src));
-                text += {op, modrm};
-                // TODO: mcode_sib_if_r12 ??
+                opcode_slash_r_address(text, op, src, Address::Of(inst));
             }
             // GNU syntax (src, dst operands)
             //        0xc6 /0 ib | MOV imm8, r/m8   | MI
@@ -593,22 +711,18 @@ static void assemble_inst(
             // "MI" means that the destination operand goes in the r/m field.
             else if (is_imm_local(inst)) {
                 auto [imm, local] = extract_imm_local(inst);
-                isz offset = func.local_offset(local);
 
                 u8 op = 0xc7;
                 if (imm.size <= 8)
                     op = 0xc6;
 
-                u8 modrm = modrm_byte(0b10, 0, regbits(RegisterId::RBP));
-
                 if (imm.size > 8 and imm.size <= 16)
                     text += prefix16;
-                if (imm.size > 32 or reg_topbit(RegisterId::RBP))
-                    text += rex_byte(imm.size > 32, reg_topbit(RegisterId::RBP), false, false);
-                text += {op, modrm};
-                // modrm 0b10 disp32 offset
-                text += as_bytes(i32(offset));
-                text += as_bytes_cap32(imm);
+                if (imm.size > 32)
+                    text += rex_byte(true, false, false, false);
+                text += op;
+                mcode_address(text, 0, frame.address(func, local));
+                mcode_immediate(text, imm.value, std::min<usz>(imm.size, 32));
             } else Diag::ICE(
                 "Sorry, unhandled form of move (deref rhs)\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -625,7 +739,6 @@ static void assemble_inst(
             // the destination operand is in the reg field of the modrm byte.
             if (is_local_reg(inst)) {
                 auto [local, reg] = extract_local_reg(inst);
-                isz offset = func.local_offset(local);
 
                 LCC_ASSERT((is_one_of<1, 8, 16, 32, 64>(reg.size)));
 
@@ -633,13 +746,7 @@ static void assemble_inst(
                 if (reg.size == 1 or reg.size == 8)
                     op = 0x8a;
 
-                u8 modrm = modrm_byte(0b10, regbits(reg), regbits(RegisterId::RBP));
-
-                if (reg.size == 16) text += prefix16;
-                if (reg.size == 64 or reg_topbit(reg))
-                    text += rex_byte(reg.size == 64, reg_topbit(reg), false, false);
-                text += {op, modrm};
-                text += as_bytes(i32(offset));
+                opcode_slash_r_address(text, op, reg, frame.address(func, local));
             } else if (is_global_reg(inst)) {
                 auto [global, dst] = extract_global_reg(inst);
 
@@ -668,9 +775,9 @@ static void assemble_inst(
                 reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
                 gobj.relocations.push_back(reloc);
 
-                text += as_bytes(u32(0));
-            } else if (is_reg_reg(inst)) {
-                auto [src, dst] = extract_reg_reg(inst);
+                mcode_bytes(text, 0, 4);
+            } else if (Address::Is(inst) and std::holds_alternative<MOperandRegister>(inst.get_operand(1))) {
+                auto dst = std::get<MOperandRegister>(inst.get_operand(1));
 
                 LCC_ASSERT((is_one_of<1, 8, 16, 32, 64>(dst.size)));
 
@@ -678,14 +785,7 @@ static void assemble_inst(
                 if (dst.size == 1 or dst.size == 8)
                     op = 0x8a;
 
-                u8 modrm = modrm_byte(0b11, regbits(dst), regbits(src));
-
-                if (dst.size == 16) text += prefix16;
-                if (dst.size == 64 || reg_topbit(src) || reg_topbit(dst))
-                    text += rex_byte(dst.size == 64, reg_topbit(dst), false, reg_topbit(src));
-                text += {op, modrm};
-                // TODO: mcode_sib_if_r12 ??
-
+                opcode_slash_r_address(text, op, dst, Address::Of(inst));
             } else Diag::ICE(
                 "Sorry, unhandled form of move (deref lhs)\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -693,16 +793,39 @@ static void assemble_inst(
         } break;
 
         case Opcode::ShiftLeft:
+        case Opcode::ShiftRightLogical:
         case Opcode::ShiftRightArithmetic: {
             // /digit where digit is:
             //     ShiftLeft:            /4
+            //     ShiftRightLogical:    /5
             //     ShiftRightArithmetic: /7
             //
-            //       0xd2 /4  |  SAL %cl, r/m8   |  MC
-            // 0x66  0xd3 /4  |  SAL %cl, r/m16  |  MC
-            //       0xd3 /4  |  SAL %cl, r/m32  |  MC
-            // REX.W 0xd3 /4  |  SAL %cl, r/m64  |  MC
-            if (is_reg_reg(inst)) {
+            //       0xd2 /4     |  SAL %cl, r/m8     |  MC
+            // 0x66  0xd3 /4     |  SAL %cl, r/m16    |  MC
+            //       0xd3 /4     |  SAL %cl, r/m32    |  MC
+            // REX.W 0xd3 /4     |  SAL %cl, r/m64    |  MC
+            //       0xc0 /4 ib  |  SAL imm8, r/m8    |  MI
+            //       0xc1 /4 ib  |  SAL imm8, r/m32   |  MI (etc.)
+            //       0xd0 /4     |  SAL $1, r/m8      |  M1
+            //       0xd1 /4     |  SAL $1, r/m32     |  M1 (etc.)
+            u8 opcode_extension = 4;
+            if (inst.opcode() == +Opcode::ShiftRightLogical) opcode_extension = 5;
+            else if (inst.opcode() == +Opcode::ShiftRightArithmetic) opcode_extension = 7;
+
+            if (is_imm_reg(inst)) {
+                auto [imm, dst] = extract_imm_reg(inst);
+                usz size = dst.size == 1 ? 8 : dst.size;
+                LCC_ASSERT((is_one_of<8, 16, 32, 64>(size)), "x86_64: Invalid register size: got {}", dst.size);
+
+                u8 op = imm.value == 1 ? 0xd1 : 0xc1;
+                if (size == 8) op -= 1;
+
+                if (size == 16) text += prefix16;
+                if (size == 64 or reg_topbit(dst) or byte_register_needs_rex(dst))
+                    text += rex_byte(size == 64, false, false, reg_topbit(dst));
+                text += {op, modrm_byte(0b11, opcode_extension, regbits(dst))};
+                if (imm.value != 1) text += u8(imm.value);
+            } else if (is_reg_reg(inst)) {
                 auto [src, dst] = extract_reg_reg(inst);
 
                 LCC_ASSERT(
@@ -721,13 +844,10 @@ static void assemble_inst(
                 if (dst.size == 1 or dst.size == 8)
                     op = 0xd2;
 
-                u8 opcode_extension = 4;
-                if (inst.opcode() == +Opcode::ShiftRightArithmetic)
-                    opcode_extension = 7;
                 u8 modrm = modrm_byte(0b11, opcode_extension, regbits(dst));
 
                 if (dst.size == 16) text += prefix16;
-                if (dst.size == 64 or reg_topbit(dst))
+                if (dst.size == 64 or reg_topbit(dst) or byte_register_needs_rex(dst))
                     text += rex_byte(dst.size == 64, false, false, reg_topbit(dst));
                 text += {op, modrm};
             } else Diag::ICE(
@@ -766,11 +886,10 @@ static void assemble_inst(
                 reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
                 gobj.relocations.push_back(reloc);
 
-                text += as_bytes(u32(0));
+                mcode_bytes(text, 0, 4);
 
             } else if (is_local_reg(inst)) {
                 auto [local, reg] = extract_local_reg(inst);
-                isz offset = func.local_offset(local);
 
                 LCC_ASSERT(
                     (is_one_of<16, 32, 64>(reg.size)),
@@ -778,15 +897,17 @@ static void assemble_inst(
                     reg.size
                 );
 
-                u8 op = 0x8d;
+                opcode_slash_r_address(text, 0x8d, reg, frame.address(func, local));
+            } else if (Address::Is(inst) and std::holds_alternative<MOperandRegister>(inst.get_operand(1))) {
+                auto dst = std::get<MOperandRegister>(inst.get_operand(1));
 
-                u8 modrm = modrm_byte(0b10, regbits(reg), regbits(RegisterId::RBP));
+                LCC_ASSERT(
+                    (is_one_of<16, 32, 64>(dst.size)),
+                    "x86_64 lea only supports 16, 32, or 64 bit register destination operand: got {}",
+                    dst.size
+                );
 
-                if (reg.size == 16) text += prefix16;
-                if (reg.size == 64 || reg_topbit(reg))
-                    text += rex_byte(reg.size == 64, reg_topbit(reg), false, false);
-                text += {op, modrm};
-                text += as_bytes(i32(offset));
+                opcode_slash_r_address(text, 0x8d, dst, Address::Of(inst));
             } else Diag::ICE(
                 "Sorry, invalid form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -809,8 +930,16 @@ static void assemble_inst(
                 reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
                 gobj.relocations.push_back(reloc);
 
-                text += as_bytes(u32(0));
+                mcode_bytes(text, 0, 4);
 
+                // Move the return value from the return register to the result
+                // register, if necessary, just like the assembly writer does.
+                if (inst.use_count() and inst.reg() and inst.reg() != +RegisterId::RAX) {
+                    auto move = MInst(usz(Opcode::Move), {0, 0});
+                    move.add_operand(MOperandRegister(+RegisterId::RAX, uint(inst.regsize())));
+                    move.add_operand(MOperandRegister(inst.reg(), uint(inst.regsize())));
+                    assemble_inst(gobj, func, frame, move, text);
+                }
             } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -826,7 +955,15 @@ static void assemble_inst(
             // "MR" means that the source operand goes in reg field of modrm and the
             // destination operand goes in the r/m field.
             if (is_reg_reg(inst)) opcode_slash_r(gobj, func, inst, 0x38, text);
-            else Diag::ICE(
+            // GNU syntax (src, dst operands)
+            //   REX 0x80 /7 ib | CMP imm8, r/m8   | MI
+            //       0x83 /7 ib | CMP imm8, r/m32  | MI
+            //       0x81 /7 id | CMP imm32, r/m32 | MI
+            // See `mcode_alu_imm_reg()` for the rest.
+            else if (is_imm_reg(inst)) {
+                auto [imm, reg] = extract_imm_reg(inst);
+                mcode_alu_imm_reg(text, 7, imm, reg, inst);
+            } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
             );
@@ -906,8 +1043,8 @@ static void assemble_inst(
             break;
 
         case Opcode::Jump: {
-            // Just do 32-bit for now. Could technically do smaller jumps if we know we
-            // aren't jumping far.
+            // Jumps to blocks are shrunk to their rel8 form, where they fit, once the
+            // whole function is assembled (see `relax_branches()`).
             // 0xe9 cd | JMP rel32 | D
             // "D" means offset is encoded after opcode.
             if (is_block(inst)) {
@@ -922,7 +1059,7 @@ static void assemble_inst(
                 reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
                 gobj.relocations.push_back(reloc);
 
-                text += as_bytes(u32(0));
+                mcode_bytes(text, 0, 4);
             } else if (is_function(inst)) {
                 auto function = extract_function(inst);
 
@@ -936,50 +1073,95 @@ static void assemble_inst(
                 reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
                 gobj.relocations.push_back(reloc);
 
-                text += as_bytes(u32(0));
+                mcode_bytes(text, 0, 4);
             } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
             );
         } break;
 
-        case Opcode::JumpIfZeroFlag: {
-            // Just do 32-bit for now. Could technically do smaller jumps if we know we
-            // aren't jumping far.
-            // 0x0f 0x84 cd | JZ rel32 | D
-            if (is_block(inst)) {
-                auto block = extract_block(inst);
+        // Shrunk to rel8 form, where it fits, by `relax_branches()`.
+        // 0x0f 0x84 cd | JZ rel32 | D
+        case Opcode::JumpIfZeroFlag:
+        case Opcode::JumpIfEqual:
+            jcc(0x84);
+            break;
 
-                text += {0x0f, 0x84};
-                // RELOCATION
-                Relocation reloc{};
-                reloc.symbol.kind = Symbol::Kind::FUNCTION;
-                reloc.symbol.byte_offset = text.contents().size();
-                reloc.symbol.name = block->name();
-                reloc.symbol.section_name = text.name;
-                reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
-                gobj.relocations.push_back(reloc);
+        // 0x0f 0x85 cd | JNZ rel32 | D
+        case Opcode::JumpIfNotZeroFlag:
+        case Opcode::JumpIfNotEqual:
+            jcc(0x85);
+            break;
 
-                text += as_bytes(u32(0));
-            } else if (is_function(inst)) {
-                auto function = extract_function(inst);
+        // 0x0f 0x88 cd | JS rel32 | D
+        case Opcode::JumpIfSignFlag:
+            jcc(0x88);
+            break;
 
-                text += {0x0f, 0x84};
-                // RELOCATION
-                Relocation reloc{};
-                reloc.symbol.kind = Symbol::Kind::FUNCTION;
-                reloc.symbol.byte_offset = text.contents().size();
-                reloc.symbol.name = function->names().at(0).name;
-                reloc.symbol.section_name = text.name;
-                reloc.kind = Relocation::Kind::DISPLACEMENT32_PCREL;
-                gobj.relocations.push_back(reloc);
+        // 0x0f 0x89 cd | JNS rel32 | D
+        case Opcode::JumpIfNotSignFlag:
+            jcc(0x89);
+            break;
 
-                text += as_bytes(u32(0));
-            } else Diag::ICE(
-                "Sorry, unhandled form\n    {}\n",
-                PrintMInstImpl(inst, opcode_to_string)
-            );
-        } break;
+        // 0x0f 0x80 cd | JO rel32 | D
+        case Opcode::JumpIfOverflowFlag:
+            jcc(0x80);
+            break;
+
+        // 0x0f 0x81 cd | JNO rel32 | D
+        case Opcode::JumpIfNotOverflowFlag:
+            jcc(0x81);
+            break;
+
+        // 0x0f 0x8a cd | JP rel32 | D
+        case Opcode::JumpIfParityFlag:
+            jcc(0x8a);
+            break;
+
+        // 0x0f 0x8b cd | JNP rel32 | D
+        case Opcode::JumpIfNotParityFlag:
+            jcc(0x8b);
+            break;
+
+        // 0x0f 0x82 cd | JB rel32 | D
+        case Opcode::JumpIfLessUnsigned:
+            jcc(0x82);
+            break;
+
+        // 0x0f 0x83 cd | JAE rel32 | D
+        case Opcode::JumpIfEqualOrGreaterUnsigned:
+            jcc(0x83);
+            break;
+
+        // 0x0f 0x86 cd | JBE rel32 | D
+        case Opcode::JumpIfEqualOrLessUnsigned:
+            jcc(0x86);
+            break;
+
+        // 0x0f 0x87 cd | JA rel32 | D
+        case Opcode::JumpIfGreaterUnsigned:
+            jcc(0x87);
+            break;
+
+        // 0x0f 0x8c cd | JL rel32 | D
+        case Opcode::JumpIfLessSigned:
+            jcc(0x8c);
+            break;
+
+        // 0x0f 0x8d cd | JGE rel32 | D
+        case Opcode::JumpIfEqualOrGreaterSigned:
+            jcc(0x8d);
+            break;
+
+        // 0x0f 0x8e cd | JLE rel32 | D
+        case Opcode::JumpIfEqualOrLessSigned:
+            jcc(0x8e);
+            break;
+
+        // 0x0f 0x8f cd | JG rel32 | D
+        case Opcode::JumpIfGreaterSigned:
+            jcc(0x8f);
+            break;
 
         case Opcode::Sub: {
             // GNU syntax (src, dst operands)
@@ -989,29 +1171,13 @@ static void assemble_inst(
             // REX.W 0x29 /r | SUB r64, r/m64 | MR
             if (is_reg_reg(inst)) opcode_slash_r(gobj, func, inst, 0x28, text);
             // GNU syntax (src, dst operands)
-            //   REX 0x80 /5 ib | SUB imm8, r/m8   | IM
-            //       0x81 /5 iw | SUB imm16, r/m16 | IM
-            //       0x81 /5 id | SUB imm32, r/m32 | IM
-            // REX.W 0x81 /5 id | SUB imm32, r/m64 | IM
+            //   REX 0x80 /5 ib | SUB imm8, r/m8   | MI
+            //       0x83 /5 ib | SUB imm8, r/m32  | MI
+            //       0x81 /5 id | SUB imm32, r/m32 | MI
+            // See `mcode_alu_imm_reg()` for the rest.
             else if (is_imm_reg(inst)) {
-                // Possible FIXME: I wrote this after coming back over a year later; there
-                // likely are bugs.
                 auto [imm, reg] = extract_imm_reg(inst);
-
-                if (imm.size > 64) Diag::ICE("Over-large immediate size ({} bits)\n", imm.size);
-
-                u8 op = 0x81;
-                if (imm.size <= 8) op = 0x80;
-
-                u8 opcode_extension = 5;
-                u8 modrm = modrm_byte(0b11, opcode_extension, regbits(reg));
-
-                if (imm.size > 8 and imm.size <= 16)
-                    text += prefix16;
-                if (imm.size <= 8 or imm.size > 32 or reg_topbit(reg))
-                    text += rex_byte(imm.size > 32, reg_topbit(reg), false, false);
-                text += {op, modrm};
-                text += as_bytes_cap32(imm);
+                mcode_alu_imm_reg(text, 5, imm, reg, inst);
             } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
@@ -1025,7 +1191,15 @@ static void assemble_inst(
             //       0x01 /r | ADD r32, r/m32 | MR
             // REX.W 0x01 /r | ADD r64, r/m64 | MR
             if (is_reg_reg(inst)) opcode_slash_r(gobj, func, inst, 0x00, text);
-            else Diag::ICE(
+            // GNU syntax (src, dst operands)
+            //   REX 0x80 /0 ib | ADD imm8, r/m8   | MI
+            //       0x83 /0 ib | ADD imm8, r/m32  | MI
+            //       0x81 /0 id | ADD imm32, r/m32 | MI
+            // See `mcode_alu_imm_reg()` for the rest.
+            else if (is_imm_reg(inst)) {
+                auto [imm, reg] = extract_imm_reg(inst);
+                mcode_alu_imm_reg(text, 0, imm, reg, inst);
+            } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
             );
@@ -1038,7 +1212,155 @@ static void assemble_inst(
             //       0x21 /r | AND r32, r/m32 | MR
             // REX.W 0x21 /r | AND r64, r/m64 | MR
             if (is_reg_reg(inst)) opcode_slash_r(gobj, func, inst, 0x20, text);
-            else Diag::ICE(
+            // GNU syntax (src, dst operands)
+            //   REX 0x80 /4 ib | AND imm8, r/m8   | MI
+            //       0x83 /4 ib | AND imm8, r/m32  | MI
+            //       0x81 /4 id | AND imm32, r/m32 | MI
+            // See `mcode_alu_imm_reg()` for the rest.
+            else if (is_imm_reg(inst)) {
+                auto [imm, reg] = extract_imm_reg(inst);
+                mcode_alu_imm_reg(text, 4, imm, reg, inst);
+            } else Diag::ICE(
+                "Sorry, unhandled form\n    {}\n",
+                PrintMInstImpl(inst, opcode_to_string)
+            );
+        } break;
+
+        case Opcode::Xor: {
+            // GNU syntax (src, dst operands)
+            //       0x30 /r | XOR r8, r/m8   | MR
+            //  0x66 0x31 /r | XOR r16, r/m16 | MR
+            //       0x31 /r | XOR r32, r/m32 | MR
+            // REX.W 0x31 /r | XOR r64, r/m64 | MR
+            if (is_reg_reg(inst)) opcode_slash_r(gobj, func, inst, 0x30, text);
+            // GNU syntax (src, dst operands)
+            //   REX 0x80 /6 ib | XOR imm8, r/m8   | MI
+            //       0x83 /6 ib | XOR imm8, r/m32  | MI
+            //       0x81 /6 id | XOR imm32, r/m32 | MI
+            // See `mcode_alu_imm_reg()` for the rest.
+            else if (is_imm_reg(inst)) {
+                auto [imm, reg] = extract_imm_reg(inst);
+                mcode_alu_imm_reg(text, 6, imm, reg, inst);
+            } else Diag::ICE(
+                "Sorry, unhandled form\n    {}\n",
+                PrintMInstImpl(inst, opcode_to_string)
+            );
+        } break;
+
+        case Opcode::MultiplyWideUnsigned:
+        case Opcode::MultiplyWideSigned: {
+            //  0x66 0xf7 /4 | MUL r/m16  | M
+            //       0xf7 /4 | MUL r/m32  | M
+            // REX.W 0xf7 /4 | MUL r/m64  | M
+            //  0x66 0xf7 /5 | IMUL r/m16 | M
+            //       0xf7 /5 | IMUL r/m32 | M
+            // REX.W 0xf7 /5 | IMUL r/m64 | M
+            // The second operand is the implicit RAX.
+            auto op = inst.get_operand(0);
+            if (not std::holds_alternative<MOperandRegister>(op)) Diag::ICE(
+                "Sorry, unhandled form\n    {}\n",
+                PrintMInstImpl(inst, opcode_to_string)
+            );
+
+            auto reg = std::get<MOperandRegister>(op);
+            LCC_ASSERT(
+                (is_one_of<16, 32, 64>(reg.size)),
+                "x86_64 one-operand multiply requires a 16, 32, or 64 bit operand: got {}",
+                reg.size
+            );
+
+            u8 opcode_extension = Opcode(inst.opcode()) == Opcode::MultiplyWideUnsigned ? 4 : 5;
+            u8 modrm = modrm_byte(0b11, opcode_extension, regbits(reg));
+            if (reg.size == 16) text += prefix16;
+            if (reg.size == 64 or reg_topbit(reg))
+                text += rex_byte(reg.size == 64, false, false, reg_topbit(reg));
+            text += {0xf7, modrm};
+        } break;
+
+        case Opcode::MoveSignExtended:
+        case Opcode::MoveZeroExtended: {
+            // GNU syntax (src, dst operands)
+            //
+            //    [REX] 0x0f 0xbe /r  |  MOVSX r/m8, r16/32/64   |  RM
+            //    [REX] 0x0f 0xbf /r  |  MOVSX r/m16, r32/64     |  RM
+            //    REX.W 0x63 /r       |  MOVSXD r/m32, r64       |  RM
+            //    [REX] 0x0f 0xb6 /r  |  MOVZX r/m8, r16/32/64   |  RM
+            //    [REX] 0x0f 0xb7 /r  |  MOVZX r/m16, r32/64     |  RM
+            //          0x89 /r       |  MOV r32, r/m32          |  MR
+            // The 16-bit destination takes a 0x66 prefix, and the 64-bit one
+            // REX.W. Zero-extending from 32 bits is a plain 32-bit move, as
+            // that clears the top half of the destination.
+            if (not is_reg_reg(inst)) LCC_TODO("Assemble {}\n", PrintMInstImpl(inst, opcode_to_string));
+
+            auto [src, dst] = extract_reg_reg(inst);
+            bool sign = Opcode(inst.opcode()) == Opcode::MoveSignExtended;
+            usz src_size = src.size == 1 ? 8 : src.size;
+            LCC_ASSERT(
+                (is_one_of<8, 16, 32>(src_size) and is_one_of<16, 32, 64>(dst.size) and src_size < dst.size),
+                "x86_64 cannot extend a {} bit register to {} bits",
+                src.size,
+                dst.size
+            );
+
+            if (src_size == 32 and not sign) {
+                if (reg_topbit(src) or reg_topbit(dst))
+                    text += rex_byte(false, reg_topbit(src), false, reg_topbit(dst));
+                text += {0x89, modrm_byte(0b11, regbits(src), regbits(dst))};
+                break;
+            }
+
+            if (dst.size == 16) text += prefix16;
+            if (dst.size == 64 or reg_topbit(src) or reg_topbit(dst) or byte_register_needs_rex(src))
+                text += rex_byte(dst.size == 64, reg_topbit(dst), false, reg_topbit(src));
+
+            if (src_size == 32) text += u8(0x63);
+            else if (sign) text += {0x0f, u8(src_size == 8 ? 0xbe : 0xbf)};
+            else text += {0x0f, u8(src_size == 8 ? 0xb6 : 0xb7)};
+            text += modrm_byte(0b11, regbits(dst), regbits(src));
+        } break;
+
+        case Opcode::Multiply: {
+            // GNU syntax (src, dst operands)
+            //
+            //  [0x66] 0x0f 0xaf /r  |  IMUL r/m16/32, r16/32    |  RM
+            //   REX.W 0x0f 0xaf /r  |  IMUL r/m64, r64          |  RM
+            //  [0x66] 0x6b /r ib    |  IMUL imm8, r16/32        |  RMI
+            //  [0x66] 0x69 /r iw/id |  IMUL imm16/32, r16/32    |  RMI
+            //   REX.W 0x69 /r id    |  IMUL imm32, r64          |  RMI
+            // The immediate forms have three operands; the register is both
+            // of the register operands. There is no 8-bit form.
+            const auto CheckSize = [&](Register dst) {
+                LCC_ASSERT(
+                    (is_one_of<16, 32, 64>(dst.size)),
+                    "x86_64 two-operand multiply requires a 16, 32, or 64 bit register: got {}",
+                    dst.size
+                );
+            };
+
+            if (is_reg_reg(inst)) {
+                auto [src, dst] = extract_reg_reg(inst);
+                CheckSize(dst);
+                if (dst.size == 16) text += prefix16;
+                if (dst.size == 64 or reg_topbit(src) or reg_topbit(dst))
+                    text += rex_byte(dst.size == 64, reg_topbit(dst), false, reg_topbit(src));
+                text += {0x0f, 0xaf, modrm_byte(0b11, regbits(dst), regbits(src))};
+            } else if (is_imm_reg(inst)) {
+                auto [imm, dst] = extract_imm_reg(inst);
+                CheckSize(dst);
+                auto value = SignedImmediate(imm.value, dst.size);
+                if (dst.size == 64 and not fits_in<i32>(value)) Diag::ICE(
+                    "x86_64 cannot encode an immediate that does not fit in 32 bits with a 64-bit register\n    {}\n",
+                    PrintMInstImpl(inst, opcode_to_string)
+                );
+
+                bool short_imm = fits_in<i8>(value);
+                if (dst.size == 16) text += prefix16;
+                if (dst.size == 64 or reg_topbit(dst))
+                    text += rex_byte(dst.size == 64, reg_topbit(dst), false, reg_topbit(dst));
+                text += {u8(short_imm ? 0x6b : 0x69), modrm_byte(0b11, regbits(dst), regbits(dst))};
+                if (short_imm) mcode_bytes(text, u64(value), 1);
+                else mcode_immediate(text, u64(value), std::min<usz>(dst.size, 32));
+            } else Diag::ICE(
                 "Sorry, unhandled form\n    {}\n",
                 PrintMInstImpl(inst, opcode_to_string)
             );
@@ -1046,44 +1368,186 @@ static void assemble_inst(
 
         case Opcode::Not:
         case Opcode::Or:
-        case Opcode::Multiply:
-        case Opcode::MoveSignExtended:
-        case Opcode::MoveZeroExtended:
-        case Opcode::ShiftRightLogical:
             LCC_TODO("Assemble {}\n", PrintMInstImpl(inst, opcode_to_string));
 
         case Opcode::Poison: LCC_UNREACHABLE();
     }
 }
 
-static void assemble(GenericObject& gobj, MFunction& func, Section& text) {
-    // TODO: Stack frame kinds.
-    // GNU syntax (src, dst operands)
-    // push %rbp
-    // mov %rsp, %rbp
-    auto push_rbp = MInst(usz(Opcode::Push), {0, 0});
-    push_rbp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
-    auto mov_rsp_into_rbp = MInst(usz(Opcode::Move), {0, 0});
-    mov_rsp_into_rbp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
-    mov_rsp_into_rbp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
-    assemble_inst(gobj, func, push_rbp, text);
-    assemble_inst(gobj, func, mov_rsp_into_rbp, text);
-
-    // TODO: Different stack frame kinds
-    usz stack_frame_size = rgs::fold_left(
-        vws::transform(func.locals(), [](AllocaInst* l) {
-            return l->allocated_type()->bytes();
-        }),
-        0,
-        std::plus{}
-    );
-    if (stack_frame_size) {
-        constexpr usz alignment = 16;
-        stack_frame_size = utils::AlignTo(stack_frame_size, alignment);
-        auto sub_rsp = MInst(usz(Opcode::Sub), {});
-        sub_rsp.add_operand(MOperandImmediate(stack_frame_size));
-        sub_rsp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
-        assemble_inst(gobj, func, sub_rsp, text);
+/// A jump, or conditional jump, to a block of the function being
+/// assembled.
+struct Branch {
+    /// Offset of the instruction, as assembled in its rel32 form.
+    usz offset;
+
+    /// Condition code (the low nibble of the opcode) of a conditional
+    /// jump, or none for an unconditional one.
+    std::optional<u8> condition;
+
+    /// Offset of the target block, as assembled.
+    usz target;
+
+    /// Whether the branch needs its rel32 form; rel8 otherwise.
+    bool near{false};
+
+    [[nodiscard]]
+    auto rel32_size() const -> usz { return condition ? 6 : 5; }
+
+    [[nodiscard]]
+    auto size() const -> usz { return near ? rel32_size() : 2; }
+};
+
+/// Resolve the branches to blocks of a function that was assembled into
+/// \p text from \p function_offset onwards, encoding each in the shortest
+/// form its displacement fits in.
+///
+/// Branches are assembled in their rel32 form, with a relocation against
+/// the target block. Starting with every branch in its rel8 form, those
+/// whose displacement doesn't fit are grown to their rel32 form until
+/// the layout doesn't change; as branches only ever grow, this is bound
+/// to happen. Other relocations and the block symbols are then moved to
+/// where their bytes end up.
+static void relax_branches(
+    GenericObject& gobj,
+    Section& text,
+    usz function_offset,
+    usz relocations_before,
+    usz symbols_before
+) {
+    // The only symbols added while assembling a function are its blocks.
+    std::unordered_map<std::string_view, usz> blocks{};
+    for (usz i = symbols_before; i < gobj.symbols.size(); ++i)
+        blocks.emplace(gobj.symbols.at(i).name, gobj.symbols.at(i).byte_offset);
+
+    auto& code = text.contents();
+    std::vector<Branch> branches{};
+    std::vector<Relocation> relocations{};
+    for (usz i = relocations_before; i < gobj.relocations.size(); ++i) {
+        auto& reloc = gobj.relocations.at(i);
+        auto block = blocks.find(reloc.symbol.name);
+        if (reloc.symbol.kind == Symbol::Kind::FUNCTION or block == blocks.end()) {
+            relocations.push_back(std::move(reloc));
+            continue;
+        }
+
+        // 0xe9 cd | JMP rel32
+        // 0x0f 0x80+cc cd | Jcc rel32
+        auto at = reloc.symbol.byte_offset;
+        if (code.at(at - 1) == 0xe9) branches.push_back({at - 1, std::nullopt, block->second});
+        else {
+            LCC_ASSERT(
+                code.at(at - 2) == 0x0f and (code.at(at - 1) & 0xf0) == 0x80,
+                "x86_64: relocation against block {} is not a branch",
+                reloc.symbol.name
+            );
+            branches.push_back({at - 2, u8(code.at(at - 1) & 0x0f), block->second});
+        }
+    }
+    gobj.relocations.resize(relocations_before);
+
+    // Bytes saved by all branches before the one at each index, and where an
+    // assembled offset ends up given those savings. Branches are in order.
+    std::vector<usz> saved(branches.size() + 1);
+    const auto moved = [&](usz offset) {
+        auto before = std::lower_bound(
+            branches.begin(),
+            branches.end(),
+            offset,
+            [](const Branch& b, usz o) { return b.offset < o; }
+        );
+        return offset - saved.at(usz(before - branches.begin()));
+    };
+    const auto displacement = [&](const Branch& b) {
+        return isz(moved(b.target)) - isz(moved(b.offset) + b.size());
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (usz i = 0; i < branches.size(); ++i)
+            saved.at(i + 1) = saved.at(i) + branches.at(i).rel32_size() - branches.at(i).size();
+        for (auto& branch : branches) {
+            auto d = displacement(branch);
+            if (
+                not branch.near
+                and (d < std::numeric_limits<i8>::min() or d > std::numeric_limits<i8>::max())
+            ) {
+                branch.near = true;
+                changed = true;
+            }
+        }
+    }
+
+    // Every branch ends up at most as large as it was assembled, so the code
+    // can be moved down in place.
+    usz to = function_offset;
+    usz from = function_offset;
+    for (auto& branch : branches) {
+        std::copy(code.begin() + isz(from), code.begin() + isz(branch.offset), code.begin() + isz(to));
+        to += branch.offset - from;
+        from = branch.offset + branch.rel32_size();
+
+        auto d = displacement(branch);
+        if (branch.near) {
+            // 0xe9 cd | JMP rel32
+            // 0x0f 0x80+cc cd | Jcc rel32
+            if (branch.condition) {
+                code.at(to++) = 0x0f;
+                code.at(to++) = u8(0x80 | *branch.condition);
+            } else code.at(to++) = 0xe9;
+            for (usz i = 0; i < sizeof(i32); ++i)
+                code.at(to++) = u8(u32(i32(d)) >> (8 * i));
+        } else {
+            // 0xeb cb | JMP rel8
+            // 0x70+cc cb | Jcc rel8
+            code.at(to++) = branch.condition ? u8(0x70 | *branch.condition) : u8(0xeb);
+            code.at(to++) = u8(i8(d));
+        }
+    }
+    std::copy(code.begin() + isz(from), code.end(), code.begin() + isz(to));
+    code.resize(to + (code.size() - from));
+
+    for (auto& reloc : relocations) {
+        reloc.symbol.byte_offset = moved(reloc.symbol.byte_offset);
+        gobj.relocations.push_back(std::move(reloc));
+    }
+    for (usz i = symbols_before; i < gobj.symbols.size(); ++i)
+        gobj.symbols.at(i).byte_offset = moved(gobj.symbols.at(i).byte_offset);
+}
+
+static void assemble(GenericObject& gobj, const Frame& frame, MFunction& func, Section& text) {
+    const usz function_offset = text.contents().size();
+    const usz relocations_before = gobj.relocations.size();
+    const usz symbols_before = gobj.symbols.size();
+
+    const auto push = [&](usz reg) {
+        auto push_reg = MInst(usz(Opcode::Push), {0, 0});
+        push_reg.add_operand(MOperandRegister(reg, 64));
+        assemble_inst(gobj, func, frame, push_reg, text);
+    };
+    const auto sub_rsp = [&] {
+        auto sub = MInst(usz(Opcode::Sub), {});
+        sub.add_operand(MOperandImmediate(frame.size, 64));
+        sub.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
+        assemble_inst(gobj, func, frame, sub, text);
+    };
+
+    if (frame.has_base_pointer()) {
+        // GNU syntax (src, dst operands)
+        // push %rbp
+        // mov %rsp, %rbp
+        push(usz(RegisterId::RBP));
+        auto mov_rsp_into_rbp = MInst(usz(Opcode::Move), {0, 0});
+        mov_rsp_into_rbp.add_operand(MOperandRegister(usz(RegisterId::RSP), 64));
+        mov_rsp_into_rbp.add_operand(MOperandRegister(usz(RegisterId::RBP), 64));
+        assemble_inst(gobj, func, frame, mov_rsp_into_rbp, text);
+
+        // Preserved registers are saved below the locals.
+        if (frame.size) sub_rsp();
+        for (auto reg : frame.saved) push(reg);
+    } else {
+        // Preserved registers are saved above the locals.
+        for (auto reg : frame.saved) push(reg);
+        if (frame.size) sub_rsp();
     }
 
     for (auto& block : func.blocks()) {
@@ -1095,8 +1559,10 @@ static void assemble(GenericObject& gobj, MFunction& func, Section& text) {
         );
 
         for (auto& inst : block.instructions())
-            assemble_inst(gobj, func, inst, text);
+            assemble_inst(gobj, func, frame, inst, text);
     }
+
+    relax_branches(gobj, text, function_offset, relocations_before, symbols_before);
 }
 
 auto emit_mcode_gobj(
@@ -1115,30 +1581,39 @@ auto emit_mcode_gobj(
     data_.attribute(Section::Attribute::WRITABLE, true);
     bss_.attribute(Section::Attribute::LOAD, true);
     bss_.attribute(Section::Attribute::WRITABLE, true);
-    out.sections.push_back(text_);
-    out.sections.push_back(data_);
-    out.sections.push_back(bss_);
-
-    // Extra sections (frontend metadata and the like).
+    bss_.is_fill = true;
+    const usz text_index = out.sections.size();
+    out.sections.push_back(std::move(text_));
+    out.sections.push_back(std::move(data_));
+    out.sections.push_back(std::move(bss_));
+
+    // Extra sections (frontend metadata and the like). Emitting the object
+    // is the last thing that happens to the module, so they are moved
+    // rather than copied.
     out.sections.insert(
         out.sections.end(),
-        module->extra_sections().begin(),
-        module->extra_sections().end()
+        std::make_move_iterator(module->extra_sections().begin()),
+        std::make_move_iterator(module->extra_sections().end())
     );
+    module->extra_sections().clear();
 
     Section gnu_stack{};
     gnu_stack.name = ".note.GNU-stack";
-    out.sections.push_back(gnu_stack);
-
-    Section& text = out.section(".text");
-    // Section& data = out.section(".data");
-    // Section& bss = out.section(".bss");
+    out.sections.push_back(std::move(gnu_stack));
 
     for (auto* var : module->vars())
         out.symbols_from_global(var);
 
-    for (auto& func : mir) {
-        for (auto n : func.names()) {
+    // Each function is assembled on its own, into its own `.text`, with
+    // symbols and relocations relative to the start of it; functions
+    // don't refer to each other's code other than through relocations.
+    std::vector<GenericObject> functions(mir.size());
+    ParallelFor(mir.size(), [&](usz i) {
+        auto& func = mir[i];
+        auto& gobj = functions[i];
+        Section& text = gobj.sections.emplace_back(".text");
+
+        for (const auto& n : func.names()) {
             const bool imported = IsImportedLinkage(n.linkage);
             // const bool exported = IsLinkageExported(n.linkage);
 
@@ -1146,23 +1621,43 @@ auto emit_mcode_gobj(
                 Symbol sym{};
                 sym.kind = Symbol::Kind::EXTERNAL;
                 sym.name = n.name;
-                out.symbols.push_back(sym);
+                gobj.symbols.push_back(sym);
             } else {
                 Symbol sym{};
                 sym.kind = Symbol::Kind::FUNCTION;
                 sym.name = n.name;
                 sym.section_name = text.name;
-                sym.byte_offset = text.contents().size();
-                out.symbols.push_back(sym);
+                sym.byte_offset = 0;
+                gobj.symbols.push_back(sym);
             }
         }
 
         // Assemble function into machine code.
-        assemble(out, func, text);
+        assemble(gobj, Frame::Of(module->context(), desc, func), func, text);
+    });
+
+    // Lay the functions out one after the other, in order, so the object
+    // doesn't depend on which thread finished first.
+    Section& text = out.section(text_index);
+    usz text_size{};
+    for (auto& gobj : functions) text_size += gobj.section(0).contents().size();
+    text.contents().reserve(text_size);
+
+    for (auto& gobj : functions) {
+        const usz function_offset = text.contents().size();
+        auto& code = gobj.section(0).contents();
+        text.contents().insert(text.contents().end(), code.begin(), code.end());
+
+        for (auto& sym : gobj.symbols) {
+            if (sym.kind != Symbol::Kind::EXTERNAL) sym.byte_offset += function_offset;
+            out.symbols.push_back(std::move(sym));
+        }
+        for (auto& reloc : gobj.relocations) {
+            reloc.symbol.byte_offset += function_offset;
+            out.relocations.push_back(std::move(reloc));
+        }
     }
 
-    // TODO: Resolve local label ".Lxxxx" relocations.
-
     return out;
 }
 
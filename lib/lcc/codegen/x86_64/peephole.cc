@@ -0,0 +1,355 @@
+#include <lcc/codegen/mir.hh>
+#include <lcc/codegen/mir_utils.hh>
+#include <lcc/codegen/x86_64/peephole.hh>
+#include <lcc/codegen/x86_64/x86_64.hh>
+#include <lcc/utils.hh>
+#include <lcc/utils/statistics.hh>
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace lcc::x86_64 {
+namespace {
+auto SameOperand(const MOperand& a, const MOperand& b) -> bool {
+    if (a.index() != b.index()) return false;
+    if (std::holds_alternative<MOperandRegister>(a)) {
+        auto lhs = std::get<MOperandRegister>(a);
+        auto rhs = std::get<MOperandRegister>(b);
+        return lhs.value == rhs.value and lhs.size == rhs.size;
+    }
+    if (std::holds_alternative<MOperandImmediate>(a)) {
+        auto lhs = std::get<MOperandImmediate>(a);
+        auto rhs = std::get<MOperandImmediate>(b);
+        return lhs.value == rhs.value and lhs.size == rhs.size;
+    }
+    if (std::holds_alternative<MOperandLocal>(a)) {
+        auto lhs = std::get<MOperandLocal>(a);
+        auto rhs = std::get<MOperandLocal>(b);
+        return lhs.index == rhs.index and lhs.offset == rhs.offset;
+    }
+    if (std::holds_alternative<MOperandGlobal>(a))
+        return std::get<MOperandGlobal>(a) == std::get<MOperandGlobal>(b);
+    if (std::holds_alternative<MOperandFunction>(a))
+        return std::get<MOperandFunction>(a) == std::get<MOperandFunction>(b);
+    return std::get<MOperandBlock>(a) == std::get<MOperandBlock>(b);
+}
+
+auto ReadsFlags(const MInst& inst) -> bool {
+    switch (Opcode(inst.opcode())) {
+        case Opcode::JumpIfZeroFlag:
+        case Opcode::JumpIfNotZeroFlag:
+        case Opcode::JumpIfSignFlag:
+        case Opcode::JumpIfNotSignFlag:
+        case Opcode::JumpIfOverflowFlag:
+        case Opcode::JumpIfNotOverflowFlag:
+        case Opcode::JumpIfParityFlag:
+        case Opcode::JumpIfNotParityFlag:
+        case Opcode::JumpIfEqual:
+        case Opcode::JumpIfNotEqual:
+        case Opcode::JumpIfEqualOrLessUnsigned:
+        case Opcode::JumpIfEqualOrLessSigned:
+        case Opcode::JumpIfEqualOrGreaterUnsigned:
+        case Opcode::JumpIfEqualOrGreaterSigned:
+        case Opcode::JumpIfLessUnsigned:
+        case Opcode::JumpIfLessSigned:
+        case Opcode::JumpIfGreaterUnsigned:
+        case Opcode::JumpIfGreaterSigned:
+        case Opcode::SetByteIfEqual:
+        case Opcode::SetByteIfNotEqual:
+        case Opcode::SetByteIfEqualOrLessUnsigned:
+        case Opcode::SetByteIfEqualOrLessSigned:
+        case Opcode::SetByteIfEqualOrGreaterUnsigned:
+        case Opcode::SetByteIfEqualOrGreaterSigned:
+        case Opcode::SetByteIfLessUnsigned:
+        case Opcode::SetByteIfLessSigned:
+        case Opcode::SetByteIfGreaterUnsigned:
+        case Opcode::SetByteIfGreaterSigned:
+            return true;
+
+        default: return false;
+    }
+}
+
+/// Whether an instruction overwrites all of the flags that are read by
+/// the instructions in `ReadsFlags()`. Calls count, as no flags survive
+/// them.
+auto WritesFlags(const MInst& inst) -> bool {
+    switch (Opcode(inst.opcode())) {
+        case Opcode::Compare:
+        case Opcode::Test:
+        case Opcode::Add:
+        case Opcode::Sub:
+        case Opcode::And:
+        case Opcode::Or:
+        case Opcode::Xor:
+        case Opcode::Call:
+            return true;
+
+        default: return false;
+    }
+}
+
+/// Whether the flags after the instruction at `index` may be read later.
+/// Flags are never live across blocks.
+auto FlagsLiveAfter(const std::vector<MInst>& instructions, usz index) -> bool {
+    for (usz i = index + 1; i < instructions.size(); ++i) {
+        if (ReadsFlags(instructions[i])) return true;
+        if (WritesFlags(instructions[i])) return false;
+    }
+    return false;
+}
+
+/// Whether two dereferencing moves access the same address. `load` is a
+/// MoveDereferenceLHS; `other` is either one.
+auto SameAddress(const MInst& load, const MInst& other) -> bool {
+    auto base = Address::BaseOperand(Opcode(other.opcode()));
+    if (load.all_operands().size() != other.all_operands().size()) return false;
+    if (not SameOperand(load.get_operand(0), other.get_operand(base))) return false;
+    for (usz i = Address::DisplacementOperand; i < load.all_operands().size(); ++i)
+        if (not SameOperand(load.get_operand(i), other.get_operand(i))) return false;
+    return true;
+}
+
+/// Index of the operand that holds the register a load writes, or a
+/// store reads.
+auto ValueOperand(const MInst& inst) -> usz {
+    return inst.opcode() == +Opcode::MoveDereferenceLHS ? 1 : 0;
+}
+
+auto ValueRegister(const MInst& inst) -> std::optional<MOperandRegister> {
+    auto op = inst.get_operand(ValueOperand(inst));
+    if (not std::holds_alternative<MOperandRegister>(op)) return std::nullopt;
+    return std::get<MOperandRegister>(op);
+}
+
+/// Whether the address of a load (or store) is computed from `reg`.
+auto AddressUses(const MInst& inst, MOperandRegister reg) -> bool {
+    for (auto [index, op] : vws::enumerate(inst.all_operands())) {
+        if (usz(index) == ValueOperand(inst) or not std::holds_alternative<MOperandRegister>(op)) continue;
+        if (std::get<MOperandRegister>(op).value == reg.value) return true;
+    }
+    return false;
+}
+
+class Peephole {
+    MFunction& _function;
+
+    /// The block being rewritten, and its rewritten instructions so far.
+    std::vector<MInst>* _in{};
+    std::vector<MInst> _out{};
+
+public:
+    explicit Peephole(MFunction& function) : _function(function) {}
+
+    void run() {
+        auto& blocks = _function.blocks();
+        for (usz block_index = 0; block_index < blocks.size(); ++block_index) {
+            auto& block = blocks[block_index];
+            auto* next = block_index + 1 < blocks.size() ? &blocks[block_index + 1] : nullptr;
+
+            _in = &block.instructions();
+            _out.clear();
+            _out.reserve(_in->size());
+            for (usz i = 0; i < _in->size(); ++i) {
+                auto& inst = _in->at(i);
+                if (
+                    not remove_self_move(inst)
+                    and not remove_jump_to(inst, next)
+                    and not remove_reload(inst)
+                    and not merge_immediate_add(inst, i)
+                    and not merge_displacements(inst)
+                    and not zero_with_xor(inst, i)
+                    and not compare_zero_with_test(inst)
+                ) _out.push_back(std::move(inst));
+            }
+
+            block.instructions() = std::move(_out);
+        }
+    }
+
+private:
+    /// mov %r, %r
+    ///
+    /// A 32-bit move into itself clears the upper half of the register,
+    /// so it is not a no-op.
+    auto remove_self_move(MInst& inst) -> bool {
+        if (inst.opcode() != +Opcode::Move or not is_reg_reg(inst)) return false;
+        auto [src, dst] = extract_reg_reg(inst);
+        if (src.value != dst.value or src.size != dst.size or src.size == 32) return false;
+        stats::Count("peephole", "self-moves removed");
+        return true;
+    }
+
+    /// jmp <next block>
+    auto remove_jump_to(MInst& inst, MBlock* next) -> bool {
+        if (not next or inst.opcode() != +Opcode::Jump or not is_block(inst)) return false;
+        if (extract_block(inst)->name() != next->name()) return false;
+        stats::Count("peephole", "jumps to next block removed");
+        return true;
+    }
+
+    /// mov %r, <addr>              mov %r, <addr>
+    /// mov <addr>, %r     -->
+    ///
+    /// mov %r, <addr>              mov %r, <addr>
+    /// mov <addr>, %s     -->      mov %r, %s
+    ///
+    /// mov <addr>, %r              mov <addr>, %r
+    /// mov <addr>, %r     -->
+    auto remove_reload(MInst& inst) -> bool {
+        if (inst.opcode() != +Opcode::MoveDereferenceLHS or _out.empty()) return false;
+        const auto& prev = _out.back();
+        if (prev.opcode() != +Opcode::MoveDereferenceLHS and prev.opcode() != +Opcode::MoveDereferenceRHS) return false;
+        if (not SameAddress(inst, prev)) return false;
+
+        auto dst = ValueRegister(inst);
+        auto value = ValueRegister(prev);
+        if (not dst or not value or dst->size != value->size) return false;
+
+        if (prev.opcode() == +Opcode::MoveDereferenceLHS) {
+            // The first load must not have changed the address.
+            if (dst->value != value->value or AddressUses(prev, *value)) return false;
+            stats::Count("peephole", "reloads removed");
+            return true;
+        }
+
+        if (dst->value != value->value) {
+            auto move = MInst(usz(Opcode::Move), {0, 0});
+            move.location(inst.location());
+            move.add_operand(*value);
+            move.add_operand(*dst);
+            _out.push_back(std::move(move));
+        }
+
+        stats::Count("peephole", "reloads removed");
+        return true;
+    }
+
+    /// add $a, %r
+    /// add $b, %r     -->      add $(a + b), %r
+    ///
+    /// This changes the carry and overflow flags, so the flags must not be
+    /// used afterwards.
+    auto merge_immediate_add(MInst& inst, usz index) -> bool {
+        const auto IsImmediateAdd = [](MInst& i) {
+            return (i.opcode() == +Opcode::Add or i.opcode() == +Opcode::Sub)
+               and is_imm_reg(i);
+        };
+
+        if (_out.empty() or not IsImmediateAdd(inst) or not IsImmediateAdd(_out.back())) return false;
+        auto [imm, reg] = extract_imm_reg(inst);
+        auto [prev_imm, prev_reg] = extract_imm_reg(_out.back());
+        if (reg.value != prev_reg.value or reg.size != prev_reg.size) return false;
+        if (FlagsLiveAfter(*_in, index)) return false;
+
+        const auto Delta = [&](const MInst& i, MOperandImmediate value) {
+            auto delta = u64(SignedImmediate(value.value, reg.size));
+            return i.opcode() == +Opcode::Sub ? u64(0) - delta : delta;
+        };
+
+        // Wrap the sum around at the size of the register, then make sure
+        // its magnitude is encodable as a (sign-extended) 32-bit immediate.
+        auto sum = SignedImmediate(Delta(inst, imm) + Delta(_out.back(), prev_imm), reg.size);
+        if (sum < -i64(std::numeric_limits<i32>::max()) or sum > std::numeric_limits<i32>::max())
+            return false;
+
+        stats::Count("peephole", "immediate adds merged");
+        if (sum == 0) {
+            _out.pop_back();
+            return true;
+        }
+
+        auto merged = MInst(usz(sum < 0 ? Opcode::Sub : Opcode::Add), {0, 0});
+        merged.location(_out.back().location());
+        merged.add_operand(MOperandImmediate{u64(sum < 0 ? -sum : sum), reg.size});
+        merged.add_operand(reg);
+        _out.back() = std::move(merged);
+        return true;
+    }
+
+    /// lea a(%r), %s
+    /// lea b(%s), %s     -->      lea (a + b)(%r), %s
+    ///
+    /// This is what chains of immediate additions to a pointer-sized
+    /// register look like once ISel has turned them into `lea`s.
+    auto merge_displacements(MInst& inst) -> bool {
+        if (_out.empty() or not Address::Is(inst) or not Address::Is(_out.back())) return false;
+        if (inst.opcode() != +Opcode::LoadEffectiveAddress or _out.back().opcode() != +Opcode::LoadEffectiveAddress)
+            return false;
+
+        auto& prev = _out.back();
+        if (not std::holds_alternative<MOperandRegister>(inst.get_operand(1))) return false;
+        if (not SameOperand(inst.get_operand(1), prev.get_operand(1))) return false;
+
+        auto dst = std::get<MOperandRegister>(inst.get_operand(1));
+        auto address = Address::Of(inst);
+        auto merged_address = Address::Of(prev);
+        if (address.index or not SameOperand(address.base, dst)) return false;
+
+        auto displacement = merged_address.displacement + address.displacement;
+        if (displacement < std::numeric_limits<i32>::min() or displacement > std::numeric_limits<i32>::max())
+            return false;
+        merged_address.displacement = displacement;
+
+        auto merged = MInst(usz(Opcode::LoadEffectiveAddress), {0, 0});
+        merged.location(prev.location());
+        merged.add_operand(merged_address.base);
+        merged.add_operand(dst);
+        merged_address.append_to(merged);
+        prev = std::move(merged);
+
+        stats::Count("peephole", "displacements merged");
+        return true;
+    }
+
+    /// mov $0, %r     -->      xor %r, %r
+    ///
+    /// A 32-bit `xor` clears the whole of a 64-bit register, and is shorter.
+    /// Unlike `mov`, it sets the flags, so they must not be used afterwards.
+    auto zero_with_xor(MInst& inst, usz index) -> bool {
+        if (inst.opcode() != +Opcode::Move or not is_imm_reg(inst)) return false;
+        auto [imm, reg] = extract_imm_reg(inst);
+        if (imm.value != 0) return false;
+        if (reg.size != 8 and reg.size != 16 and reg.size != 32 and reg.size != 64) return false;
+        if (FlagsLiveAfter(*_in, index)) return false;
+
+        if (reg.size == 64) reg.size = 32;
+        auto zero = MInst(usz(Opcode::Xor), {0, 0});
+        zero.location(inst.location());
+        zero.add_operand(reg);
+        zero.add_operand(reg);
+        _out.push_back(std::move(zero));
+
+        stats::Count("peephole", "zeroing moves replaced with xor");
+        return true;
+    }
+
+    /// cmp $0, %r     -->      test %r, %r
+    ///
+    /// Both set the flags the same way (other than the auxiliary carry
+    /// flag, which no conditional instruction reads).
+    auto compare_zero_with_test(MInst& inst) -> bool {
+        if (inst.opcode() != +Opcode::Compare or not is_imm_reg(inst)) return false;
+        auto [imm, reg] = extract_imm_reg(inst);
+        if (imm.value != 0) return false;
+
+        auto test = MInst(usz(Opcode::Test), {0, 0});
+        test.location(inst.location());
+        test.add_operand(reg);
+        test.add_operand(reg);
+        _out.push_back(std::move(test));
+
+        stats::Count("peephole", "compares with zero replaced with test");
+        return true;
+    }
+};
+} // namespace
+
+void optimise_peephole(MFunction& function) {
+    Peephole{function}.run();
+}
+
+} // namespace lcc::x86_64
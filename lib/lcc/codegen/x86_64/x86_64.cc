@@ -1,6 +1,9 @@
 #include <lcc/codegen/x86_64/x86_64.hh>
 
 #include <lcc/codegen/mir.hh>
+#include <lcc/context.hh>
+
+#include <algorithm>
 
 namespace lcc::x86_64 {
 
@@ -9,4 +12,297 @@ std::string opcode_to_string(usz opcode) {
         return std::string{ToString(static_cast<Opcode>(opcode))};
     return MInstOpcodeToString(opcode);
 }
+
+auto ReadsOperand(const MInst& inst, usz index) -> bool {
+    switch (Opcode(inst.opcode())) {
+        // Operands exist only for the register allocator.
+        case Opcode::Syscall:
+            return false;
+
+        // Only write their (only) operand.
+        case Opcode::Pop:
+        case Opcode::SetByteIfEqual:
+        case Opcode::SetByteIfNotEqual:
+        case Opcode::SetByteIfEqualOrLessUnsigned:
+        case Opcode::SetByteIfEqualOrLessSigned:
+        case Opcode::SetByteIfEqualOrGreaterUnsigned:
+        case Opcode::SetByteIfEqualOrGreaterSigned:
+        case Opcode::SetByteIfLessUnsigned:
+        case Opcode::SetByteIfLessSigned:
+        case Opcode::SetByteIfGreaterUnsigned:
+        case Opcode::SetByteIfGreaterSigned:
+            return index != 0;
+
+        // Overwrite their destination (the second operand).
+        case Opcode::Move:
+        case Opcode::MoveSignExtended:
+        case Opcode::MoveZeroExtended:
+        case Opcode::MoveDereferenceLHS:
+        case Opcode::LoadEffectiveAddress:
+            return index != 1;
+
+        default: return true;
+    }
+}
+
+auto WritesOperand(const MInst& inst, usz index) -> bool {
+    auto clobbers = inst.operand_clobbers();
+    if (rgs::find(clobbers, index) != clobbers.end()) return true;
+    auto op = inst.get_operand(index);
+    if (std::holds_alternative<MOperandRegister>(op) and std::get<MOperandRegister>(op).defining_use)
+        return true;
+
+    switch (Opcode(inst.opcode())) {
+        // Only read their operands.
+        case Opcode::Poison:
+        case Opcode::Return:
+        case Opcode::Push:
+        case Opcode::Jump:
+        case Opcode::Call:
+        case Opcode::MoveDereferenceRHS:
+        case Opcode::Compare:
+        case Opcode::Test:
+        case Opcode::JumpIfZeroFlag:
+        case Opcode::JumpIfNotZeroFlag:
+        case Opcode::JumpIfSignFlag:
+        case Opcode::JumpIfNotSignFlag:
+        case Opcode::JumpIfOverflowFlag:
+        case Opcode::JumpIfNotOverflowFlag:
+        case Opcode::JumpIfParityFlag:
+        case Opcode::JumpIfNotParityFlag:
+        case Opcode::JumpIfEqual:
+        case Opcode::JumpIfNotEqual:
+        case Opcode::JumpIfEqualOrLessUnsigned:
+        case Opcode::JumpIfEqualOrLessSigned:
+        case Opcode::JumpIfEqualOrGreaterUnsigned:
+        case Opcode::JumpIfEqualOrGreaterSigned:
+        case Opcode::JumpIfLessUnsigned:
+        case Opcode::JumpIfLessSigned:
+        case Opcode::JumpIfGreaterUnsigned:
+        case Opcode::JumpIfGreaterSigned:
+            return false;
+
+        // Clobbered by the kernel.
+        case Opcode::Syscall:
+            return true;
+
+        // One operand, which is written.
+        case Opcode::Pop:
+        case Opcode::Not:
+        case Opcode::SetByteIfEqual:
+        case Opcode::SetByteIfNotEqual:
+        case Opcode::SetByteIfEqualOrLessUnsigned:
+        case Opcode::SetByteIfEqualOrLessSigned:
+        case Opcode::SetByteIfEqualOrGreaterUnsigned:
+        case Opcode::SetByteIfEqualOrGreaterSigned:
+        case Opcode::SetByteIfLessUnsigned:
+        case Opcode::SetByteIfLessSigned:
+        case Opcode::SetByteIfGreaterUnsigned:
+        case Opcode::SetByteIfGreaterSigned:
+            return index == 0;
+
+        // Source, then destination (the rest are address operands).
+        case Opcode::Move:
+        case Opcode::MoveSignExtended:
+        case Opcode::MoveZeroExtended:
+        case Opcode::MoveDereferenceLHS:
+        case Opcode::LoadEffectiveAddress:
+        case Opcode::And:
+        case Opcode::Or:
+        case Opcode::Xor:
+        case Opcode::ShiftRightArithmetic:
+        case Opcode::ShiftRightLogical:
+        case Opcode::ShiftLeft:
+        case Opcode::Add:
+        case Opcode::Multiply:
+        case Opcode::MultiplyWideUnsigned:
+        case Opcode::MultiplyWideSigned:
+        case Opcode::Sub:
+            return index == 1;
+    }
+
+    LCC_UNREACHABLE();
+}
+
+auto SignedImmediate(u64 value, usz bits) -> i64 {
+    auto shift = 64 - std::max<usz>(bits, 8);
+    return i64(value << shift) >> shift;
+}
+
+auto GetMachineDescription(const Target* target) -> MachineDescription {
+    MachineDescription desc{};
+    desc.return_register_to_replace = +RegisterId::RETURN;
+    desc.call_opcode = +Opcode::Call;
+    desc.copy_opcode = +Opcode::Move;
+    desc.load_opcode = +Opcode::MoveDereferenceLHS;
+    desc.store_opcode = +Opcode::MoveDereferenceRHS;
+    desc.address_opcode = +Opcode::LoadEffectiveAddress;
+    desc.reads_operand = ReadsOperand;
+    desc.writes_operand = WritesOperand;
+    // The volatile registers come first, so that preserved ones
+    // (which must be saved and restored) are only used for values
+    // that live across calls, or when the volatile ones run out.
+    if (target->is_cconv_ms()) {
+        desc.return_register = +RegisterId::RAX;
+        desc.registers = {
+            +RegisterId::RAX,
+            +RegisterId::RCX,
+            +RegisterId::RDX,
+            +RegisterId::R8,
+            +RegisterId::R9,
+            +RegisterId::R10,
+            +RegisterId::R11,
+        };
+        desc.preserved_registers = {
+            +RegisterId::RBX,
+            +RegisterId::RSI,
+            +RegisterId::RDI,
+            +RegisterId::R12,
+            +RegisterId::R13,
+            +RegisterId::R14,
+            +RegisterId::R15,
+        };
+    } else {
+        desc.return_register = +RegisterId::RAX;
+        desc.registers = {
+            +RegisterId::RAX,
+            +RegisterId::RCX,
+            +RegisterId::RDX,
+            +RegisterId::RSI,
+            +RegisterId::RDI,
+            +RegisterId::R8,
+            +RegisterId::R9,
+            +RegisterId::R10,
+            +RegisterId::R11,
+        };
+        desc.preserved_registers = {
+            +RegisterId::RBX,
+            +RegisterId::R12,
+            +RegisterId::R13,
+            +RegisterId::R14,
+            +RegisterId::R15,
+        };
+    }
+    desc.registers.insert(
+        desc.registers.end(),
+        desc.preserved_registers.begin(),
+        desc.preserved_registers.end()
+    );
+    return desc;
+}
+
+auto Address::Is(const MInst& inst) -> bool {
+    if (
+        inst.opcode() != +Opcode::MoveDereferenceLHS
+        and inst.opcode() != +Opcode::MoveDereferenceRHS
+        and inst.opcode() != +Opcode::LoadEffectiveAddress
+    ) return false;
+
+    auto base = BaseOperand(Opcode(inst.opcode()));
+    return base < inst.all_operands().size()
+       and std::holds_alternative<MOperandRegister>(inst.all_operands().at(base));
+}
+
+auto Address::Of(const MInst& inst) -> Address {
+    LCC_ASSERT(Is(inst), "Instruction does not access memory through a register");
+    const auto& operands = inst.all_operands();
+
+    Address address{std::get<MOperandRegister>(operands.at(BaseOperand(Opcode(inst.opcode()))))};
+    if (operands.size() > DisplacementOperand) {
+        LCC_ASSERT(
+            std::holds_alternative<MOperandImmediate>(operands.at(DisplacementOperand)),
+            "Offset operand of dereferencing move must be an immediate"
+        );
+        address.displacement = i64(std::get<MOperandImmediate>(operands.at(DisplacementOperand)).value);
+    }
+
+    if (operands.size() > DisplacementOperand + 1) {
+        LCC_ASSERT(
+            operands.size() == DisplacementOperand + 3
+                and std::holds_alternative<MOperandRegister>(operands.at(DisplacementOperand + 1))
+                and std::holds_alternative<MOperandImmediate>(operands.at(DisplacementOperand + 2)),
+            "Indexed address must have an index register and an immediate scale"
+        );
+        address.index = std::get<MOperandRegister>(operands.at(DisplacementOperand + 1));
+        address.scale = u8(std::get<MOperandImmediate>(operands.at(DisplacementOperand + 2)).value);
+        LCC_ASSERT(
+            address.scale == 1 or address.scale == 2 or address.scale == 4 or address.scale == 8,
+            "Invalid scale {} in indexed address",
+            address.scale
+        );
+    }
+
+    return address;
+}
+
+void Address::append_to(MInst& inst) const {
+    LCC_ASSERT(inst.all_operands().size() == DisplacementOperand);
+    if (not displacement and not index) return;
+    inst.add_operand(MOperandImmediate(u64(displacement), 32));
+    if (index) {
+        inst.add_operand(*index);
+        inst.add_operand(MOperandImmediate(scale, 8));
+    }
+}
+auto Frame::Of(const Context* ctx, const MachineDescription& desc, const MFunction& function) -> Frame {
+    Frame frame{};
+    frame.saved = saved_registers(desc, function);
+
+    // Code that pushes, pops, or otherwise accesses %rsp or %rbp itself
+    // (e.g. to pass arguments in memory) needs the base pointer.
+    bool leaf = true;
+    bool touches_frame_registers = false;
+    const auto is_frame_register = [](usz reg) {
+        return reg == +RegisterId::RSP or reg == +RegisterId::RBP;
+    };
+    for (auto& block : function.blocks()) {
+        for (auto& inst : block.instructions()) {
+            if (inst.opcode() == desc.call_opcode) leaf = false;
+            if (
+                inst.opcode() == +Opcode::Push
+                or inst.opcode() == +Opcode::Pop
+                or is_frame_register(inst.reg())
+            ) touches_frame_registers = true;
+            for (auto& op : inst.all_operands()) {
+                if (auto* reg = std::get_if<MOperandRegister>(&op); reg and is_frame_register(reg->value))
+                    touches_frame_registers = true;
+            }
+        }
+    }
+
+    constexpr usz alignment = 16;
+    auto locals = function.frame_size();
+    if (touches_frame_registers) {
+        // %rsp is aligned once %rbp is pushed; pad the frame so that it
+        // stays aligned after pushing the saved registers.
+        frame.size = utils::AlignTo(locals, alignment) + (frame.saved.size() % 2 ? 8 : 0);
+        return frame;
+    }
+
+    // Without a base pointer, %rsp is aligned once the return address and
+    // an odd number of saved registers are pushed.
+    usz padding = frame.saved.size() % 2 ? 0 : 8;
+    if (leaf and not locals) frame.kind = FrameKind::None;
+    else if (leaf and not ctx->target()->is_cconv_ms() and padding + locals <= RedZoneSize)
+        frame.kind = FrameKind::RedZone;
+    else if (ctx->option_omit_frame_pointer()) {
+        frame.kind = FrameKind::StackPointer;
+        frame.size = utils::AlignTo(locals, alignment) + padding;
+    } else frame.size = utils::AlignTo(locals, alignment) + (frame.saved.size() % 2 ? 8 : 0);
+
+    return frame;
+}
+
+auto Frame::address(const MFunction& function, MOperandLocal local) const -> Address {
+    auto offset = function.local_offset(local);
+    if (has_base_pointer()) return {MOperandRegister(+RegisterId::RBP, 64), offset};
+
+    // Local offsets are relative to where %rbp would point: 16 bytes below
+    // the CFA for parameters, and the aligned address below the saved
+    // registers for locals.
+    auto pushed = isz(8 * saved.size());
+    if (local.index == MOperandLocal::absolute_index) offset += isz(size) + pushed - 8;
+    else offset += isz(size) - (saved.size() % 2 ? 0 : 8);
+    return {MOperandRegister(+RegisterId::RSP, 64), offset};
+}
 } // namespace lcc::x86_64
@@ -806,6 +806,18 @@ struct LCCIRPrinter : IRPrinter<LCCIRPrinter, 2> {
                         );
                         return;
                     }
+
+                    case IntrinsicKind::SystemCall: {
+                        PrintTemp(i);
+                        Print(
+                            "intrinsic {}@syscall{}({}{})",
+                            C(Green),
+                            C(Red),
+                            fmt::join(vws::transform(operands, [&](Value* v) { return Val(v); }), fmt::format("{}, ", C(Red))),
+                            C(Red)
+                        );
+                        return;
+                    }
                 }
             }
 
@@ -1076,7 +1088,7 @@ struct LCCIRPrinter : IRPrinter<LCCIRPrinter, 2> {
                         return Format("intrinsic.memset");
 
                     case IntrinsicKind::SystemCall:
-                        return Format("intrinsic.syscall");
+                        return Format("{}%{}", C(TempColour), Index(intrinsic));
                 }
                 LCC_UNREACHABLE();
             }
@@ -1194,7 +1206,7 @@ struct LCCIRPrinter : IRPrinter<LCCIRPrinter, 2> {
                     case IntrinsicKind::MemSet: return false;
 
                     case IntrinsicKind::DebugTrap: return false;
-                    case IntrinsicKind::SystemCall: return true; // ??
+                    case IntrinsicKind::SystemCall: return true;
                 }
             }
 
@@ -1,9 +1,13 @@
 #include <fmt/format.h>
+#include <lcc/calling_conventions/ms_x64.hh>
+#include <lcc/calling_conventions/sysv_x86_64.hh>
 #include <lcc/codegen/isel.hh>
 #include <lcc/codegen/mir.hh>
 #include <lcc/codegen/register_allocation.hh>
+#include <lcc/codegen/stack_slots.hh>
 #include <lcc/codegen/x86_64/assembly.hh>
 #include <lcc/codegen/x86_64/object.hh>
+#include <lcc/codegen/x86_64/peephole.hh>
 #include <lcc/codegen/x86_64/x86_64.hh>
 #include <lcc/context.hh>
 #include <lcc/diags.hh>
@@ -13,6 +17,8 @@
 #include <lcc/target.hh>
 #include <lcc/utils.hh>
 #include <lcc/utils/ir_printer.hh>
+#include <lcc/utils/parallel.hh>
+#include <lcc/utils/statistics.hh>
 #include <object/generic.hh>
 
 #include <algorithm>
@@ -27,6 +33,39 @@ void Module::lower() {
         for (auto function : code()) {
             FunctionType* function_type = as<FunctionType>(function->type());
 
+            const bool sysv = _ctx->target()->is_cconv_sysv();
+            const bool msx64 = _ctx->target()->is_cconv_ms();
+
+            // Add parameter for over-large return types (in-memory ones that alter
+            // function signature). This comes first, as the pointer takes up the
+            // first argument register, leaving one fewer for the other parameters.
+            // SysV is able to return objects <= 16 bytes in two registers, and x64
+            // objects of 1, 2, 4, or 8 bytes in one.
+            bool ret_in_memory = function_type->ret()->bytes() > x86_64::GeneralPurposeBytewidth;
+            if (sysv) ret_in_memory = not cconv::sysv::returns_in_registers(function_type->ret());
+            else if (msx64) ret_in_memory = not cconv::msx64::returns_in_registers(function_type->ret());
+            Value* ret_v_large{nullptr};
+            if (ret_in_memory) {
+                // Prepend parameter to both function value and function type.
+                function_type->params().insert(function_type->params().begin(), Type::PtrTy);
+                function->params().insert(function->params().begin(), new (*this) Parameter{Type::PtrTy, 0});
+                // Update the indices of the rest of the displaced parameters, if any.
+                for (usz i = 1; i < function->params().size(); ++i)
+                    function->params()[i]->index() = u32(i);
+
+                if (function->blocks().size() and function->blocks().at(0)->instructions().size()) {
+                    auto start = function->blocks().at(0);
+                    auto alloca = new (*this) AllocaInst(Type::PtrTy, {});
+                    auto store = new (*this) StoreInst(function->params().at(0), alloca);
+                    start->insert_before(alloca, start->instructions().at(0));
+                    start->insert_after(store, alloca);
+                    ret_v_large = alloca;
+                }
+
+                // Now we should go through and lower all the returns in the function to
+                // instead be a memcpy into this pointer.
+            }
+
             // Memory parameters need their type changed to pointer type.
             //
             // Also cache pointer to local for later use in storing from this
@@ -66,102 +105,137 @@ void Module::lower() {
             //     return (*xptr).a + (*xptr).b;
             // }
             //
+            auto param_description = sysv ? cconv::sysv::parameter_description(function) : cconv::sysv::ParameterDescription{};
             for (size_t param_i{0}; param_i < function_type->params().size(); ++param_i) {
                 auto*& param = function_type->params().at(param_i);
                 // TODO: Calling convention here /may/ be affected by function calling
                 // convention (maybe `function->call_conv()`).
-                // TODO: This isn't a proper check of whether or not a parameter should go
-                // in memory or not. We need to make sure there are registers left, even
-                // if it would fit.
-                bool sysv_memory_param = _ctx->target()->is_cconv_sysv() and param->bytes() > 16;
-                bool x64_memory_param = _ctx->target()->is_cconv_ms() and param->bytes() >= 8;
+                // SysV copies aggregates that don't go in registers onto the stack, where
+                // the callee uses them in place; x64 passes a pointer to a copy instead.
+                bool sysv_memory_param = sysv
+                                     and param->bytes() > x86_64::GeneralPurposeBytewidth
+                                     and param_description.info.at(param_i).kind == cconv::sysv::ParameterClass::MEMORY;
+                bool x64_memory_param = msx64 and not cconv::msx64::passes_in_register(param);
+                if (not sysv_memory_param and not x64_memory_param) continue;
 
                 // TODO: x64 will also use this style lowering when actually passing stack
                 // parameters, not memory parameters.
-                if (sysv_memory_param) {
-                    param = Type::PtrTy;
-                    auto* parameter = function->param(param_i);
-                    for (auto* user : parameter->users()) {
-                        if (auto store = cast<StoreInst>(user)) {
-                            LCC_ASSERT(
-                                is<Parameter>(store->val()),
-                                "Use of memory parameter in destination pointer of store instruction: we don't yet support this, sorry"
+                param = Type::PtrTy;
+                auto* parameter = function->param(param_i);
+                for (auto* user : std::vector(parameter->users())) {
+                    if (auto store = cast<StoreInst>(user)) {
+                        LCC_ASSERT(
+                            is<Parameter>(store->val()),
+                            "Use of memory parameter in destination pointer of store instruction: we don't yet support this, sorry"
+                        );
+                        LCC_ASSERT(
+                            is<AllocaInst>(store->ptr()),
+                            "We only support storing memory parameter into pointer returned by AllocaInst, sorry"
+                        );
+
+                        // Replace uses of store->ptr() with (a copy of) store->val(). A SysV
+                        // memory parameter refers to the memory it is in, while an x64 one
+                        // is the pointer to it.
+                        auto alloca = as<AllocaInst>(store->ptr());
+                        for (auto* pointer_user : std::vector(alloca->users())) {
+                            // Alloca fetched with store->val() is (obviously) used by the store, but
+                            // we don't want to replace the alloca in the store because we are going
+                            // to be removing the store anyway..
+                            if (pointer_user == store) continue;
+
+                            // Replace use of Alloca.
+                            auto copy = new (*this) Parameter(
+                                sysv_memory_param ? parameter->type() : Type::PtrTy,
+                                parameter->index()
                             );
-                            LCC_ASSERT(
-                                is<AllocaInst>(store->ptr()),
-                                "We only support storing memory parameter into pointer returned by AllocaInst, sorry"
-                            );
-
-                            // Replace uses of store->ptr() with (a copy of) store->val()
-                            auto alloca = as<AllocaInst>(store->ptr());
-                            for (auto pointer_user : alloca->users()) {
-                                // Alloca fetched with store->val() is (obviously) used by the store, but
-                                // we don't want to replace the alloca in the store because we are going
-                                // to be removing the store anyway..
-                                if (pointer_user == store) continue;
-
-                                // Replace use of Alloca.
-                                auto copy = new (*this) Parameter(parameter->type(), parameter->index());
-                                pointer_user->replace_children([&](Value* v) -> Value* {
-                                    if (v == alloca) return copy;
-                                    return nullptr;
-                                });
-                            }
-                            // Erase store
-                            store->erase();
-                            alloca->erase();
-
-                        } else LCC_ASSERT(false, "Unhandled instruction type in replacement of users of memory parameter");
-                    }
+                            pointer_user->replace_children([&](Value* v) -> Value* {
+                                if (v == alloca) return copy;
+                                return nullptr;
+                            });
+                        }
+                        // Erase store
+                        store->erase();
+                        alloca->erase();
+
+                    } else LCC_ASSERT(false, "Unhandled instruction type in replacement of users of memory parameter");
                 }
-                // TODO: This lowering should only ever apply to memory parameters that
-                // have their pointer passed in a register.
-                else if (x64_memory_param) {
-                    param = Type::PtrTy;
-                    auto* parameter = function->param(param_i);
-                    for (auto* user : parameter->users()) {
-                        if (auto store = cast<StoreInst>(user)) {
-                            LCC_ASSERT(
-                                is<Parameter>(store->val()),
-                                "Use of memory parameter in destination pointer of store instruction: we don't yet support this, sorry"
-                            );
-                            LCC_ASSERT(
-                                is<AllocaInst>(store->ptr()),
-                                "We only support storing memory parameter into pointer returned by AllocaInst, sorry"
-                            );
+            }
 
-                            LCC_ASSERT(false, "TODO: MSx64 calling convention memory parameter (change alloca to ptr type, insert load before uses of alloca)");
+            // MIR generation loads a SysV argument that goes in multiple registers,
+            // or in memory, from the memory it is in; anything else (the result of
+            // another call, say) is stored into a temporary first. An argument that
+            // x64 passes by reference is copied into a temporary, and a pointer to
+            // that passed instead.
+            const auto temporary = [&](Type* type, Location location) {
+                auto* entry = function->blocks().at(0);
+                auto* alloca = new (*this) AllocaInst(type, location);
+                entry->insert_before(alloca, entry->instructions().at(0));
+                return alloca;
+            };
+            for (auto* block : function->blocks()) {
+                for (auto* instruction : std::vector(block->instructions())) {
+                    auto* call = cast<CallInst>(instruction);
+                    if (not call) continue;
+
+                    auto description = sysv ? cconv::sysv::parameter_description(call) : cconv::sysv::ParameterDescription{};
+                    for (usz arg_i = 0; arg_i < call->args().size(); ++arg_i) {
+                        auto* arg = call->args().at(arg_i);
+                        Value* replacement{nullptr};
+
+                        if (sysv) {
+                            const auto& param = description.info.at(arg_i);
+                            bool from_memory = param.arg_regs > 1
+                                           or (
+                                               param.kind == cconv::sysv::ParameterClass::MEMORY
+                                               and arg->type()->bytes() > x86_64::GeneralPurposeBytewidth
+                                           );
+                            if (not from_memory or is<LoadInst, AllocaInst>(arg)) continue;
+
+                            // Only values that MIR generation knows how to store in multiple
+                            // registers' worth of memory.
+                            if (
+                                arg->type()->bytes() > x86_64::GeneralPurposeBytewidth
+                                and not is<CallInst, Parameter>(arg)
+                            ) continue;
 
-                        } else LCC_ASSERT(false, "Unhandled instruction type in replacement of users of memory parameter");
-                    }
-                }
-            }
+                            auto* alloca = temporary(arg->type(), call->location());
+                            block->insert_before(new (*this) StoreInst(arg, alloca, call->location()), call);
+                            replacement = new (*this) LoadInst(arg->type(), alloca, call->location());
+                            block->insert_before(as<Inst>(replacement), call);
+                        } else if (msx64) {
+                            if (cconv::msx64::passes_in_register(arg->type())) continue;
 
-            // Add parameter for over-large return types (in-memory ones that alter
-            // function signature).
-            // SysV is able to return objects <= 16 bytes in two registers.
-            bool ret_t_tworeg = _ctx->target()->is_cconv_sysv() and function_type->ret()->bytes() > 8 and function_type->ret()->bytes() <= 16;
-            bool ret_t_large = function_type->ret()->bytes() > 8;
-            Value* ret_v_large{nullptr};
-            if (not ret_t_tworeg and ret_t_large) {
-                // Prepend parameter to both function value and function type.
-                function_type->params().insert(function_type->params().begin(), Type::PtrTy);
-                function->params().insert(function->params().begin(), new (*this) Parameter{Type::PtrTy, 0});
-                // Update the indices of the rest of the displaced parameters, if any.
-                for (usz i = 1; i < function->params().size(); ++i)
-                    function->params()[i]->index() = u32(i);
+                            Value* source{nullptr};
+                            auto* load = cast<LoadInst>(arg);
+                            if (load) source = load->ptr();
+                            else if (is<AllocaInst>(arg)) source = arg;
+                            else continue;
 
-                if (function->blocks().size() and function->blocks().at(0)->instructions().size()) {
-                    auto start = function->blocks().at(0);
-                    auto alloca = new (*this) AllocaInst(Type::PtrTy, {});
-                    auto store = new (*this) StoreInst(function->params().at(0), alloca);
-                    start->insert_before(alloca, start->instructions().at(0));
-                    start->insert_after(store, alloca);
-                    ret_v_large = alloca;
+                            auto* alloca = temporary(arg->type(), call->location());
+                            std::vector<Value*> memcpy_operands{
+                                alloca,
+                                source,
+                                new (*this) IntegerConstant(
+                                    IntegerType::Get(context(), x86_64::GeneralPurposeBitwidth),
+                                    arg->type()->bytes()
+                                ) //
+                            };
+                            block->insert_before(
+                                new (*this) IntrinsicInst(IntrinsicKind::MemCopy, memcpy_operands, call->location()),
+                                call
+                            );
+                            replacement = alloca;
+                        }
+
+                        if (not replacement) continue;
+                        call->replace_children([&](Value* v) -> Value* {
+                            if (v == arg) return replacement;
+                            return nullptr;
+                        });
+                        if (auto* load = cast<LoadInst>(arg); load and load->users().empty())
+                            load->erase();
+                    }
                 }
-
-                // Now we should go through and lower all the returns in the function to
-                // instead be a memcpy into this pointer.
             }
 
             for (auto* block : function->blocks()) {
@@ -173,7 +247,7 @@ void Module::lower() {
 
                             // For large return types, we memcpy the returned value into the pointer
                             // passed as the hidden first arugument.
-                            if (not ret_t_tworeg and ret_t_large) {
+                            if (ret_in_memory) {
                                 auto* dest_ptr = ret_v_large;
                                 auto* source_ptr = ret->val();
                                 if (not source_ptr->type()->is_ptr())
@@ -323,6 +397,7 @@ void Module::emit(std::filesystem::path output_file_path) {
         } break;
 
         case Format::LLVM_TEXTUAL_IR: {
+            stats::Timer _{"emit"};
             auto llvm_ir = llvm();
             if (output_file_path.empty() || output_file_path == "-")
                 fmt::print("{}", llvm_ir);
@@ -332,13 +407,25 @@ void Module::emit(std::filesystem::path output_file_path) {
         case Format::COFF_OBJECT:
         case Format::ELF_OBJECT:
         case Format::GNU_AS_ATT_ASSEMBLY: {
-            auto machine_ir = mir();
+            std::vector<MFunction> machine_ir{};
+            {
+                stats::Timer _{"mir"};
+                machine_ir = mir();
+            }
 
             if (_ctx->option_print_mir())
                 fmt::print("{}", PrintMIR(vars(), machine_ir));
 
-            for (auto& mfunc : machine_ir)
-                select_instructions(this, mfunc);
+            // Every function is selected, allocated, and optimised on its
+            // own, so each phase runs on all functions in parallel. The
+            // functions stay in order in `machine_ir`, so the output
+            // doesn't depend on which thread finished first.
+            {
+                stats::Timer _{"isel"};
+                ParallelFor(machine_ir.size(), [&](usz i) {
+                    select_instructions(this, machine_ir[i]);
+                });
+            }
 
             if (_ctx->option_print_mir()) {
                 fmt::print("\nAfter ISel\n");
@@ -355,39 +442,19 @@ void Module::emit(std::filesystem::path output_file_path) {
 
             // Register Allocation
             MachineDescription desc{};
-            if (_ctx->target()->is_arch_x86_64()) {
-                desc.return_register_to_replace = +x86_64::RegisterId::RETURN;
-                if (_ctx->target()->is_cconv_ms()) {
-                    desc.return_register = +x86_64::RegisterId::RAX;
-                    // Just the volatile registers
-                    desc.registers = {
-                        +x86_64::RegisterId::RAX,
-                        +x86_64::RegisterId::RCX,
-                        +x86_64::RegisterId::RDX,
-                        +x86_64::RegisterId::R8,
-                        +x86_64::RegisterId::R9,
-                        +x86_64::RegisterId::R10,
-                        +x86_64::RegisterId::R11,
-                    };
-                } else {
-                    desc.return_register = +x86_64::RegisterId::RAX;
-                    // Just the volatile registers
-                    desc.registers = {
-                        +x86_64::RegisterId::RAX,
-                        +x86_64::RegisterId::RCX,
-                        +x86_64::RegisterId::RDX,
-                        +x86_64::RegisterId::RSI,
-                        +x86_64::RegisterId::RDI,
-                        +x86_64::RegisterId::R8,
-                        +x86_64::RegisterId::R9,
-                        +x86_64::RegisterId::R10,
-                        +x86_64::RegisterId::R11,
-                    };
-                }
-            } else LCC_ASSERT(false, "Sorry, unhandled target architecture");
-
-            for (auto& mfunc : machine_ir)
-                allocate_registers(desc, mfunc);
+            if (_ctx->target()->is_arch_x86_64())
+                desc = x86_64::GetMachineDescription(_ctx->target());
+            else LCC_ASSERT(false, "Sorry, unhandled target architecture");
+
+            {
+                stats::Timer _{"ra"};
+                auto allocator = _ctx->option_use_linear_scan()
+                                   ? RegisterAllocator::LinearScan
+                                   : RegisterAllocator::GraphColouring;
+                ParallelFor(machine_ir.size(), [&](usz i) {
+                    allocate_registers(desc, machine_ir[i], allocator);
+                });
+            }
 
             if (_ctx->option_print_mir()) {
                 fmt::print("\nAfter RA\n");
@@ -402,8 +469,23 @@ void Module::emit(std::filesystem::path output_file_path) {
                 }
             }
 
+            if (_ctx->target()->is_arch_x86_64()) {
+                stats::Timer _{"peephole"};
+                ParallelFor(machine_ir.size(), [&](usz i) {
+                    x86_64::optimise_peephole(machine_ir[i]);
+                });
+            }
+
+            {
+                stats::Timer _{"frame"};
+                ParallelFor(machine_ir.size(), [&](usz i) {
+                    allocate_stack_slots(desc, machine_ir[i]);
+                });
+            }
+
             if (_ctx->option_stopat_mir()) std::exit(0);
 
+            stats::Timer _{"emit"};
             if (_ctx->format()->format() == Format::GNU_AS_ATT_ASSEMBLY) {
                 if (_ctx->target()->is_arch_x86_64())
                     x86_64::emit_gnu_att_assembly(output_file_path, this, desc, machine_ir);
@@ -1,3 +1,4 @@
+#include <lcc/calling_conventions/ms_x64.hh>
 #include <lcc/calling_conventions/sysv_x86_64.hh>
 #include <lcc/codegen/mir.hh>
 #include <lcc/codegen/x86_64/x86_64.hh>
@@ -6,8 +7,10 @@
 #include <lcc/ir/module.hh>
 #include <lcc/target.hh>
 #include <lcc/utils.hh>
+#include <lcc/utils/statistics.hh>
 
 #include <algorithm>
+#include <array>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -171,9 +174,10 @@ auto Module::mir() -> std::vector<MFunction> {
                         assign_virtual_register(gmp->idx());
                     } break;
 
-                    case Value::Kind::Intrinsic:
-                        // TODO: Assign virtual register to intrinsic operands, if any
-                        break;
+                    case Value::Kind::Intrinsic: {
+                        for (auto* op : as<IntrinsicInst>(instruction)->operands())
+                            assign_virtual_register(op);
+                    } break;
 
                     case Value::Kind::Load: {
                         assign_virtual_register(as<LoadInst>(instruction)->ptr());
@@ -252,6 +256,11 @@ auto Module::mir() -> std::vector<MFunction> {
         return nullptr;
     };
 
+    // Virtual registers that parameters which fit in a register are copied
+    // (or, if passed on the stack, loaded) into at the start of the current
+    // function, by parameter index (zero for any other parameter).
+    std::vector<usz> parameter_registers{};
+
     // Handle inlining of values into operands vs using register references.
     const auto MOperandValueReference = [&](Function* f_ir, MFunction& f, Value* v) -> MOperand {
         // Find MInst if possible, add to use count.
@@ -278,83 +287,59 @@ auto Module::mir() -> std::vector<MFunction> {
                 // Otherwise, this will handle the general case of single-register
                 // parameters and memory parameters being referenced.
                 if (_ctx->target()->is_arch_x86_64()) {
-                    if (_ctx->target()->is_platform_windows()) {
-                        constexpr std::array<x86_64::RegisterId, 4> reg_by_param_index{
-                            x86_64::RegisterId::RCX,
-                            x86_64::RegisterId::RDX,
-                            x86_64::RegisterId::R8,
-                            x86_64::RegisterId::R9 //
-                        };
-                        if (
-                            param->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                            and param->index() < reg_by_param_index.size()
-                        ) {
+                    // Parameters that fit in a register were copied or loaded into a virtual
+                    // one at the start of the function.
+                    if (
+                        param->index() < parameter_registers.size()
+                        and parameter_registers.at(param->index())
+                    ) {
+                        auto reg = parameter_registers.at(param->index());
+                        if (auto* inst = MInstByVirtualRegister(reg)) inst->add_use();
+                        return MOperandRegister(reg, uint(param->type()->bits()));
+                    }
+
+                    if (_ctx->target()->is_cconv_ms()) {
+                        // Parameters passed by reference were lowered to pointers.
+                        LCC_ASSERT(
+                            param->type()->bytes() <= x86_64::GeneralPurposeBytewidth,
+                            "x64 parameter must fit in a register"
+                        );
+                        auto description = cconv::msx64::parameter_description(f_ir).info.at(param->index());
+                        if (description.in_register) {
                             return MOperandRegister(
-                                +reg_by_param_index.at(param->index()),
+                                cconv::msx64::arg_regs.at(param->index()),
                                 uint(param->type()->bits())
                             );
                         }
 
-                        LCC_ASSERT(false, "TODO: Handle x64cc memory parameter");
+                        // Return Local with positive offset into parent stack frame, past the
+                        // saved base pointer, the return address and the shadow space.
+                        return MOperandLocal(
+                            MOperandLocal::absolute_index,
+                            i32(2 * x86_64::GeneralPurposeBytewidth + description.stack_byte_offset)
+                        );
 
                     } else if (_ctx->target()->is_cconv_sysv()) {
-                        usz sysv_registers_used = 0;
-                        i32 sysv_memory_parameter_offset = 0;
-                        for (usz i = 0; i < param->index(); ++i) {
-                            auto* p = f_ir->param(i);
-                            if (
-                                p->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                                and sysv_registers_used < cconv::sysv::arg_regs.size()
-                            )
-                                ++sysv_registers_used;
-                            else if (
-                                p->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-                                and sysv_registers_used < cconv::sysv::arg_regs.size() - 1
-                            ) {
-                                sysv_registers_used += 2;
-                            } else {
-                                // TODO: Take alignment into consideration.
-                                sysv_memory_parameter_offset += i32(p->type()->bytes());
-                            }
-                        }
-
-                        static constexpr std::array<x86_64::RegisterId, 6> reg_by_param_index{
-                            x86_64::RegisterId::RDI,
-                            x86_64::RegisterId::RSI,
-                            x86_64::RegisterId::RDX,
-                            x86_64::RegisterId::RCX,
-                            x86_64::RegisterId::R8,
-                            x86_64::RegisterId::R9 //
-                        };
+                        auto description = cconv::sysv::parameter_description(f_ir).info.at(param->index());
 
                         // Single register parameter
-                        if (
-                            param->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                            and sysv_registers_used < cconv::sysv::arg_regs.size()
-                        ) {
+                        if (description.kind == cconv::sysv::ParameterClass::REGISTER) {
+                            LCC_ASSERT(
+                                description.arg_regs == 1,
+                                "Cannot handle multiple register parameter in this way"
+                            );
                             return MOperandRegister(
-                                +reg_by_param_index.at(sysv_registers_used),
+                                cconv::sysv::arg_regs.at(description.arg_regs_used),
                                 uint(param->type()->bits())
                             );
                         }
-                        // Multiple register parameter
-                        if (
-                            param->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-                            and sysv_registers_used < cconv::sysv::arg_regs.size() - 1
-                        )
-                            LCC_ASSERT(false, "Cannot handle multiple register parameter in this way");
-                        else {
-                            // Return Local with positive offset into parent stack frame.
-                            // To get the actual offset, we need to know how many memory parameters
-                            // come before this parameter, as well as their size (and alignment, I'd
-                            // think).
-                            i32 offset = 2 * x86_64::GeneralPurposeBytewidth;
-                            offset += sysv_memory_parameter_offset;
-                            return MOperandLocal(
-                                MOperandLocal::absolute_index,
-                                offset
-                            );
-                        }
+
+                        // Return Local with positive offset into parent stack frame, past the
+                        // saved base pointer and the return address.
+                        return MOperandLocal(
+                            MOperandLocal::absolute_index,
+                            i32(2 * x86_64::GeneralPurposeBytewidth + description.stack_byte_offset)
+                        );
                     }
                 }
                 Diag::ICE("It appears we haven't handled the target properly, sorry");
@@ -434,6 +419,212 @@ auto Module::mir() -> std::vector<MFunction> {
         return MOperandRegister{virts[v], uint(regsize)};
     };
 
+    // Division (and remainder) by a constant is lowered to a multiplication
+    // by the divisor's "magic number" (see `UnsignedDivisionMagic()` and
+    // `SignedDivisionMagic()`), and powers of two to shifts and masks, as
+    // dividing is an order of magnitude slower than either.
+    //
+    // Returns false if nothing was emitted, i.e. the division has to be
+    // lowered as is.
+    const auto LowerDivisionByConstant = [&](MBlock& bb, BinaryInst* div_ir, MOperand dividend) -> bool {
+        auto* divisor_ir = cast<IntegerConstant>(div_ir->rhs());
+        if (not divisor_ir) return false;
+
+        const auto bits = uint(div_ir->type()->bits());
+        const bool is_signed = is<SDivInst, SRemInst>(div_ir);
+        const bool is_rem = is<SRemInst, URemInst>(div_ir);
+        if (bits < 8 or bits > 64) return false;
+
+        const aint divisor{bits, divisor_ir->value().value()};
+        const aint abs_divisor = is_signed and divisor.is_negative() ? -divisor : divisor;
+        if (divisor == 0) return false;
+
+        const bool power_of_two = abs_divisor.is_power_of_two();
+        const bool magic = abs_divisor != 1 and not power_of_two;
+
+        // The multiply-high only exists for the operand sizes of the
+        // one-operand multiply, so 8-bit operands are extended to 32 bits,
+        // and the result truncated back.
+        const bool widen = magic and bits == 8;
+        const auto width = widen ? 32u : bits;
+        if (magic and width != 16 and width != 32 and width != 64) return false;
+
+        // Emit an instruction that computes an intermediate value (or the
+        // result, if `reg` is given).
+        const auto first_emitted = bb.instructions().size();
+        const auto Imm = [&](u64 value) { return MOperandImmediate(value, width); };
+        const auto EmitSized = [&](MInst::Kind kind, uint size, std::initializer_list<MOperand> operands, usz reg = 0) {
+            auto inst = MInst(kind, {reg ? reg : next_vreg(), size});
+            inst.location(div_ir->location());
+            for (const auto& op : operands) {
+                if (std::holds_alternative<MOperandRegister>(op)) {
+                    auto value = std::get<MOperandRegister>(op).value;
+                    for (auto& emitted : bb.instructions() | vws::drop(first_emitted))
+                        if (emitted.reg() == value) emitted.add_use();
+                }
+                inst.add_operand(op);
+            }
+            bb.add_instruction(inst);
+            return MOperandRegister(inst.reg(), size);
+        };
+        const auto Emit = [&](MInst::Kind kind, std::initializer_list<MOperand> operands, usz reg = 0) {
+            return EmitSized(kind, width, operands, reg);
+        };
+
+        // Immediate operands of x86_64 arithmetic are at most 32 bits, and
+        // sign-extended; anything larger goes in a register.
+        const auto Constant = [&](aint value) -> MOperand {
+            if (width == 64 and i64(value.value()) != i64(i32(value.value())))
+                return Emit(MInst::Kind::Copy, {Imm(value.value())});
+            return Imm(value.value());
+        };
+
+        // Most x86_64 arithmetic overwrites one of its operands, so every
+        // use of the dividend gets its own copy (extended, if need be).
+        const auto Dividend = [&] {
+            if (not widen) return Emit(MInst::Kind::Copy, {dividend});
+            if (auto* imm = std::get_if<MOperandImmediate>(&dividend)) {
+                auto value = is_signed ? u64(i64(i8(imm->value))) : u64(u8(imm->value));
+                return Emit(MInst::Kind::Copy, {Imm(value)});
+            }
+            return Emit(is_signed ? MInst::Kind::SExt : MInst::Kind::ZExt, {dividend});
+        };
+        const auto result = virts[div_ir];
+
+        // Signed division by the most negative value has no positive
+        // counterpart to take the magnitude of; the quotient is 1 if the
+        // dividend is that same value and 0 otherwise, and the remainder
+        // is 0 if so and the dividend otherwise.
+        if (is_signed and abs_divisor.is_negative()) {
+            // Comparisons set a whole byte, so an 8-bit result needs no
+            // extending (and there is no zero-extending move from a byte to a
+            // byte anyway).
+            const auto IsMin = [&](usz reg = 0) {
+                if (width == 8) return EmitSized(MInst::Kind::Eq, 8, {Dividend(), Constant(divisor)}, reg);
+                auto is_min = EmitSized(MInst::Kind::Eq, 1, {Dividend(), Constant(divisor)});
+                return Emit(MInst::Kind::ZExt, {is_min}, reg);
+            };
+
+            if (not is_rem) {
+                IsMin(result);
+                return true;
+            }
+
+            // x & (x == MIN ? 0 : -1)
+            auto mask = Emit(MInst::Kind::Sub, {IsMin(), Imm(1)});
+            Emit(MInst::Kind::And, {mask, Dividend()}, result);
+            return true;
+        }
+
+        // x % 1 == 0, x % -1 == 0
+        if (is_rem and abs_divisor == 1) {
+            Emit(MInst::Kind::Copy, {Imm(0)}, result);
+            return true;
+        }
+
+        // Unsigned division by a power of two is a shift, and the
+        // remainder a mask.
+        if (not is_signed and power_of_two) {
+            if (is_rem) {
+                Emit(MInst::Kind::And, {Dividend(), Constant(divisor - aint{bits, u64(1)})}, result);
+            } else if (divisor == 1) {
+                Emit(MInst::Kind::Copy, {dividend}, result);
+            } else {
+                Emit(MInst::Kind::Shr, {Dividend(), Imm(divisor.log2())}, result);
+            }
+            return true;
+        }
+
+        // Signed division by a power of two is an arithmetic shift, but
+        // negative dividends first need to be biased by `divisor - 1`, to
+        // round towards zero instead of towards negative infinity.
+        if (is_signed and power_of_two) {
+            const auto k = abs_divisor.log2();
+            const auto Negate = [&](MOperand value, usz reg = 0) {
+                return Emit(MInst::Kind::Sub, {Emit(MInst::Kind::Copy, {Imm(0)}), value}, reg);
+            };
+
+            if (k == 0) {
+                if (divisor.is_negative()) Negate(Dividend(), result);
+                else Emit(MInst::Kind::Copy, {dividend}, result);
+                return true;
+            }
+
+            auto bias = Dividend();
+            if (k > 1) bias = Emit(MInst::Kind::Sar, {bias, Imm(k - 1)});
+            bias = Emit(MInst::Kind::Shr, {bias, Imm(bits - k)});
+            auto biased = Emit(MInst::Kind::Add, {bias, Dividend()});
+
+            // x % 2^k == x - ((x + bias) & -2^k)
+            if (is_rem) {
+                auto rounded = Emit(MInst::Kind::Sar, {biased, Imm(k)});
+                rounded = Emit(MInst::Kind::Shl, {rounded, Imm(k)});
+                Emit(MInst::Kind::Sub, {Dividend(), rounded}, result);
+                return true;
+            }
+
+            if (divisor.is_negative()) Negate(Emit(MInst::Kind::Sar, {biased, Imm(k)}), result);
+            else Emit(MInst::Kind::Sar, {biased, Imm(k)}, result);
+            return true;
+        }
+
+        // Everything else uses the magic number. If we only want the
+        // quotient, the last instruction defines the result (unless it
+        // still has to be truncated).
+        const auto wide_result = widen ? next_vreg() : result;
+        const auto quotient_reg = is_rem ? 0 : wide_result;
+        const aint wide_divisor{
+            width,
+            widen and is_signed ? u64(i64(i8(divisor.value()))) : u64(divisor.value()),
+        };
+        MOperandRegister quotient{};
+        if (is_signed) {
+            auto [multiplier, shift, _] = SignedDivisionMagic(wide_divisor);
+            auto q = Emit(
+                MInst::Kind::SMulHi,
+                {Dividend(), Imm(multiplier.value())}
+            );
+
+            if (not divisor.is_negative() and multiplier.is_negative())
+                q = Emit(MInst::Kind::Add, {q, Dividend()});
+            else if (divisor.is_negative() and not multiplier.is_negative())
+                q = Emit(MInst::Kind::Sub, {q, Dividend()});
+
+            if (shift) q = Emit(MInst::Kind::Sar, {q, Imm(shift)});
+
+            // Add one if the quotient is negative to round towards zero.
+            auto sign = Emit(MInst::Kind::Shr, {Emit(MInst::Kind::Copy, {q}), Imm(width - 1)});
+            quotient = Emit(MInst::Kind::Add, {sign, q}, quotient_reg);
+        } else {
+            auto [multiplier, shift, add] = UnsignedDivisionMagic(wide_divisor);
+            bool last = not add and not shift;
+            auto q = Emit(
+                MInst::Kind::UMulHi,
+                {Dividend(), Imm(multiplier.value())},
+                last ? quotient_reg : 0
+            );
+
+            if (add) {
+                auto fixup = Emit(MInst::Kind::Sub, {Dividend(), q});
+                fixup = Emit(MInst::Kind::Shr, {fixup, Imm(1)});
+                q = Emit(MInst::Kind::Add, {fixup, q}, shift == 1 ? quotient_reg : 0);
+                shift -= 1;
+            }
+
+            if (shift) q = Emit(MInst::Kind::Shr, {q, Imm(shift)}, quotient_reg);
+            quotient = q;
+        }
+
+        // x % d == x - (x / d) * d
+        if (is_rem) {
+            auto product = Emit(MInst::Kind::Mul, {quotient, Constant(wide_divisor)});
+            Emit(MInst::Kind::Sub, {Dividend(), product}, wide_result);
+        }
+
+        if (widen) EmitSized(MInst::Kind::Trunc, bits, {MOperandRegister(wide_result, width)}, result);
+        return true;
+    };
+
     // NOTE: We cannot add functions to the IR while iterating over them (use-
     // after-free nightmare), so, please, do not alter the IR in the main loop
     // that generates MIR, for here there be dragons.
@@ -461,8 +652,11 @@ auto Module::mir() -> std::vector<MFunction> {
         auto& f = funcs.back();
         f.names() = function->names();
         f.location(function->location());
-        for (auto& block : function->blocks())
-            f.add_block(MBlock(block->name()));
+        for (auto& block : function->blocks()) {
+            MBlock mblock{block->name()};
+            mblock.execution_count(block->execution_count());
+            f.add_block(mblock);
+        }
     }
 
     // Now that the vectors won't be resizing, we can put MFunction and MBlock
@@ -481,6 +675,46 @@ auto Module::mir() -> std::vector<MFunction> {
 
     for (auto [f_index, function] : vws::enumerate(code())) {
         auto& f = funcs.at(usz(f_index));
+
+        // Copy parameters that fit in a register into virtual registers before
+        // anything else, loading the ones passed on the stack, so that any
+        // instruction may use them like any other value. Argument registers
+        // are overwritten by calls and by instructions that need a particular
+        // register, so they can't hold a parameter for longer than that.
+        parameter_registers.assign(function->params().size(), 0);
+        if (_ctx->target()->is_arch_x86_64() and not function->blocks().empty()) {
+            std::vector<bool> in_register(function->params().size());
+            std::vector<bool> on_stack(function->params().size());
+            if (_ctx->target()->is_cconv_sysv()) {
+                auto description = cconv::sysv::parameter_description(function);
+                for (auto [param_i, param] : vws::enumerate(function->params())) {
+                    const auto& info = description.info.at(usz(param_i));
+                    in_register.at(usz(param_i)) = info.kind == cconv::sysv::ParameterClass::REGISTER
+                                               and info.arg_regs == 1;
+                    on_stack.at(usz(param_i)) = info.kind == cconv::sysv::ParameterClass::MEMORY
+                                            and param->type()->bytes() <= x86_64::GeneralPurposeBytewidth;
+                }
+            } else if (_ctx->target()->is_cconv_ms()) {
+                auto description = cconv::msx64::parameter_description(function);
+                for (auto [param_i, param] : vws::enumerate(description.info)) {
+                    in_register.at(usz(param_i)) = param.in_register;
+                    on_stack.at(usz(param_i)) = not param.in_register;
+                }
+            }
+
+            for (auto [param_i, param] : vws::enumerate(function->params())) {
+                if (param->users().empty()) continue;
+                if (not in_register.at(usz(param_i)) and not on_stack.at(usz(param_i))) continue;
+
+                auto kind = in_register.at(usz(param_i)) ? MInst::Kind::Copy : MInst::Kind::Load;
+                auto inst = MInst(kind, {next_vreg(), uint(param->type()->bits())});
+                inst.location(function->location());
+                inst.add_operand(MOperandValueReference(function, f, param));
+                f.blocks().at(0).add_instruction(inst);
+                parameter_registers.at(usz(param_i)) = inst.reg();
+            }
+        }
+
         for (auto [block_index, block] : vws::enumerate(function->blocks())) {
             auto& bb = f.blocks().at(usz(block_index));
             for (auto& instruction : block->instructions()) {
@@ -539,201 +773,218 @@ auto Module::mir() -> std::vector<MFunction> {
 
                         usz arg_stack_bytes_used = 0;
                         if (_ctx->target()->is_arch_x86_64()) {
-                            if (_ctx->target()->is_platform_windows()) {
-                                constexpr std::array<usz, 4> arg_regs = {
-                                    +x86_64::RegisterId::RCX,
-                                    +x86_64::RegisterId::RDX,
-                                    +x86_64::RegisterId::R8,
-                                    +x86_64::RegisterId::R9,
-                                };
-
+                            if (_ctx->target()->is_cconv_ms()) {
+                                auto description = cconv::msx64::parameter_description(call_ir);
+
+                                // The shadow space is reserved for every call, along with space for the
+                                // stack arguments after it, keeping the stack aligned at the call.
+                                constexpr Register stack_pointer_reg{+x86_64::RegisterId::RSP, 64};
+                                arg_stack_bytes_used = utils::AlignTo(description.stack_bytes, usz(16));
+                                auto sub = MInst(+x86_64::Opcode::Sub, stack_pointer_reg);
+                                sub.location(call_ir->location());
+                                sub.add_operand(MOperandImmediate(arg_stack_bytes_used, 32));
+                                sub.add_operand(stack_pointer_reg);
+                                bb.add_instruction(sub);
+
+                                // Arguments that are passed by reference have already been replaced
+                                // with a pointer to a copy made by the caller (see `Module::lower()`).
+                                // Stack arguments are stored first, so that computing their address
+                                // doesn't clobber the argument registers.
                                 for (auto [arg_i, arg] : vws::enumerate(call_ir->args())) {
-                                    if (
-                                        usz(arg_i) < arg_regs.size()
-                                        and arg->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                                    ) {
-                                        auto copy = MInst(
-                                            MInst::Kind::Copy,
-                                            {arg_regs.at(usz(arg_i)), x86_64::GeneralPurposeBitwidth}
-                                        );
-                                        copy.location(call_ir->location());
-                                        copy.add_operand(MOperandValueReference(function, f, arg));
-                                        bb.add_instruction(copy);
-                                    } else {
-                                        // Basically, if an argument is over-large, we allocate a copy on the
-                                        // stack (that way the caller can modify without doing bad bad), and then
-                                        // pass the pointer to the stack address in the regular place the argument
-                                        // would have gone (either the register the argument would have fit in, or
-                                        // on the stack).
-                                        // "Structs or unions (larger than 64 bits) are passed as a pointer to
-                                        // memory allocated by the caller. For these aggregate types passed as a
-                                        // pointer, including __m128, the caller-allocated temporary memory must
-                                        // be 16-byte aligned."
-                                        LCC_ASSERT(false, "Handle gMIR lowering of x64 memory arguments");
-                                    }
+                                    const auto& param = description.info.at(usz(arg_i));
+                                    if (param.in_register) continue;
+                                    LCC_ASSERT(
+                                        arg->type()->bytes() <= x86_64::GeneralPurposeBytewidth,
+                                        "x64 argument must fit in a register"
+                                    );
+
+                                    auto add = MInst(MInst::Kind::Add, {next_vreg(), 64});
+                                    add.location(call_ir->location());
+                                    add.add_operand(stack_pointer_reg);
+                                    add.add_operand(MOperandImmediate(param.stack_byte_offset, 32));
+                                    bb.add_instruction(add);
+
+                                    auto store = MInst(MInst::Kind::Store, {0, 0});
+                                    store.location(call_ir->location());
+                                    store.add_operand(MOperandValueReference(function, f, arg));
+                                    store.add_operand(MOperandRegister(add.reg(), uint(add.regsize())));
+                                    bb.add_instruction(store);
                                 }
 
-                            } else if (_ctx->target()->is_cconv_sysv()) {
-                                // Handle all arguments that are passed in memory first, before register arguments.
-                                usz arg_regs_used = 0;
                                 for (auto [arg_i, arg] : vws::enumerate(call_ir->args())) {
-                                    if (
-                                        arg_regs_used < cconv::sysv::arg_regs.size()
-                                        and arg->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                                    )
-                                        ++arg_regs_used;
-
-                                    else if (
-                                        arg_regs_used < cconv::sysv::arg_regs.size() - 1
-                                        and arg->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-                                    )
-                                        arg_regs_used += 2;
-
-                                    else {
-                                        // Memory parameter
-                                        // Basically just allocate a temporary on the stack, memcpy (or similar)
-                                        // into that.
-
-                                        // Remove the original argument; we will be building it by hand.
-                                        auto arg_mir = MOperandValueReference(function, f, arg);
-                                        LCC_ASSERT(std::holds_alternative<MOperandRegister>(arg_mir));
-                                        auto arg_reg = std::get<MOperandRegister>(arg_mir);
-                                        bb.remove_inst_by_reg(arg_reg.value);
-
-                                        // Get a reference to a pointer to the argument.
-                                        Value* arg_ptr{nullptr};
-                                        if (auto* load = cast<LoadInst>(arg))
-                                            arg_ptr = load->ptr();
-                                        else if (auto* alloca = cast<AllocaInst>(arg))
-                                            arg_ptr = alloca;
-                                        else LCC_ASSERT(
-                                            false,
-                                            "Memory argument must be prepared such that MIR generation may fetch the pointer (i.e. a LoadInst or AllocaInst).\n"
-                                            "This allows us to copy from the pointer (load operand) onto the stack."
-                                        );
-
-                                        auto byte_count = arg->type()->bytes();
-
-                                        // sub $<size>, %rsp
-                                        constexpr Register stack_pointer_reg{+x86_64::RegisterId::RSP, 64};
-                                        auto sub = MInst(MInst::Kind::Sub, stack_pointer_reg);
-                                        sub.location(call_ir->location());
-                                        sub.add_operand(stack_pointer_reg);
-                                        sub.add_operand(MOperandImmediate(byte_count));
-                                        bb.add_instruction(sub);
+                                    if (not description.info.at(usz(arg_i)).in_register) continue;
+                                    auto copy = MInst(
+                                        MInst::Kind::Copy,
+                                        {cconv::msx64::arg_regs.at(usz(arg_i)), x86_64::GeneralPurposeBitwidth}
+                                    );
+                                    copy.location(call_ir->location());
+                                    copy.add_operand(MOperandValueReference(function, f, arg));
+                                    bb.add_instruction(copy);
+                                }
 
-                                        // Record stack subtraction so we can undo it after the call
-                                        arg_stack_bytes_used += byte_count;
+                            } else if (_ctx->target()->is_cconv_sysv()) {
+                                auto description = cconv::sysv::parameter_description(call_ir);
+
+                                // Handle all arguments that are passed in memory first, before register
+                                // arguments, as copying them clobbers the argument registers. Space for
+                                // all of them is allocated at once, keeping the stack aligned at the call.
+                                constexpr Register stack_pointer_reg{+x86_64::RegisterId::RSP, 64};
+                                if (description.stack_bytes) {
+                                    // sub $<size>, %rsp
+                                    arg_stack_bytes_used = utils::AlignTo(description.stack_bytes, usz(16));
+                                    auto sub = MInst(+x86_64::Opcode::Sub, stack_pointer_reg);
+                                    sub.location(call_ir->location());
+                                    sub.add_operand(MOperandImmediate(arg_stack_bytes_used, 32));
+                                    sub.add_operand(stack_pointer_reg);
+                                    bb.add_instruction(sub);
+                                }
 
-                                        // Copy from arg into stack pointer
+                                for (auto [arg_i, arg] : vws::enumerate(call_ir->args())) {
+                                    const auto& param = description.info.at(usz(arg_i));
+                                    if (param.kind != cconv::sysv::ParameterClass::MEMORY) continue;
+
+                                    // A memory argument that fits in a register (because we ran out of
+                                    // argument registers) is stored onto the stack directly.
+                                    if (arg->type()->bytes() <= x86_64::GeneralPurposeBytewidth) {
+                                        MOperand destination = stack_pointer_reg;
+                                        if (param.stack_byte_offset) {
+                                            auto add = MInst(MInst::Kind::Add, {next_vreg(), 64});
+                                            add.location(call_ir->location());
+                                            add.add_operand(stack_pointer_reg);
+                                            add.add_operand(MOperandImmediate(param.stack_byte_offset, 32));
+                                            destination = MOperandRegister(add.reg(), uint(add.regsize()));
+                                            bb.add_instruction(add);
+                                        }
+                                        auto store = MInst(MInst::Kind::Store, {0, 0});
+                                        store.location(call_ir->location());
+                                        store.add_operand(MOperandValueReference(function, f, arg));
+                                        store.add_operand(destination);
+                                        bb.add_instruction(store);
+                                        continue;
+                                    }
 
-                                        // TODO: If memcpy sets return register we may end up having a bad time.
+                                    // Memory parameter
+                                    // Basically just memcpy the argument into its place on the stack.
+
+                                    // Remove the original argument; we will be building it by hand.
+                                    auto arg_mir = MOperandValueReference(function, f, arg);
+                                    LCC_ASSERT(std::holds_alternative<MOperandRegister>(arg_mir));
+                                    auto arg_reg = std::get<MOperandRegister>(arg_mir);
+                                    bb.remove_inst_by_reg(arg_reg.value);
+
+                                    // Get a reference to a pointer to the argument.
+                                    Value* arg_ptr{nullptr};
+                                    if (auto* load = cast<LoadInst>(arg))
+                                        arg_ptr = load->ptr();
+                                    else if (auto* alloca = cast<AllocaInst>(arg))
+                                        arg_ptr = alloca;
+                                    else LCC_ASSERT(
+                                        false,
+                                        "Memory argument must be prepared such that MIR generation may fetch the pointer (i.e. a LoadInst or AllocaInst).\n"
+                                        "This allows us to copy from the pointer (load operand) onto the stack."
+                                    );
 
-                                        { // Destination argument (stack pointer)
-                                            auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[0], 64});
-                                            copy.location(call_ir->location());
-                                            copy.add_operand(stack_pointer_reg);
-                                            bb.add_instruction(copy);
-                                        }
-                                        { // Source argument
-                                            auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[1], 64});
-                                            copy.location(call_ir->location());
-                                            copy.add_operand(MOperandValueReference(function, f, arg_ptr));
-                                            bb.add_instruction(copy);
-                                        }
-                                        { // Size argument
-                                            auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[2], 64});
-                                            copy.location(call_ir->location());
-                                            copy.add_operand(MOperandImmediate(byte_count));
-                                            bb.add_instruction(copy);
-                                        }
+                                    // TODO: If memcpy sets return register we may end up having a bad time.
 
-                                        auto call = MInst(
-                                            MInst::Kind::Call,
-                                            {usz(x86_64::RegisterId::RETURN), 0}
-                                        );
-                                        call.location(call_ir->location());
-                                        call.add_operand(memcpy_function);
-                                        bb.add_instruction(call);
+                                    { // Destination argument (stack pointer, plus offset of parameter)
+                                        auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[0], 64});
+                                        copy.location(call_ir->location());
+                                        if (param.stack_byte_offset) {
+                                            auto add = MInst(MInst::Kind::Add, {next_vreg(), 64});
+                                            add.location(call_ir->location());
+                                            add.add_operand(stack_pointer_reg);
+                                            add.add_operand(MOperandImmediate(param.stack_byte_offset, 32));
+                                            copy.add_operand(MOperandRegister(add.reg(), uint(add.regsize())));
+                                            bb.add_instruction(add);
+                                        } else copy.add_operand(stack_pointer_reg);
+                                        bb.add_instruction(copy);
+                                    }
+                                    { // Source argument
+                                        auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[1], 64});
+                                        copy.location(call_ir->location());
+                                        copy.add_operand(MOperandValueReference(function, f, arg_ptr));
+                                        bb.add_instruction(copy);
                                     }
+                                    { // Size argument
+                                        auto copy = MInst(MInst::Kind::Copy, {cconv::sysv::arg_regs[2], 64});
+                                        copy.location(call_ir->location());
+                                        copy.add_operand(MOperandImmediate(arg->type()->bytes(), 64));
+                                        bb.add_instruction(copy);
+                                    }
+
+                                    auto call = MInst(
+                                        MInst::Kind::Call,
+                                        {usz(x86_64::RegisterId::RETURN), 0}
+                                    );
+                                    call.location(call_ir->location());
+                                    call.add_operand(memcpy_function);
+                                    bb.add_instruction(call);
                                 }
 
-                                arg_regs_used = 0;
                                 for (auto [arg_i, arg] : vws::enumerate(call_ir->args())) {
-                                    if (
-                                        arg_regs_used < cconv::sysv::arg_regs.size()
-                                        and arg->type()->bytes() <= x86_64::GeneralPurposeBytewidth
-                                    ) {
+                                    const auto& param = description.info.at(usz(arg_i));
+                                    if (param.kind != cconv::sysv::ParameterClass::REGISTER) continue;
+
+                                    auto arg_regs_used = param.arg_regs_used;
+                                    if (param.arg_regs == 1) {
                                         // TODO: May have to quantize arg->type()->bits() to 8, 16, 32, 64
                                         auto copy = MInst(
                                             MInst::Kind::Copy,
-                                            {cconv::sysv::arg_regs.at(arg_regs_used++), uint(arg->type()->bits())}
+                                            {cconv::sysv::arg_regs.at(arg_regs_used), uint(arg->type()->bits())}
                                         );
                                         copy.location(call_ir->location());
                                         copy.add_operand(MOperandValueReference(function, f, arg));
                                         bb.add_instruction(copy);
-                                    } else if (
-                                        arg_regs_used < cconv::sysv::arg_regs.size() - 1
-                                        and arg->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-                                    ) {
-                                        auto load_a = MInst(
-                                            MInst::Kind::Load,
-                                            {
-                                                cconv::sysv::arg_regs.at(arg_regs_used++),
-                                                x86_64::GeneralPurposeBitwidth //
-                                            }
-                                        );
-                                        auto load_b = MInst(
-                                            MInst::Kind::Load,
-                                            {
-                                                cconv::sysv::arg_regs.at(arg_regs_used++),
-                                                uint(arg->type()->bits() - x86_64::GeneralPurposeBitwidth) //
-                                            }
-                                        );
-                                        load_a.location(call_ir->location());
-                                        load_b.location(call_ir->location());
-
-                                        if (auto* load_arg = cast<LoadInst>(arg)) {
-                                            if (auto* alloca = cast<AllocaInst>(load_arg->ptr())) {
-                                                load_a.add_operand(MOperandValueReference(function, f, alloca));
-
-                                                auto add_b = MInst(
-                                                    MInst::Kind::Add,
-                                                    {next_vreg(), x86_64::GeneralPurposeBitwidth}
-                                                );
-                                                add_b.location(call_ir->location());
-                                                add_b.add_operand(MOperandValueReference(function, f, alloca));
-                                                add_b.add_operand(MOperandImmediate(x86_64::GeneralPurposeBytewidth, 32));
-
-                                                load_b.add_operand(MOperandRegister(add_b.reg(), uint(add_b.regsize())));
-                                                bb.add_instruction(add_b);
-
-                                                // In doing the copying and stuff, we have effectively loaded the thing
-                                                // manually. So, we remove the load that was there before.
-                                                bb.remove_inst_by_reg(virts[load_arg]);
-
-                                            } else LCC_ASSERT(false, "TODO: Create a temporary, store into it, and then treat argument like any other alloca.");
-                                        } else if (arg->kind() == Value::Kind::Alloca) {
-                                            load_a.add_operand(MOperandValueReference(function, f, arg));
-
-                                            auto add_b = MInst(
-                                                MInst::Kind::Add,
-                                                {next_vreg(), x86_64::GeneralPurposeBitwidth}
-                                            );
-                                            add_b.location(call_ir->location());
-                                            add_b.add_operand(MOperandValueReference(function, f, arg));
-                                            add_b.add_operand(MOperandImmediate(x86_64::GeneralPurposeBytewidth, 32));
-
-                                            load_b.add_operand(MOperandRegister(add_b.reg(), uint(add_b.regsize())));
-                                            bb.add_instruction(add_b);
-                                        } else {
-                                            arg->print();
-                                            LCC_ASSERT(false, "Handle gMIR lowering of SysV multiple register argument");
-                                        }
+                                        continue;
+                                    }
 
-                                        bb.add_instruction(load_a);
-                                        bb.add_instruction(load_b);
+                                    // Multiple register argument: load each eightbyte from memory the
+                                    // argument is in. `Module::lower()` makes sure that it is in memory.
+                                    auto load_a = MInst(
+                                        MInst::Kind::Load,
+                                        {
+                                            cconv::sysv::arg_regs.at(arg_regs_used++),
+                                            x86_64::GeneralPurposeBitwidth //
+                                        }
+                                    );
+                                    auto load_b = MInst(
+                                        MInst::Kind::Load,
+                                        {
+                                            cconv::sysv::arg_regs.at(arg_regs_used++),
+                                            uint(arg->type()->bits() - x86_64::GeneralPurposeBitwidth) //
+                                        }
+                                    );
+                                    load_a.location(call_ir->location());
+                                    load_b.location(call_ir->location());
+
+                                    Value* arg_ptr{nullptr};
+                                    if (auto* load_arg = cast<LoadInst>(arg)) {
+                                        arg_ptr = load_arg->ptr();
+
+                                        // In doing the copying and stuff, we have effectively loaded the thing
+                                        // manually. So, we remove the load that was there before.
+                                        bb.remove_inst_by_reg(virts[load_arg]);
+                                    } else if (arg->kind() == Value::Kind::Alloca) {
+                                        arg_ptr = arg;
+                                    } else {
+                                        arg->print();
+                                        LCC_ASSERT(false, "Handle gMIR lowering of SysV multiple register argument");
                                     }
+
+                                    load_a.add_operand(MOperandValueReference(function, f, arg_ptr));
+
+                                    auto add_b = MInst(
+                                        MInst::Kind::Add,
+                                        {next_vreg(), x86_64::GeneralPurposeBitwidth}
+                                    );
+                                    add_b.location(call_ir->location());
+                                    add_b.add_operand(MOperandValueReference(function, f, arg_ptr));
+                                    add_b.add_operand(MOperandImmediate(x86_64::GeneralPurposeBytewidth, 32));
+
+                                    load_b.add_operand(MOperandRegister(add_b.reg(), uint(add_b.regsize())));
+                                    bb.add_instruction(add_b);
+                                    bb.add_instruction(load_a);
+                                    bb.add_instruction(load_b);
                                 }
                             }
                         } else (LCC_ASSERT(false, "Unhandled architecture in gMIR generation from IR call"));
@@ -753,7 +1004,7 @@ auto Module::mir() -> std::vector<MFunction> {
                                 {+x86_64::RegisterId::RSP, x86_64::GeneralPurposeBitwidth}
                             );
                             stack_fixup.location(call_ir->location());
-                            stack_fixup.add_operand(MOperandImmediate(arg_stack_bytes_used));
+                            stack_fixup.add_operand(MOperandImmediate(arg_stack_bytes_used, 32));
                             stack_fixup.add_operand(
                                 MOperandRegister{
                                     +x86_64::RegisterId::RSP,
@@ -773,18 +1024,23 @@ auto Module::mir() -> std::vector<MFunction> {
                                 std::vector<usz> arg_regs{};
                                 // TODO: Static assert for handling of targets.
                                 if (_ctx->target()->is_platform_windows()) {
-                                    arg_regs = {
-                                        +x86_64::RegisterId::RCX,
-                                        +x86_64::RegisterId::RDX,
-                                        +x86_64::RegisterId::R8,
-                                        +x86_64::RegisterId::R9,
-                                    };
+                                    arg_regs = utils::to_vec(cconv::msx64::arg_regs);
                                 } else if (_ctx->target()->is_cconv_sysv()) {
                                     arg_regs = utils::to_vec(cconv::sysv::arg_regs);
                                 } else {
                                     Diag::ICE("Unhandled target in argument lowering for memcpy intrinsic");
                                 }
 
+                                // x64 callers reserve the shadow space even for library calls.
+                                constexpr Register stack_pointer_reg{+x86_64::RegisterId::RSP, 64};
+                                if (_ctx->target()->is_cconv_ms()) {
+                                    auto sub = MInst(+x86_64::Opcode::Sub, stack_pointer_reg);
+                                    sub.location(intrinsic->location());
+                                    sub.add_operand(MOperandImmediate(cconv::msx64::shadow_space_bytes, 32));
+                                    sub.add_operand(stack_pointer_reg);
+                                    bb.add_instruction(sub);
+                                }
+
                                 usz arg_regs_used = 0;
                                 for (auto op : intrinsic->operands()) {
                                     auto copy = MInst(
@@ -800,11 +1056,76 @@ auto Module::mir() -> std::vector<MFunction> {
                                 call.location(intrinsic->location());
                                 call.add_operand(memcpy_function);
                                 bb.add_instruction(call);
+
+                                if (_ctx->target()->is_cconv_ms()) {
+                                    auto stack_fixup = MInst(+x86_64::Opcode::Add, stack_pointer_reg);
+                                    stack_fixup.location(intrinsic->location());
+                                    stack_fixup.add_operand(MOperandImmediate(cconv::msx64::shadow_space_bytes, 32));
+                                    stack_fixup.add_operand(stack_pointer_reg);
+                                    bb.add_instruction(stack_fixup);
+                                }
+                            } break;
+
+                            case IntrinsicKind::SystemCall: {
+                                LCC_ASSERT(
+                                    not intrinsic->operands().empty() and intrinsic->operands().size() <= 7,
+                                    "Invalid number of operands to syscall intrinsic"
+                                );
+                                if (not _ctx->target()->is_arch_x86_64() or not _ctx->target()->is_platform_linux())
+                                    Diag::ICE("Unhandled target in MIR generation for syscall intrinsic");
+
+                                // Linux x86_64 syscall convention: the number goes in rax and the
+                                // arguments in rdi, rsi, rdx, r10, r8, r9 (r10 instead of rcx,
+                                // since the syscall instruction itself clobbers rcx and r11).
+                                static constexpr std::array syscall_arg_regs{
+                                    x86_64::RegisterId::RDI,
+                                    x86_64::RegisterId::RSI,
+                                    x86_64::RegisterId::RDX,
+                                    x86_64::RegisterId::R10,
+                                    x86_64::RegisterId::R8,
+                                    x86_64::RegisterId::R9,
+                                };
+
+                                const auto copy_into = [&](x86_64::RegisterId reg, Value* op) {
+                                    auto copy = MInst(
+                                        MInst::Kind::Copy,
+                                        {+reg, uint(op->type()->bits())}
+                                    );
+                                    copy.location(intrinsic->location());
+                                    copy.add_operand(MOperandValueReference(function, f, op));
+                                    bb.add_instruction(copy);
+                                };
+
+                                // Copy the syscall number last, as rax is the return register.
+                                const auto& operands = intrinsic->operands();
+                                for (usz i = 1; i < operands.size(); ++i)
+                                    copy_into(syscall_arg_regs.at(i - 1), operands.at(i));
+                                copy_into(x86_64::RegisterId::RAX, operands.front());
+
+                                auto syscall = MInst(+x86_64::Opcode::Syscall, {0, 0});
+                                syscall.location(intrinsic->location());
+                                for (auto clobber : {x86_64::RegisterId::RAX, x86_64::RegisterId::RCX, x86_64::RegisterId::R11}) {
+                                    syscall.add_operand(MOperandRegister{+clobber, x86_64::GeneralPurposeBitwidth});
+                                    syscall.add_operand_clobber(syscall.all_operands().size() - 1);
+                                }
+                                bb.add_instruction(syscall);
+
+                                auto result = MInst(
+                                    MInst::Kind::Copy,
+                                    {virts[instruction], x86_64::GeneralPurposeBitwidth}
+                                );
+                                result.location(intrinsic->location());
+                                result.add_operand(
+                                    MOperandRegister{
+                                        +x86_64::RegisterId::RAX,
+                                        x86_64::GeneralPurposeBitwidth //
+                                    }
+                                );
+                                bb.add_instruction(result);
                             } break;
 
                             case IntrinsicKind::DebugTrap:
                             case IntrinsicKind::MemSet:
-                            case IntrinsicKind::SystemCall:
                                 LCC_TODO("Generate MIR for IntrinsicInst");
                         }
                     } break;
@@ -836,7 +1157,11 @@ auto Module::mir() -> std::vector<MFunction> {
                             break;
                         }
 
-                        auto mul = MInst(MInst::Kind::Mul, reg);
+                        // The scaled index gets its own register, so instruction selection can
+                        // tell that it is only used by the add.
+                        Register scaled{next_vreg(), reg.size};
+
+                        auto mul = MInst(MInst::Kind::Mul, scaled);
                         mul.location(gep_ir->location());
                         mul.add_operand(MOperandImmediate(gep_ir->base_type()->bytes(), 32));
                         mul.add_operand(MOperandValueReference(function, f, gep_ir->idx()));
@@ -844,7 +1169,7 @@ auto Module::mir() -> std::vector<MFunction> {
                         auto add = MInst(MInst::Kind::Add, reg);
                         add.location(gep_ir->location());
                         add.add_operand(MOperandValueReference(function, f, gep_ir->ptr()));
-                        add.add_operand(reg);
+                        add.add_operand(scaled);
 
                         usz use_count = gep_ir->users().size();
                         while (use_count--) add.add_use();
@@ -899,8 +1224,8 @@ auto Module::mir() -> std::vector<MFunction> {
                         // MIR Control Flow Graph
                         if (std::holds_alternative<MOperandBlock>(op)) {
                             MOperandBlock destination_block = std::get<MOperandBlock>(op);
-                            bb.add_successor(destination_block->machine_block()->name());
-                            destination_block->machine_block()->add_predecessor(bb.name());
+                            bb.add_successor(destination_block->machine_block()->id());
+                            destination_block->machine_block()->add_predecessor(bb.id());
                         }
                     } break;
 
@@ -923,13 +1248,13 @@ auto Module::mir() -> std::vector<MFunction> {
                         // MIR Control Flow Graph
                         if (std::holds_alternative<MOperandBlock>(then_op)) {
                             MOperandBlock then_block = std::get<MOperandBlock>(then_op);
-                            bb.add_successor(then_block->machine_block()->name());
-                            then_block->machine_block()->add_predecessor(bb.name());
+                            bb.add_successor(then_block->machine_block()->id());
+                            then_block->machine_block()->add_predecessor(bb.id());
                         }
                         if (std::holds_alternative<MOperandBlock>(else_op)) {
                             MOperandBlock else_block = std::get<MOperandBlock>(else_op);
-                            bb.add_successor(else_block->machine_block()->name());
-                            else_block->machine_block()->add_predecessor(bb.name());
+                            bb.add_successor(else_block->machine_block()->id());
+                            else_block->machine_block()->add_predecessor(bb.id());
                         }
                     } break;
 
@@ -953,15 +1278,15 @@ auto Module::mir() -> std::vector<MFunction> {
                             and _ctx->target()->is_arch_x86_64()
                             and _ctx->target()->is_cconv_sysv()
                             and store_ir->val()->type()->bits() > x86_64::GeneralPurposeBitwidth
-                            and store_ir->val()->type()->bits() <= 2 * x86_64::GeneralPurposeBitwidth
+                            and cconv::sysv::returns_in_registers(store_ir->val()->type())
                         ) {
                             // Multiple register return value stored into store's destination pointer
                             auto reg_a = MOperandRegister(
-                                +x86_64::RegisterId::RAX,
+                                cconv::sysv::ret_regs[0],
                                 x86_64::GeneralPurposeBitwidth
                             );
                             auto reg_b = MOperandRegister(
-                                +x86_64::RegisterId::RDX,
+                                cconv::sysv::ret_regs[1],
                                 uint(store_ir->val()->type()->bits() - x86_64::GeneralPurposeBitwidth)
                             );
 
@@ -993,17 +1318,14 @@ auto Module::mir() -> std::vector<MFunction> {
                             // FIXME: What does f.calling_convention() (C, Glint) have to do
                             // with any of this?
                             if (_ctx->target()->is_arch_x86_64() and _ctx->target()->is_cconv_sysv()) {
-                                auto param_description = cconv::sysv::parameter_description(function);
+                                auto param_description = cconv::sysv::parameter_description(function).info.at(param->index());
 
-                                auto arg_regs_used_before_parameter = param_description.info.at(param->index()).arg_regs_used;
+                                auto arg_regs_used_before_parameter = param_description.arg_regs_used;
 
                                 // Multiple register parameter
                                 if (
-                                    // The parameter value has to fit within two registers (and not one).
-                                    param->type()->bytes() > x86_64::GeneralPurposeBytewidth
-                                    and param->type()->bytes() <= 2 * x86_64::GeneralPurposeBytewidth
-                                    // There has to be two registers available, obviously.
-                                    and arg_regs_used_before_parameter < cconv::sysv::arg_regs.size() - 1
+                                    param_description.kind == cconv::sysv::ParameterClass::REGISTER
+                                    and param_description.arg_regs == 2
                                 ) {
                                     if (auto* alloca = cast<AllocaInst>(store_ir->ptr())) {
                                         // Multiple register parameter stored into alloca
@@ -1055,7 +1377,21 @@ auto Module::mir() -> std::vector<MFunction> {
                         auto store = MInst(MInst::Kind::Store, {virts[instruction], 0});
                         store.location(store_ir->location());
                         store.add_operand(MOperandValueReference(function, f, store_ir->val()));
-                        store.add_operand(MOperandValueReference(function, f, store_ir->ptr()));
+
+                        // There is no instruction selection for storing straight into a global,
+                        // so take its address first.
+                        if (store_ir->ptr()->kind() == Value::Kind::GlobalVariable) {
+                            auto copy = MInst(
+                                MInst::Kind::Copy,
+                                {next_vreg(), x86_64::GeneralPurposeBitwidth}
+                            );
+                            copy.location(store_ir->location());
+                            copy.add_operand(MOperandValueReference(function, f, store_ir->ptr()));
+                            copy.add_use();
+                            bb.add_instruction(copy);
+                            store.add_operand(MOperandRegister(copy.reg(), uint(copy.regsize())));
+                        } else store.add_operand(MOperandValueReference(function, f, store_ir->ptr()));
+
                         bb.add_instruction(store);
                     } break;
 
@@ -1080,7 +1416,7 @@ auto Module::mir() -> std::vector<MFunction> {
                             _ctx->target()->is_cconv_sysv()
                             and ret_ir->has_value()
                             and ret_type_bytes > x86_64::GeneralPurposeBytewidth
-                            and ret_type_bytes <= 2 * x86_64::GeneralPurposeBytewidth
+                            and cconv::sysv::returns_in_registers(func_type->ret())
                         ) {
                             if (_ctx->target()->is_arch_x86_64()) {
                                 // Add eight bytes to pointer to load from next.
@@ -1102,7 +1438,7 @@ auto Module::mir() -> std::vector<MFunction> {
 
                                 auto load_a = MInst(
                                     MInst::Kind::Load,
-                                    {usz(x86_64::RegisterId::RAX), x86_64::GeneralPurposeBitwidth}
+                                    {cconv::sysv::ret_regs[0], x86_64::GeneralPurposeBitwidth}
                                 );
                                 load_a.location(ret_ir->location());
                                 load_a.add_operand(MOperandValueReference(function, f, ret_ir->val()));
@@ -1110,7 +1446,7 @@ auto Module::mir() -> std::vector<MFunction> {
                                 auto load_b = MInst(
                                     MInst::Kind::Load,
                                     {
-                                        usz(x86_64::RegisterId::RDX),
+                                        cconv::sysv::ret_regs[1],
                                         uint(func_type->ret()->bits() - x86_64::GeneralPurposeBitwidth) //
                                     }
                                 );
@@ -1177,10 +1513,37 @@ auto Module::mir() -> std::vector<MFunction> {
                     case Value::Kind::UGt:
                     case Value::Kind::UGe: {
                         auto* binary_ir = as<BinaryInst>(instruction);
+                        auto lhs = MOperandValueReference(function, f, binary_ir->lhs());
+                        if (
+                            is<SDivInst, UDivInst, SRemInst, URemInst>(binary_ir)
+                            and LowerDivisionByConstant(bb, binary_ir, lhs)
+                        ) {
+                            stats::Count("mir", "divisions by constant lowered");
+                            break;
+                        }
+
                         auto binary = MInst(ir_nary_inst_kind_to_mir(binary_ir->kind()), {virts[instruction], uint(binary_ir->type()->bits())});
                         binary.location(binary_ir->location());
-                        binary.add_operand(MOperandValueReference(function, f, binary_ir->lhs()));
-                        binary.add_operand(MOperandValueReference(function, f, binary_ir->rhs()));
+                        binary.add_operand(lhs);
+
+                        // Immediate operands of x86_64 arithmetic are at most 32 bits, and
+                        // sign-extended; anything larger goes in a register (e.g. the mask
+                        // InstCombine makes of `urem x, 1 << 40`).
+                        auto* rhs_constant = cast<IntegerConstant>(binary_ir->rhs());
+                        if (
+                            _ctx->target()->is_arch_x86_64()
+                            and rhs_constant
+                            and binary_ir->type()->bits() == 64
+                            and i64(rhs_constant->value().value()) != i64(i32(rhs_constant->value().value()))
+                        ) {
+                            auto copy = MInst(MInst::Kind::Copy, {next_vreg(), 64});
+                            copy.location(binary_ir->location());
+                            copy.add_operand(MOperandImmediate(rhs_constant->value().value(), 64));
+                            copy.add_use();
+                            bb.add_instruction(copy);
+                            binary.add_operand(MOperandRegister(copy.reg(), uint(copy.regsize())));
+                        } else binary.add_operand(MOperandValueReference(function, f, binary_ir->rhs()));
+
                         bb.add_instruction(binary);
                     } break;
                 }
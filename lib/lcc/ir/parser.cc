@@ -63,7 +63,8 @@ constexpr auto StringifyEnum(TokenKind t) -> std::string_view {
 }
 
 std::unordered_map<std::string, IntrinsicKind> intrinsic_kinds{
-    {"@memcpy", IntrinsicKind::MemCopy}};
+    {"@memcpy", IntrinsicKind::MemCopy},
+    {"@syscall", IntrinsicKind::SystemCall}};
 
 class Parser : syntax::Lexer<syntax::Token<TokenKind>> {
     using Tk = TokenKind;
@@ -346,7 +347,7 @@ void lcc::parser::Parser::NextToken() {
             }
 
             NextNumber();
-            tok.integer_value = tok.integer_value;
+            tok.integer_value = -tok.integer_value;
             break;
 
         default:
@@ -521,7 +522,12 @@ auto lcc::parser::Parser::ParseIntrinsic() -> Result<IntrinsicInst*> {
 
     if (not Consume(Tk::RParen)) return Error("Expected ')'");
 
-    auto intrinsic = new (*mod) IntrinsicInst(intrinsic_it->second, {}, loc);
+    /// System calls yield the value returned by the kernel.
+    auto* ty = intrinsic_it->second == IntrinsicKind::SystemCall
+                 ? IntegerType::Get(mod->context(), 64)
+                 : Type::UnknownTy;
+
+    auto intrinsic = new (*mod) IntrinsicInst(intrinsic_it->second, {}, ty, loc);
     intrinsic->operand_list.resize(args.size());
     for (const auto& [i, arg] : vws::enumerate(args))
         SetValue(intrinsic, intrinsic->operand_list[usz(i)], arg);
@@ -805,6 +811,14 @@ auto lcc::parser::Parser::ParseInstruction() -> Result<Inst*> {
         return call;
     }
 
+    if (tok.text == "intrinsic") {
+        NextToken();
+        auto intrinsic = ParseIntrinsic();
+        if (intrinsic.is_diag()) return intrinsic.diag();
+        AddTemporary(std::move(tmp), *intrinsic);
+        return intrinsic;
+    }
+
     if (tok.text == "gep") return ParseGEP<GEPInst>(std::move(tmp));
     if (tok.text == "gmp") return ParseGEP<GetMemberPtrInst>(std::move(tmp));
 
@@ -39,7 +39,9 @@ LccContextRef lcc_context_create(LccTargetRef target, LccFormatRef format) {
             lcc::Context::DoNotStopatSyntax,
             lcc::Context::DoNotStopatSema,
             lcc::Context::DoNotPrintMIR,
-            lcc::Context::DoNotStopatMIR //
+            lcc::Context::DoNotStopatMIR,
+            lcc::Context::DoNotUseLinearScan,
+            lcc::Context::DoNotOmitFramePointer //
         }});
 }
 
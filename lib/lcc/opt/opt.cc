@@ -1,6 +1,7 @@
 #include <lcc/core.hh>
 #include <lcc/ir/domtree.hh>
 #include <lcc/opt/opt.hh>
+#include <lcc/utils/statistics.hh>
 
 #include <algorithm>
 #include <concepts>
@@ -9,6 +10,7 @@
 #include <string_view>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -23,7 +25,7 @@ struct OptimisationPass {
 
     /// Check if this pass has changed the ir.
     [[nodiscard]]
-    auto changed() const -> bool { return has_changed; }
+    auto changed() const -> bool { return change_count != 0; }
 
 protected:
     /// Helper to create an integer constant.
@@ -68,10 +70,14 @@ protected:
     }
 
     /// Mark that this pass has changed the ir.
-    void SetChanged() { has_changed = true; }
+    void SetChanged() { ++change_count; }
+
+    /// How many times this pass has changed the ir so far.
+    [[nodiscard]]
+    auto changes() const -> usz { return change_count; }
 
 private:
-    bool has_changed = false;
+    usz change_count = 0;
 };
 
 /// Optimisation pass that runs on an instruction kind.
@@ -116,6 +122,8 @@ struct ModuleRewritePass : OptimisationPass {};
 /// operate on individual instructions and don’t really fit in anywhere
 /// else can also go here.
 struct InstCombinePass : InstructionRewritePass {
+    static constexpr std::string_view name = "icmb";
+
 private:
     /// Get the lhs and rhs of a binary expression as integer constants.
     static auto GetIntegerPair(BinaryInst* b) {
@@ -155,12 +163,44 @@ private:
         }
 
         /// Division by a power of two is a right shift (note that
-        /// this only works for *unsigned* division; for signed
-        /// division, we defer optimising this to the backend).
+        /// this only works for *unsigned* division; signed division
+        /// by a power of two, and division by any other constant, is
+        /// strength-reduced when generating MIR).
         else {
             if constexpr (std::is_same_v<DivInst, UDivInst>) {
                 if (rhs->value().is_power_of_two()) {
-                    Replace<ShiftInst>(i, d->lhs(), MakeInt(rhs->value().log2()), d->location());
+                    auto* amount = new (*mod) IntegerConstant(d->type(), rhs->value().log2());
+                    Replace<ShiftInst>(i, d->lhs(), amount, d->location());
+                }
+            }
+        }
+    }
+
+    /// Handle signed and unsigned remainder.
+    template <typename RemInst, auto Eval>
+    void RemImpl(Inst* i) {
+        auto r = as<RemInst>(i);
+        auto rhs = cast<IntegerConstant>(r->rhs());
+        if (not rhs) return;
+
+        /// Check for division by zero.
+        if (rhs->value() == 0) Replace<PoisonValue>(i, r->type());
+
+        /// The remainder of a division by 1 is always 0.
+        else if (rhs->value() == 1) Replace<IntegerConstant>(i, r->type(), 0);
+
+        /// Evaluate the remainder if both operands are constants.
+        else if (auto lhs = cast<IntegerConstant>(r->lhs())) {
+            Replace(i, Eval(lhs->value(), rhs->value()));
+        }
+
+        /// The remainder of an unsigned division by a power of two
+        /// is the dividend masked to the bits below that power.
+        else {
+            if constexpr (std::is_same_v<RemInst, URemInst>) {
+                if (rhs->value().is_power_of_two()) {
+                    auto* mask = new (*mod) IntegerConstant(r->type(), rhs->value().value() - 1);
+                    Replace<AndInst>(i, r->lhs(), mask, r->location());
                 }
             }
         }
@@ -191,8 +231,7 @@ private:
         if (op) Replace(i, std::invoke(Eval, op->value(), u8(cast<IntegerType>(e->type())->bitwidth())));
     }
 
-public:
-    void run_on_instruction(Inst* i) {
+    void Combine(Inst* i) {
         switch (i->kind()) {
             default: return;
             case Value::Kind::Alloca: {
@@ -383,6 +422,14 @@ public:
                 DivImpl<UDivInst, ShrInst, [](auto l, auto r) { return l.udiv(r); }>(i);
                 break;
 
+            case Value::Kind::SRem:
+                RemImpl<SRemInst, [](auto l, auto r) { return l.srem(r); }>(i);
+                break;
+
+            case Value::Kind::URem:
+                RemImpl<URemInst, [](auto l, auto r) { return l.urem(r); }>(i);
+                break;
+
             case Value::Kind::Eq: CmpImpl < &aint::operator==>(i); break;
             case Value::Kind::Ne: CmpImpl < &aint::operator!=>(i); break;
             case Value::Kind::SLt: CmpImpl<&aint::slt>(i); break;
@@ -399,6 +446,13 @@ public:
             case Value::Kind::ZExt: TruncExtImpl<&aint::zext>(i); break;
         }
     }
+
+public:
+    void run_on_instruction(Inst* i) {
+        auto changes_before = changes();
+        Combine(i);
+        if (changes() != changes_before) stats::Count(name, "instructions combined");
+    }
 };
 
 /// Scalar replacement of aggregates.
@@ -407,6 +461,8 @@ public:
 /// into multiple variables if possible so we can optimise
 /// each one in isolation.
 struct SROAPass : InstructionRewritePass {
+    static constexpr std::string_view name = "sroa";
+
 private:
     void TrySplitAlloca(AllocaInst* a) {
         /// Skip if this is not a struct or array type.
@@ -416,6 +472,7 @@ private:
         if (a->users().empty()) {
             a->erase_cascade();
             SetChanged();
+            stats::Count(name, "unused allocas removed");
             return;
         }
 
@@ -547,6 +604,7 @@ private:
 
         /// Finally, delete the original alloca.
         a->erase();
+        stats::Count(name, "allocas split");
     }
 
     /// Split a struct into multiple variables; since structs
@@ -587,6 +645,7 @@ private:
         /// Finally, delete the original alloca.
         a->erase();
         SetChanged();
+        stats::Count(name, "allocas split");
     }
 
 public:
@@ -598,6 +657,8 @@ public:
 
 /// Pass that performs simple store forwarding.
 struct StoreFowardingPass : InstructionRewritePass {
+    static constexpr std::string_view name = "sfwd";
+
     struct Var {
         AllocaInst* alloca;
         StoreInst* store{};
@@ -651,6 +712,7 @@ struct StoreFowardingPass : InstructionRewritePass {
             l->replace_with(var->last_value);
             var->last_store_used = true;
             SetChanged();
+            stats::Count(name, "loads forwarded");
             return;
         }
 
@@ -713,12 +775,15 @@ private:
         if (var.store and var.last_value == var.store->val() and not var.last_store_used) {
             var.store->erase();
             SetChanged();
+            stats::Count(name, "dead stores removed");
         }
     }
 };
 
 /// SSA construction pass (aka mem2reg).
 struct SSAConstructionPass : InstructionRewritePass {
+    static constexpr std::string_view name = "ssa";
+
     std::vector<AllocaInst*> allocas{};
 
     void run_on_instruction(Inst* i) {
@@ -733,6 +798,7 @@ struct SSAConstructionPass : InstructionRewritePass {
         auto optimisable = utils::to_vec(allocas | vws::filter(Optimisable));
         if (optimisable.empty()) return;
         SetChanged();
+        stats::Count(name, "allocas promoted", optimisable.size());
 
         /// Definitions of a variable.
         std::unordered_map<AllocaInst*, std::vector<Inst*>> defs{optimisable.size()};
@@ -782,6 +848,7 @@ struct SSAConstructionPass : InstructionRewritePass {
                 auto* phi = b->create_phi(a->allocated_type(), a->location());
                 defs[a].push_back(phi);
                 phis.emplace_back(phi, a);
+                stats::Count(name, "phis inserted");
             }
         }
 
@@ -841,6 +908,8 @@ private:
 
 /// CFG simplification pass.
 struct CFGSimplPass : InstructionRewritePass {
+    static constexpr std::string_view name = "cfgs";
+
     void run_on_function(Function* f) {
         /// We start at 1 because the entry block is always reachable.
         for (usz i = 1; i < f->blocks().size(); /** No increment! **/) {
@@ -866,6 +935,7 @@ struct CFGSimplPass : InstructionRewritePass {
                     continue;
                 }
                 branch->block()->merge(b);
+                stats::Count(name, "blocks merged");
             }
             // Otherwise, the block is unreachable. Remove it from all PHIs.
             else {
@@ -876,6 +946,7 @@ struct CFGSimplPass : InstructionRewritePass {
 
                 /// Yeet!
                 b->erase();
+                stats::Count(name, "unreachable blocks removed");
             }
 
             // Don't increment, since we may just have removed this block, and
@@ -887,6 +958,8 @@ struct CFGSimplPass : InstructionRewritePass {
 
 /// Eliminate instructions whose results are unused if they have no side-effects.
 struct DCEPass : InstructionRewritePass {
+    static constexpr std::string_view name = "dce";
+
     void run_on_instruction(Inst* i) {
         if (not i->users().empty()) return;
         switch (i->kind()) {
@@ -926,12 +999,122 @@ struct DCEPass : InstructionRewritePass {
             case Value::Kind::UGe:
                 i->erase();
                 SetChanged();
+                stats::Count(name, "instructions removed");
                 return;
         }
     }
 };
 
+/// Replace an instruction that computes the same value as an earlier
+/// instruction in the same block with that earlier instruction.
+///
+/// This compares each instruction against every one before it in its
+/// block, so it is only run at -O3.
+struct LocalCSEPass : InstructionRewritePass {
+    static constexpr std::string_view name = "cse";
+
+    /// Instructions in the current block whose values can be reused.
+    std::vector<Inst*> available{};
+
+    void enter_block(Block*) { available.clear(); }
+
+    void run_on_instruction(Inst* i) {
+        if (not Pure(i)) return;
+        auto it = rgs::find_if(available, [&](Inst* a) { return Equivalent(a, i); });
+        if (it == available.end()) {
+            available.push_back(i);
+            return;
+        }
+
+        Replace(i, *it);
+        stats::Count(name, "instructions removed");
+    }
+
+private:
+    /// Whether an instruction's value only depends on its operands.
+    static auto Pure(Inst* i) -> bool {
+        switch (i->kind()) {
+            default: return false;
+            case Value::Kind::GetElementPtr:
+            case Value::Kind::GetMemberPtr:
+            case Value::Kind::ZExt:
+            case Value::Kind::SExt:
+            case Value::Kind::Trunc:
+            case Value::Kind::Bitcast:
+            case Value::Kind::Neg:
+            case Value::Kind::Compl:
+            case Value::Kind::Add:
+            case Value::Kind::Sub:
+            case Value::Kind::Mul:
+            case Value::Kind::SDiv:
+            case Value::Kind::UDiv:
+            case Value::Kind::SRem:
+            case Value::Kind::URem:
+            case Value::Kind::Shl:
+            case Value::Kind::Sar:
+            case Value::Kind::Shr:
+            case Value::Kind::And:
+            case Value::Kind::Or:
+            case Value::Kind::Xor:
+            case Value::Kind::Eq:
+            case Value::Kind::Ne:
+            case Value::Kind::SLt:
+            case Value::Kind::SLe:
+            case Value::Kind::SGt:
+            case Value::Kind::SGe:
+            case Value::Kind::ULt:
+            case Value::Kind::ULe:
+            case Value::Kind::UGt:
+            case Value::Kind::UGe:
+                return true;
+        }
+    }
+
+    static auto Commutative(Inst* i) -> bool {
+        switch (i->kind()) {
+            default: return false;
+            case Value::Kind::Add:
+            case Value::Kind::Mul:
+            case Value::Kind::And:
+            case Value::Kind::Or:
+            case Value::Kind::Xor:
+            case Value::Kind::Eq:
+            case Value::Kind::Ne:
+                return true;
+        }
+    }
+
+    /// Integer constants are not uniqued, so compare them by value.
+    static auto Same(Value* a, Value* b) -> bool {
+        if (a == b) return true;
+        auto* x = cast<IntegerConstant>(a);
+        auto* y = cast<IntegerConstant>(b);
+        return x and y and x->type() == y->type() and x->value() == y->value();
+    }
+
+    static auto Equivalent(Inst* a, Inst* b) -> bool {
+        if (a->kind() != b->kind() or a->type() != b->type()) return false;
+
+        if (auto* x = cast<GEPBaseInst>(a)) {
+            auto* y = as<GEPBaseInst>(b);
+            return x->base_type() == y->base_type()
+               and Same(x->ptr(), y->ptr())
+               and Same(x->idx(), y->idx());
+        }
+
+        if (auto* x = cast<BinaryInst>(a)) {
+            auto* y = as<BinaryInst>(b);
+            if (Same(x->lhs(), y->lhs()) and Same(x->rhs(), y->rhs())) return true;
+            return Commutative(a) and Same(x->lhs(), y->rhs()) and Same(x->rhs(), y->lhs());
+        }
+
+        return Same(as<UnaryInstBase>(a)->operand(), as<UnaryInstBase>(b)->operand());
+    }
+};
+
 struct GlobalDCEPass : ModuleRewritePass {
+    static constexpr std::string_view name = "gdce";
+
     void run() {
         for (usz i = 0; i < mod->code().size(); /** No increment! **/) {
             auto* f = mod->code()[i];
@@ -953,12 +1136,277 @@ struct GlobalDCEPass : ModuleRewritePass {
 
             /// Yeet.
             mod->code().erase(mod->code().begin() + isz(i));
+            stats::Count(name, "functions removed");
+        }
+    }
+};
+
+/// Reorder the blocks of a function so that the common path falls
+/// through instead of jumping.
+///
+/// Blocks are placed in chains: starting at the entry, each block is
+/// followed by its most likely successor that has not been placed yet.
+/// Without a profile, a successor inside a deeper loop is preferred
+/// over a loop exit, so loop bodies (and their latches) come before the
+/// code after the loop and the branch back to the header is the one
+/// that is taken; otherwise, the then block is preferred. With a
+/// profile (see `-fprofile-use`), the most executed successor wins.
+///
+/// Cold blocks, i.e. blocks that end in `unreachable`, that only lead
+/// to cold blocks, that are dominated by a cold block, or that were
+/// never executed when profiling, are moved to the end of the function.
+///
+/// A block is only placed once its immediate dominator has been, so
+/// definitions still precede their uses in the final order. Lastly,
+/// conditional branches whose else block now directly follows them
+/// are inverted, since only a fallthrough to the then block saves a
+/// jump.
+struct BlockLayoutPass : InstructionRewritePass {
+    static constexpr std::string_view name = "layout";
+
+    void run_on_function(Function* f) {
+        /// Nothing to reorder, as the entry block always stays first.
+        if (f->blocks().size() < 3) return;
+
+        /// Take a copy; the dominator tree identifies blocks by their
+        /// index, so all of this has to be computed before we move
+        /// anything around.
+        const auto original = f->blocks();
+        auto reachable = Reachable(f);
+        DomTree dom{f, false};
+
+        std::unordered_map<Block*, Block*> idoms{};
+        for (auto* b : original) {
+            if (b == f->entry() or not reachable.contains(b)) continue;
+            for (auto* p : dom.parents(b)) {
+                idoms[b] = p;
+                break;
+            }
+        }
+
+        /// Predecessors of each block, and how many of them reach it
+        /// through a forward (i.e. not a back) edge and are not placed
+        /// yet. A join point is only placed after all of those, so
+        /// e.g. an if/else is laid out as then, else, join rather than
+        /// then, join, else.
+        std::unordered_map<Block*, std::vector<Block*>> predecessors{};
+        std::unordered_map<Block*, usz> pending{};
+        for (auto* b : original) {
+            if (not reachable.contains(b)) continue;
+            for (auto* s : b->successors()) {
+                predecessors[s].push_back(b);
+                if (not dom.dominates(s, b)) pending[s]++;
+            }
+        }
+
+        auto depth = LoopDepths(original, reachable, predecessors, dom);
+        auto cold = ColdBlocks(f, original, reachable, dom);
+        bool profiled = rgs::all_of(original, [](Block* b) { return b->execution_count().has_value(); });
+
+        /// Check if `a` is a better fallthrough successor than `b`. On a
+        /// tie, the successor that comes first (i.e. the then block) is
+        /// kept.
+        const auto Better = [&](Block* a, Block* b) {
+            if (profiled and *a->execution_count() != *b->execution_count())
+                return *a->execution_count() > *b->execution_count();
+            return depth[a] > depth[b];
+        };
+
+        std::vector<Block*> layout{};
+        std::unordered_set<Block*> placed{};
+        const auto Placeable = [&](Block* b, bool want_cold, bool strict) {
+            if (placed.contains(b) or not reachable.contains(b)) return false;
+            if (cold.contains(b) != want_cold) return false;
+            if (strict and pending[b] != 0) return false;
+            return b == f->entry() or placed.contains(idoms.at(b));
+        };
+
+        const auto Place = [&](Block* b) {
+            layout.push_back(b);
+            placed.insert(b);
+            for (auto* s : b->successors())
+                if (not dom.dominates(s, b)) pending[s]--;
+        };
+
+        /// Place all hot blocks first, then all cold blocks, each time
+        /// starting a new chain at the first block (in the original
+        /// order) that can be placed. If the CFG is irreducible, there
+        /// may not be a block all of whose predecessors are placed, in
+        /// which case we settle for one whose dominator is.
+        for (bool want_cold : {false, true}) {
+            for (;;) {
+                const auto Seed = [&](bool strict) {
+                    return rgs::find_if(original, [&](Block* b) { return Placeable(b, want_cold, strict); });
+                };
+
+                auto seed = Seed(true);
+                if (seed == original.end()) seed = Seed(false);
+                if (seed == original.end()) break;
+                for (auto* b = *seed; b;) {
+                    Place(b);
+                    Block* next{};
+                    for (auto* s : b->successors())
+                        if (Placeable(s, want_cold, true) and (not next or Better(s, next)))
+                            next = s;
+                    b = next;
+                }
+            }
+        }
+
+        /// Blocks that cannot be reached at all go last.
+        for (auto* b : original)
+            if (not reachable.contains(b)) layout.push_back(b);
+
+        LCC_ASSERT(layout.size() == original.size(), "Block layout lost or duplicated a block");
+        LCC_ASSERT(layout.front() == f->entry(), "Block layout must not move the entry block");
+
+        usz moved = 0;
+        for (usz i = 0; i < layout.size(); i++)
+            if (layout[i] != original[i]) moved++;
+
+        if (moved) {
+            f->blocks() = std::move(layout);
+            SetChanged();
+            stats::Count(name, "blocks moved", moved);
+        }
+
+        for (usz i = 0; i + 1 < f->blocks().size(); i++)
+            InvertBranch(f->blocks()[i], f->blocks()[i + 1]);
+    }
+
+private:
+    /// Blocks reachable from the entry block.
+    static auto Reachable(Function* f) -> std::unordered_set<Block*> {
+        std::unordered_set<Block*> reachable{f->entry()};
+        std::vector<Block*> worklist{f->entry()};
+        while (not worklist.empty()) {
+            auto* b = worklist.back();
+            worklist.pop_back();
+            for (auto* s : b->successors())
+                if (reachable.insert(s).second) worklist.push_back(s);
+        }
+        return reachable;
+    }
+
+    /// Number of natural loops each block is part of. A back edge is
+    /// an edge to a block that dominates its source; the loop is the
+    /// header plus every block that reaches the source of a back edge
+    /// without going through the header.
+    static auto LoopDepths(
+        const std::vector<Block*>& blocks,
+        const std::unordered_set<Block*>& reachable,
+        std::unordered_map<Block*, std::vector<Block*>>& predecessors,
+        const DomTree& dom
+    ) -> std::unordered_map<Block*, usz> {
+        std::unordered_map<Block*, std::unordered_set<Block*>> loops{};
+        for (auto* latch : blocks) {
+            if (not reachable.contains(latch)) continue;
+            for (auto* header : latch->successors()) {
+                if (not dom.dominates(header, latch)) continue;
+                auto& body = loops[header];
+                body.insert(header);
+                std::vector<Block*> worklist{};
+                if (body.insert(latch).second) worklist.push_back(latch);
+                while (not worklist.empty()) {
+                    auto* b = worklist.back();
+                    worklist.pop_back();
+                    for (auto* p : predecessors[b])
+                        if (reachable.contains(p) and body.insert(p).second)
+                            worklist.push_back(p);
+                }
+            }
+        }
+
+        std::unordered_map<Block*, usz> depth{};
+        for (auto* b : blocks) depth[b] = 0;
+        for (auto& [_, body] : loops)
+            for (auto* b : body) depth[b]++;
+        return depth;
+    }
+
+    /// Blocks that are unlikely to be executed.
+    static auto ColdBlocks(
+        Function* f,
+        const std::vector<Block*>& blocks,
+        const std::unordered_set<Block*>& reachable,
+        DomTree& dom
+    ) -> std::unordered_set<Block*> {
+        std::unordered_set<Block*> cold{};
+        for (auto* b : blocks) {
+            if (b == f->entry()) continue;
+            if ((b->closed() and is<UnreachableInst>(b->terminator())) or b->execution_count() == 0u)
+                cold.insert(b);
+        }
+
+        /// A block that can only end up in cold code is itself cold.
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto* b : blocks) {
+                if (b == f->entry() or cold.contains(b) or b->successor_count() == 0) continue;
+                bool all_cold = true;
+                for (auto* s : b->successors()) all_cold = all_cold and cold.contains(s);
+                if (all_cold) {
+                    cold.insert(b);
+                    changed = true;
+                }
+            }
+        }
+
+        /// And so is one that can only be reached through cold code.
+        std::vector<Block*> dominated{};
+        for (auto* b : blocks) {
+            if (b == f->entry() or cold.contains(b) or not reachable.contains(b)) continue;
+            for (auto* p : dom.parents(b)) {
+                if (cold.contains(p)) {
+                    dominated.push_back(b);
+                    break;
+                }
+            }
         }
+
+        cold.insert(dominated.begin(), dominated.end());
+        return cold;
+    }
+
+    /// Invert a conditional branch at the end of `b` if its else block
+    /// is the one that follows it.
+    void InvertBranch(Block* b, Block* next) {
+        if (not b->closed()) return;
+        auto* br = cast<CondBranchInst>(b->terminator());
+        if (not br or br->else_block() != next or br->then_block() == next) return;
+
+        /// We only flip comparisons that are used for nothing else.
+        auto* cmp = cast<CompareInst>(br->cond());
+        if (not cmp or cmp->users().size() != 1) return;
+
+        auto* lhs = cmp->lhs();
+        auto* rhs = cmp->rhs();
+        auto loc = cmp->location();
+        switch (cmp->kind()) {
+            case Value::Kind::Eq: Replace<NeInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::Ne: Replace<EqInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::SLt: Replace<SGeInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::SLe: Replace<SGtInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::SGt: Replace<SLeInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::SGe: Replace<SLtInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::ULt: Replace<UGeInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::ULe: Replace<UGtInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::UGt: Replace<ULeInst>(cmp, lhs, rhs, loc); break;
+            case Value::Kind::UGe: Replace<ULtInst>(cmp, lhs, rhs, loc); break;
+            default: return;
+        }
+
+        auto* then = br->then_block();
+        br->then_block(next);
+        br->else_block(then);
+        stats::Count(name, "branches inverted");
     }
 };
 
 /// Debugging pass to print the dominator tree of a function.
 struct PrintDOMTreePass : InstructionRewritePass {
+    static constexpr std::string_view name = "print-dom";
+
     static void run_on_function(Function* f) {
         fmt::print("{}", DomTree{f, false}.debug());
     }
@@ -966,23 +1414,49 @@ struct PrintDOMTreePass : InstructionRewritePass {
 
 struct Optimiser {
     Module* mod;
+    int opt_level;
 
-    /// TODO: Actually use this.
-    [[maybe_unused]] int opt_level;
+    /// Maximum number of times a pipeline is rerun while its
+    /// passes keep changing the module. -O3 effectively runs
+    /// until nothing changes anymore.
+    static constexpr usz O1Iterations = 2;
+    static constexpr usz O2Iterations = 8;
+    static constexpr usz O3Iterations = 64;
 
     /// Entry point.
     void run() { // clang-format off
-        RunPasses<
-            InstCombinePass,
-            SROAPass,
-            StoreFowardingPass,
-            CFGSimplPass,
-            SSAConstructionPass,
-            DCEPass,
-            GlobalDCEPass
-        >();
+        switch (opt_level) {
+            case 0: return;
+
+            /// Cheap cleanups only: promote scalars to registers,
+            /// fold what that exposes, and drop dead code and unused
+            /// internal functions.
+            case 1:
+                RunPasses<
+                    SSAConstructionPass,
+                    InstCombinePass,
+                    DCEPass,
+                    GlobalDCEPass
+                >(O1Iterations);
+                return;
+
+            /// Everything, including aggregate splitting, store
+            /// forwarding and CFG simplification.
+            case 2:
+                RunFullPipeline(O2Iterations);
+                return;
+
+            /// Same passes as -O2, plus common subexpression
+            /// elimination, iterated to a fixed point.
+            default:
+                RunFullPipeline<LocalCSEPass>(O3Iterations);
+                return;
+        }
     } // clang-format on
 
+    /// Entry point for block placement.
+    void layout() { (void) RunPass<BlockLayoutPass>(); }
+
     /// Entry point for running select passes.
     void run_passes(std::string_view passes) {
         for (const auto& p : vws::split(passes, ',')) {
@@ -994,22 +1468,44 @@ struct Optimiser {
             else if (s == "gdce") (void) RunPass<GlobalDCEPass>();
             else if (s == "ssa") (void) RunPass<SSAConstructionPass>();
             else if (s == "cfgs") (void) RunPass<CFGSimplPass>();
+            else if (s == "cse") (void) RunPass<LocalCSEPass>();
+            else if (s == "layout") (void) RunPass<BlockLayoutPass>();
             else if (s == "print-dom") (void) RunPass<PrintDOMTreePass>();
-            else if (s == "*") run();
+            else if (s == "*") RunFullPipeline<LocalCSEPass>(O3Iterations);
             else Diag::Fatal("Unknown pass '{}'", s);
         }
     }
 
 private:
+    /// Run every pass that -O2 runs, and then `ExtraPasses`.
+    template <typename... ExtraPasses>
+    void RunFullPipeline(usz max_iterations) { // clang-format off
+        RunPasses<
+            InstCombinePass,
+            SROAPass,
+            StoreFowardingPass,
+            CFGSimplPass,
+            SSAConstructionPass,
+            ExtraPasses...,
+            DCEPass,
+            GlobalDCEPass
+        >(max_iterations);
+    } // clang-format on
+
     template <typename... Passes>
-    void RunPasses() {
-        /// Run all passes so long as at least one of them returns true.
-        while (((unsigned int) (RunPass<Passes>()) | ...)) {}
+    void RunPasses(usz max_iterations) {
+        /// Run all passes so long as at least one of them returns true,
+        /// but give up after a fixed number of iterations.
+        for (usz i = 0; i < max_iterations; i++) {
+            stats::Count("opt", "pipeline iterations");
+            if (not((unsigned int) (RunPass<Passes>()) | ...)) break;
+        }
     }
 
     template <typename Pass>
     [[nodiscard]]
     auto RunPass() -> bool {
+        stats::Timer _{Pass::name};
         if constexpr (std::derived_from<Pass, InstructionRewritePass>) {
             return RunPassOnInstructions<Pass>();
         } else if constexpr (std::derived_from<Pass, ModuleRewritePass>) {
@@ -1083,11 +1579,19 @@ private:
 } // namespace lcc::opt
 
 void lcc::opt::Optimise(Module* module, int opt_level) {
+    stats::Timer _{"opt"};
     Optimiser o{module, opt_level};
     o.run();
 }
 
 void lcc::opt::RunPasses(lcc::Module* module, std::string_view passes) {
+    stats::Timer _{"opt"};
     Optimiser o{module, 0};
     o.run_passes(passes);
 }
+
+void lcc::opt::LayoutBlocks(lcc::Module* module) {
+    stats::Timer _{"opt"};
+    Optimiser o{module, 0};
+    o.layout();
+}
@@ -0,0 +1,296 @@
+#include <lcc/context.hh>
+#include <lcc/core.hh>
+#include <lcc/diags.hh>
+#include <lcc/file.hh>
+#include <lcc/format.hh>
+#include <lcc/ir/ir.hh>
+#include <lcc/ir/module.hh>
+#include <lcc/opt/profile.hh>
+#include <lcc/target.hh>
+#include <lcc/utils.hh>
+#include <lcc/utils/statistics.hh>
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+namespace lcc::opt {
+namespace {
+/// A profile is an array of little-endian 64-bit words: a header
+/// followed by one execution count per instrumented block. The same
+/// array lives in the instrumented program as a global variable and
+/// is written to disk as-is.
+///
+///     [0]      ProfileMagic
+///     [1]      StructuralHash() of the module that was instrumented
+///     [2]      Number of counters
+///     [3...]   Counters, in order of functions, then blocks
+constexpr u64 ProfileMagic = 0x01464f525043434c; // "LCCPROF\x01"
+constexpr usz ProfileHeaderWords = 3;
+
+/// Linux x86_64 system call numbers and flags used by the profile dump.
+constexpr u64 SysWrite = 1;
+constexpr u64 SysOpen = 2;
+constexpr u64 SysClose = 3;
+constexpr u64 SysExit = 60;
+constexpr u64 SysExitGroup = 231;
+constexpr u64 OpenFlags = 0x241; // O_WRONLY | O_CREAT | O_TRUNC
+constexpr u64 OpenMode = 0644;
+
+/// Functions whose blocks are counted (i.e. the ones with a body).
+auto ProfiledFunctions(Module* mod) -> std::vector<Function*> {
+    std::vector<Function*> functions{};
+    for (auto* f : mod->code())
+        if (not f->blocks().empty()) functions.push_back(f);
+    return functions;
+}
+
+auto ProfiledBlockCount(const std::vector<Function*>& functions) -> usz {
+    usz count = 0;
+    for (auto* f : functions) count += f->blocks().size();
+    return count;
+}
+
+/// FNV-1a hash over the shape of the module: the name and block count
+/// of each function, and the instruction kinds in each block. A profile
+/// is only applied to a module with the same shape as the one that was
+/// instrumented, since the counters are matched to blocks by position.
+auto StructuralHash(const std::vector<Function*>& functions) -> u64 {
+    constexpr u64 FNVOffsetBasis = 0xcbf29ce484222325;
+    constexpr u64 FNVPrime = 0x100000001b3;
+
+    u64 hash = FNVOffsetBasis;
+    const auto MixByte = [&](u8 byte) {
+        hash ^= byte;
+        hash *= FNVPrime;
+    };
+    const auto Mix = [&](u64 value) {
+        for (usz i = 0; i < sizeof(u64); ++i) MixByte(u8(value >> (i * 8)));
+    };
+
+    for (auto* f : functions) {
+        auto name = f->names().at(0).name;
+        for (char c : name) MixByte(u8(c));
+        Mix(f->blocks().size());
+        for (auto* b : f->blocks()) {
+            Mix(b->instructions().size());
+            for (auto* i : b->instructions()) Mix(u64(+i->kind()));
+        }
+    }
+
+    return hash;
+}
+
+/// Whether \p inst ends the process without returning from `main`, so
+/// that the profile has to be written before it.
+auto ExitsProcess(Inst* inst) -> bool {
+    if (auto* call = cast<CallInst>(inst)) {
+        auto* callee = cast<Function>(call->callee());
+        if (not callee) return false;
+        return rgs::any_of(callee->names(), [](const auto& n) {
+            return n.name == "exit" or n.name == "_exit" or n.name == "_Exit"
+                or n.name == "quick_exit" or n.name == "abort";
+        });
+    }
+
+    if (auto* intrinsic = cast<IntrinsicInst>(inst)) {
+        if (intrinsic->intrinsic_kind() != IntrinsicKind::SystemCall) return false;
+        auto* number = cast<IntegerConstant>(intrinsic->operands().at(0));
+        return number and (number->value() == SysExit or number->value() == SysExitGroup);
+    }
+
+    return false;
+}
+
+auto FindMain(Module* mod) -> Function* {
+    for (auto* f : mod->code()) {
+        if (f->blocks().empty()) continue;
+        for (const auto& n : f->names())
+            if (n.name == "main" and IsExportedLinkage(n.linkage)) return f;
+    }
+    return nullptr;
+}
+} // namespace
+} // namespace lcc::opt
+
+void lcc::opt::InstrumentProfile(Module* mod, std::string_view profile_path) {
+    stats::Timer _{"profile-generate"};
+
+    auto* ctx = mod->context();
+    if (not ctx->target()->is_arch_x86_64() or not ctx->target()->is_platform_linux()) {
+        Diag::Error("-fprofile-generate is only supported when targeting x86_64 Linux");
+        return;
+    }
+
+    if (
+        ctx->format()->format() != Format::GNU_AS_ATT_ASSEMBLY
+        and ctx->format()->format() != Format::ELF_OBJECT
+    ) {
+        Diag::Error("-fprofile-generate requires native code output (assembly or object file)");
+        return;
+    }
+
+    /// The counters are written out when the program exits, which it
+    /// only does by itself if it has a `main`.
+    auto* main = FindMain(mod);
+    if (not main) {
+        Diag::Warning("-fprofile-generate: module has no `main` function; not instrumenting");
+        return;
+    }
+
+    auto functions = ProfiledFunctions(mod);
+    auto block_count = ProfiledBlockCount(functions);
+    auto hash = StructuralHash(functions);
+
+    auto* i64 = IntegerType::Get(ctx, 64);
+    const auto Constant = [&](u64 value) { return new (*mod) IntegerConstant(i64, value); };
+
+    auto* counters = new (*mod) GlobalVariable(
+        mod,
+        ArrayType::Get(ctx, ProfileHeaderWords + block_count, i64),
+        "__lcc_profile_counters",
+        Linkage::Internal,
+        nullptr
+    );
+
+    /// Increment the counter of each block when it is entered.
+    usz counter = ProfileHeaderWords;
+    for (auto* f : functions) {
+        for (auto* b : f->blocks()) {
+            /// PHIs must stay at the start of the block.
+            auto first = rgs::find_if(b->instructions(), [](Inst* i) { return not is<PhiInst>(i); });
+            LCC_ASSERT(first != b->instructions().end(), "Cannot instrument block without terminator");
+            auto* before = *first;
+
+            auto* ptr = new (*mod) GEPInst(i64, counters, Constant(counter++));
+            auto* count = new (*mod) LoadInst(i64, ptr);
+            auto* incremented = new (*mod) AddInst(count, Constant(1));
+            auto* store = new (*mod) StoreInst(incremented, ptr);
+            for (auto* i : std::array<Inst*, 4>{ptr, count, incremented, store})
+                b->insert_before(i, before);
+        }
+    }
+
+    /// Create a function that fills in the header and writes the counters
+    /// to the profile file using raw system calls, so instrumented code
+    /// does not depend on any runtime library.
+    auto* path = GlobalVariable::CreateStringPtr(mod, "__lcc_profile_path", profile_path);
+    auto* dump_ty = FunctionType::Get(ctx, Type::VoidTy, {});
+    auto* dump = new (*mod) Function(mod, "__lcc_profile_dump", dump_ty, Linkage::Internal, CallConv::C);
+    auto* entry = new (*mod) Block("__lcc_profile_dump.entry");
+    dump->append_block(entry);
+
+    for (auto [index, value] : std::array<std::pair<u64, u64>, 3>{{
+             {0, ProfileMagic},
+             {1, hash},
+             {2, block_count},
+         }}) {
+        auto* ptr = entry->insert(new (*mod) GEPInst(i64, counters, Constant(index)));
+        entry->insert(new (*mod) StoreInst(Constant(value), ptr));
+    }
+
+    const auto Syscall = [&](Block* b, std::vector<Value*> operands) {
+        return b->insert(new (*mod) IntrinsicInst(IntrinsicKind::SystemCall, std::move(operands), i64));
+    };
+
+    /// If the file cannot be opened, `open` returns a negated error
+    /// number, and the profile is dropped.
+    auto* write = new (*mod) Block("__lcc_profile_dump.write");
+    auto* exit = new (*mod) Block("__lcc_profile_dump.exit");
+    auto* fd = Syscall(entry, {Constant(SysOpen), path, Constant(OpenFlags), Constant(OpenMode)});
+    auto* failed = entry->insert(new (*mod) SLtInst(fd, Constant(0)));
+    entry->insert(new (*mod) CondBranchInst(failed, exit, write));
+
+    dump->append_block(write);
+    Syscall(write, {Constant(SysWrite), fd, counters, Constant((ProfileHeaderWords + block_count) * sizeof(u64))});
+    Syscall(write, {Constant(SysClose), fd});
+    write->insert(new (*mod) BranchInst(exit));
+
+    dump->append_block(exit);
+    exit->insert(new (*mod) ReturnInst(nullptr));
+
+    /// Call it before anything that ends the process, and before every
+    /// return from `main`. The return value is kept in memory across the
+    /// call, as it may live in a register the dump function clobbers.
+    for (auto* f : functions) {
+        for (auto* b : f->blocks()) {
+            for (auto* i : std::vector(b->instructions()))
+                if (ExitsProcess(i)) b->insert_before(new (*mod) CallInst(dump, dump_ty, {}), i);
+        }
+    }
+
+    AllocaInst* return_slot{};
+    for (auto* b : main->blocks()) {
+        if (not b->closed() or not is<ReturnInst>(b->terminator())) continue;
+        auto* ret = as<ReturnInst>(b->terminator());
+
+        if (ret->has_value() and is<Inst>(ret->val())) {
+            auto* ty = ret->val()->type();
+            if (not return_slot) {
+                return_slot = new (*mod) AllocaInst(ty);
+                main->entry()->insert_before(return_slot, main->entry()->instructions().front());
+            }
+
+            b->insert_before(new (*mod) StoreInst(ret->val(), return_slot), ret);
+            b->insert_before(new (*mod) CallInst(dump, dump_ty, {}), ret);
+            auto* reload = new (*mod) LoadInst(ty, return_slot);
+            b->insert_before(reload, ret);
+            ret->val(reload);
+        } else {
+            b->insert_before(new (*mod) CallInst(dump, dump_ty, {}), ret);
+        }
+    }
+
+    stats::Count("profile", "blocks instrumented", block_count);
+}
+
+void lcc::opt::ApplyProfile(Module* mod, std::string_view profile_path) {
+    stats::Timer _{"profile-use"};
+
+    fs::path path{profile_path};
+    if (not fs::exists(path)) {
+        Diag::Warning("Profile '{}' does not exist; ignoring -fprofile-use", path.string());
+        return;
+    }
+
+    auto data = File::Read(path);
+    if (data.size() % sizeof(u64) or data.size() < ProfileHeaderWords * sizeof(u64)) {
+        Diag::Warning("Profile '{}' is malformed; ignoring it", path.string());
+        return;
+    }
+
+    std::vector<u64> words(data.size() / sizeof(u64));
+    std::memcpy(words.data(), data.data(), data.size());
+    if (words[0] != ProfileMagic) {
+        Diag::Warning("'{}' is not an LCC profile; ignoring it", path.string());
+        return;
+    }
+
+    auto functions = ProfiledFunctions(mod);
+    auto block_count = ProfiledBlockCount(functions);
+    if (
+        words[1] != StructuralHash(functions)
+        or words[2] != block_count
+        or words.size() != ProfileHeaderWords + block_count
+    ) {
+        Diag::Warning(
+            "Profile '{}' does not match this program (was it generated from a different "
+            "version of it?); ignoring it",
+            path.string()
+        );
+        return;
+    }
+
+    usz counter = ProfileHeaderWords;
+    for (auto* f : functions) {
+        for (auto* b : f->blocks()) {
+            auto count = words[counter++];
+            b->execution_count(count);
+            if (not count) stats::Count("profile", "blocks never executed");
+        }
+    }
+
+    stats::Count("profile", "blocks annotated", block_count);
+}
@@ -12,6 +12,7 @@
 #    define NOMINMAX
 #    include <io.h>
 #    include <Windows.h>
+#    include <Psapi.h>
 #    define isatty _isatty
 #endif
 
@@ -20,6 +21,10 @@
 #    include <unistd.h>
 #endif
 
+#if defined(__linux__) or defined(__APPLE__)
+#    include <sys/resource.h>
+#endif
+
 namespace {
 
 }
@@ -125,3 +130,23 @@ bool lcc::platform::StdoutIsTerminal() {
 bool lcc::platform::StderrIsTerminal() {
     return isatty(fileno(stderr));
 }
+
+unsigned long long lcc::platform::PeakMemoryUsage() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (not GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#elif defined(__linux__) or defined(__APPLE__)
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#    if defined(__APPLE__)
+    // Already in bytes.
+    return (unsigned long long) usage.ru_maxrss;
+#    else
+    // In kilobytes.
+    return (unsigned long long) usage.ru_maxrss * 1024;
+#    endif
+#else
+    return 0;
+#endif
+}
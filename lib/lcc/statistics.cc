@@ -0,0 +1,232 @@
+#include <lcc/utils.hh>
+#include <lcc/utils/platform.hh>
+#include <lcc/utils/statistics.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lcc::stats {
+namespace {
+struct Phase {
+    std::string name;
+    usz depth;
+    usz runs{};
+    chr::nanoseconds time{};
+    unsigned long long peak_memory{};
+};
+
+struct Counter {
+    std::string group;
+    std::string name;
+    usz value{};
+};
+
+std::atomic_bool timing_enabled{false};
+std::atomic_bool counters_enabled{false};
+
+/// Phases and counters are kept in the order in which they were first
+/// recorded so the report reads like the compiler pipeline.
+std::mutex mutex{};
+std::vector<Phase> phases{};
+std::vector<Counter> counters{};
+
+/// Find a counter, creating it if it doesn't exist yet. The caller must
+/// hold the mutex.
+auto FindCounter(std::string_view group, std::string_view name) -> Counter& {
+    auto it = rgs::find_if(counters, [&](const Counter& c) {
+        return c.group == group and c.name == name;
+    });
+    if (it != counters.end()) return *it;
+    return counters.emplace_back(std::string{group}, std::string{name});
+}
+
+/// How many timers are currently running on this thread.
+thread_local usz timer_depth{0};
+
+auto FormatMiB(unsigned long long bytes) -> std::string {
+    return fmt::format("{:.1f}", double(bytes) / (1024.0 * 1024.0));
+}
+
+auto FormatMilliseconds(chr::nanoseconds time) -> std::string {
+    return fmt::format("{:.3f}", chr::duration<double, std::milli>(time).count());
+}
+
+/// Phase and counter names are identifiers we pick ourselves, but
+/// better safe than sorry.
+auto EscapeJSON(std::string_view s) -> std::string {
+    std::string out{};
+    for (auto c : s) {
+        if (c == '"' or c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+auto TableReport() -> std::string {
+    std::string out{};
+
+    if (timing_enabled) {
+        /// Only top-level phases count towards the total, since nested
+        /// phases are already included in their parent.
+        chr::nanoseconds total{};
+        usz name_width = std::string_view{"Phase"}.size();
+        for (const auto& p : phases) {
+            if (p.depth == 0) total += p.time;
+            name_width = std::max(name_width, 2 * p.depth + p.name.size());
+        }
+
+        out += fmt::format(
+            "===-- Time Report --===\n"
+            "{:<{}}  {:>8}  {:>14}  {:>7}  {:>16}\n",
+            "Phase",
+            name_width,
+            "Runs",
+            "Wall Time (ms)",
+            "%",
+            "Peak Memory (MiB)"
+        );
+
+        for (const auto& p : phases) {
+            auto percent = total.count() ? 100.0 * double(p.time.count()) / double(total.count()) : 0.0;
+            out += fmt::format(
+                "{:<{}}  {:>8}  {:>14}  {:>7.1f}  {:>16}\n",
+                std::string(2 * p.depth, ' ') + p.name,
+                name_width,
+                p.runs,
+                FormatMilliseconds(p.time),
+                percent,
+                FormatMiB(p.peak_memory)
+            );
+        }
+
+        out += fmt::format("{:<{}}  {:>8}  {:>14}\n", "Total", name_width, "", FormatMilliseconds(total));
+    }
+
+    if (counters_enabled) {
+        if (not out.empty()) out += '\n';
+
+        usz name_width = std::string_view{"Statistic"}.size();
+        for (const auto& c : counters)
+            name_width = std::max(name_width, c.group.size() + 1 + c.name.size());
+
+        out += fmt::format(
+            "===-- Statistics --===\n"
+            "{:<{}}  {:>12}\n",
+            "Statistic",
+            name_width,
+            "Value"
+        );
+
+        for (const auto& c : counters) {
+            out += fmt::format(
+                "{:<{}}  {:>12}\n",
+                fmt::format("{}.{}", c.group, c.name),
+                name_width,
+                c.value
+            );
+        }
+    }
+
+    return out;
+}
+
+auto JSONReport() -> std::string {
+    std::vector<std::string> sections{};
+
+    if (timing_enabled) {
+        std::vector<std::string> entries{};
+        for (const auto& p : phases) {
+            entries.push_back(fmt::format(
+                "    {{\"name\": \"{}\", \"depth\": {}, \"runs\": {}, \"wall_ms\": {}, \"peak_memory_bytes\": {}}}",
+                EscapeJSON(p.name),
+                p.depth,
+                p.runs,
+                FormatMilliseconds(p.time),
+                p.peak_memory
+            ));
+        }
+        sections.push_back(fmt::format("  \"phases\": [\n{}\n  ]", fmt::join(entries, ",\n")));
+    }
+
+    if (counters_enabled) {
+        std::vector<std::string> entries{};
+        for (const auto& c : counters) {
+            entries.push_back(fmt::format(
+                "    {{\"group\": \"{}\", \"name\": \"{}\", \"value\": {}}}",
+                EscapeJSON(c.group),
+                EscapeJSON(c.name),
+                c.value
+            ));
+        }
+        sections.push_back(fmt::format("  \"counters\": [\n{}\n  ]", fmt::join(entries, ",\n")));
+    }
+
+    return fmt::format("{{\n{}\n}}\n", fmt::join(sections, ",\n"));
+}
+} // namespace
+} // namespace lcc::stats
+
+void lcc::stats::EnableTiming() { timing_enabled = true; }
+void lcc::stats::EnableCounters() { counters_enabled = true; }
+auto lcc::stats::TimingEnabled() -> bool { return timing_enabled; }
+auto lcc::stats::CountersEnabled() -> bool { return counters_enabled; }
+
+lcc::stats::Timer::Timer(std::string_view phase) : _active(timing_enabled) {
+    if (not _active) return;
+
+    {
+        std::unique_lock _{mutex};
+        auto it = rgs::find(phases, phase, &Phase::name);
+        if (it == phases.end()) {
+            _phase = phases.size();
+            phases.emplace_back(std::string{phase}, timer_depth);
+        } else {
+            _phase = usz(std::distance(phases.begin(), it));
+        }
+    }
+
+    ++timer_depth;
+    _start = chr::steady_clock::now();
+}
+
+lcc::stats::Timer::~Timer() {
+    if (not _active) return;
+    auto elapsed = chr::steady_clock::now() - _start;
+    auto peak = platform::PeakMemoryUsage();
+    --timer_depth;
+
+    std::unique_lock _{mutex};
+    auto& p = phases[_phase];
+    p.runs++;
+    p.time += chr::duration_cast<chr::nanoseconds>(elapsed);
+    p.peak_memory = std::max(p.peak_memory, peak);
+}
+
+void lcc::stats::Count(std::string_view group, std::string_view name, usz amount) {
+    if (not counters_enabled) return;
+
+    std::unique_lock _{mutex};
+    auto& c = FindCounter(group, name);
+    c.value += amount;
+}
+
+void lcc::stats::Max(std::string_view group, std::string_view name, usz value) {
+    if (not counters_enabled) return;
+
+    std::unique_lock _{mutex};
+    auto& c = FindCounter(group, name);
+    c.value = std::max(c.value, value);
+}
+
+auto lcc::stats::Report(ReportFormat format) -> std::string {
+    std::unique_lock _{mutex};
+    switch (format) {
+        case ReportFormat::Table: return TableReport();
+        case ReportFormat::JSON: return JSONReport();
+    }
+    LCC_UNREACHABLE();
+}
@@ -4,7 +4,8 @@
 
 #include <algorithm>
 #include <cstdio>
-#include <cstring>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace lcc {
@@ -127,27 +128,24 @@ void GenericObject::as_elf(FILE* f) {
         shdrs.push_back(shdr);
     }
 
+    // ELF section index of each section, by name; the first section with
+    // a given name wins. "+ 1" because we need to start past NULL entry.
+    std::unordered_map<std::string_view, usz> section_indices{};
+    for (auto [i, section] : vws::enumerate(sections))
+        section_indices.emplace(section.name, usz(i) + 1);
+
     for (auto& sym : symbols) {
         elf64_sym elf_sym{};
         elf_sym.st_name = elf_add_string(string_table, sym.name);
 
         if (sym.kind != Symbol::Kind::EXTERNAL) {
-            // Get index of section by name
-            bool found{false};
-            usz elf_section_index{1}; // "1" because we need to start past NULL entry
-            for (auto& section : sections) {
-                if (section.name == sym.section_name) {
-                    found = true;
-                    break;
-                }
-                ++elf_section_index;
-            }
-            if (not found) Diag::ICE(
+            auto found = section_indices.find(sym.section_name);
+            if (found == section_indices.end()) Diag::ICE(
                 "[GObj]: Could not find section {} mention by symbol {}",
                 sym.section_name,
                 sym.name
             );
-            elf_sym.st_shndx = u16(elf_section_index);
+            elf_sym.st_shndx = u16(found->second);
         }
 
         elf_sym.st_value = sym.byte_offset;
@@ -248,32 +246,29 @@ void GenericObject::as_elf(FILE* f) {
         data_offset += shdr.sh_size;
     }
 
+    // Index of each symbol in the symbol table, by name; the first symbol
+    // with a given name wins. No more strings are added to the string
+    // table past this point, so it is safe to refer into it.
+    std::unordered_map<std::string_view, usz> symbol_indices{};
+    for (auto [i, elf_sym] : vws::enumerate(syms))
+        symbol_indices.emplace((const char*) string_table.data() + elf_sym.st_name, usz(i));
+
     // Build elf64_rela relocations
     std::vector<elf64_rela> elf_relocations{};
+    elf_relocations.reserve(relocations.size());
     for (auto& reloc : relocations) {
         // Find symbol with matching name.
-        auto found = std::find_if(syms.begin(), syms.end(), [&](elf64_sym elf_sym) {
-            char* sym_name = (char*) string_table.data() + elf_sym.st_name;
-            return strcmp(sym_name, reloc.symbol.name.data()) == 0;
-        });
-        if (found == syms.end()) Diag::ICE(
+        auto found = symbol_indices.find(reloc.symbol.name);
+        if (found == symbol_indices.end()) Diag::ICE(
             "Could not find symbol {} referenced by relocation",
             reloc.symbol.name
         );
-        usz sym_index = usz(found - syms.begin());
+        usz sym_index = found->second;
 
         elf64_rela elf_reloc{};
         elf_reloc.r_offset = reloc.symbol.byte_offset;
         switch (reloc.kind) {
             case Relocation::Kind::DISPLACEMENT32_PCREL: {
-                auto found_symbol = std::find_if(symbols.begin(), symbols.end(), [&](Symbol& symbol) {
-                    return symbol.name == reloc.symbol.name;
-                });
-                if (found_symbol == symbols.end()) Diag::ICE(
-                    "Could not find symbol {} referenced by relocation",
-                    reloc.symbol.name
-                );
-
                 if (reloc.symbol.kind == Symbol::Kind::FUNCTION)
                     elf_reloc.r_info = ELF64_R_INFO(sym_index, R_X86_64_PLT32);
                 else elf_reloc.r_info = ELF64_R_INFO(sym_index, R_X86_64_PC32);
@@ -298,14 +293,11 @@ void GenericObject::as_elf(FILE* f) {
     for (auto& shdr : shdrs)
         fwrite(&shdr, 1, sizeof(shdr), f);
     // Write section's data
+    // NOTE: Fill sections (e.g. .bss) are SHT_NOBITS and take up no space in
+    // the file.
     for (auto& section : sections) {
-        if (section.is_fill) {
-            // Skips .bss
-            if (section.attribute(Attr::LOAD)) {
-                for (usz n = section.length(); n; --n)
-                    fwrite(&section.value(), 1, 1, f);
-            }
-        } else fwrite(section.contents().data(), 1, section.contents().size(), f);
+        if (not section.is_fill)
+            fwrite(section.contents().data(), 1, section.contents().size(), f);
     }
     // Write symbol table ".symtab"
     fwrite(syms.data(), sizeof(*syms.data()), syms.size(), f);
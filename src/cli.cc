@@ -24,6 +24,12 @@ void help() {
         {"  --stopat-sema", "Request language does not process input further than semantic analysis\n"},
         {"  --stopat-ir", "Do not process input further than LCC's intermediate representation (IR)\n"},
         {"  --stopat-mir", "Do not process input further than LCC's machine instruction representation (MIR)\n"},
+        {"  -ftime-report", "Report wall time and peak memory usage of each compilation phase\n"},
+        {"  -fomit-frame-pointer", "Address the stack frame relative to the stack pointer instead of keeping a base pointer\n"},
+        {"  -fno-omit-frame-pointer", "Keep a base pointer in every function that needs a stack frame (default)\n"},
+        {"  -stats", "Report statistics collected by each compilation phase (e.g. instructions combined)\n"},
+        {"  -fprofile-generate[=<path>]", "Instrument the program to write block execution counts to <path> (default: lcc.profdata)\n"},
+        {"  -fprofile-use[=<path>]", "Optimise using block execution counts read from <path> (default: lcc.profdata)\n"},
         {"  --aluminium", "That special something to spice up your compilation\n"},
     }}.get());
     fmt::print("OPTIONS:\n");
@@ -44,11 +50,29 @@ void help() {
         {"", "    asm: gnu-as-att,\n"},
         {"", "    obj: elf, coff,\n"},
         {"", "    IR: ir, llvm\n"},
+        {"  --stats-format", "What format to print -ftime-report and -stats reports in (default: table)\n"},
+        {"", "    table, json\n"},
+        {"  --regalloc", "How to allocate registers (default: linear at -O0, graph otherwise)\n"},
+        {"", "    graph, linear\n"},
+        {"  --target", "What target to generate code for (default: the one lcc runs on)\n"},
+        {"", "    x86_64-linux, x86_64-windows\n"},
     }}.get());
     // clang-format on
     std::exit(0);
 }
 
+/// Get the path from `-fprofile-generate=<path>` and friends.
+auto profile_path(std::string_view arg) -> std::string {
+    auto eq = arg.find('=');
+    if (eq == std::string_view::npos) return "lcc.profdata";
+    auto path = arg.substr(eq + 1);
+    if (path.empty()) {
+        fmt::print("CLI ERROR: Expected a path after = in {}\n", arg);
+        std::exit(1);
+    }
+    return std::string{path};
+}
+
 auto parse(int argc, const char** argv) -> Options {
     Options o{};
     for (int i = 1; i < argc; ++i) {
@@ -85,6 +109,18 @@ auto parse(int argc, const char** argv) -> Options {
             o.mir = lcc::Context::PrintMIR;
         else if (arg == "--stopat-mir")
             o.stopat_mir = lcc::Context::StopatMIR;
+        else if (arg == "-ftime-report")
+            o.time_report = true;
+        else if (arg == "-fomit-frame-pointer")
+            o.omit_frame_pointer = lcc::Context::OmitFramePointer;
+        else if (arg == "-fno-omit-frame-pointer")
+            o.omit_frame_pointer = lcc::Context::DoNotOmitFramePointer;
+        else if (arg == "-stats")
+            o.stats = true;
+        else if (arg == "-fprofile-generate" or arg.starts_with("-fprofile-generate="))
+            o.profile_generate = profile_path(arg);
+        else if (arg == "-fprofile-use" or arg.starts_with("-fprofile-use="))
+            o.profile_use = profile_path(arg);
 
         else if (arg == "-I") {
             // Add a directory to the include search paths
@@ -145,6 +181,30 @@ auto parse(int argc, const char** argv) -> Options {
                 std::exit(1);
             }
             o.format = format;
+        } else if (arg == "--stats-format") {
+            // What format to print statistics reports in
+            auto stats_format = next_arg();
+            if (stats_format != "table" and stats_format != "json") {
+                fmt::print("CLI ERROR: Invalid stats format {}\n", stats_format);
+                std::exit(1);
+            }
+            o.stats_format = stats_format;
+        } else if (arg == "--regalloc") {
+            // How to allocate registers
+            auto register_allocator = next_arg();
+            if (register_allocator != "graph" and register_allocator != "linear") {
+                fmt::print("CLI ERROR: Invalid register allocator {}\n", register_allocator);
+                std::exit(1);
+            }
+            o.register_allocator = register_allocator;
+        } else if (arg == "--target") {
+            // What target to generate code for
+            auto target = next_arg();
+            if (target != "x86_64-linux" and target != "x86_64-windows") {
+                fmt::print("CLI ERROR: Invalid target {}\n", target);
+                std::exit(1);
+            }
+            o.target = target;
         } else if (arg.starts_with("-")) {
             fmt::print(
                 "CLI ERROR: Unrecognized command line option or flag {}\n"
@@ -14,11 +14,14 @@ struct Options {
     bool aluminium{false};
     bool ir{false};
     bool stopat_ir{false};
+    bool time_report{false};
+    bool stats{false};
     lcc::Context::OptionPrintAST ast{false};
     lcc::Context::OptionPrintMIR mir{false};
     lcc::Context::OptionStopatSyntax stopat_syntax{false};
     lcc::Context::OptionStopatSema stopat_sema{false};
     lcc::Context::OptionStopatMIR stopat_mir{false};
+    lcc::Context::OptionOmitFramePointer omit_frame_pointer{false};
 
     std::vector<std::string> input_files{};
     std::vector<std::string> include_directories{};
@@ -28,6 +31,14 @@ struct Options {
     std::string color{"auto"};
     std::string language{"default"};
     std::string format{"default"};
+    std::string stats_format{"table"};
+    std::string register_allocator{"default"};
+    std::string target{"default"};
+
+    /// Profile file to write from (or read into) the compiled program;
+    /// empty unless -fprofile-generate (-fprofile-use) was given.
+    std::string profile_generate{};
+    std::string profile_use{};
 };
 
 auto parse(int argc, const char** argv) -> Options;
@@ -6,9 +6,11 @@
 #include <lcc/ir/module.hh>
 #include <lcc/lcc-c.h>
 #include <lcc/opt/opt.hh>
+#include <lcc/opt/profile.hh>
 #include <lcc/target.hh>
 #include <lcc/utils.hh>
 #include <lcc/utils/platform.hh>
+#include <lcc/utils/statistics.hh>
 
 #include <glint/driver.hh>
 
@@ -103,6 +105,9 @@ const lcc::Format* const default_format = lcc::Format::gnu_as_att_assembly;
     return contents;
 }
 
+/// Format of the -ftime-report/-stats report printed at exit.
+lcc::stats::ReportFormat stats_report_format{};
+
 auto main(int argc, const char** argv) -> int {
     auto options = cli::parse(argc, argv);
 
@@ -111,6 +116,17 @@ auto main(int argc, const char** argv) -> int {
         return 0;
     }
 
+    /// Print the report at exit, since some stages (e.g. --stopat-mir)
+    /// terminate the compiler early.
+    if (options.time_report or options.stats) {
+        if (options.time_report) lcc::stats::EnableTiming();
+        if (options.stats) lcc::stats::EnableCounters();
+        if (options.stats_format == "json") stats_report_format = lcc::stats::ReportFormat::JSON;
+        std::atexit([] {
+            fmt::print(stderr, "{}", lcc::stats::Report(stats_report_format));
+        });
+    }
+
     /// Determine whether to use colours in the output.
     /// TODO: Enable colours in the console on Windows (for `cmd`).
     auto colour_opt = options.color;
@@ -132,8 +148,14 @@ auto main(int argc, const char** argv) -> int {
 
     /// Compile the file.
 
+    // Get target from command line option, falling back to default.
+    auto* target = default_target;
+    if (options.target == "x86_64-linux")
+        target = lcc::Target::x86_64_linux;
+    else if (options.target == "x86_64-windows")
+        target = lcc::Target::x86_64_windows;
+
     // Get format from command line option, falling back to default.
-    // TODO: Get target from "-t" or "--target" command line option.
     auto* format = default_format;
     if (options.format == "default") {
         ;
@@ -155,8 +177,18 @@ auto main(int argc, const char** argv) -> int {
         format = lcc::Format::llvm_textual_ir;
     } else LCC_ASSERT(false, "Unhandled format");
 
+    // Linear scan allocates registers much faster than graph colouring,
+    // which pays off when compile time matters more than the code.
+    auto register_allocator = options.optimisation
+                                ? lcc::Context::DoNotUseLinearScan
+                                : lcc::Context::UseLinearScan;
+    if (options.register_allocator == "graph")
+        register_allocator = lcc::Context::DoNotUseLinearScan;
+    else if (options.register_allocator == "linear")
+        register_allocator = lcc::Context::UseLinearScan;
+
     lcc::Context context{
-        default_target,
+        target,
         format,
         lcc::Context::Options{
             (lcc::Context::OptionColour) use_colour,
@@ -164,8 +196,10 @@ auto main(int argc, const char** argv) -> int {
             options.stopat_syntax,
             options.stopat_sema,
             options.mir,
-            options.stopat_mir //
-        }                      //
+            options.stopat_mir,
+            register_allocator,
+            options.omit_frame_pointer //
+        }                              //
     };
 
     context.add_include_directory(".");
@@ -198,6 +232,21 @@ auto main(int argc, const char** argv) -> int {
         if (options.ir)
             m->print_ir(use_colour);
 
+        // NOTE: Profiles are generated and applied before optimisation, so
+        // that both see the same module whatever the optimisation level.
+        // The counts stay on the blocks for block layout and register
+        // allocation.
+        if (not options.profile_use.empty())
+            lcc::opt::ApplyProfile(m, options.profile_use);
+
+        if (not options.profile_generate.empty()) {
+            lcc::opt::InstrumentProfile(m, options.profile_generate);
+            if (options.ir) {
+                fmt::print("\nAfter Instrumentation:\n");
+                m->print_ir(use_colour);
+            }
+        }
+
         // NOTE: Only apply full optimisation if specific passes were not requested.
         if (options.optimisation and options.optimisation_passes.empty())
             lcc::opt::Optimise(m, int(options.optimisation));
@@ -207,7 +256,19 @@ auto main(int argc, const char** argv) -> int {
             m->print_ir(use_colour);
         }
 
-        m->lower();
+        // NOTE: Block layout runs last so it sees the final control flow.
+        if (options.optimisation and options.optimisation_passes.empty()) {
+            lcc::opt::LayoutBlocks(m);
+            if (options.ir) {
+                fmt::print("\nAfter Block Layout:\n");
+                m->print_ir(use_colour);
+            }
+        }
+
+        {
+            lcc::stats::Timer _{"lower"};
+            m->lower();
+        }
 
         if (options.ir) {
             fmt::print("\nAfter Lowering:\n");
@@ -257,7 +318,11 @@ auto main(int argc, const char** argv) -> int {
             specified_language == "ir"
             or (specified_language == "default" and path_str.ends_with(".lcc"))
         ) {
-            auto mod = lcc::Module::Parse(&context, file);
+            std::unique_ptr<lcc::Module> mod{};
+            {
+                lcc::stats::Timer _{"parse"};
+                mod = lcc::Module::Parse(&context, file);
+            }
             if (context.has_error()) return; // the error condition is handled by the caller already
             EmitModule(mod.get(), path_str, output_file_path);
             return;